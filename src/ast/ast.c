@@ -6,10 +6,14 @@
 #include "ast.h"
 
 extern Arena *global_arena;
+extern int yylineno;
 
 ASTNode *alloc_node(NodeType type) {
     ASTNode *node = arena_alloc(global_arena, sizeof(ASTNode));
     node->type = type;
+    node->line = yylineno;
+    node->tc_type = NULL;
+    node->local = false;
     return node;
 }
 
@@ -42,7 +46,8 @@ ASTNode *create_string_node(const char *value) {
     size_t len = strlen(value) + 1;
     char *copy = arena_alloc(global_arena, len);
     memcpy(copy, value, len);
-    node->strval = copy;
+    node->string_lit.value = copy;
+    node->string_lit.interned = NULL;
     return node;
 }
 
@@ -81,6 +86,8 @@ ASTNode *create_unary_node(const char *op, ASTNode *operand) {
 ASTNode *create_block_node(ASTNode **stmts, int count) {
     ASTNode *node = arena_alloc(global_arena, sizeof(ASTNode));
     node->type = NodeBlock;
+    node->line = yylineno;
+    node->tc_type = NULL;
     node->block.statements = stmts;
     node->block.count = count;
     return node;
@@ -111,6 +118,7 @@ ASTNode *create_function_node(const char *name, struct Param *params, int param_
     node->function.param_count = param_count;
     node->function.expr = body;
     node->function.return_type = return_type;
+    node->function.profile_id = -1;
 
     if (params) {
         const char **names = arena_alloc(global_arena, sizeof(char *) * (size_t)param_count);
@@ -138,6 +146,125 @@ ASTNode *create_call_node(ASTNode *callee, ASTNode **args, int arg_count) {
     return node;
 }
 
+ASTNode *create_list_op_node(ListOpKind op, ASTNode *function, ASTNode *init, ASTNode *list) {
+    ASTNode *node = alloc_node(NodeListOp);
+    node->list_op.op = op;
+    node->list_op.function = function;
+    node->list_op.init = init;
+    node->list_op.list = list;
+    return node;
+}
+
+/* value |> stage: fills the missing list of map(f), filter(p) or reduce(f, init), and otherwise calls stage with value first. */
+ASTNode *build_pipe(ASTNode *value, ASTNode *stage) {
+    if (stage->type == NodeListOp && !stage->list_op.list) {
+        stage->list_op.list = value;
+        return stage;
+    }
+    if (stage->type != NodeCall) {
+        ASTNode **args = arena_alloc(global_arena, sizeof(ASTNode *));
+        args[0] = value;
+        return create_call_node(stage, args, 1);
+    }
+
+    ASTNode **args = arena_alloc(global_arena, sizeof(ASTNode *) * (size_t)(stage->call.arg_count + 1));
+    args[0] = value;
+    memcpy(args + 1, stage->call.args, sizeof(ASTNode *) * (size_t)stage->call.arg_count);
+    stage->call.args = args;
+    stage->call.arg_count++;
+    return stage;
+}
+
+ASTNode *create_match_node(ASTNode *scrutinee, Pattern **patterns, ASTNode **arms, int arm_count) {
+    ASTNode *node = alloc_node(NodeMatch);
+    node->match.scrutinee = scrutinee;
+    node->match.patterns = patterns;
+    node->match.arms = arms;
+    node->match.arm_count = arm_count;
+    node->match.plan = NULL;
+    return node;
+}
+
+ASTNode *create_if_node(ASTNode *condition, ASTNode *then_branch, ASTNode *else_branch) {
+    ASTNode *node = alloc_node(NodeIf);
+    node->if_expr.condition = condition;
+    node->if_expr.then_branch = then_branch;
+    node->if_expr.else_branch = else_branch;
+    return node;
+}
+
+ASTNode *create_import_node(const char *module) {
+    ASTNode *node = alloc_node(NodeImport);
+    node->strval = module;
+    return node;
+}
+
+Pattern *create_pattern(PatternKind kind) {
+    Pattern *pattern = arena_alloc(global_arena, sizeof(Pattern));
+    pattern->kind = kind;
+    pattern->line = yylineno;
+    return pattern;
+}
+
+Pattern *create_bind_pattern(const char *name) {
+    Pattern *pattern = create_pattern(PatternBind);
+    pattern->name = name;
+    return pattern;
+}
+
+Pattern *create_cons_pattern(Pattern *head, Pattern *tail) {
+    Pattern *pattern = create_pattern(PatternCons);
+    pattern->cons.head = head;
+    pattern->cons.tail = tail;
+    return pattern;
+}
+
+Pattern *build_list_pattern(Pattern **elements, int count) {
+    Pattern *pattern = create_pattern(PatternNil);
+    for (int i = count - 1; i >= 0; i--) {
+        pattern = create_cons_pattern(elements[i], pattern);
+    }
+    return pattern;
+}
+
+Pattern *create_constructor_pattern(const char *name, Pattern **args, int arg_count) {
+    Pattern *pattern = create_pattern(PatternConstructor);
+    pattern->constructor.name = name;
+    pattern->constructor.args = args;
+    pattern->constructor.arg_count = arg_count;
+    pattern->constructor.tag = -1;
+    return pattern;
+}
+
+ASTNode *create_type_decl_node(const char *name, struct Variant *variants, int variant_count) {
+    ASTNode *node = alloc_node(NodeTypeDecl);
+    node->type_decl.name = name;
+    node->type_decl.variants = variants;
+    node->type_decl.variant_count = variant_count;
+    node->type_decl.declared = NULL;
+    return node;
+}
+
+/* A built-in constructor (None, Some, Ok, Error); the type checker picks its type from context. */
+ASTNode *create_construct_node(const char *name, ASTNode **args, int arg_count) {
+    ASTNode *node = alloc_node(NodeConstruct);
+    node->construct.name = name;
+    node->construct.args = args;
+    node->construct.arg_count = arg_count;
+    node->construct.constructor = NULL;
+    return node;
+}
+
+/* Built-in list functions that are called like ordinary functions; 0 if name is not one. */
+int list_builtin_arity(const char *name) {
+    if (strcmp(name, "length") == 0 || strcmp(name, "head") == 0 || strcmp(name, "tail") == 0) return 1;
+    if (strcmp(name, "sum") == 0) return 1;
+    if (strcmp(name, "nth") == 0 || strcmp(name, "push") == 0 || strcmp(name, "concat") == 0) return 2;
+    if (strcmp(name, "take") == 0 || strcmp(name, "drop") == 0) return 2;
+    if (strcmp(name, "update") == 0) return 3;
+    return 0;
+}
+
 void indent_print(int indent, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -146,6 +273,46 @@ void indent_print(int indent, const char *fmt, ...) {
     va_end(args);
 }
 
+void print_pattern(const Pattern *pattern) {
+    switch (pattern->kind) {
+        case PatternWildcard:
+            printf("_");
+            break;
+        case PatternBind:
+            printf("%s", pattern->name);
+            break;
+        case PatternInt:
+            printf("%d", pattern->intval);
+            break;
+        case PatternChar:
+            printf("'%c'", pattern->charval);
+            break;
+        case PatternBool:
+            printf("%s", pattern->boolval ? "true" : "false");
+            break;
+        case PatternNil:
+            printf("[]");
+            break;
+        case PatternCons:
+            printf("(");
+            print_pattern(pattern->cons.head);
+            printf(" :: ");
+            print_pattern(pattern->cons.tail);
+            printf(")");
+            break;
+        case PatternConstructor:
+            printf("%s", pattern->constructor.name);
+            if (!pattern->constructor.arg_count) break;
+            printf("(");
+            for (int i = 0; i < pattern->constructor.arg_count; i++) {
+                if (i) printf(", ");
+                print_pattern(pattern->constructor.args[i]);
+            }
+            printf(")");
+            break;
+    }
+}
+
 void printAST(ASTNode *node, int indent) {
     if (!node) return;
 
@@ -164,7 +331,7 @@ void printAST(ASTNode *node, int indent) {
             printf("CharLiteral: '%c'\n", node->charval);
             break;
         case NodeStringLit:
-            printf("StringLiteral: %s\n", node->strval);
+            printf("StringLiteral: %s\n", node->string_lit.value);
             break;
         case NodeBoolLit:
             printf("BoolLiteral: %d\n", node->boolval);
@@ -226,6 +393,61 @@ void printAST(ASTNode *node, int indent) {
                 printAST(node->call.args[i], indent + 2);
             }
             break;
+        case NodeListOp: {
+            static const char *names[] = { "Map", "Filter", "Reduce" };
+            printf("%s:\n", names[node->list_op.op]);
+            printAST(node->list_op.function, indent + 1);
+            printAST(node->list_op.init, indent + 1);
+            printAST(node->list_op.list, indent + 1);
+            break;
+        }
+        case NodeListPipeline: {
+            printf("Pipeline:\n");
+            printAST(node->pipeline.source, indent + 1);
+            for (int i = 0; i < node->pipeline.stage_count; i++) {
+                printAST(node->pipeline.stages[i]->list_op.function, indent + 1);
+            }
+            printAST(node->pipeline.sink, indent + 1);
+            break;
+        }
+        case NodeMatch:
+            printf("Match:\n");
+            printAST(node->match.scrutinee, indent + 1);
+            for (int i = 0; i < node->match.arm_count; i++) {
+                indent_print(indent + 1, "Case ");
+                print_pattern(node->match.patterns[i]);
+                printf(":\n");
+                printAST(node->match.arms[i], indent + 2);
+            }
+            break;
+        case NodeIf:
+            printf("If:\n");
+            printAST(node->if_expr.condition, indent + 1);
+            indent_print(indent + 1, "Then:\n");
+            printAST(node->if_expr.then_branch, indent + 2);
+            indent_print(indent + 1, "Else:\n");
+            printAST(node->if_expr.else_branch, indent + 2);
+            break;
+        case NodeTypeDecl:
+            printf("TypeDecl: %s\n", node->type_decl.name);
+            for (int i = 0; i < node->type_decl.variant_count; i++) {
+                const struct Variant *variant = &node->type_decl.variants[i];
+                indent_print(indent + 1, "Variant: %s", variant->name);
+                for (int j = 0; j < variant->field_count; j++) {
+                    printf("%s%s", j ? ", " : "(", variant->field_types[j]);
+                }
+                printf(variant->field_count ? ")\n" : "\n");
+            }
+            break;
+        case NodeImport:
+            printf("Import: %s\n", node->strval);
+            break;
+        case NodeConstruct:
+            printf("Construct: %s\n", node->construct.name);
+            for (int i = 0; i < node->construct.arg_count; i++) {
+                printAST(node->construct.args[i], indent + 1);
+            }
+            break;
         default:
             return;
     }
@@ -0,0 +1,104 @@
+#include <stdbool.h>
+#include <string.h>
+#include "ast.h"
+
+/*
+ * Escape analysis for list literals in function bodies. A literal escapes
+ * when its value can outlive the call that built it: it is returned,
+ * stored in another list or a constructor, bound to a name, passed to a
+ * user function, or seen through a view (tail, take, drop) that escapes.
+ * Literals that only ever reach builtins which read them, such as length,
+ * sum, map or an elementwise operator, are marked local and compiled into
+ * the function's stack frame instead of the heap.
+ */
+
+static void walk(ASTNode *node, bool escapes);
+
+/* A builtin call never has its callee type-checked; see fusion.c. */
+static const char *builtin_name(const ASTNode *node) {
+    const ASTNode *callee = node->call.callee;
+    if (callee->type != NodeIdentifier || callee->tc_type || !list_builtin_arity(callee->strval)) return NULL;
+    return callee->strval;
+}
+
+static void walk_call(ASTNode *node, bool escapes) {
+    const char *name = builtin_name(node);
+    for (int i = 0; i < node->call.arg_count; i++) {
+        bool arg_escapes = true;
+        if (name) {
+            bool is_view = strcmp(name, "tail") == 0 || strcmp(name, "take") == 0 || strcmp(name, "drop") == 0;
+            bool is_element = (strcmp(name, "push") == 0 && i == 1) || (strcmp(name, "update") == 0 && i == 2);
+            arg_escapes = is_element || (is_view && i == 0 && escapes);
+        }
+        walk(node->call.args[i], arg_escapes);
+    }
+}
+
+static void walk(ASTNode *node, bool escapes) {
+    if (!node) return;
+
+    switch (node->type) {
+        case NodeList:
+            node->local = !escapes;
+            for (int i = 0; i < node->list.count; i++) walk(node->list.elements[i], true);
+            break;
+        case NodeCall:
+            walk(node->call.callee, true);
+            walk_call(node, escapes);
+            break;
+        case NodeListOp:
+            walk(node->list_op.function, true);
+            walk(node->list_op.list, false);
+            /* reduce returns its initial value for an empty list. */
+            walk(node->list_op.init, escapes);
+            break;
+        case NodeListPipeline:
+            walk(node->pipeline.source, false);
+            for (int i = 0; i < node->pipeline.stage_count; i++) walk(node->pipeline.stages[i]->list_op.function, true);
+            if (node->pipeline.sink && node->pipeline.sink->type == NodeListOp) {
+                walk(node->pipeline.sink->list_op.function, true);
+                walk(node->pipeline.sink->list_op.init, escapes);
+            }
+            break;
+        case NodeBinaryExpr:
+            walk(node->binary_expr.left, false);
+            walk(node->binary_expr.right, false);
+            break;
+        case NodeUnaryExpr:
+            walk(node->unary_expr.operand, false);
+            break;
+        case NodePrint:
+            walk(node->print.value, false);
+            break;
+        case NodeBlock:
+            for (int i = 0; i < node->block.count; i++) {
+                walk(node->block.statements[i], escapes && i == node->block.count - 1);
+            }
+            break;
+        case NodeVarDecl:
+            walk(node->var_decl.expr, true);
+            break;
+        case NodeFunction:
+            walk(node->function.expr, true);
+            break;
+        case NodeConstruct:
+            for (int i = 0; i < node->construct.arg_count; i++) walk(node->construct.args[i], true);
+            break;
+        case NodeMatch:
+            /* Patterns can bind the tail of the scrutinee, which shares its elements. */
+            walk(node->match.scrutinee, true);
+            for (int i = 0; i < node->match.arm_count; i++) walk(node->match.arms[i], escapes);
+            break;
+        case NodeIf:
+            walk(node->if_expr.condition, false);
+            walk(node->if_expr.then_branch, escapes);
+            walk(node->if_expr.else_branch, escapes);
+            break;
+        default:
+            break;
+    }
+}
+
+void mark_local_lists(ASTNode *root) {
+    walk(root, true);
+}
@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <string.h>
+#include "memory.h"
+#include "ast.h"
+
+extern Arena *global_arena;
+
+/*
+ * Deforestation of list chains. After type checking, a nest such as
+ * reduce(add, 0, map(g, filter(p, map(f, xs)))), which is what
+ * xs |> map(f) |> filter(p) |> map(g) |> reduce(add, 0) parses to, is
+ * replaced by one NodeListPipeline. Each element then runs through every
+ * stage before the next element is read, and no intermediate list is built.
+ */
+
+static bool is_stage(const ASTNode *node) {
+    return node->type == NodeListOp && node->list_op.op != ListReduce;
+}
+
+/* A builtin call never has its callee type-checked, so a user function named sum still has a type. */
+static bool is_sum_call(const ASTNode *node) {
+    return node->type == NodeCall && node->call.callee->type == NodeIdentifier &&
+           strcmp(node->call.callee->strval, "sum") == 0 && !node->call.callee->tc_type &&
+           node->call.arg_count == 1;
+}
+
+static ASTNode *chain_input(const ASTNode *node) {
+    return node->type == NodeCall ? node->call.args[0] : node->list_op.list;
+}
+
+static ASTNode *build_pipeline(ASTNode *head) {
+    bool has_sink = !is_stage(head);
+    int stage_count = has_sink ? 0 : 1;
+    ASTNode *input = chain_input(head);
+    for (; is_stage(input); input = input->list_op.list) stage_count++;
+
+    /* A lone map or filter already makes a single pass; only sum has no other lowering. */
+    if (stage_count + has_sink < 2 && !is_sum_call(head)) return NULL;
+
+    ASTNode *node = alloc_node(NodeListPipeline);
+    node->line = head->line;
+    node->tc_type = head->tc_type;
+    node->pipeline.source = input;
+    node->pipeline.sink = has_sink ? head : NULL;
+    node->pipeline.stage_count = stage_count;
+    node->pipeline.stages = arena_alloc(global_arena, sizeof(ASTNode *) * (size_t)(stage_count ? stage_count : 1));
+
+    ASTNode *stage = has_sink ? chain_input(head) : head;
+    for (int i = stage_count - 1; i >= 0; i--, stage = stage->list_op.list) {
+        node->pipeline.stages[i] = stage;
+    }
+    return node;
+}
+
+ASTNode *fuse_list_pipelines(ASTNode *node) {
+    if (!node) return NULL;
+
+    switch (node->type) {
+        case NodeBinaryExpr:
+            node->binary_expr.left = fuse_list_pipelines(node->binary_expr.left);
+            node->binary_expr.right = fuse_list_pipelines(node->binary_expr.right);
+            break;
+        case NodeUnaryExpr:
+            node->unary_expr.operand = fuse_list_pipelines(node->unary_expr.operand);
+            break;
+        case NodeVarDecl:
+            node->var_decl.expr = fuse_list_pipelines(node->var_decl.expr);
+            break;
+        case NodeBlock:
+            for (int i = 0; i < node->block.count; i++) {
+                node->block.statements[i] = fuse_list_pipelines(node->block.statements[i]);
+            }
+            break;
+        case NodePrint:
+            node->print.value = fuse_list_pipelines(node->print.value);
+            break;
+        case NodeList:
+            for (int i = 0; i < node->list.count; i++) {
+                node->list.elements[i] = fuse_list_pipelines(node->list.elements[i]);
+            }
+            break;
+        case NodeFunction:
+            node->function.expr = fuse_list_pipelines(node->function.expr);
+            break;
+        case NodeMatch:
+            node->match.scrutinee = fuse_list_pipelines(node->match.scrutinee);
+            for (int i = 0; i < node->match.arm_count; i++) {
+                node->match.arms[i] = fuse_list_pipelines(node->match.arms[i]);
+            }
+            break;
+        case NodeIf:
+            node->if_expr.condition = fuse_list_pipelines(node->if_expr.condition);
+            node->if_expr.then_branch = fuse_list_pipelines(node->if_expr.then_branch);
+            node->if_expr.else_branch = fuse_list_pipelines(node->if_expr.else_branch);
+            break;
+        case NodeConstruct:
+            for (int i = 0; i < node->construct.arg_count; i++) {
+                node->construct.args[i] = fuse_list_pipelines(node->construct.args[i]);
+            }
+            break;
+        case NodeCall:
+        case NodeListOp: {
+            ASTNode *pipeline = (node->type == NodeListOp || is_sum_call(node)) ? build_pipeline(node) : NULL;
+            if (pipeline) {
+                pipeline->pipeline.source = fuse_list_pipelines(pipeline->pipeline.source);
+                if (pipeline->pipeline.sink && pipeline->pipeline.sink->type == NodeListOp) {
+                    pipeline->pipeline.sink->list_op.init = fuse_list_pipelines(pipeline->pipeline.sink->list_op.init);
+                }
+                return pipeline;
+            }
+
+            if (node->type == NodeListOp) {
+                node->list_op.init = fuse_list_pipelines(node->list_op.init);
+                node->list_op.list = fuse_list_pipelines(node->list_op.list);
+            } else {
+                for (int i = 0; i < node->call.arg_count; i++) {
+                    node->call.args[i] = fuse_list_pipelines(node->call.args[i]);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return node;
+}
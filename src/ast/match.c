@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <string.h>
+#include "match.h"
+#include "memory.h"
+
+extern Arena *global_arena;
+
+/*
+ * Match compilation, after Maranget's "Compiling Pattern Matching to Good
+ * Decision Trees". The arms form a matrix with one row per arm and one
+ * column per occurrence still to be looked at. The first row picks the
+ * column to branch on (its leftmost constructor); each tag found there
+ * gets the rows that can still match once the occurrence has that tag,
+ * with the column replaced by its fields, and a fallback takes the rows
+ * that don't care when the tags seen don't cover the type. A branched-on
+ * column is gone from every subtree below it, so no path tests the same
+ * value twice, and picking a case is a table lookup or a binary search
+ * instead of trying the arms in turn.
+ */
+
+typedef struct Row {
+    Pattern **columns;
+    MatchBinding *bindings;
+    int binding_count;
+    int arm;
+} Row;
+
+typedef struct Matrix {
+    Row *rows;
+    int row_count;
+    int *occurrences; /* what each column is matched against */
+    int column_count;
+} Matrix;
+
+typedef struct MatchBuilder {
+    MatchOccurrence *occurrences;
+    int occurrence_count, occurrence_capacity;
+    bool exhaustive;
+} MatchBuilder;
+
+static Pattern wildcard = { .kind = PatternWildcard };
+
+static bool is_constructor(const Pattern *pattern) {
+    return pattern->kind != PatternWildcard && pattern->kind != PatternBind;
+}
+
+static int64_t pattern_tag(const Pattern *pattern) {
+    switch (pattern->kind) {
+        case PatternInt: return pattern->intval;
+        case PatternChar: return (unsigned char)pattern->charval;
+        case PatternBool: return pattern->boolval != 0;
+        case PatternCons: return 1;
+        case PatternConstructor: return pattern->constructor.tag;
+        default: return 0;
+    }
+}
+
+static int pattern_arity(const Pattern *pattern) {
+    if (pattern->kind == PatternConstructor) return pattern->constructor.arg_count;
+    return pattern->kind == PatternCons ? 2 : 0;
+}
+
+static Pattern *pattern_field(const Pattern *pattern, int field) {
+    if (pattern->kind == PatternConstructor) return pattern->constructor.args[field];
+    return field == 0 ? pattern->cons.head : pattern->cons.tail;
+}
+
+/* How many tags a type has, or 0 when there are too many to ever list them all. */
+static int64_t signature_size(const TypeTC *type) {
+    switch (type->kind) {
+        case TypeList:
+        case TypeBool: return 2;
+        case TypeChar: return 256;
+        case TypeVariant: return type->variant->constructor_count;
+        default: return 0;
+    }
+}
+
+static TypeTC *field_type(TypeTC *type, int64_t tag, int field) {
+    if (type->kind == TypeVariant) return type->variant->constructors[tag].fields[field];
+    return field == 0 ? type->element_type : type;
+}
+
+static int add_occurrence(MatchBuilder *builder, int parent, int64_t tag, int field, TypeTC *type) {
+    for (int i = 0; i < builder->occurrence_count; i++) {
+        const MatchOccurrence *occurrence = &builder->occurrences[i];
+        if (occurrence->parent == parent && occurrence->tag == tag && occurrence->field == field) return i;
+    }
+    if (builder->occurrence_count == builder->occurrence_capacity) {
+        int capacity = builder->occurrence_capacity ? builder->occurrence_capacity * 2 : 8;
+        MatchOccurrence *grown = arena_alloc(global_arena, sizeof(MatchOccurrence) * (size_t)capacity);
+        if (builder->occurrence_count) {
+            memcpy(grown, builder->occurrences, sizeof(MatchOccurrence) * (size_t)builder->occurrence_count);
+        }
+        builder->occurrences = grown;
+        builder->occurrence_capacity = capacity;
+    }
+    builder->occurrences[builder->occurrence_count] = (MatchOccurrence){ parent, tag, field, type };
+    return builder->occurrence_count++;
+}
+
+/* A variable pattern in a column that is about to go away binds its name to the column's occurrence. */
+static void absorb(Row *row, const Pattern *pattern, int occurrence) {
+    if (pattern->kind != PatternBind) return;
+    MatchBinding *bindings = arena_alloc(global_arena, sizeof(MatchBinding) * (size_t)(row->binding_count + 1));
+    if (row->binding_count) memcpy(bindings, row->bindings, sizeof(MatchBinding) * (size_t)row->binding_count);
+    bindings[row->binding_count] = (MatchBinding){ pattern->name, occurrence };
+    row->bindings = bindings;
+    row->binding_count++;
+}
+
+static Decision *new_decision(DecisionKind kind) {
+    Decision *decision = arena_alloc(global_arena, sizeof(Decision));
+    memset(decision, 0, sizeof(Decision));
+    decision->kind = kind;
+    return decision;
+}
+
+static Matrix new_matrix(const Matrix *from, int column_count) {
+    Matrix matrix;
+    matrix.rows = arena_alloc(global_arena, sizeof(Row) * (size_t)(from->row_count ? from->row_count : 1));
+    matrix.row_count = 0;
+    matrix.occurrences = arena_alloc(global_arena, sizeof(int) * (size_t)(column_count ? column_count : 1));
+    matrix.column_count = column_count;
+    return matrix;
+}
+
+/* The rows that still match once the occurrence in column has tag, with the column replaced by its fields. */
+static Matrix specialize(MatchBuilder *builder, const Matrix *matrix, int column, int64_t tag, int arity) {
+    Matrix out = new_matrix(matrix, matrix->column_count - 1 + arity);
+    int parent = matrix->occurrences[column];
+    TypeTC *parent_type = builder->occurrences[parent].type;
+
+    memcpy(out.occurrences, matrix->occurrences, sizeof(int) * (size_t)column);
+    for (int f = 0; f < arity; f++) {
+        out.occurrences[column + f] = add_occurrence(builder, parent, tag, f, field_type(parent_type, tag, f));
+    }
+    memcpy(out.occurrences + column + arity, matrix->occurrences + column + 1, sizeof(int) * (size_t)(matrix->column_count - column - 1));
+
+    for (int r = 0; r < matrix->row_count; r++) {
+        const Row *row = &matrix->rows[r];
+        Pattern *pattern = row->columns[column];
+        if (is_constructor(pattern) && pattern_tag(pattern) != tag) continue;
+
+        Row *next = &out.rows[out.row_count++];
+        *next = *row;
+        next->columns = arena_alloc(global_arena, sizeof(Pattern *) * (size_t)(out.column_count ? out.column_count : 1));
+        memcpy(next->columns, row->columns, sizeof(Pattern *) * (size_t)column);
+        for (int f = 0; f < arity; f++) {
+            next->columns[column + f] = is_constructor(pattern) ? pattern_field(pattern, f) : &wildcard;
+        }
+        memcpy(next->columns + column + arity, row->columns + column + 1, sizeof(Pattern *) * (size_t)(matrix->column_count - column - 1));
+        absorb(next, pattern, parent);
+    }
+    return out;
+}
+
+/* The rows that match whatever tag the occurrence in column has, without that column. */
+static Matrix default_rows(const Matrix *matrix, int column) {
+    Matrix out = new_matrix(matrix, matrix->column_count - 1);
+    memcpy(out.occurrences, matrix->occurrences, sizeof(int) * (size_t)column);
+    memcpy(out.occurrences + column, matrix->occurrences + column + 1, sizeof(int) * (size_t)(matrix->column_count - column - 1));
+
+    for (int r = 0; r < matrix->row_count; r++) {
+        const Row *row = &matrix->rows[r];
+        Pattern *pattern = row->columns[column];
+        if (is_constructor(pattern)) continue;
+
+        Row *next = &out.rows[out.row_count++];
+        *next = *row;
+        next->columns = arena_alloc(global_arena, sizeof(Pattern *) * (size_t)(out.column_count ? out.column_count : 1));
+        memcpy(next->columns, row->columns, sizeof(Pattern *) * (size_t)column);
+        memcpy(next->columns + column, row->columns + column + 1, sizeof(Pattern *) * (size_t)(matrix->column_count - column - 1));
+        absorb(next, pattern, matrix->occurrences[column]);
+    }
+    return out;
+}
+
+static int compare_cases(const void *a, const void *b) {
+    int64_t left = ((const DecisionCase *)a)->tag, right = ((const DecisionCase *)b)->tag;
+    return (left > right) - (left < right);
+}
+
+static void build_table(Decision *decision) {
+    int64_t min = decision->cases[0].tag, max = decision->cases[decision->case_count - 1].tag;
+    if (decision->case_count < MATCH_TABLE_MIN_CASES || max - min + 1 > 2 * (int64_t)decision->case_count) return;
+
+    decision->table_min = min;
+    decision->table_size = max - min + 1;
+    decision->table = arena_alloc(global_arena, sizeof(Decision *) * (size_t)decision->table_size);
+    for (int64_t i = 0; i < decision->table_size; i++) decision->table[i] = decision->fallback;
+    for (int i = 0; i < decision->case_count; i++) {
+        decision->table[decision->cases[i].tag - min] = decision->cases[i].next;
+    }
+}
+
+static Decision *compile_rows(MatchBuilder *builder, const Matrix *matrix) {
+    if (matrix->row_count == 0) {
+        builder->exhaustive = false;
+        return new_decision(DecisionFail);
+    }
+
+    Row first = matrix->rows[0];
+    int column = -1;
+    for (int i = 0; i < matrix->column_count && column < 0; i++) {
+        if (is_constructor(first.columns[i])) column = i;
+    }
+    if (column < 0) {
+        for (int i = 0; i < matrix->column_count; i++) absorb(&first, first.columns[i], matrix->occurrences[i]);
+        Decision *leaf = new_decision(DecisionLeaf);
+        leaf->arm = first.arm;
+        leaf->bindings = first.bindings;
+        leaf->binding_count = first.binding_count;
+        return leaf;
+    }
+
+    Decision *decision = new_decision(DecisionSwitch);
+    decision->occurrence = matrix->occurrences[column];
+    decision->cases = arena_alloc(global_arena, sizeof(DecisionCase) * (size_t)matrix->row_count);
+    int *arities = malloc(sizeof(int) * (size_t)matrix->row_count);
+    for (int r = 0; r < matrix->row_count; r++) {
+        Pattern *pattern = matrix->rows[r].columns[column];
+        if (!is_constructor(pattern)) continue;
+        int64_t tag = pattern_tag(pattern);
+        bool seen = false;
+        for (int c = 0; c < decision->case_count && !seen; c++) seen = decision->cases[c].tag == tag;
+        if (seen) continue;
+        arities[decision->case_count] = pattern_arity(pattern);
+        decision->cases[decision->case_count++] = (DecisionCase){ tag, NULL };
+    }
+
+    for (int c = 0; c < decision->case_count; c++) {
+        Matrix specialized = specialize(builder, matrix, column, decision->cases[c].tag, arities[c]);
+        decision->cases[c].next = compile_rows(builder, &specialized);
+    }
+    free(arities);
+    qsort(decision->cases, (size_t)decision->case_count, sizeof(DecisionCase), compare_cases);
+
+    int64_t signature = signature_size(builder->occurrences[decision->occurrence].type);
+    if (!signature || decision->case_count < signature) {
+        Matrix rest = default_rows(matrix, column);
+        decision->fallback = compile_rows(builder, &rest);
+    }
+    build_table(decision);
+    return decision;
+}
+
+/* Builds the decision tree of a type-checked match. */
+MatchPlan *compile_match(ASTNode *node) {
+    MatchBuilder builder = { NULL, 0, 0, true };
+    add_occurrence(&builder, -1, 0, 0, node->match.scrutinee->tc_type);
+
+    Matrix matrix;
+    matrix.row_count = node->match.arm_count;
+    matrix.column_count = 1;
+    matrix.occurrences = arena_alloc(global_arena, sizeof(int));
+    matrix.occurrences[0] = 0;
+    matrix.rows = arena_alloc(global_arena, sizeof(Row) * (size_t)node->match.arm_count);
+    for (int i = 0; i < node->match.arm_count; i++) {
+        Row *row = &matrix.rows[i];
+        row->columns = arena_alloc(global_arena, sizeof(Pattern *));
+        row->columns[0] = node->match.patterns[i];
+        row->bindings = NULL;
+        row->binding_count = 0;
+        row->arm = i;
+    }
+
+    MatchPlan *plan = arena_alloc(global_arena, sizeof(MatchPlan));
+    plan->tree = compile_rows(&builder, &matrix);
+    plan->occurrences = builder.occurrences;
+    plan->occurrence_count = builder.occurrence_count;
+    plan->exhaustive = builder.exhaustive;
+    return plan;
+}
+
+/* The subtree for an occurrence with tag: a table lookup in a dense switch and a binary search otherwise. */
+Decision *decision_select(const Decision *decision, int64_t tag) {
+    if (decision->table) {
+        int64_t index = tag - decision->table_min;
+        return index >= 0 && index < decision->table_size ? decision->table[index] : decision->fallback;
+    }
+
+    int low = 0, high = decision->case_count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (decision->cases[mid].tag < tag) low = mid + 1;
+        else high = mid;
+    }
+    if (low < decision->case_count && decision->cases[low].tag == tag) return decision->cases[low].next;
+    return decision->fallback;
+}
+
+int pattern_binding_count(const Pattern *pattern) {
+    if (pattern->kind == PatternBind) return 1;
+    if (pattern->kind == PatternCons) return pattern_binding_count(pattern->cons.head) + pattern_binding_count(pattern->cons.tail);
+    int count = 0;
+    if (pattern->kind == PatternConstructor) {
+        for (int i = 0; i < pattern->constructor.arg_count; i++) count += pattern_binding_count(pattern->constructor.args[i]);
+    }
+    return count;
+}
+
+/* Appends the names a pattern binds, left to right. */
+void pattern_bindings(const Pattern *pattern, const char **names, int *count) {
+    if (pattern->kind == PatternBind) {
+        names[(*count)++] = pattern->name;
+    } else if (pattern->kind == PatternCons) {
+        pattern_bindings(pattern->cons.head, names, count);
+        pattern_bindings(pattern->cons.tail, names, count);
+    } else if (pattern->kind == PatternConstructor) {
+        for (int i = 0; i < pattern->constructor.arg_count; i++) pattern_bindings(pattern->constructor.args[i], names, count);
+    }
+}
@@ -10,6 +10,21 @@
 #else
     #include <sys/utsname.h>
 #endif
+
+VexOptions vex_options = {
+    .profile = false,
+    .profile_output = "vex-profile.folded",
+    .jit_threshold = 1000,
+    .jit_repl = false,
+    .auto_par = false,
+    .opt_level = -1,
+    .opt_size = false,
+    .fast_math = false,
+    .cpu = NULL,
+    .emit = EmitExecutable,
+    .output = NULL,
+    .save_temps = false,
+};
  
 void printHelpMenu(void) {
     puts("Usage: vex [options] file...\n"
@@ -17,14 +32,20 @@ void printHelpMenu(void) {
          "  --help                   Display this information.\n"
          "  --help={optimizers|warnings|target|compiler}[,...]\n"
          "                           Display help on specific option categories.\n"
-         "  --version                Display compiler version information.\n\n"
-         "  repl                     Launch the interactive Vex REPL (Read-Eval-Print Loop).\n\n"
+         "  --version                Display compiler version information.\n"
+         "  --profile[=<file>]       Profile interpreted execution; write folded stacks to <file>.\n"
+         "  --jit-threshold=<n>      JIT-compile interpreted functions after <n> calls (default 1000).\n"
+         "  --no-jit                 Never leave the interpreter.\n"
+         "  --jit                    Compile every REPL input with the JIT instead of interpreting it.\n"
+         "  --auto-par               Run expensive independent subexpressions of compiled code in parallel.\n\n"
+         "  repl                     Launch the interactive Vex REPL (Read-Eval-Print Loop).\n"
+         "  run <file>               Compile <file> with the JIT and call its 'main' function.\n\n"
          "Report bugs at <https://github.com/PeterGriffinSr/Vex/issues>");
 }
 
 void printOptimizersHelp(void) {
     puts("Optimization Options:\n"
-         "  -O0                      Disable all optimizations (default).\n"
+         "  -O0                      Disable all optimizations (default; the JIT uses -O2).\n"
          "  -O1                      Enable basic optimizations.\n"
          "  -O2                      Enable additional optimizations.\n"
          "  -O3                      Enable full optimizations, including inlining.\n"
@@ -36,7 +57,10 @@ void printTargetHelp(void) {
     puts("Target-Specific Options:\n"
          "  --target=<platform>     Specify the target platform (e.g., linux, wasm, arm).\n"
          "  --arch=<arch>           Specify the target architecture (e.g., x86_64, arm64).\n"
-         "  --emit-llvm             Output LLVM IR instead of native code.\n");
+         "  -mcpu=<cpu>             Build executables and objects for <cpu> ('native' for this machine) instead of the\n"
+         "                          architecture's generic CPU. The JIT always builds for this machine.\n"
+         "  -march=<cpu>            Same as -mcpu=<cpu>.\n"
+         "  --emit-llvm             Same as --emit-ir.\n");
 }
 
 void printWarningsHelp(void) {
@@ -49,10 +73,10 @@ void printWarningsHelp(void) {
 
 void printCompilerHelp(void) {
     puts("Compiler Control Options:\n"
-         "  -save-temps             Do not delete intermediate files (e.g., .ll, .s).\n"
+         "  -save-temps             Keep the object file and write the IR (.ll) beside the output.\n"
          "  -S                      Compile only; do not assemble or link.\n"
-         "  -c                      Compile and assemble, but do not link.\n"
-         "  -o <file>               Place the output into <file>.\n"
+         "  -c                      Compile and assemble, but do not link; also write the .vexi interface.\n"
+         "  -o <file>               Place the output into <file> ('-' prints IR to stdout).\n"
          "  --emit-ast              Output the parsed AST instead of compiling.\n"
          "  --emit-ir               Output the intermediate representation (IR).\n");
 }
@@ -95,6 +119,73 @@ bool handleCliOption(const char *arg) {
         printHelpMenu();
         return true;
     }
+    if (strcmp(arg, "--profile") == 0) {
+        vex_options.profile = true;
+        return false;
+    }
+    if (strncmp(arg, "--profile=", 10) == 0) {
+        vex_options.profile = true;
+        vex_options.profile_output = arg + 10;
+        return false;
+    }
+    if (strncmp(arg, "--jit-threshold=", 16) == 0) {
+        vex_options.jit_threshold = (unsigned int)strtoul(arg + 16, NULL, 10);
+        return false;
+    }
+    if (strcmp(arg, "--auto-par") == 0) {
+        vex_options.auto_par = true;
+        return false;
+    }
+    if (strcmp(arg, "--jit") == 0) {
+        vex_options.jit_repl = true;
+        return false;
+    }
+    if (strlen(arg) == 3 && strncmp(arg, "-O", 2) == 0 && arg[2] >= '0' && arg[2] <= '3') {
+        vex_options.opt_level = arg[2] - '0';
+        vex_options.opt_size = false;
+        vex_options.fast_math = false;
+        return false;
+    }
+    if (strcmp(arg, "-Os") == 0) {
+        vex_options.opt_level = 2;
+        vex_options.opt_size = true;
+        vex_options.fast_math = false;
+        return false;
+    }
+    if (strcmp(arg, "-Ofast") == 0) {
+        vex_options.opt_level = 3;
+        vex_options.opt_size = false;
+        vex_options.fast_math = true;
+        return false;
+    }
+    if (strncmp(arg, "-mcpu=", 6) == 0 || strncmp(arg, "-march=", 7) == 0) {
+        vex_options.cpu = strchr(arg, '=') + 1;
+        return false;
+    }
+    if (strcmp(arg, "-S") == 0) {
+        vex_options.emit = EmitAssembly;
+        return false;
+    }
+    if (strcmp(arg, "-c") == 0) {
+        vex_options.emit = EmitObject;
+        return false;
+    }
+    if (strcmp(arg, "--emit-ir") == 0 || strcmp(arg, "--emit-llvm") == 0) {
+        vex_options.emit = EmitIR;
+        return false;
+    }
+    if (strcmp(arg, "--emit-ast") == 0) {
+        vex_options.emit = EmitAST;
+        return false;
+    }
+    if (strcmp(arg, "-save-temps") == 0) {
+        vex_options.save_temps = true;
+        return false;
+    }
+    if (strcmp(arg, "--no-jit") == 0) {
+        vex_options.jit_threshold = 0;
+        return false;
+    }
     if (strcmp(arg, "repl") == 0) {
         vex_repl();
         return true;
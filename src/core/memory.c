@@ -5,40 +5,93 @@
 
 size_t line_allocated = 0;
 
+static ArenaBlock *arena_block_create(ArenaBlock *prev, size_t size) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock));
+    if (!block) return NULL;
+
+    block->memory = malloc(size);
+    if (!block->memory) {
+        free(block);
+        return NULL;
+    }
+
+    block->prev = prev;
+    block->base = prev ? prev->base + prev->capacity : 0;
+    block->capacity = size;
+    block->used = 0;
+    return block;
+}
+
+static void arena_block_destroy(ArenaBlock *block) {
+    free(block->memory);
+    free(block);
+}
+
 Arena *arena_create(size_t size) {
     Arena *arena = malloc(sizeof(Arena));
     if (!arena) return NULL;
 
-    arena->memory = malloc(size);
-    if (!arena->memory) {
+    arena->block = arena_block_create(NULL, size);
+    if (!arena->block) {
         free(arena);
         return NULL;
     }
 
-    arena->capacity = size;
-    arena->used = 0;
+    arena->block_size = size;
     return arena;
 }
 
 void *arena_alloc(Arena *arena, size_t size) {
     size = (size + 7) & (size_t)~7;
 
-    if (arena->used + size > arena->capacity) {
-        fprintf(stderr, "Arena out of memory!\n");
-        exit(EXIT_FAILURE);
+    ArenaBlock *block = arena->block;
+    if (block->used + size > block->capacity) {
+        block = arena_block_create(block, size > arena->block_size ? size : arena->block_size);
+        if (!block) {
+            fprintf(stderr, "Arena out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+        arena->block = block;
     }
 
-    void *ptr = arena->memory + arena->used;
-    arena->used += size;
+    void *ptr = block->memory + block->used;
+    block->used += size;
     line_allocated += size;
     return ptr;
 }
 
+size_t arena_checkpoint(const Arena *arena) {
+    return arena->block->base + arena->block->used;
+}
+
+/* Releases everything allocated since the checkpoint; pointers into that range become invalid. */
+void arena_rollback(Arena *arena, size_t checkpoint) {
+    while (arena->block->prev && arena->block->base > checkpoint) {
+        ArenaBlock *prev = arena->block->prev;
+        arena_block_destroy(arena->block);
+        arena->block = prev;
+    }
+
+    ArenaBlock *block = arena->block;
+    if (checkpoint < block->base + block->used) block->used = checkpoint - block->base;
+}
+
 void arena_destroy(Arena *arena) {
-    if (arena) {
-        free(arena->memory);
-        free(arena);
+    if (!arena) return;
+    while (arena->block) {
+        ArenaBlock *prev = arena->block->prev;
+        arena_block_destroy(arena->block);
+        arena->block = prev;
+    }
+    free(arena);
+}
+
+/* Whether pointer is into memory the arena has handed out. */
+bool arena_owns(const Arena *arena, const void *pointer) {
+    for (const ArenaBlock *block = arena->block; block; block = block->prev) {
+        if ((const char *)pointer >= block->memory && (const char *)pointer < block->memory + block->used) return true;
     }
+    return false;
 }
 
 void arena_new_line(void) {
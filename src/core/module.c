@@ -0,0 +1,610 @@
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "common.h"
+#include "memory.h"
+#include "module.h"
+
+#define INTERFACE_MAGIC "VEXI"
+#define INTERFACE_VERSION 1
+
+/* Names of the modules the processes above this one are compiling, colon separated, to catch import cycles. */
+#define IMPORT_CHAIN_VARIABLE "VEX_IMPORT_CHAIN"
+
+extern Arena *global_arena;
+
+/*
+ * An interface file is "VEXI", a version byte, and then three sections:
+ * the names of the modules imported; each type with its constructors and
+ * their field types; each function with its return and parameter types.
+ * Every section and string starts with its length as an unsigned LEB128,
+ * and types are written the way they are annotated in source.
+ */
+typedef struct Interface {
+    const char **imports;
+    int import_count;
+    ASTNode **types, **functions;
+    int type_count, function_count;
+} Interface;
+
+typedef struct Module {
+    const char *name;
+    Interface interface;
+    bool has_interface, types_loaded, functions_loaded;
+} Module;
+
+typedef struct ByteBuffer {
+    unsigned char *data;
+    size_t length, capacity;
+} ByteBuffer;
+
+typedef struct Reader {
+    const unsigned char *data;
+    size_t length, offset;
+    bool failed;
+} Reader;
+
+static Module *modules = NULL;
+static int module_count = 0, module_capacity = 0;
+static const char **objects = NULL;
+static int object_count = 0, object_capacity = 0;
+static const char *source_dir = NULL;
+static const char *compiler = NULL;
+
+/* The statements load_imports put in front of root's own, and the names root imports. */
+static bool building_import = false;
+static int imported_count = 0;
+static const char **direct_imports = NULL;
+static int direct_import_count = 0;
+
+static char *module_path(const char *dir, const char *name, const char *extension) {
+    size_t size = strlen(dir) + strlen(name) + strlen(extension) + 1;
+    char *path = arena_alloc(global_arena, size);
+    snprintf(path, size, "%s%s%s", dir, name, extension);
+    return path;
+}
+
+static Module *find_module(const char *name) {
+    for (int i = 0; i < module_count; i++) {
+        if (strcmp(modules[i].name, name) == 0) return &modules[i];
+    }
+    return NULL;
+}
+
+static Module *add_module(const char *name) {
+    Module *module = find_module(name);
+    if (module) return module;
+    if (module_count == module_capacity) {
+        module_capacity = module_capacity ? module_capacity * 2 : 8;
+        modules = realloc(modules, sizeof(Module) * (size_t)module_capacity);
+    }
+    module = &modules[module_count++];
+    memset(module, 0, sizeof(Module));
+    module->name = name;
+    return module;
+}
+
+static void put_byte(ByteBuffer *buffer, unsigned char byte) {
+    if (buffer->length == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    buffer->data[buffer->length++] = byte;
+}
+
+static void put_count(ByteBuffer *buffer, size_t count) {
+    do {
+        unsigned char byte = (unsigned char)(count & 0x7f);
+        count >>= 7;
+        put_byte(buffer, count ? (unsigned char)(byte | 0x80) : byte);
+    } while (count);
+}
+
+static void put_string(ByteBuffer *buffer, const char *string) {
+    size_t length = strlen(string);
+    put_count(buffer, length);
+    for (size_t i = 0; i < length; i++) put_byte(buffer, (unsigned char)string[i]);
+}
+
+/* Top-level definitions other modules can import; main belongs to the program and is never exported. */
+static bool is_exported(const ASTNode *node) {
+    return node->type == NodeTypeDecl || (node->type == NodeFunction && strcmp(node->function.name, "main") != 0);
+}
+
+static void encode_interface(ASTNode *root, ByteBuffer *buffer) {
+    for (const char *magic = INTERFACE_MAGIC; *magic; magic++) put_byte(buffer, (unsigned char)*magic);
+    put_byte(buffer, INTERFACE_VERSION);
+
+    put_count(buffer, (size_t)direct_import_count);
+    for (int i = 0; i < direct_import_count; i++) put_string(buffer, direct_imports[i]);
+
+    ASTNode **statements = root->type == NodeBlock ? root->block.statements + imported_count : &root;
+    int count = root->type == NodeBlock ? root->block.count - imported_count : 1;
+    for (int kind = 0; kind < 2; kind++) {
+        NodeType type = kind == 0 ? NodeTypeDecl : NodeFunction;
+        size_t exported = 0;
+        for (int i = 0; i < count; i++) {
+            if (statements[i]->type == type && is_exported(statements[i])) exported++;
+        }
+        put_count(buffer, exported);
+
+        for (int i = 0; i < count; i++) {
+            ASTNode *node = statements[i];
+            if (node->type != type || !is_exported(node)) continue;
+            if (type == NodeTypeDecl) {
+                put_string(buffer, node->type_decl.name);
+                put_count(buffer, (size_t)node->type_decl.variant_count);
+                for (int v = 0; v < node->type_decl.variant_count; v++) {
+                    const struct Variant *variant = &node->type_decl.variants[v];
+                    put_string(buffer, variant->name);
+                    put_count(buffer, (size_t)variant->field_count);
+                    for (int f = 0; f < variant->field_count; f++) put_string(buffer, variant->field_types[f]);
+                }
+            } else {
+                put_string(buffer, node->function.name);
+                put_string(buffer, node->function.return_type);
+                put_count(buffer, (size_t)node->function.param_count);
+                for (int p = 0; p < node->function.param_count; p++) put_string(buffer, node->function.param_types[p]);
+            }
+        }
+    }
+}
+
+static unsigned char *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    size_t capacity = 4096, size = 0;
+    unsigned char *data = malloc(capacity);
+    size_t read;
+    while ((read = fread(data + size, 1, capacity - size, file)) > 0) {
+        size += read;
+        if (size == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    fclose(file);
+    *length = size;
+    return data;
+}
+
+bool write_interface(ASTNode *root, const char *path) {
+    ByteBuffer buffer = { 0 };
+    encode_interface(root, &buffer);
+
+    /* An unchanged interface keeps its timestamp, so importers are not rebuilt for a change to a body. */
+    size_t length = 0;
+    unsigned char *existing = read_file(path, &length);
+    bool same = existing && length == buffer.length && memcmp(existing, buffer.data, length) == 0;
+    free(existing);
+    if (same) {
+        free(buffer.data);
+        return true;
+    }
+
+    size_t size = strlen(path) + 32;
+    char *temp = malloc(size);
+    snprintf(temp, size, "%s.%ld", path, (long)getpid());
+    FILE *file = fopen(temp, "wb");
+    bool ok = file && fwrite(buffer.data, 1, buffer.length, file) == buffer.length;
+    if (file && fclose(file) != 0) ok = false;
+    if (ok && rename(temp, path) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "vex: error: could not write '%s': %s\n", path, strerror(errno));
+        remove(temp);
+    }
+    free(temp);
+    free(buffer.data);
+    return ok;
+}
+
+static size_t read_count(Reader *reader) {
+    size_t count = 0;
+    for (unsigned int shift = 0; !reader->failed; shift += 7) {
+        if (reader->offset == reader->length || shift > 28) {
+            reader->failed = true;
+            break;
+        }
+        unsigned char byte = reader->data[reader->offset++];
+        count |= (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    /* Every counted item takes at least a byte, which bounds what a damaged file can make us allocate. */
+    if (count > reader->length - reader->offset) reader->failed = true;
+    return reader->failed ? 0 : count;
+}
+
+static const char *read_string(Reader *reader) {
+    size_t length = read_count(reader);
+    char *string = arena_alloc(global_arena, length + 1);
+    if (!reader->failed) memcpy(string, reader->data + reader->offset, length);
+    string[reader->failed ? 0 : length] = '\0';
+    reader->offset += length;
+    return string;
+}
+
+static bool decode_interface(Reader *reader, Interface *interface) {
+    size_t magic_length = strlen(INTERFACE_MAGIC);
+    if (reader->length < magic_length + 1 || memcmp(reader->data, INTERFACE_MAGIC, magic_length) != 0 ||
+        reader->data[magic_length] != INTERFACE_VERSION) {
+        return false;
+    }
+    reader->offset = magic_length + 1;
+
+    interface->import_count = (int)read_count(reader);
+    interface->imports = arena_alloc(global_arena, sizeof(const char *) * (size_t)(interface->import_count + 1));
+    for (int i = 0; i < interface->import_count; i++) interface->imports[i] = read_string(reader);
+
+    interface->type_count = (int)read_count(reader);
+    interface->types = arena_alloc(global_arena, sizeof(ASTNode *) * (size_t)(interface->type_count + 1));
+    for (int i = 0; i < interface->type_count; i++) {
+        const char *name = read_string(reader);
+        int variant_count = (int)read_count(reader);
+        struct Variant *variants = arena_alloc(global_arena, sizeof(struct Variant) * (size_t)(variant_count + 1));
+        for (int v = 0; v < variant_count; v++) {
+            variants[v].name = read_string(reader);
+            variants[v].field_count = (int)read_count(reader);
+            variants[v].field_types = arena_alloc(global_arena, sizeof(const char *) * (size_t)(variants[v].field_count + 1));
+            for (int f = 0; f < variants[v].field_count; f++) variants[v].field_types[f] = read_string(reader);
+        }
+        interface->types[i] = create_type_decl_node(name, variants, variant_count);
+    }
+
+    interface->function_count = (int)read_count(reader);
+    interface->functions = arena_alloc(global_arena, sizeof(ASTNode *) * (size_t)(interface->function_count + 1));
+    for (int i = 0; i < interface->function_count; i++) {
+        const char *name = read_string(reader);
+        const char *return_type = read_string(reader);
+        int param_count = (int)read_count(reader);
+        struct Param *params = arena_alloc(global_arena, sizeof(struct Param) * (size_t)(param_count + 1));
+        for (int p = 0; p < param_count; p++) {
+            params[p].name = "_";
+            params[p].type = read_string(reader);
+        }
+        interface->functions[i] = create_function_node(name, params, param_count, NULL, return_type, NULL);
+    }
+    return !reader->failed && reader->offset == reader->length;
+}
+
+static bool read_interface(Module *module) {
+    if (module->has_interface) return true;
+    size_t length = 0;
+    unsigned char *data = read_file(module_path("", module->name, ".vexi"), &length);
+    if (!data) return false;
+    Reader reader = { data, length, 0, false };
+    module->has_interface = decode_interface(&reader, &module->interface);
+    free(data);
+    return module->has_interface;
+}
+
+static bool is_name_char(char c, bool first) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (!first && c >= '0' && c <= '9');
+}
+
+/*
+ * The imports at the top of a module's source, found without the parser
+ * so that the build can order modules that have no interface yet. An
+ * import further down is still honoured when the module is compiled.
+ */
+static int leading_imports(const char *path, const char ***names) {
+    size_t length = 0;
+    unsigned char *data = read_file(path, &length);
+    *names = NULL;
+    if (!data) return 0;
+
+    const char *text = (const char *)data, *end = text + length;
+    int count = 0, capacity = 0;
+    while (text < end) {
+        if (*text == ' ' || *text == '\t' || *text == '\r' || *text == '\n') {
+            text++;
+            continue;
+        }
+        if (*text == '#') {
+            while (text < end && *text != '\n') text++;
+            continue;
+        }
+        if (end - text < 7 || strncmp(text, "import", 6) != 0 || is_name_char(text[6], false)) break;
+        const char *name = text + 6;
+        while (name < end && (*name == ' ' || *name == '\t')) name++;
+        const char *name_end = name;
+        while (name_end < end && is_name_char(*name_end, name_end == name)) name_end++;
+        text = name_end;
+        while (text < end && (*text == ' ' || *text == '\t')) text++;
+        if (name_end == name || text == end || *text != ';') break;
+        text++;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            const char **grown = arena_alloc(global_arena, sizeof(const char *) * (size_t)capacity);
+            if (count) memcpy(grown, *names, sizeof(const char *) * (size_t)count);
+            *names = grown;
+        }
+        char *copy = arena_alloc(global_arena, (size_t)(name_end - name) + 1);
+        memcpy(copy, name, (size_t)(name_end - name));
+        copy[name_end - name] = '\0';
+        (*names)[count++] = copy;
+    }
+    free(data);
+    return count;
+}
+
+/* The nanoseconds past st_mtime, which macOS keeps in st_mtimespec rather than POSIX's st_mtim. */
+static long mtime_nsec(const struct stat *st) {
+#if defined(__APPLE__)
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+static bool newer(const struct stat *a, const struct stat *b) {
+    return a->st_mtime > b->st_mtime || (a->st_mtime == b->st_mtime && mtime_nsec(a) > mtime_nsec(b));
+}
+
+/* Whether name.o and name.vexi are missing or older than the source or an imported interface. */
+static bool is_stale(Module *module) {
+    struct stat source, object, interface;
+    if (stat(module_path(source_dir, module->name, ".vex"), &source) != 0 ||
+        stat(module_path("", module->name, ".o"), &object) != 0 ||
+        stat(module_path("", module->name, ".vexi"), &interface) != 0) {
+        return true;
+    }
+    if (newer(&source, &object) || !read_interface(module)) return true;
+
+    for (int i = 0; i < module->interface.import_count; i++) {
+        struct stat imported;
+        if (stat(module_path("", module->interface.imports[i], ".vexi"), &imported) != 0 || newer(&imported, &object)) return true;
+    }
+    return false;
+}
+
+static bool in_import_chain(const char *name) {
+    const char *chain = getenv(IMPORT_CHAIN_VARIABLE);
+    size_t length = strlen(name);
+    for (const char *part = chain; part && *part; part = strchr(part, ':') ? strchr(part, ':') + 1 : NULL) {
+        if (strncmp(part, name, length) == 0 && (part[length] == ':' || part[length] == '\0')) return true;
+    }
+    return false;
+}
+
+static bool spawn_build(const char *name, pid_t *pid) {
+    const char *argv[7];
+    int argc = 0;
+    char level[16], cpu[256];
+    argv[argc++] = compiler;
+    argv[argc++] = "-c";
+    if (vex_options.fast_math) argv[argc++] = "-Ofast";
+    else if (vex_options.opt_size) argv[argc++] = "-Os";
+    else if (vex_options.opt_level >= 0) {
+        snprintf(level, sizeof(level), "-O%d", vex_options.opt_level);
+        argv[argc++] = level;
+    }
+    if (vex_options.auto_par) argv[argc++] = "--auto-par";
+    if (vex_options.cpu) {
+        snprintf(cpu, sizeof(cpu), "-mcpu=%s", vex_options.cpu);
+        argv[argc++] = cpu;
+    }
+    argv[argc++] = module_path(source_dir, name, ".vex");
+    argv[argc] = NULL;
+
+    int status = posix_spawnp(pid, compiler, NULL, NULL, (char *const *)argv, environ);
+    if (status != 0) {
+        fprintf(stderr, "vex: error: could not run '%s' to build module '%s': %s\n", compiler, name, strerror(status));
+        return false;
+    }
+    return true;
+}
+
+static bool wait_for_build(const pid_t *pids, const char **names, int count) {
+    int status;
+    pid_t pid = wait(&status);
+    for (int i = 0; i < count; i++) {
+        if (pids[i] != pid) continue;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "vex: error: building module '%s' failed\n", names[i]);
+            return false;
+        }
+        return true;
+    }
+    return pid >= 0;
+}
+
+/*
+ * Each module's imports are brought up to date before the module itself,
+ * so two modules sharing an import never both build it. The stale ones
+ * among names are then compiled by child processes, one per core at most.
+ */
+static bool build_modules(const char **names, int count) {
+    const char **pending = malloc(sizeof(const char *) * (size_t)(count ? count : 1));
+    int pending_count = 0;
+    bool ok = true;
+
+    for (int i = 0; ok && i < count; i++) {
+        if (find_module(names[i])) continue;
+        Module *module = add_module(names[i]);
+        struct stat source;
+        if (stat(module_path(source_dir, module->name, ".vex"), &source) != 0) {
+            fprintf(stderr, "vex: error: no module '%s' (looked for '%s')\n", module->name, module_path(source_dir, module->name, ".vex"));
+            ok = false;
+        } else if (in_import_chain(module->name)) {
+            fprintf(stderr, "vex: error: module '%s' is part of an import cycle\n", module->name);
+            ok = false;
+        } else {
+            const char **imports;
+            int import_count = leading_imports(module_path(source_dir, module->name, ".vex"), &imports);
+            ok = build_modules(imports, import_count);
+        }
+        if (ok) pending[pending_count++] = module->name;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int jobs = cores > 0 ? (int)cores : 1, running = 0, started = 0;
+    pid_t *pids = malloc(sizeof(pid_t) * (size_t)(pending_count ? pending_count : 1));
+    const char **building = malloc(sizeof(const char *) * (size_t)(pending_count ? pending_count : 1));
+    for (int i = 0; ok && i < pending_count; i++) {
+        Module *module = find_module(pending[i]);
+        if (!is_stale(module)) continue;
+        if (running == jobs) {
+            ok = wait_for_build(pids, building, started);
+            running--;
+        }
+        if (ok && spawn_build(module->name, &pids[started])) {
+            building[started++] = module->name;
+            module->has_interface = false;
+            running++;
+        } else {
+            ok = false;
+        }
+    }
+    while (running > 0) {
+        if (!wait_for_build(pids, building, started)) ok = false;
+        running--;
+    }
+
+    free(building);
+    free(pids);
+    free(pending);
+    return ok;
+}
+
+static void add_object(const char *name) {
+    if (object_count == object_capacity) {
+        object_capacity = object_capacity ? object_capacity * 2 : 8;
+        objects = realloc(objects, sizeof(const char *) * (size_t)object_capacity);
+    }
+    objects[object_count++] = module_path("", name, ".o");
+}
+
+static void add_declaration(ASTNode ***declarations, int *count, int *capacity, ASTNode *node) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        ASTNode **grown = arena_alloc(global_arena, sizeof(ASTNode *) * (size_t)*capacity);
+        if (*count) memcpy(grown, *declarations, sizeof(ASTNode *) * (size_t)*count);
+        *declarations = grown;
+    }
+    (*declarations)[(*count)++] = node;
+}
+
+/*
+ * Types come from every module reachable through imports, since a
+ * signature may mention any of them; functions only from the modules
+ * named in an import. Dependencies are loaded first.
+ */
+static bool load_module(const char *name, bool direct, ASTNode ***declarations, int *count, int *capacity) {
+    Module *module = add_module(name);
+    if (!module->types_loaded) {
+        module->types_loaded = true;
+        if (!read_interface(module)) {
+            fprintf(stderr, "vex: error: could not read the interface of module '%s'; compile it with 'vex -c'\n", name);
+            return false;
+        }
+        for (int i = 0; i < module->interface.import_count; i++) {
+            if (!load_module(module->interface.imports[i], false, declarations, count, capacity)) return false;
+        }
+        for (int i = 0; i < module->interface.type_count; i++) {
+            add_declaration(declarations, count, capacity, module->interface.types[i]);
+        }
+        add_object(name);
+    }
+    if (direct && !module->functions_loaded) {
+        module->functions_loaded = true;
+        for (int i = 0; i < module->interface.function_count; i++) {
+            add_declaration(declarations, count, capacity, module->interface.functions[i]);
+        }
+    }
+    return true;
+}
+
+static const char *declared_name(const ASTNode *node) {
+    if (node->type == NodeFunction) return node->function.name;
+    if (node->type == NodeTypeDecl) return node->type_decl.name;
+    return NULL;
+}
+
+/* Two imports, or an import and this file, may not declare the same top-level name. */
+static bool check_conflicts(ASTNode **statements, int count) {
+    for (int i = 0; i < count; i++) {
+        const char *name = declared_name(statements[i]);
+        for (int j = 0; name && j < i && j < imported_count; j++) {
+            const char *other = declared_name(statements[j]);
+            if (!other || strcmp(name, other) != 0) continue;
+            fprintf(stderr, "vex: error: '%s' is declared by %s\n", name,
+                    i < imported_count ? "more than one imported module" : "an imported module and by this file");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void set_import_chain(const char *source) {
+    const char *base = strrchr(source, '/');
+    base = base ? base + 1 : source;
+    size_t length = strlen(base);
+    if (length > 4 && strcmp(base + length - 4, ".vex") == 0) length -= 4;
+
+    const char *chain = getenv(IMPORT_CHAIN_VARIABLE);
+    size_t size = (chain ? strlen(chain) + 1 : 0) + length + 1;
+    char *value = malloc(size);
+    snprintf(value, size, "%s%s%.*s", chain ? chain : "", chain ? ":" : "", (int)length, base);
+    setenv(IMPORT_CHAIN_VARIABLE, value, 1);
+    free(value);
+}
+
+bool load_imports(ASTNode *root, const char *source, const char *compiler_path) {
+    /* Only a build another vex started for an importer inherits a chain. */
+    building_import = getenv(IMPORT_CHAIN_VARIABLE) != NULL;
+    if (root->type != NodeBlock) return true;
+    for (int i = 0; i < root->block.count; i++) {
+        if (root->block.statements[i]->type != NodeImport) continue;
+        if (!direct_imports) direct_imports = arena_alloc(global_arena, sizeof(const char *) * (size_t)root->block.count);
+        direct_imports[direct_import_count++] = root->block.statements[i]->strval;
+    }
+    if (!direct_import_count) return true;
+
+    const char *slash = strrchr(source, '/');
+    char *dir = arena_alloc(global_arena, slash ? (size_t)(slash - source) + 2 : 1);
+    if (slash) memcpy(dir, source, (size_t)(slash - source) + 1);
+    dir[slash ? slash - source + 1 : 0] = '\0';
+    source_dir = dir;
+    compiler = compiler_path;
+
+    set_import_chain(source);
+    if (!build_modules(direct_imports, direct_import_count)) return false;
+
+    ASTNode **declarations = NULL;
+    int count = 0, capacity = 0;
+    for (int i = 0; i < direct_import_count; i++) {
+        if (!load_module(direct_imports[i], true, &declarations, &count, &capacity)) return false;
+    }
+    imported_count = count;
+    for (int i = 0; i < root->block.count; i++) {
+        if (root->block.statements[i]->type != NodeImport) add_declaration(&declarations, &count, &capacity, root->block.statements[i]);
+    }
+    if (!check_conflicts(declarations, count)) return false;
+
+    root->block.statements = declarations;
+    root->block.count = count;
+    return true;
+}
+
+bool is_building_import(void) {
+    return building_import;
+}
+
+const char **module_objects(int *count) {
+    *count = object_count;
+    return objects;
+}
+
+void free_modules(void) {
+    free(modules);
+    free(objects);
+    modules = NULL;
+    objects = NULL;
+    module_count = module_capacity = object_count = object_capacity = 0;
+}
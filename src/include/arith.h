@@ -0,0 +1,13 @@
+#ifndef ARITH_H
+#define ARITH_H
+
+#include <stdint.h>
+
+/*
+ * Compiled code divides by a zero int without trapping: it gets 0, as the
+ * interpreter does, and calls this with the number of zero divisors so the
+ * same runtime error is printed once per division.
+ */
+void vex_division_by_zero(int64_t count);
+
+#endif // ARITH_H
@@ -1,6 +1,7 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 typedef enum {
@@ -17,18 +18,82 @@ typedef enum {
     NodeList,
     NodeFunction,
     NodeCall,
-    NodeBinaryExpr
+    NodeBinaryExpr,
+    NodeListOp,
+    NodeListPipeline,
+    NodeMatch,
+    NodeTypeDecl,
+    NodeConstruct,
+    NodeIf,
+    NodeImport
 } NodeType;
 
+typedef enum {
+    ListMap,
+    ListFilter,
+    ListReduce
+} ListOpKind;
+
+typedef enum {
+    PatternWildcard,
+    PatternBind,
+    PatternInt,
+    PatternChar,
+    PatternBool,
+    PatternNil,
+    PatternCons,
+    PatternConstructor
+} PatternKind;
+
+/*
+ * [p1, p2] is parsed as p1 :: p2 :: []. A bare name is parsed as a bind
+ * and becomes a constructor pattern when the type checker finds that the
+ * matched type has a constructor of that name; it also fills in the tag.
+ */
+typedef struct Pattern Pattern;
+struct Pattern {
+    PatternKind kind;
+    int line;
+    union {
+        const char *name;
+        int intval;
+        char charval;
+        int boolval;
+        struct {
+            Pattern *head, *tail;
+        } cons;
+        struct {
+            const char *name;
+            Pattern **args;
+            int arg_count, tag;
+        } constructor;
+    };
+};
+
 struct Param {
     const char *name;
     const char *type;
 };
 
+/* One alternative of a type declaration, with the type names of its fields. */
+struct Variant {
+    const char *name;
+    const char **field_types;
+    int field_count;
+};
+
 typedef struct ASTNode ASTNode;
+struct TypeTC;
+struct MatchPlan;
+struct VariantType;
+struct VariantConstructor;
+struct VexString;
 
 struct ASTNode {
     NodeType type;
+    int line;
+    struct TypeTC *tc_type;
+    bool local; /* a list literal that never outlives its function; see escape.c */
 
     union {
         int intval;
@@ -37,6 +102,11 @@ struct ASTNode {
         char charval;
         const char *strval;
 
+        struct {
+            const char *value;
+            const struct VexString *interned; /* made by the interpreter the first time it evaluates the literal */
+        } string_lit;
+
         struct {
             const char *op;
             ASTNode *left, *right;
@@ -52,6 +122,10 @@ struct ASTNode {
             ASTNode *expr;
         } var_decl;
 
+        struct {
+            ASTNode *condition, *then_branch, *else_branch;
+        } if_expr;
+
         struct {
             ASTNode **statements;
             int count;
@@ -67,9 +141,14 @@ struct ASTNode {
             int count;
         } list;
 
+        /*
+         * expr is NULL for a function imported from another module's
+         * interface; see module.h. profile_id is the function's entry in
+         * the --profile report, or -1 until its first profiled call.
+         */
         struct {
             const char *name, **param_names, **param_types, *return_type;
-            int param_count;
+            int param_count, profile_id;
             ASTNode *expr;
         } function;
 
@@ -77,6 +156,44 @@ struct ASTNode {
             ASTNode *callee, **args;
             int arg_count;
         } call;
+
+        struct {
+            ListOpKind op;
+            ASTNode *function, *init, *list;
+        } list_op;
+
+        /* Fused chain: source, then map/filter stages in order, then a reduce or sum sink (NULL collects a list). */
+        struct {
+            ASTNode *source, **stages, *sink;
+            int stage_count;
+        } pipeline;
+
+        /* The plan is the decision tree the type checker compiles the arms into; see match.h. */
+        struct {
+            ASTNode *scrutinee, **arms;
+            Pattern **patterns;
+            int arm_count;
+            struct MatchPlan *plan;
+        } match;
+
+        struct {
+            const char *name;
+            struct Variant *variants;
+            int variant_count;
+            struct VariantType *declared; /* set by the type checker */
+        } type_decl;
+
+        /*
+         * A call or name the type checker resolved to a declared constructor,
+         * or a built-in one (None, Some, Ok, Error) whose constructor it picks
+         * from the expected type; see tc.h.
+         */
+        struct {
+            const char *name;
+            ASTNode **args;
+            int arg_count;
+            struct VariantConstructor *constructor;
+        } construct;
     };
 };
 
@@ -94,10 +211,27 @@ ASTNode *create_print_node(ASTNode *value, const char *type);
 ASTNode *create_unary_node(const char *op, ASTNode *operand);
 ASTNode *create_call_node(ASTNode *callee, ASTNode **args, int arg_count);
 ASTNode *create_binary_node(const char *op, ASTNode *left, ASTNode *right);
+ASTNode *create_list_op_node(ListOpKind op, ASTNode *function, ASTNode *init, ASTNode *list);
+ASTNode *build_pipe(ASTNode *value, ASTNode *stage);
+ASTNode *create_match_node(ASTNode *scrutinee, Pattern **patterns, ASTNode **arms, int arm_count);
+ASTNode *create_if_node(ASTNode *condition, ASTNode *then_branch, ASTNode *else_branch);
+ASTNode *create_import_node(const char *module);
+Pattern *create_pattern(PatternKind kind);
+Pattern *create_bind_pattern(const char *name);
+Pattern *create_cons_pattern(Pattern *head, Pattern *tail);
+Pattern *build_list_pattern(Pattern **elements, int count);
+Pattern *create_constructor_pattern(const char *name, Pattern **args, int arg_count);
+ASTNode *create_type_decl_node(const char *name, struct Variant *variants, int variant_count);
+ASTNode *create_construct_node(const char *name, ASTNode **args, int arg_count);
 ASTNode *create_var_decl_node(const char* value, const char *type, ASTNode *expr);
 ASTNode *create_function_node(const char *name, struct Param *params, int param_count, const char **param_types, const char *return_type, ASTNode *body);
 
+int list_builtin_arity(const char *name);
+ASTNode *fuse_list_pipelines(ASTNode *node);
+void mark_local_lists(ASTNode *root);
+
 void printAST(ASTNode *node, int indent);
+void print_pattern(const Pattern *pattern);
 void indent_print(int indent, const char *fmt, ...);
 
 #endif // AST_H
@@ -10,6 +10,32 @@
 #define MINOR_VERSION 1
 #define PATCH_VERSION 0
 
+/* What compiling a file produces; an executable unless an option asks for an earlier stage. */
+typedef enum {
+    EmitExecutable,
+    EmitObject,
+    EmitAssembly,
+    EmitIR,
+    EmitAST
+} VexEmit;
+
+typedef struct VexOptions {
+    bool profile;
+    const char *profile_output;
+    unsigned int jit_threshold;
+    bool jit_repl;
+    bool auto_par;
+    int opt_level; /* 0-3, or -1 when no -O option was given */
+    bool opt_size;
+    bool fast_math;
+    const char *cpu; /* -mcpu or -march, or NULL for the target's generic CPU */
+    VexEmit emit;
+    const char *output; /* -o, or NULL for a name derived from the input */
+    bool save_temps;
+} VexOptions;
+
+extern VexOptions vex_options;
+
 void printHelpMenu(void);
 void printVersion(void);
 void printOptimizersHelp(void);
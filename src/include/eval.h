@@ -2,7 +2,10 @@
 #define EVAL_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include "ast.h"
+#include "str.h"
 
 typedef enum {
     VAL_INT,
@@ -10,20 +13,132 @@ typedef enum {
     VAL_BOOL,
     VAL_CHAR,
     VAL_STRING,
-    VAL_UNIT
+    VAL_UNIT,
+    VAL_LIST,
+    VAL_CLOSURE,
+    VAL_VARIANT
 } ValueKind;
 
-typedef struct {
-    ValueKind kind;
-    union {
-        int int_val;
-        double float_val;
-        int bool_val;
-        char char_val;
-        const char *string_val;
-    };
-} Value;
+/*
+ * A Value is a single NaN-boxed 64-bit word. Any bit pattern that is not a
+ * tagged quiet NaN is a double stored as-is. Every other kind lives in the
+ * quiet-NaN space: the top 13 bits are all ones, bits 48-50 hold a non-zero
+ * tag and the low 48 bits hold the payload (a 32-bit int, a bool, a char,
+ * a string word or a pointer). Tag 0 is left to the canonical NaN so real NaNs stay doubles.
+ * Unit and values of declared types share tag 4: unit is payload 0, and a
+ * variant word (see variant.h) is never 0.
+ */
+typedef uint64_t Value;
 
+#define VALUE_QNAN         UINT64_C(0x7ff8000000000000)
+#define VALUE_TAG_MASK     UINT64_C(0x0007000000000000)
+#define VALUE_PAYLOAD_MASK UINT64_C(0x0000ffffffffffff)
+#define VALUE_TAG_SHIFT    48
+
+#define VALUE_TAG_INT     UINT64_C(1)
+#define VALUE_TAG_BOOL    UINT64_C(2)
+#define VALUE_TAG_CHAR    UINT64_C(3)
+#define VALUE_TAG_UNIT    UINT64_C(4)
+#define VALUE_TAG_VARIANT VALUE_TAG_UNIT
+#define VALUE_TAG_STRING  UINT64_C(5)
+#define VALUE_TAG_LIST    UINT64_C(6)
+#define VALUE_TAG_CLOSURE UINT64_C(7)
+
+#define VALUE_BOX(tag, payload) (VALUE_QNAN | ((tag) << VALUE_TAG_SHIFT) | ((uint64_t)(payload) & VALUE_PAYLOAD_MASK))
+#define VALUE_UNIT VALUE_BOX(VALUE_TAG_UNIT, 0)
+
+static inline bool value_is_float(Value v) {
+    return (v & VALUE_QNAN) != VALUE_QNAN || (v & VALUE_TAG_MASK) == 0;
+}
+
+static inline uint64_t value_tag(Value v) {
+    return value_is_float(v) ? 0 : (v & VALUE_TAG_MASK) >> VALUE_TAG_SHIFT;
+}
+
+static inline bool value_has_tag(Value v, uint64_t tag) {
+    return (v & (VALUE_QNAN | VALUE_TAG_MASK)) == (VALUE_QNAN | (tag << VALUE_TAG_SHIFT));
+}
+
+static inline Value make_float_value(double d) {
+    Value v;
+    if (d != d) return VALUE_QNAN;
+    memcpy(&v, &d, sizeof(v));
+    return v;
+}
+
+static inline Value make_int_value(int i) { return VALUE_BOX(VALUE_TAG_INT, (uint32_t)i); }
+static inline Value make_bool_value(int b) { return VALUE_BOX(VALUE_TAG_BOOL, b != 0); }
+static inline Value make_char_value(char c) { return VALUE_BOX(VALUE_TAG_CHAR, (unsigned char)c); }
+static inline Value make_string_value(const VexString *s) { return VALUE_BOX(VALUE_TAG_STRING, (uintptr_t)s); }
+static inline Value make_pointer_value(uint64_t tag, const void *p) { return VALUE_BOX(tag, (uintptr_t)p); }
+static inline Value make_variant_value(int64_t word) { return VALUE_BOX(VALUE_TAG_VARIANT, word); }
+
+static inline bool value_is_variant(Value v) {
+    return value_has_tag(v, VALUE_TAG_VARIANT) && (v & VALUE_PAYLOAD_MASK) != 0;
+}
+
+static inline double value_as_float(Value v) {
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+static inline int value_as_int(Value v) { return (int)(uint32_t)v; }
+static inline int value_as_bool(Value v) { return (int)(v & 1); }
+static inline char value_as_char(Value v) { return (char)(unsigned char)v; }
+static inline void *value_as_pointer(Value v) { return (void *)(uintptr_t)(v & VALUE_PAYLOAD_MASK); }
+static inline const VexString *value_as_string(Value v) { return value_as_pointer(v); }
+
+/* The payload sign-extended, since an unboxed int field may be negative. */
+static inline int64_t value_as_variant(Value v) {
+    return (int64_t)((v & VALUE_PAYLOAD_MASK) << 16) >> 16;
+}
+
+typedef struct Closure {
+    ASTNode *function;
+    uint32_t calls, backedges, active;
+    bool jit_failed;
+    int64_t (*native)(const int64_t *args);
+} Closure;
+
+typedef struct Binding {
+    const char *name;
+    Value value;
+} Binding;
+
+/*
+ * Everything the interpreter binds. Bindings live on one stack of (name,
+ * value) pairs. A call pushes its parameters above frame_base and pops
+ * them on return; lookups search the current frame first and then the
+ * top-level bindings below global_count.
+ *
+ * Lists the interpreter holds only in C locals are kept in temps so the
+ * collector sees them. A call or block statement drops the entries it
+ * added when it finishes; anything still needed is bound or returned.
+ *
+ * A program runs in one environment of its own; a REPL session brings
+ * its own, which outlives each input line (see repl.c).
+ */
+typedef struct EvalEnv {
+    Binding *bindings;
+    size_t binding_count, binding_capacity;
+    size_t frame_base, global_count;
+    int call_depth;
+    Value *temps;
+    size_t temp_count, temp_capacity;
+} EvalEnv;
+
+extern bool eval_echo_types;
+extern uint32_t eval_tier_threshold;
+
+ValueKind value_kind(Value v);
 Value eval_ast(ASTNode *node);
+Value eval_program(ASTNode *root);
+bool eval_compile_global(const char *name);
+bool eval_call_global(const char *name, Value *result);
+ASTNode *eval_global_function(const char *name);
+void eval_forget_shadowed(const char *name);
+void eval_use_env(EvalEnv *env);
+void eval_free_env(EvalEnv *env);
 
 #endif
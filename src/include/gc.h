@@ -0,0 +1,62 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "list.h"
+#include "str.h"
+#include "variant.h"
+
+/* What an object holds, so the collector knows which of its words are references. */
+typedef enum {
+    VEX_GC_DATA,   /* no references */
+    VEX_GC_LIST,   /* a VexList header; traced according to its flags */
+    VEX_GC_NODE,   /* a persistent vector node; traced through the list that owns its tree */
+    VEX_GC_STRING, /* a VexString; a rope refers to its halves */
+    VEX_GC_VARIANT /* a boxed constructor; its header says which fields are references */
+} VexGcKind;
+
+/*
+ * The shadow frame of one compiled function: every list or string the
+ * function produces is stored in a slot, and the frame is pushed on entry
+ * and popped on return. Unused slots are NULL.
+ */
+typedef struct VexGcFrame {
+    struct VexGcFrame *prev;
+    int64_t count;
+    void *roots[];
+} VexGcFrame;
+
+/* Reports extra roots during a collection by calling vex_gc_mark_root on each. */
+typedef void (*VexGcRootFn)(void);
+
+/* Set once the nursery is full; compiled code and the interpreter poll it at safepoints. */
+extern atomic_int vex_gc_pending;
+
+void *vex_gc_alloc(size_t size, VexGcKind kind);
+size_t vex_gc_size(const void *object);
+void vex_gc_write_barrier(const void *object);
+void vex_gc_push_frame(VexGcFrame *frame);
+void vex_gc_pop_frame(VexGcFrame *frame);
+void vex_gc_add_global(void *slot);
+void vex_gc_add_roots(VexGcRootFn fn);
+void vex_gc_block(void);
+void vex_gc_unblock(void);
+void vex_gc_safepoint(void);
+void vex_gc_collect(bool major);
+
+/* For runtime types that trace their own fields during a collection. */
+bool vex_gc_mark(const void *object);
+void vex_gc_mark_list(const VexList *list);
+void vex_gc_mark_string(const VexString *string);
+void vex_gc_mark_variant(const VexVariant *variant);
+void vex_gc_mark_element(VexElemKind kind, int64_t word);
+void vex_gc_mark_root(const void *object);
+
+static inline void vex_gc_poll(void) {
+    if (atomic_load_explicit(&vex_gc_pending, memory_order_relaxed)) vex_gc_safepoint();
+}
+
+#endif // GC_H
@@ -0,0 +1,23 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ast.h"
+
+/*
+ * Native entry point of a tiered-up function. Arguments and the result are
+ * passed as 64-bit words: ints and chars are widened, floats keep their bit
+ * pattern and strings are passed as pointers.
+ */
+typedef int64_t (*JitEntry)(const int64_t *args);
+
+/* Maps a top-level name to its function definition, or NULL if it is not a function. */
+typedef ASTNode *(*JitResolver)(const char *name);
+
+JitEntry jit_compile_function(ASTNode *function, JitResolver resolve);
+void jit_add_object_file(const char *path);
+bool jit_repl_line(ASTNode *root);
+void jit_shutdown(void);
+
+#endif // JIT_H
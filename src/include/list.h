@@ -0,0 +1,109 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Elements per chunk of a bulk list operation; smaller lists run on the calling thread. */
+#define VEX_LIST_GRAIN 4096
+
+typedef enum {
+    VEX_ELEM_INT,
+    VEX_ELEM_FLOAT,
+    VEX_ELEM_BOOL,
+    VEX_ELEM_CHAR,
+    VEX_ELEM_STRING,
+    VEX_ELEM_LIST
+} VexElemKind;
+
+#define VEX_LIST_KIND_MASK UINT32_C(0x7)
+#define VEX_LIST_STATIC    UINT32_C(0x8)  /* header and elements are a read-only global */
+#define VEX_LIST_VIEW      UINT32_C(0x10) /* shares its elements with another list */
+#define VEX_LIST_TREE      UINT32_C(0x20) /* data is a VexVector rather than contiguous elements */
+#define VEX_LIST_LOCAL     UINT32_C(0x40) /* header and elements live in a compiled function's stack frame */
+
+/*
+ * Lists up to this length stay contiguous when updated; longer ones become
+ * persistent vectors. An update of an owned list, one that nothing else can
+ * refer to (see the _owned functions), happens in place instead.
+ */
+#define VEX_LIST_FLAT_MAX 256
+
+/*
+ * A list is one contiguous buffer of unboxed elements: ints are 32-bit,
+ * floats are doubles, bools and chars are single bytes, and strings (see
+ * str.h) and lists are words. The element kind lives in the low bits of flags.
+ * Large lists that are updated incrementally switch to a persistent vector
+ * (see vector.h) so each update shares structure instead of copying. Lists
+ * live on the collected heap (see gc.h) unless they are VEX_LIST_STATIC.
+ */
+typedef struct VexList {
+    int64_t length;
+    int32_t elem_size;
+    uint32_t flags;
+    void *data;
+} VexList;
+
+/* Same word ABI as JIT entry points: arguments and result are 64-bit words. */
+typedef int64_t (*VexWordFn)(const int64_t *args);
+
+/* One fused pass over an element: rewrites *word in place and returns false to drop it. */
+typedef bool (*VexStageFn)(int64_t *word, void *ctx);
+
+/*
+ * Loops over elements [begin, end) of a contiguous list, specialized by
+ * compiled code for one known function so that each element is a direct
+ * call rather than one through a VexWordFn. A filter kernel sets keep[i]
+ * and returns how many it kept; a reduce kernel folds from acc.
+ */
+typedef void (*VexMapKernel)(const VexList *in, VexList *out, int64_t begin, int64_t end);
+typedef int64_t (*VexFilterKernel)(const VexList *in, uint8_t *keep, int64_t begin, int64_t end);
+typedef int64_t (*VexReduceKernel)(const VexList *in, int64_t begin, int64_t end, int64_t acc);
+
+static inline int32_t vex_elem_size(VexElemKind kind) {
+    if (kind == VEX_ELEM_BOOL || kind == VEX_ELEM_CHAR) return 1;
+    return kind == VEX_ELEM_INT ? 4 : 8;
+}
+
+/* Elements of these kinds are pointers into the collected heap. */
+static inline bool vex_elem_is_reference(VexElemKind kind) {
+    return kind == VEX_ELEM_STRING || kind == VEX_ELEM_LIST;
+}
+
+static inline VexElemKind vex_list_kind(const VexList *list) {
+    return (VexElemKind)(list->flags & VEX_LIST_KIND_MASK);
+}
+
+VexList *vex_list_new(VexElemKind kind, int64_t length);
+int64_t vex_list_length(const VexList *list);
+int64_t vex_list_index(const VexList *list, int64_t index);
+int64_t vex_list_head(const VexList *list);
+VexList *vex_list_tail(const VexList *list);
+VexList *vex_list_push(const VexList *list, int64_t word);
+VexList *vex_list_update(const VexList *list, int64_t index, int64_t word);
+VexList *vex_list_concat(const VexList *left, const VexList *right);
+VexList *vex_list_take(const VexList *list, int64_t count);
+VexList *vex_list_drop(const VexList *list, int64_t count);
+VexList *vex_list_push_owned(VexList *list, int64_t word);
+VexList *vex_list_update_owned(VexList *list, int64_t index, int64_t word);
+VexList *vex_list_concat_owned(VexList *left, const VexList *right);
+VexList *vex_list_take_owned(VexList *list, int64_t count);
+VexList *vex_list_reuse(VexList *list, VexElemKind kind);
+const VexList *vex_list_contiguous(const VexList *list);
+int64_t vex_list_zip_length(const VexList *left, const VexList *right);
+int64_t vex_list_get_word(const VexList *list, int64_t index);
+void vex_list_set_word(VexList *list, int64_t index, int64_t word);
+void vex_list_trace(const VexList *list);
+
+VexList *vex_list_map(const VexList *list, VexElemKind out_kind, VexWordFn fn);
+VexList *vex_list_map_owned(VexList *list, VexElemKind out_kind, VexWordFn fn);
+VexList *vex_list_filter(const VexList *list, VexWordFn fn);
+int64_t vex_list_reduce(const VexList *list, int64_t init, VexWordFn fn);
+VexList *vex_list_map_kernel(const VexList *list, VexElemKind out_kind, VexMapKernel kernel);
+VexList *vex_list_map_kernel_owned(VexList *list, VexElemKind out_kind, VexMapKernel kernel);
+VexList *vex_list_filter_kernel(const VexList *list, VexFilterKernel kernel);
+int64_t vex_list_reduce_kernel(const VexList *list, int64_t init, VexReduceKernel kernel, VexWordFn combine);
+VexList *vex_list_pipeline(const VexList *list, VexElemKind out_kind, VexStageFn stage, void *ctx);
+int64_t vex_list_pipeline_reduce(const VexList *list, VexStageFn stage, void *ctx, int64_t init, VexWordFn combine);
+
+#endif // LIST_H
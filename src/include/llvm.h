@@ -1,6 +1,7 @@
 #ifndef LLVM_H
 #define LLVM_H
 
+#include <stdbool.h>
 #include <llvm-c/Types.h>
 #include <llvm-c/Core.h>
 #include <llvm-c/ExecutionEngine.h>
@@ -13,6 +14,10 @@
 extern LLVMContextRef TheContext;
 extern LLVMModuleRef TheModule;
 extern LLVMBuilderRef Builder;
+extern bool llvm_echo_types;
+extern bool llvm_auto_par;
+/* Keep the names of instructions and arguments; only worth it when the IR is written out for someone to read. */
+extern bool llvm_keep_names;
 
 typedef struct VarBinding {
     const char *name;
@@ -20,14 +25,35 @@ typedef struct VarBinding {
     UT_hash_handle hh;
 } VarBinding;
 
+/* The shadow frame of the function being lowered; see gc.h for the runtime layout. */
+typedef struct GcFrame {
+    LLVMValueRef function, slots;
+    unsigned int count;
+    struct GcFrame *parent;
+} GcFrame;
+
 void compile_root(void);
 void print_llvm_ir(void);
 void free_variables(void);
-void init_llvm_codegen(void);
+void free_globals(void);
+void free_function_defs(void);
+void init_llvm_codegen(const char *module_name);
 LLVMValueRef llvm_eval_ast(ASTNode *node);
+LLVMTypeRef get_list_type(void);
+LLVMTypeRef get_llvm_type(const char *type_str);
+LLVMValueRef declare_function(ASTNode *node);
 LLVMValueRef get_variable(const char *name);
-void write_llvm_ir_to_file(const char *filename);
+LLVMValueRef get_global(const char *name);
+void insert_global(const char *name, LLVMValueRef value);
+bool write_llvm_ir_to_file(const char *filename);
 void insert_variable(const char *name, LLVMValueRef value);
 LLVMValueRef create_printf_function_type(LLVMTypeRef *out_type);
+LLVMValueRef word_to_native(LLVMValueRef word, LLVMTypeRef type);
+LLVMValueRef native_to_word(LLVMValueRef value);
+LLVMValueRef build_word_thunk(const char *name, LLVMValueRef target);
+void gc_frame_begin(GcFrame *frame, LLVMValueRef function);
+void gc_frame_end(GcFrame *frame, LLVMValueRef result);
+void gc_root(LLVMValueRef value);
+LLVMValueRef outcome_reference(LLVMValueRef value);
 
 #endif // LLVM_H
@@ -0,0 +1,78 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ast.h"
+#include "tc.h"
+
+/* Switches with at least this many cases, spanning at most twice as many values, dispatch through a table. */
+#define MATCH_TABLE_MIN_CASES 4
+
+/*
+ * A value the decision tree looks at: the scrutinee (occurrence 0) or a
+ * field of another occurrence once it is known to have tag, such as the
+ * head (field 0) or tail (field 1) of a non-empty list, or a field of one
+ * constructor of a declared type. Each one is computed at most once on
+ * any path.
+ */
+typedef struct MatchOccurrence {
+    int parent; /* -1 for the scrutinee */
+    int64_t tag;
+    int field;
+    TypeTC *type;
+} MatchOccurrence;
+
+typedef struct MatchBinding {
+    const char *name;
+    int occurrence;
+} MatchBinding;
+
+typedef enum {
+    DecisionFail,  /* no arm matches; only left in a match the type checker rejects */
+    DecisionLeaf,  /* bind and run one arm */
+    DecisionSwitch /* branch on the tag of one occurrence */
+} DecisionKind;
+
+typedef struct Decision Decision;
+
+typedef struct DecisionCase {
+    int64_t tag;
+    Decision *next;
+} DecisionCase;
+
+/*
+ * The tag of an occurrence is 0 for [] and 1 for a non-empty list, 0 or
+ * 1 for a bool, the value itself for an int or a char, and the
+ * constructor's tag for a declared type (see variant.h). Cases are
+ * sorted by tag. A dense switch also has a table from tag - table_min to
+ * the case to take, with the fallback filling the holes.
+ */
+struct Decision {
+    DecisionKind kind;
+
+    int arm;
+    MatchBinding *bindings;
+    int binding_count;
+
+    int occurrence;
+    DecisionCase *cases;
+    int case_count;
+    Decision *fallback; /* NULL when the cases cover every tag */
+    Decision **table;
+    int64_t table_min, table_size;
+};
+
+typedef struct MatchPlan {
+    Decision *tree;
+    MatchOccurrence *occurrences;
+    int occurrence_count;
+    bool exhaustive;
+} MatchPlan;
+
+MatchPlan *compile_match(ASTNode *node);
+Decision *decision_select(const Decision *decision, int64_t tag);
+int pattern_binding_count(const Pattern *pattern);
+void pattern_bindings(const Pattern *pattern, const char **names, int *count);
+
+#endif // MATCH_H
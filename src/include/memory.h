@@ -1,16 +1,27 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
-typedef struct Arena {
+/* Blocks are chained; base is the block's offset in the arena as a whole, which checkpoints use. */
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t base, capacity, used;
     char *memory;
-    size_t capacity, used;
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *block;
+    size_t block_size;
 } Arena;
 
 Arena *arena_create(size_t size);
 void *arena_alloc(Arena *arena, size_t size);
+size_t arena_checkpoint(const Arena *arena);
+void arena_rollback(Arena *arena, size_t checkpoint);
 void arena_destroy(Arena *arena);
+bool arena_owns(const Arena *arena, const void *pointer);
 void arena_new_line(void) ;
 
 #endif // MEMORY_H
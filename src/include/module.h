@@ -0,0 +1,40 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include <stdbool.h>
+#include "ast.h"
+
+/*
+ * Every .vex file is a module, and `import name;` makes the types and
+ * functions of name.vex, from the same directory, visible in the file that
+ * says it. Compiling a module with -c writes name.o and name.vexi, its
+ * interface: the modules it imports and the signatures of its top-level
+ * types and functions. Importers read only interfaces, never another
+ * module's source, and an interface is rewritten only when it changes, so
+ * editing a function body rebuilds that module alone.
+ */
+
+/*
+ * Brings every module root imports up to date, building stale ones with
+ * `<compiler> -c` in parallel, then replaces the import statements with
+ * the declarations their interfaces export: imported functions have no
+ * body, and imported types are declared as usual. False after reporting
+ * an error.
+ */
+bool load_imports(ASTNode *root, const char *source, const char *compiler);
+
+/*
+ * Whether this process is building a module for an importer rather than
+ * the program itself; such a module's main is not the program's.
+ */
+bool is_building_import(void);
+
+/* Writes root's interface to path, unless the file already says the same. */
+bool write_interface(ASTNode *root, const char *path);
+
+/* The objects of every module the program uses, directly or not, for linking or the JIT. */
+const char **module_objects(int *count);
+
+void free_modules(void);
+
+#endif // MODULE_H
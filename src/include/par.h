@@ -0,0 +1,38 @@
+#ifndef PAR_H
+#define PAR_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Stack space, in 64-bit words, that compiled code reserves for one VexTask. */
+#define VEX_TASK_WORDS 4
+
+typedef void (*VexTaskFn)(void *env);
+typedef void (*VexRangeFn)(int64_t begin, int64_t end, void *ctx);
+
+/*
+ * A unit of fork-join work. Tasks live in the spawning frame, which always
+ * joins them before returning, so the runtime never allocates or frees one.
+ */
+typedef struct VexTask {
+    VexTaskFn fn;
+    void *env;
+    atomic_int done;
+    int depth;
+} VexTask;
+
+_Static_assert(sizeof(VexTask) <= VEX_TASK_WORDS * sizeof(int64_t), "VexTask must fit in VEX_TASK_WORDS");
+
+/*
+ * Whether a fork here is still worth a task: true until forks nest a few
+ * levels deeper than it takes to occupy every worker. Compiled code asks
+ * at each fork site and runs sequential code from there when told no.
+ */
+bool vex_par_should_spawn(void);
+void vex_par_spawn(void *task, VexTaskFn fn, void *env);
+void vex_par_join(void *task);
+void vex_par_for(int64_t count, int64_t grain, VexRangeFn body, void *ctx);
+unsigned int vex_par_worker_count(void);
+
+#endif // PAR_H
@@ -0,0 +1,51 @@
+#ifndef STR_H
+#define STR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "list.h"
+
+/* Strings of up to this many bytes are packed into the string word itself. */
+#define VEX_STRING_INLINE_MAX 5
+
+/* Concatenations up to this many bytes are copied into one flat string instead of a rope. */
+#define VEX_STRING_LEAF_MAX 64
+
+/* A rope deeper than this is rebuilt as a balanced tree over the same leaves. */
+#define VEX_STRING_MAX_DEPTH 48
+
+/* Same bit as VEX_LIST_STATIC, so the collector can tell either kind of root is not on the heap. */
+#define VEX_STRING_STATIC VEX_LIST_STATIC
+#define VEX_STRING_ROPE   UINT32_C(0x1) /* followed by its left and right halves rather than bytes */
+
+/*
+ * A string is one word. Up to VEX_STRING_INLINE_MAX bytes are stored in
+ * the word itself: the low byte is the length shifted left once with the
+ * low bit set, and the following bytes are the characters, which fits
+ * the payload of an interpreter Value. Any other string is a pointer to
+ * a VexString. A flat one is followed by its bytes and a NUL; literals
+ * are flat, static and interned. A rope is followed by the two strings
+ * it joins, so concatenation does not copy. Either way the byte length is
+ * stored up front and is O(1) to read.
+ *
+ * The length and flags sit where VexList keeps them; see VEX_STRING_STATIC.
+ */
+typedef struct VexString {
+    int64_t length;
+    uint32_t depth; /* 0 for a flat string */
+    uint32_t flags;
+} VexString;
+
+static inline bool vex_string_is_inline(const VexString *string) {
+    return ((uintptr_t)string & 1) != 0;
+}
+
+const VexString *vex_string_intern(const char *bytes, int64_t length);
+const VexString *vex_string_concat(const VexString *left, const VexString *right);
+int64_t vex_string_length(const VexString *string);
+const char *vex_string_cstr(const VexString *string);
+void vex_string_trace(const VexString *string);
+bool vex_utf8_valid(const char *bytes, int64_t length);
+
+#endif // STR_H
@@ -0,0 +1,26 @@
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <stdbool.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+
+/*
+ * The optimization level picked on the command line: 0-3, or -1 when no
+ * -O option was given and each caller falls back to its own default.
+ * -Os is level 2 optimizing for size, and -Ofast is level 3 with
+ * fast-math on every float operator. cpu is what -mcpu or -march named,
+ * or NULL; it only applies to files, as JIT code always runs on the host.
+ */
+void target_configure(int opt_level, bool opt_size, bool fast_math, const char *cpu);
+
+LLVMTargetMachineRef host_target_machine(int level);
+bool optimize_module(LLVMModuleRef module, int default_level);
+bool optimize_output_module(LLVMModuleRef module);
+LLVMValueRef fast_math(LLVMValueRef value);
+
+bool emit_native_file(LLVMModuleRef module, const char *path, LLVMCodeGenFileType type);
+LLVMMemoryBufferRef compile_to_object(LLVMModuleRef module, int default_level);
+bool link_executable(const char **objects, int object_count, const char *output);
+
+#endif // TARGET_H
@@ -1,6 +1,8 @@
 #ifndef TC_H
 #define TC_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "ast.h"
 
 typedef enum {
@@ -11,10 +13,12 @@ typedef enum {
     TypeString,
     TypeList,
     TypeFunction,
+    TypeVariant,
     TypeError
 } TypeKind;
 
 typedef struct TypeTC TypeTC;
+typedef struct VariantType VariantType;
 
 struct TypeTC {
     TypeKind kind;
@@ -22,11 +26,60 @@ struct TypeTC {
     int param_count;
     TypeTC *return_type;
     TypeTC *element_type;
+    VariantType *variant;
+};
+
+/* How a constructor's values are laid out; see variant.h. */
+typedef enum {
+    ConstructorBoxed,     /* a heap object holding the fields */
+    ConstructorImmediate, /* no fields: the tag alone */
+    ConstructorUnboxed    /* one int, char or bool field, stored in the word with the tag */
+} ConstructorRepr;
+
+typedef struct VariantConstructor {
+    const char *name;
+    uint32_t tag;
+    ConstructorRepr repr;
+    TypeTC **fields;
+    int field_count;
+    uint32_t references; /* fields the collector follows, as in VexVariant */
+    VariantType *type;
+} VariantConstructor;
+
+/*
+ * How compiled code holds a type's values. Declared types are one tagged
+ * word (see variant.h). An option of a string, list or declared type,
+ * none of which is ever a null word, is the value itself with null for
+ * None. Every other option and result is a flag, which is the tag, and a
+ * payload word, so it is returned in two registers and never allocated;
+ * only where such a value has to be one word (the interpreter, a field or
+ * a JIT entry) is it laid out like a declared type's value.
+ */
+typedef enum {
+    VariantTagged,
+    VariantNullable,
+    VariantFlagged
+} VariantLayout;
+
+/*
+ * A declared type, or one instance of option<T> (None, Some) or
+ * result<T,E> (Ok, Error). Constructors are indexed by tag: for a
+ * declared type the boxed ones first, each group in declaration order.
+ */
+struct VariantType {
+    const char *name;
+    VariantLayout layout;
+    VariantConstructor *constructors;
+    int constructor_count, boxed_count;
+    bool pointer_tagged; /* every boxed constructor's tag is in its pointer */
+    bool has_payloads;   /* some constructor is unboxed */
+    VariantType *next;
 };
 
 typedef struct TypeEnv {
     const char *name;
     TypeTC *type;
+    bool used; /* set by a lookup that finds it; the REPL reads it to see what an input refers to */
     struct TypeEnv *next;
 } TypeEnv;
 
@@ -36,6 +89,7 @@ typedef struct TypeMapping {
 } TypeMapping;
 
 TypeTC *typecheck(ASTNode *node);
+TypeTC *typecheck_with_env(ASTNode *node, TypeEnv **env);
 TypeTC *make_type(TypeKind kind);
 TypeTC *typecheck_expr(ASTNode *node);
 const char *type_to_string(TypeKind kind);
@@ -50,5 +104,6 @@ TypeEnv *add_binding(TypeEnv *env, const char *name, TypeTC *type);
 TypeTC *typecheck_binary(const char *op, TypeTC *left, TypeTC *right);
 void update_binding(TypeEnv *env, ASTNode *ident_node, TypeTC *new_type);
 TypeTC *make_function_type(TypeTC *return_type, TypeTC **param_types, int param_count);
+VariantType *find_variant_type(const char *name);
 
 #endif // TC_H
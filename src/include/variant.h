@@ -0,0 +1,91 @@
+#ifndef VARIANT_H
+#define VARIANT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Constructors one type can have; an immediate keeps its tag in bits 1-7. */
+#define VEX_VARIANT_MAX_TAGS 128
+
+/* Boxed constructors whose tag fits in bits 1-2 of an 8-byte aligned pointer. */
+#define VEX_VARIANT_POINTER_TAGS 4
+
+/* Fields one constructor can have, one bit each in VexVariant.references. */
+#define VEX_VARIANT_MAX_FIELDS 32
+
+#define VEX_VARIANT_IMMEDIATE     UINT64_C(0x1)
+#define VEX_VARIANT_TAG_MASK      UINT64_C(0x7f)
+#define VEX_VARIANT_POINTER_MASK  UINT64_C(0x7)
+#define VEX_VARIANT_PAYLOAD_SHIFT 8
+
+/*
+ * A value of a declared type is one word. A constructor without fields is
+ * an immediate: its tag shifted left once with the low bit set, so it
+ * never allocates and can never be mistaken for a pointer. A constructor
+ * whose one field is an int, char or bool is an immediate too, with the
+ * field above the low byte (an int keeps its low 56 bits). Every other
+ * constructor is a pointer to a VexVariant on the collected heap, which
+ * holds its fields as words. Tags are numbered boxed constructors first,
+ * and heap objects are 8-byte aligned, so when a type has at most
+ * VEX_VARIANT_POINTER_TAGS boxed constructors the pointer carries the tag
+ * in bits 1-2 and a match never loads the header to find it.
+ *
+ * The flags sit where VexList keeps them and are always 0, so a shadow
+ * frame slot can hold a variant as well as a list or a string.
+ */
+typedef struct VexVariant {
+    uint32_t tag;
+    uint32_t field_count;
+    uint32_t references; /* bit i is set when field i is a string, list or variant */
+    uint32_t flags;
+} VexVariant;
+
+static inline bool vex_variant_is_immediate(int64_t word) {
+    return ((uint64_t)word & VEX_VARIANT_IMMEDIATE) != 0;
+}
+
+static inline int64_t vex_variant_immediate(uint32_t tag, int64_t payload) {
+    return (int64_t)((uint64_t)payload << VEX_VARIANT_PAYLOAD_SHIFT | (uint64_t)tag << 1 | VEX_VARIANT_IMMEDIATE);
+}
+
+static inline int64_t vex_variant_payload(int64_t word) {
+    return word >> VEX_VARIANT_PAYLOAD_SHIFT;
+}
+
+static inline VexVariant *vex_variant_object(int64_t word) {
+    return (VexVariant *)(uintptr_t)((uint64_t)word & ~VEX_VARIANT_POINTER_MASK);
+}
+
+static inline int64_t *vex_variant_fields(const VexVariant *variant) {
+    return (int64_t *)(uintptr_t)(variant + 1);
+}
+
+/* The word for a boxed constructor: the object, with its tag in the low bits when the type has room for it there. */
+static inline int64_t vex_variant_word(const VexVariant *variant, bool pointer_tagged) {
+    uint64_t word = (uint64_t)(uintptr_t)variant;
+    if (pointer_tagged) word |= (uint64_t)variant->tag << 1;
+    return (int64_t)word;
+}
+
+static inline uint32_t vex_variant_tag(int64_t word, bool pointer_tagged) {
+    if (vex_variant_is_immediate(word)) return (uint32_t)((uint64_t)word >> 1 & VEX_VARIANT_TAG_MASK);
+    if (pointer_tagged) return (uint32_t)((uint64_t)word >> 1 & (VEX_VARIANT_POINTER_TAGS - 1));
+    return vex_variant_object(word)->tag;
+}
+
+VexVariant *vex_variant_new(uint32_t tag, uint32_t field_count, uint32_t references);
+void vex_variant_trace(const VexVariant *variant);
+
+/*
+ * Compiled code holds most options and results as a tag and a payload
+ * word rather than one word (see VariantLayout in tc.h). These convert
+ * between the two where a word is needed: bit t of boxed_tags says
+ * constructor t is boxed, and bit t of reference_tags that its payload
+ * is a reference. Such types have at most two constructors, so the
+ * pointer always carries the tag.
+ */
+int64_t vex_variant_box(uint32_t tag, int64_t payload, uint32_t boxed_tags, uint32_t reference_tags);
+uint32_t vex_variant_unbox_tag(int64_t word);
+int64_t vex_variant_unbox_payload(int64_t word);
+
+#endif // VARIANT_H
@@ -0,0 +1,36 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "list.h"
+
+#define VEX_VECTOR_BITS   5
+#define VEX_VECTOR_BRANCH (1 << VEX_VECTOR_BITS)
+
+typedef struct VexNode VexNode;
+
+/*
+ * Persistent vector of 64-bit words: a relaxed radix-balanced (RRB) tree
+ * with 32-way nodes plus a tail leaf that absorbs appends. Nodes are never
+ * modified once built, so every operation shares all but O(log32 n) of
+ * them with its input.
+ */
+typedef struct VexVector {
+    VexNode *root;
+    VexNode *tail;
+    int64_t root_size;
+    uint32_t shift;
+} VexVector;
+
+int64_t vex_vector_length(const VexVector *vector);
+int64_t vex_vector_get(const VexVector *vector, int64_t index);
+void vex_vector_from_list(VexVector *out, const VexList *flat);
+void vex_vector_to_list(const VexVector *vector, VexList *flat);
+void vex_vector_push(VexVector *out, const VexVector *vector, int64_t word);
+void vex_vector_update(VexVector *out, const VexVector *vector, int64_t index, int64_t word);
+void vex_vector_concat(VexVector *out, const VexVector *left, const VexVector *right);
+void vex_vector_slice(VexVector *out, const VexVector *vector, int64_t begin, int64_t end);
+void vex_vector_trace(const VexVector *vector, VexElemKind kind);
+
+#endif // VECTOR_H
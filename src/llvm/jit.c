@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include "jit.h"
+#include "llvm.h"
+#include "match.h"
+#include "target.h"
+#include "tc.h"
+
+typedef struct NameScope {
+    const char **names;
+    int count, capacity;
+} NameScope;
+
+/* The hot function plus every function it can reach; all are lowered into one module. */
+typedef struct TierUnit {
+    ASTNode **functions;
+    int count, capacity;
+    JitResolver resolve;
+} TierUnit;
+
+/* A top-level REPL definition and the JIT symbol its current version lives under. */
+typedef struct ReplSymbol {
+    const char *name;
+    char *symbol;
+    ASTNode *definition;
+} ReplSymbol;
+
+static LLVMOrcLLJITRef jit = NULL;
+static const char **object_files = NULL;
+static int object_file_count = 0, object_file_capacity = 0;
+static unsigned int tier_count = 0;
+static ReplSymbol *repl_symbols = NULL;
+static int repl_symbol_count = 0, repl_symbol_capacity = 0;
+static unsigned int repl_line_count = 0, repl_version_count = 0;
+
+static void report_jit_error(const char *what, LLVMErrorRef err) {
+    char *message = LLVMGetErrorMessage(err);
+    fprintf(stderr, "JIT error: %s: %s\n", what, message);
+    LLVMDisposeErrorMessage(message);
+}
+
+static bool start_jit(void) {
+    if (jit) return true;
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    LLVMErrorRef err = LLVMOrcCreateLLJIT(&jit, NULL);
+    if (err) {
+        report_jit_error("could not create LLJIT", err);
+        jit = NULL;
+        return false;
+    }
+
+    LLVMOrcDefinitionGeneratorRef process_symbols;
+    err = LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(&process_symbols, LLVMOrcLLJITGetGlobalPrefix(jit), NULL, NULL);
+    if (err) {
+        report_jit_error("could not expose process symbols", err);
+        return false;
+    }
+    LLVMOrcJITDylibAddGenerator(LLVMOrcLLJITGetMainJITDylib(jit), process_symbols);
+
+    for (int i = 0; i < object_file_count; i++) {
+        LLVMMemoryBufferRef object;
+        char *message = NULL;
+        if (LLVMCreateMemoryBufferWithContentsOfFile(object_files[i], &object, &message)) {
+            fprintf(stderr, "JIT error: could not read '%s': %s\n", object_files[i], message);
+            LLVMDisposeMessage(message);
+            return false;
+        }
+        err = LLVMOrcLLJITAddObjectFile(jit, LLVMOrcLLJITGetMainJITDylib(jit), object);
+        if (err) {
+            report_jit_error("could not add object file", err);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* An imported module's object, whose functions tier units can call. Objects are loaded when the JIT starts. */
+void jit_add_object_file(const char *path) {
+    if (object_file_count == object_file_capacity) {
+        object_file_capacity = object_file_capacity ? object_file_capacity * 2 : 8;
+        object_files = realloc(object_files, sizeof(const char *) * (size_t)object_file_capacity);
+    }
+    object_files[object_file_count++] = path;
+}
+
+void jit_shutdown(void) {
+    for (int i = 0; i < repl_symbol_count; i++) {
+        free(repl_symbols[i].symbol);
+    }
+    free(repl_symbols);
+    repl_symbols = NULL;
+    repl_symbol_count = repl_symbol_capacity = 0;
+    free(object_files);
+    object_files = NULL;
+    object_file_count = object_file_capacity = 0;
+
+    free_function_defs();
+    if (!jit) return;
+    LLVMErrorRef err = LLVMOrcDisposeLLJIT(jit);
+    if (err) report_jit_error("could not shut down LLJIT", err);
+    jit = NULL;
+}
+
+/* Lists travel as pointers to their header and declared types as their one word, so they fit in a word too. */
+static bool is_word_type(const char *type) {
+    return strcmp(type, "int") == 0 || strcmp(type, "float") == 0 ||
+           strcmp(type, "bool") == 0 || strcmp(type, "char") == 0 ||
+           strcmp(type, "string") == 0 || type[0] == '<' || find_variant_type(type);
+}
+
+static bool is_lowered_binary_op(const char *op) {
+    static const char *ops[] = { "+", "-", "*", "/", "+.", "-.", "*.", "/.", "<", ">", "<=", ">=", "==", "!=", "&&", "||" };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(op, ops[i]) == 0) return true;
+    }
+    return false;
+}
+
+static void scope_push(NameScope *scope, const char *name) {
+    if (scope->count == scope->capacity) {
+        scope->capacity = scope->capacity ? scope->capacity * 2 : 16;
+        scope->names = realloc(scope->names, sizeof(const char *) * (size_t)scope->capacity);
+    }
+    scope->names[scope->count++] = name;
+}
+
+static bool scope_contains(const NameScope *scope, const char *name) {
+    for (int i = scope->count; i > 0; i--) {
+        if (strcmp(scope->names[i - 1], name) == 0) return true;
+    }
+    return false;
+}
+
+static bool add_function(TierUnit *unit, ASTNode *function) {
+    for (int i = 0; i < unit->count; i++) {
+        if (unit->functions[i] == function) return true;
+        if (strcmp(unit->functions[i]->function.name, function->function.name) == 0) return false;
+    }
+
+    if (!is_word_type(function->function.return_type)) return false;
+    for (int i = 0; i < function->function.param_count; i++) {
+        if (!is_word_type(function->function.param_types[i])) return false;
+    }
+
+    if (unit->count == unit->capacity) {
+        unit->capacity = unit->capacity ? unit->capacity * 2 : 8;
+        unit->functions = realloc(unit->functions, sizeof(ASTNode *) * (size_t)unit->capacity);
+    }
+    unit->functions[unit->count++] = function;
+    return true;
+}
+
+/* Only accept what llvm.c can lower; anything else keeps the function in the interpreter. */
+static bool can_lower(TierUnit *unit, ASTNode *node, NameScope *scope) {
+    switch (node->type) {
+        case NodeIntLit:
+        case NodeFloatLit:
+        case NodeCharLit:
+        case NodeBoolLit:
+        case NodeStringLit:
+            return true;
+
+        case NodeIdentifier:
+            return scope_contains(scope, node->strval);
+
+        case NodeBinaryExpr:
+            return (is_lowered_binary_op(node->binary_expr.op) || (node->tc_type && node->tc_type->kind == TypeList)) &&
+                   can_lower(unit, node->binary_expr.left, scope) &&
+                   can_lower(unit, node->binary_expr.right, scope);
+
+        case NodeVarDecl:
+            if (!node->var_decl.type || !is_word_type(node->var_decl.type)) return false;
+            if (!can_lower(unit, node->var_decl.expr, scope)) return false;
+            scope_push(scope, node->var_decl.value);
+            return true;
+
+        case NodeBlock: {
+            int saved = scope->count;
+            bool ok = true;
+            for (int i = 0; ok && i < node->block.count; i++) {
+                ok = can_lower(unit, node->block.statements[i], scope);
+            }
+            scope->count = saved;
+            return ok;
+        }
+
+        case NodeList:
+            for (int i = 0; i < node->list.count; i++) {
+                if (!can_lower(unit, node->list.elements[i], scope)) return false;
+            }
+            return true;
+
+        case NodeListOp: {
+            ASTNode *callee = node->list_op.function;
+            if (callee->type != NodeIdentifier || scope_contains(scope, callee->strval)) return false;
+
+            ASTNode *function = unit->resolve(callee->strval);
+            if (!function || !add_function(unit, function)) return false;
+            if (node->list_op.init && !can_lower(unit, node->list_op.init, scope)) return false;
+            return can_lower(unit, node->list_op.list, scope);
+        }
+
+        case NodeListPipeline: {
+            ASTNode *sink = node->pipeline.sink;
+            bool is_reduce = sink && sink->type == NodeListOp;
+            for (int i = 0; i <= node->pipeline.stage_count; i++) {
+                ASTNode *callee = i < node->pipeline.stage_count ? node->pipeline.stages[i]->list_op.function :
+                                  is_reduce ? sink->list_op.function : NULL;
+                if (!callee) continue;
+                if (callee->type != NodeIdentifier || scope_contains(scope, callee->strval)) return false;
+
+                ASTNode *function = unit->resolve(callee->strval);
+                if (!function || !add_function(unit, function)) return false;
+            }
+            if (is_reduce && !can_lower(unit, sink->list_op.init, scope)) return false;
+            return can_lower(unit, node->pipeline.source, scope);
+        }
+
+        case NodeCall: {
+            ASTNode *callee = node->call.callee;
+            if (callee->type != NodeIdentifier || scope_contains(scope, callee->strval)) return false;
+
+            ASTNode *function = unit->resolve(callee->strval);
+            if (!function && !list_builtin_arity(callee->strval)) return false;
+            if (function && !add_function(unit, function)) return false;
+
+            for (int i = 0; i < node->call.arg_count; i++) {
+                if (!can_lower(unit, node->call.args[i], scope)) return false;
+            }
+            return true;
+        }
+
+        case NodeConstruct:
+            for (int i = 0; i < node->construct.arg_count; i++) {
+                if (!can_lower(unit, node->construct.args[i], scope)) return false;
+            }
+            return true;
+
+        case NodeIf:
+            return can_lower(unit, node->if_expr.condition, scope) && can_lower(unit, node->if_expr.then_branch, scope) &&
+                   can_lower(unit, node->if_expr.else_branch, scope);
+
+        case NodeMatch: {
+            if (!can_lower(unit, node->match.scrutinee, scope)) return false;
+            bool ok = true;
+            for (int i = 0; ok && i < node->match.arm_count; i++) {
+                int saved = scope->count;
+                int count = pattern_binding_count(node->match.patterns[i]);
+                const char **names = malloc(sizeof(const char *) * (size_t)(count ? count : 1));
+                count = 0;
+                pattern_bindings(node->match.patterns[i], names, &count);
+                for (int j = 0; j < count; j++) scope_push(scope, names[j]);
+                free(names);
+                ok = can_lower(unit, node->match.arms[i], scope);
+                scope->count = saved;
+            }
+            return ok;
+        }
+
+        default:
+            return false;
+    }
+}
+
+static bool collect_tier_unit(TierUnit *unit, ASTNode *function) {
+    if (!add_function(unit, function)) return false;
+
+    NameScope scope = { 0 };
+    bool ok = true;
+    for (int i = 0; ok && i < unit->count; i++) {
+        ASTNode *fn = unit->functions[i];
+        if (!fn->function.expr) continue;
+        scope.count = 0;
+        for (int p = 0; p < fn->function.param_count; p++) {
+            scope_push(&scope, fn->function.param_names[p]);
+        }
+        ok = can_lower(unit, fn->function.expr, &scope);
+    }
+    free(scope.names);
+    return ok;
+}
+
+static LLVMModuleRef lower_tier_unit(TierUnit *unit, LLVMContextRef context, const char *name) {
+    LLVMContextRef saved_context = TheContext;
+    LLVMModuleRef saved_module = TheModule;
+    LLVMBuilderRef saved_builder = Builder;
+
+    TheContext = context;
+    TheModule = LLVMModuleCreateWithNameInContext(name, context);
+    Builder = LLVMCreateBuilderInContext(context);
+    free_globals();
+
+    bool ok = true;
+    for (int i = 0; ok && i < unit->count; i++) {
+        LLVMValueRef function = declare_function(unit->functions[i]);
+        if (!function) ok = false;
+        else if (unit->functions[i]->function.expr) LLVMSetLinkage(function, LLVMInternalLinkage);
+    }
+    /* Imported functions stay declarations and resolve to their module's object (see jit_add_object_file). */
+    for (int i = 0; ok && i < unit->count; i++) {
+        ok = llvm_eval_ast(unit->functions[i]) != NULL;
+    }
+    if (ok) {
+        build_word_thunk(name, LLVMGetNamedFunction(TheModule, unit->functions[0]->function.name));
+        ok = !LLVMVerifyModule(TheModule, LLVMReturnStatusAction, NULL);
+    }
+
+    LLVMModuleRef module = TheModule;
+    LLVMDisposeBuilder(Builder);
+    TheContext = saved_context;
+    TheModule = saved_module;
+    Builder = saved_builder;
+
+    if (!ok) {
+        LLVMDisposeModule(module);
+        return NULL;
+    }
+    return module;
+}
+
+JitEntry jit_compile_function(ASTNode *function, JitResolver resolve) {
+    TierUnit unit = { .resolve = resolve };
+    if (!collect_tier_unit(&unit, function) || !start_jit()) {
+        free(unit.functions);
+        return NULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "vex_tier_%u", tier_count++);
+
+    /* Tier units are compiled to objects here rather than by LLJIT, so they can come from the object cache (see target.c). */
+    LLVMContextRef context = LLVMContextCreate();
+    LLVMContextSetDiscardValueNames(context, !llvm_keep_names);
+    LLVMModuleRef module = lower_tier_unit(&unit, context, name);
+    free(unit.functions);
+    LLVMMemoryBufferRef object = module ? compile_to_object(module, 2) : NULL;
+    if (module) LLVMDisposeModule(module);
+    LLVMContextDispose(context);
+    if (!object) return NULL;
+
+    LLVMErrorRef err = LLVMOrcLLJITAddObjectFile(jit, LLVMOrcLLJITGetMainJITDylib(jit), object);
+    if (err) {
+        report_jit_error("could not add module", err);
+        return NULL;
+    }
+
+    LLVMOrcExecutorAddress address = 0;
+    err = LLVMOrcLLJITLookup(jit, &address, name);
+    if (err) {
+        report_jit_error("could not look up entry point", err);
+        return NULL;
+    }
+    return (JitEntry)(uintptr_t)address;
+}
+
+static ReplSymbol *find_repl_symbol(const char *name) {
+    for (int i = 0; i < repl_symbol_count; i++) {
+        if (strcmp(repl_symbols[i].name, name) == 0) return &repl_symbols[i];
+    }
+    return NULL;
+}
+
+static const char *definition_name(ASTNode *node) {
+    if (node->type == NodeFunction) return node->function.name;
+    if (node->type == NodeVarDecl) return node->var_decl.value;
+    return NULL;
+}
+
+static bool line_defines(ASTNode **statements, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        const char *defined = definition_name(statements[i]);
+        if (defined && strcmp(defined, name) == 0) return true;
+    }
+    return false;
+}
+
+static void record_repl_symbol(ASTNode *definition, LLVMValueRef value) {
+    const char *name = definition_name(definition);
+    ReplSymbol *entry = find_repl_symbol(name);
+    if (!entry) {
+        if (repl_symbol_count == repl_symbol_capacity) {
+            repl_symbol_capacity = repl_symbol_capacity ? repl_symbol_capacity * 2 : 32;
+            repl_symbols = realloc(repl_symbols, sizeof(ReplSymbol) * (size_t)repl_symbol_capacity);
+        }
+        entry = &repl_symbols[repl_symbol_count++];
+        entry->symbol = NULL;
+    }
+
+    size_t length;
+    const char *symbol = LLVMGetValueName2(value, &length);
+    free(entry->symbol);
+    entry->symbol = malloc(length + 1);
+    memcpy(entry->symbol, symbol, length);
+    entry->symbol[length] = '\0';
+    /* The name and definition are the new input's: the REPL frees the one it replaces. */
+    entry->name = name;
+    entry->definition = definition;
+}
+
+/* Declares every earlier definition the line does not replace, bound to its current JIT symbol. */
+static bool import_repl_symbols(ASTNode **statements, int count) {
+    for (int i = 0; i < repl_symbol_count; i++) {
+        ReplSymbol *entry = &repl_symbols[i];
+        if (line_defines(statements, count, entry->name)) continue;
+
+        LLVMValueRef value;
+        if (entry->definition->type == NodeFunction) {
+            value = declare_function(entry->definition);
+            if (!value) return false;
+            LLVMSetValueName2(value, entry->symbol, strlen(entry->symbol));
+        } else {
+            value = LLVMAddGlobal(TheModule, get_llvm_type(entry->definition->var_decl.type), entry->symbol);
+        }
+        insert_global(entry->name, value);
+    }
+    return true;
+}
+
+/* Redefinitions get a fresh symbol; code compiled earlier keeps calling the version it saw. */
+static void version_redefinition(LLVMValueRef value, const char *name) {
+    if (!find_repl_symbol(name)) return;
+    char symbol[256];
+    snprintf(symbol, sizeof(symbol), "%s.%u", name, ++repl_version_count);
+    LLVMSetValueName2(value, symbol, strlen(symbol));
+}
+
+/* A list, string or variant val outlives the line that defines it, so its global becomes a collector root. */
+static void register_gc_global(LLVMValueRef global) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMValueRef add = LLVMGetNamedFunction(TheModule, "vex_gc_add_global");
+    if (!add) add = LLVMAddFunction(TheModule, "vex_gc_add_global", LLVMFunctionType(LLVMVoidTypeInContext(TheContext), &i8_ptr, 1, 0));
+    LLVMValueRef slot = LLVMBuildBitCast(Builder, global, i8_ptr, "");
+    LLVMBuildCall2(Builder, LLVMGlobalGetValueType(add), add, &slot, 1, "");
+}
+
+/*
+ * The collector reads a root as one word, but a flagged val is a tag and
+ * a payload that may or may not be a reference. What it has to see of
+ * the val is kept in a word of its own beside it.
+ */
+static void register_flagged_global(LLVMValueRef global, LLVMValueRef value) {
+    LLVMValueRef reference = outcome_reference(value);
+    if (!reference) return;
+
+    size_t length;
+    const char *name = LLVMGetValueName2(global, &length);
+    char root_name[256];
+    snprintf(root_name, sizeof(root_name), "%.*s.root", (int)length, name);
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMValueRef root = LLVMAddGlobal(TheModule, i8_ptr, root_name);
+    LLVMSetLinkage(root, LLVMInternalLinkage);
+    LLVMSetInitializer(root, LLVMConstNull(i8_ptr));
+    LLVMBuildStore(Builder, reference, root);
+    register_gc_global(root);
+}
+
+static bool lower_repl_line(ASTNode **statements, int count, const char *name, LLVMValueRef *defined) {
+    if (!import_repl_symbols(statements, count)) return false;
+
+    for (int i = 0; i < count; i++) {
+        if (statements[i]->type == NodeFunction && !(defined[i] = declare_function(statements[i]))) return false;
+    }
+    for (int i = 0; i < count; i++) {
+        if (statements[i]->type == NodeFunction && !llvm_eval_ast(statements[i])) return false;
+    }
+
+    LLVMValueRef thunk = LLVMAddFunction(TheModule, name, LLVMFunctionType(LLVMVoidTypeInContext(TheContext), NULL, 0, 0));
+    LLVMPositionBuilderAtEnd(Builder, LLVMAppendBasicBlockInContext(TheContext, thunk, "entry"));
+    GcFrame frame;
+    gc_frame_begin(&frame, thunk);
+
+    bool ok = true;
+    for (int i = 0; ok && i < count; i++) {
+        ASTNode *stmt = statements[i];
+        if (stmt->type == NodeFunction) continue;
+
+        if (stmt->type == NodeVarDecl) {
+            LLVMTypeRef type = get_llvm_type(stmt->var_decl.type);
+            LLVMValueRef init = type ? llvm_eval_ast(stmt->var_decl.expr) : NULL;
+            if (!init) {
+                ok = false;
+                break;
+            }
+
+            LLVMValueRef global = LLVMAddGlobal(TheModule, type, stmt->var_decl.value);
+            LLVMSetInitializer(global, LLVMConstNull(type));
+            LLVMBuildStore(Builder, init, global);
+            const VariantType *variant = find_variant_type(stmt->var_decl.type);
+            if (variant && variant->layout == VariantFlagged) {
+                register_flagged_global(global, init);
+            } else if (stmt->var_decl.type[0] == '<' || strcmp(stmt->var_decl.type, "string") == 0 || variant) {
+                register_gc_global(global);
+            }
+            insert_global(stmt->var_decl.value, global);
+            defined[i] = global;
+        } else {
+            ok = llvm_eval_ast(stmt) != NULL;
+        }
+    }
+    gc_frame_end(&frame, NULL);
+    if (!ok) return false;
+
+    if (LLVMVerifyModule(TheModule, LLVMReturnStatusAction, NULL)) return false;
+
+    for (int i = 0; i < count; i++) {
+        if (defined[i]) version_redefinition(defined[i], definition_name(statements[i]));
+    }
+    return true;
+}
+
+/*
+ * Compiles one REPL input into its own module and runs it. Functions and
+ * vals defined by the input become external symbols of the long-lived JIT
+ * session, so later inputs link against them instead of recompiling them.
+ */
+bool jit_repl_line(ASTNode *root) {
+    if (!start_jit()) return false;
+
+    ASTNode **statements = root->type == NodeBlock ? root->block.statements : &root;
+    int count = root->type == NodeBlock ? root->block.count : 1;
+    LLVMValueRef *defined = calloc((size_t)(count ? count : 1), sizeof(LLVMValueRef));
+
+    char name[32];
+    snprintf(name, sizeof(name), "vex_repl_%u", repl_line_count++);
+
+    LLVMOrcThreadSafeContextRef ts_context = LLVMOrcCreateNewThreadSafeContext();
+    LLVMContextRef saved_context = TheContext;
+    LLVMModuleRef saved_module = TheModule;
+    LLVMBuilderRef saved_builder = Builder;
+    bool saved_echo = llvm_echo_types;
+
+    TheContext = LLVMOrcThreadSafeContextGetContext(ts_context);
+    LLVMContextSetDiscardValueNames(TheContext, !llvm_keep_names);
+    TheModule = LLVMModuleCreateWithNameInContext(name, TheContext);
+    Builder = LLVMCreateBuilderInContext(TheContext);
+    llvm_echo_types = true;
+    free_globals();
+
+    bool ok = lower_repl_line(statements, count, name, defined);
+
+    LLVMModuleRef module = TheModule;
+    LLVMDisposeBuilder(Builder);
+    free_globals();
+    TheContext = saved_context;
+    TheModule = saved_module;
+    Builder = saved_builder;
+    llvm_echo_types = saved_echo;
+
+    if (!ok) {
+        fputs("JIT error: could not compile input\n", stderr);
+        LLVMDisposeModule(module);
+        LLVMOrcDisposeThreadSafeContext(ts_context);
+        free(defined);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (defined[i]) record_repl_symbol(statements[i], defined[i]);
+    }
+    free(defined);
+    optimize_module(module, 0);
+
+    LLVMOrcThreadSafeModuleRef ts_module = LLVMOrcCreateNewThreadSafeModule(module, ts_context);
+    LLVMOrcDisposeThreadSafeContext(ts_context);
+
+    LLVMErrorRef err = LLVMOrcLLJITAddLLVMIRModule(jit, LLVMOrcLLJITGetMainJITDylib(jit), ts_module);
+    if (err) {
+        report_jit_error("could not add module", err);
+        return false;
+    }
+
+    LLVMOrcExecutorAddress address = 0;
+    err = LLVMOrcLLJITLookup(jit, &address, name);
+    if (err) {
+        report_jit_error("could not look up input", err);
+        return false;
+    }
+
+    ((void (*)(void))(uintptr_t)address)();
+    fflush(stdout);
+    return true;
+}
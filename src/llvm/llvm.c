@@ -3,76 +3,2444 @@
 #include <string.h>
 #include "llvm.h"
 #include "ast.h"
+#include "list.h"
+#include "match.h"
+#include "par.h"
+#include "str.h"
+#include "target.h"
+#include "tc.h"
+#include "variant.h"
+
+/*
+ * A spawned operand must cost at least several calls' worth. A call costs
+ * PAR_CALL_COST plus its callee's body; a recursive call counts as
+ * PAR_MIN_COST, and the runtime decides how deep such forks still pay.
+ */
+#define PAR_CALL_COST 100
+#define PAR_MIN_COST (8 * PAR_CALL_COST)
+
+/* Largest function body, in AST nodes, that map, filter and reduce are specialized for. */
+#define SPECIALIZE_MAX_SIZE 64
+/* Total size of the function bodies specialized for in one module. */
+#define SPECIALIZE_BUDGET 1024
+
+/* Most an if's branches, or the right operand of && and ||, may cost together and still be computed unconditionally. */
+#define SELECT_MAX_COST 8
+
+enum { PURITY_UNKNOWN, PURITY_CHECKING, PURITY_PURE, PURITY_IMPURE };
+
+typedef struct FunctionDef {
+    const char *name;
+    ASTNode *node;
+    int purity;
+    unsigned int cost;
+    bool costing;
+    int forks;
+    UT_hash_handle hh;
+} FunctionDef;
+
+/* A text constant already in the current module, keyed by a kind byte ('c' or 's') and its text. */
+typedef struct LiteralDef {
+    char *key;
+    LLVMValueRef global;
+    UT_hash_handle hh;
+} LiteralDef;
+
+typedef struct ParCapture {
+    const char *name;
+    LLVMValueRef value;
+} ParCapture;
+
+/* A subexpression running on the work-stealing runtime; its result is read back after the join. */
+typedef struct ParTask {
+    LLVMValueRef storage, result;
+    LLVMTypeRef result_type;
+} ParTask;
 
 extern ASTNode *root;
 
-LLVMContextRef TheContext;
-LLVMModuleRef TheModule;
-LLVMBuilderRef Builder;
-static LLVMValueRef printf_func = NULL;
-static VarBinding *variables = NULL;
+LLVMContextRef TheContext;
+LLVMModuleRef TheModule;
+LLVMBuilderRef Builder;
+static VarBinding *variables = NULL;
+static VarBinding *globals = NULL;
+static FunctionDef *function_defs = NULL;
+static LiteralDef *literals = NULL;
+static int purity_depth = 0, purity_assumptions = 0;
+static unsigned int specialize_spent = 0;
+static GcFrame *gc_frame = NULL;
+/* Set while lowering code the runtime declined to fork: it never forks and calls sequential clones. */
+static bool par_sequential = false;
+bool llvm_echo_types = false;
+bool llvm_auto_par = false;
+bool llvm_keep_names = false;
+
+void insert_variable(const char *name, LLVMValueRef value) {
+    VarBinding *entry = malloc(sizeof(VarBinding));
+    entry->name = name;
+    entry->value = value;
+    HASH_ADD_KEYPTR(hh, variables, entry->name, strlen(entry->name), entry);
+}
+
+LLVMValueRef get_variable(const char *name) {
+    VarBinding *entry;
+    HASH_FIND_STR(variables, name, entry);
+    return entry ? entry->value : NULL;
+}
+
+void free_variables(void) {
+    VarBinding *current, *tmp;
+    HASH_ITER(hh, variables, current, tmp) {
+        HASH_DEL(variables, current);
+        free(current);
+    }
+}
+
+void insert_global(const char *name, LLVMValueRef value) {
+    VarBinding *entry;
+    HASH_FIND_STR(globals, name, entry);
+    if (!entry) {
+        entry = malloc(sizeof(VarBinding));
+        entry->name = name;
+        HASH_ADD_KEYPTR(hh, globals, entry->name, strlen(entry->name), entry);
+    }
+    entry->value = value;
+}
+
+LLVMValueRef get_global(const char *name) {
+    VarBinding *entry;
+    HASH_FIND_STR(globals, name, entry);
+    return entry ? entry->value : NULL;
+}
+
+/* Also forgets the module's text constants and specializations, since a new module is about to be built. */
+void free_globals(void) {
+    VarBinding *current, *tmp;
+    HASH_ITER(hh, globals, current, tmp) {
+        HASH_DEL(globals, current);
+        free(current);
+    }
+
+    LiteralDef *literal, *next;
+    HASH_ITER(hh, literals, literal, next) {
+        HASH_DEL(literals, literal);
+        free(literal->key);
+        free(literal);
+    }
+    specialize_spent = 0;
+}
+
+static LLVMValueRef *find_literal(char kind, const char *text) {
+    size_t length = strlen(text);
+    char *key = malloc(length + 2);
+    key[0] = kind;
+    memcpy(key + 1, text, length + 1);
+
+    LiteralDef *entry;
+    HASH_FIND_STR(literals, key, entry);
+    if (entry) {
+        free(key);
+    } else {
+        entry = malloc(sizeof(LiteralDef));
+        entry->key = key;
+        entry->global = NULL;
+        HASH_ADD_KEYPTR(hh, literals, entry->key, length + 1, entry);
+    }
+    return &entry->global;
+}
+
+static LLVMValueRef add_private_constant(LLVMValueRef initializer, const char *name) {
+    LLVMValueRef global = LLVMAddGlobal(TheModule, LLVMTypeOf(initializer), name);
+    LLVMSetInitializer(global, initializer);
+    LLVMSetGlobalConstant(global, 1);
+    LLVMSetLinkage(global, LLVMPrivateLinkage);
+    LLVMSetUnnamedAddress(global, LLVMGlobalUnnamedAddr);
+    return LLVMConstBitCast(global, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0));
+}
+
+/* A NUL-terminated C string for runtime calls such as printf; one global per distinct text. */
+static LLVMValueRef c_string_constant(const char *text, const char *name) {
+    LLVMValueRef *global = find_literal('c', text);
+    if (!*global) {
+        *global = add_private_constant(LLVMConstStringInContext(TheContext, text, (unsigned int)strlen(text), false), name);
+    }
+    return *global;
+}
+
+/*
+ * A Vex string literal, laid out as str.h describes: short ones are
+ * packed into the string word itself, the rest are static flat strings
+ * shared by every use of the same text in the module.
+ */
+static LLVMValueRef string_constant(const char *text) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    size_t length = strlen(text);
+
+    if (length <= VEX_STRING_INLINE_MAX) {
+        unsigned long long word = (unsigned long long)length << 1 | 1;
+        for (size_t i = 0; i < length; i++) word |= (unsigned long long)(unsigned char)text[i] << (8 * (i + 1));
+        return LLVMConstIntToPtr(LLVMConstInt(i64, word, false), i8_ptr);
+    }
+
+    LLVMValueRef *global = find_literal('s', text);
+    if (!*global) {
+        LLVMValueRef fields[] = {
+            LLVMConstInt(i64, length, false),
+            LLVMConstInt(i32, 0, false),
+            LLVMConstInt(i32, VEX_STRING_STATIC, false),
+            LLVMConstStringInContext(TheContext, text, (unsigned int)length, false),
+        };
+        *global = add_private_constant(LLVMConstStructInContext(TheContext, fields, 4, false), "str");
+    }
+    return *global;
+}
+
+static LLVMValueRef build_print_format(const char *spec, const char *type) {
+    if (!llvm_echo_types) return c_string_constant(spec, "fmt");
+
+    char format[64];
+    snprintf(format, sizeof(format), "- : %s = %s", type, spec);
+    return c_string_constant(format, "fmt");
+}
+
+LLVMValueRef create_printf_function_type(LLVMTypeRef *out_type) {
+    LLVMTypeRef printf_arg_types[] = {
+        LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0)
+    };
+    LLVMTypeRef printf_type = LLVMFunctionType(
+        LLVMInt32TypeInContext(TheContext), printf_arg_types, 1, true
+    );
+
+    LLVMValueRef printf_func = LLVMGetNamedFunction(TheModule, "printf");
+    if (!printf_func) {
+        printf_func = LLVMAddFunction(TheModule, "printf", printf_type);
+    }
+
+    if (out_type) *out_type = printf_type;
+    return printf_func;
+}
+
+/* %VexList = { i64 length, i32 elem_size, i32 flags, i8 *data }, mirroring list.h. */
+LLVMTypeRef get_list_type(void) {
+    LLVMTypeRef type = LLVMGetTypeByName2(TheContext, "VexList");
+    if (type) return type;
+
+    LLVMTypeRef fields[] = {
+        LLVMInt64TypeInContext(TheContext),
+        LLVMInt32TypeInContext(TheContext),
+        LLVMInt32TypeInContext(TheContext),
+        LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0),
+    };
+    type = LLVMStructCreateNamed(TheContext, "VexList");
+    LLVMStructSetBody(type, fields, 4, 0);
+    return type;
+}
+
+static LLVMTypeRef native_type_of(const TypeTC *type);
+
+/* A flagged option or result (see VariantLayout), named after its type so a word conversion can find the type again. */
+static LLVMTypeRef outcome_struct_type(const VariantType *variant) {
+    LLVMTypeRef type = LLVMGetTypeByName2(TheContext, variant->name);
+    if (type) return type;
+
+    LLVMTypeRef fields[] = { LLVMInt1TypeInContext(TheContext), LLVMInt64TypeInContext(TheContext) };
+    type = LLVMStructCreateNamed(TheContext, variant->name);
+    LLVMStructSetBody(type, fields, 2, 0);
+    return type;
+}
+
+LLVMTypeRef get_llvm_type(const char *type_str) {
+    if (strcmp(type_str, "int") == 0) {
+        return LLVMInt32TypeInContext(TheContext);
+    } else if (strcmp(type_str, "float") == 0) {
+        return LLVMDoubleTypeInContext(TheContext);
+    } else if (strcmp(type_str, "char") == 0) {
+        return LLVMInt8TypeInContext(TheContext);
+    } else if (strcmp(type_str, "string") == 0) {
+        return LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    } else if (strcmp(type_str, "bool") == 0) {
+        return LLVMInt1TypeInContext(TheContext);
+    } else if (type_str[0] == '<' || strncmp(type_str, "list<", 5) == 0) {
+        return LLVMPointerType(get_list_type(), 0);
+    }
+
+    const VariantType *variant = find_variant_type(type_str);
+    if (!variant) return NULL;
+    if (variant->layout == VariantNullable) return native_type_of(variant->constructors[1].fields[0]);
+    if (variant->layout == VariantFlagged) return outcome_struct_type(variant);
+    return LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+}
+
+static void remember_function(ASTNode *node) {
+    FunctionDef *def;
+    HASH_FIND_STR(function_defs, node->function.name, def);
+    if (!def) {
+        def = malloc(sizeof(FunctionDef));
+        def->name = node->function.name;
+        HASH_ADD_KEYPTR(hh, function_defs, def->name, strlen(def->name), def);
+    } else if (def->node == node) {
+        return;
+    }
+    def->node = node;
+    def->purity = PURITY_UNKNOWN;
+    def->cost = 0;
+    def->costing = false;
+    def->forks = -1;
+}
+
+void free_function_defs(void) {
+    FunctionDef *current, *tmp;
+    HASH_ITER(hh, function_defs, current, tmp) {
+        HASH_DEL(function_defs, current);
+        free(current);
+    }
+}
+
+LLVMValueRef declare_function(ASTNode *node) {
+    remember_function(node);
+    LLVMValueRef function = LLVMGetNamedFunction(TheModule, node->function.name);
+    if (function) return function;
+
+    LLVMTypeRef *param_types = malloc(sizeof(LLVMTypeRef) * (size_t)node->function.param_count);
+    for (int i = 0; i < node->function.param_count; i++) {
+        param_types[i] = get_llvm_type(node->function.param_types[i]);
+        if (!param_types[i]) {
+            fprintf(stderr, "LLVM error: unsupported parameter type '%s'\n", node->function.param_types[i]);
+            free(param_types);
+            return NULL;
+        }
+    }
+
+    LLVMTypeRef ret_type = get_llvm_type(node->function.return_type);
+    if (!ret_type) {
+        fprintf(stderr, "LLVM error: unsupported return type '%s'\n", node->function.return_type);
+        free(param_types);
+        return NULL;
+    }
+
+    LLVMTypeRef func_type = LLVMFunctionType(ret_type, param_types, (unsigned int)node->function.param_count, 0);
+    free(param_types);
+    return LLVMAddFunction(TheModule, node->function.name, func_type);
+}
+
+static bool is_pure(ASTNode *node);
+
+/* length, head, tail and nth are builtins unless the program binds the name itself. */
+static bool is_list_builtin_call(ASTNode *node) {
+    ASTNode *callee = node->call.callee;
+    return callee->type == NodeIdentifier && list_builtin_arity(callee->strval) &&
+        !get_variable(callee->strval) && !get_global(callee->strval) && !LLVMGetNamedFunction(TheModule, callee->strval);
+}
+
+/*
+ * A list is owned by the expression consuming it when that expression's
+ * operand has just built it: nothing else can hold a reference yet, so
+ * the consumer may update it in place (see the _owned runtime functions).
+ * Names and parameters are borrowed, and so is whatever a user function
+ * returns, since it may hand back one of its own arguments.
+ */
+static bool is_owned_list(ASTNode *node) {
+    if (!node->tc_type || node->tc_type->kind != TypeList) return false;
+    switch (node->type) {
+        case NodeList:
+        case NodeBinaryExpr:
+            return true;
+        case NodeListOp:
+            return node->list_op.op != ListReduce;
+        case NodeListPipeline:
+            return !node->pipeline.sink;
+        case NodeCall:
+            /* head and nth of a list of lists return an element the list still holds. */
+            return is_list_builtin_call(node) && strcmp(node->call.callee->strval, "head") != 0 &&
+                   strcmp(node->call.callee->strval, "nth") != 0;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Functions are pure unless they print, directly or through a callee.
+ * Recursive calls are optimistically assumed pure while the cycle is being
+ * checked; only the outermost check may cache a result that relied on that.
+ */
+static bool function_is_pure(FunctionDef *def) {
+    if (def->purity == PURITY_PURE) return true;
+    if (def->purity == PURITY_IMPURE || !def->node->function.expr) return false;
+    if (def->purity == PURITY_CHECKING) {
+        purity_assumptions++;
+        return true;
+    }
+
+    int assumptions = purity_assumptions;
+    def->purity = PURITY_CHECKING;
+    purity_depth++;
+    bool pure = is_pure(def->node->function.expr);
+    purity_depth--;
+
+    if (!pure) def->purity = PURITY_IMPURE;
+    else if (purity_depth == 0 || assumptions == purity_assumptions) def->purity = PURITY_PURE;
+    else def->purity = PURITY_UNKNOWN;
+    return pure;
+}
+
+static bool is_pure(ASTNode *node) {
+    switch (node->type) {
+        case NodeIntLit:
+        case NodeFloatLit:
+        case NodeCharLit:
+        case NodeStringLit:
+        case NodeBoolLit:
+        case NodeIdentifier:
+            return true;
+
+        case NodeBinaryExpr:
+            return is_pure(node->binary_expr.left) && is_pure(node->binary_expr.right);
+
+        case NodeVarDecl:
+            return is_pure(node->var_decl.expr);
+
+        case NodeBlock:
+            for (int i = 0; i < node->block.count; i++) {
+                if (!is_pure(node->block.statements[i])) return false;
+            }
+            return true;
+
+        case NodeList:
+            for (int i = 0; i < node->list.count; i++) {
+                if (!is_pure(node->list.elements[i])) return false;
+            }
+            return true;
+
+        case NodeListOp:
+            if (node->list_op.init && !is_pure(node->list_op.init)) return false;
+            return is_pure(node->list_op.function) && is_pure(node->list_op.list);
+
+        case NodeListPipeline: {
+            ASTNode *sink = node->pipeline.sink;
+            if (sink && sink->type == NodeListOp && !is_pure(sink->list_op.init)) return false;
+            return is_pure(node->pipeline.source);
+        }
+
+        case NodeMatch:
+            for (int i = 0; i < node->match.arm_count; i++) {
+                if (!is_pure(node->match.arms[i])) return false;
+            }
+            return is_pure(node->match.scrutinee);
+
+        case NodeIf:
+            return is_pure(node->if_expr.condition) && is_pure(node->if_expr.then_branch) && is_pure(node->if_expr.else_branch);
+
+        case NodeConstruct:
+            for (int i = 0; i < node->construct.arg_count; i++) {
+                if (!is_pure(node->construct.args[i])) return false;
+            }
+            return true;
+
+        case NodeCall: {
+            ASTNode *callee = node->call.callee;
+            if (callee->type != NodeIdentifier || get_variable(callee->strval)) return false;
+
+            FunctionDef *def;
+            HASH_FIND_STR(function_defs, callee->strval, def);
+            if (!def && !is_list_builtin_call(node)) return false;
+            if (def && !function_is_pure(def)) return false;
+
+            for (int i = 0; i < node->call.arg_count; i++) {
+                if (!is_pure(node->call.args[i])) return false;
+            }
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+static unsigned int estimate_cost(ASTNode *node);
+
+/* A function body's cost, capped at PAR_MIN_COST since nothing compares above it. */
+static unsigned int function_cost(FunctionDef *def) {
+    if (def->costing || !def->node->function.expr) return PAR_MIN_COST;
+    if (!def->cost) {
+        def->costing = true;
+        unsigned int cost = estimate_cost(def->node->function.expr);
+        def->costing = false;
+        def->cost = cost < PAR_MIN_COST ? cost : PAR_MIN_COST;
+    }
+    return def->cost;
+}
+
+static unsigned int estimate_cost(ASTNode *node) {
+    unsigned int cost = 1;
+    switch (node->type) {
+        case NodeBinaryExpr:
+            cost += estimate_cost(node->binary_expr.left) + estimate_cost(node->binary_expr.right);
+            break;
+        case NodeVarDecl:
+            cost += estimate_cost(node->var_decl.expr);
+            break;
+        case NodeBlock:
+            for (int i = 0; i < node->block.count; i++) cost += estimate_cost(node->block.statements[i]);
+            break;
+        case NodeList:
+            for (int i = 0; i < node->list.count; i++) cost += estimate_cost(node->list.elements[i]);
+            break;
+        case NodeListOp:
+            cost += PAR_CALL_COST + estimate_cost(node->list_op.list);
+            if (node->list_op.init) cost += estimate_cost(node->list_op.init);
+            break;
+        case NodeListPipeline:
+            cost += PAR_CALL_COST + estimate_cost(node->pipeline.source);
+            break;
+        case NodeCall: {
+            FunctionDef *def = NULL;
+            if (node->call.callee->type == NodeIdentifier) HASH_FIND_STR(function_defs, node->call.callee->strval, def);
+            cost += PAR_CALL_COST + (def ? function_cost(def) : 0);
+            for (int i = 0; i < node->call.arg_count; i++) cost += estimate_cost(node->call.args[i]);
+            break;
+        }
+        case NodeMatch:
+            cost += estimate_cost(node->match.scrutinee);
+            for (int i = 0; i < node->match.arm_count; i++) cost += estimate_cost(node->match.arms[i]);
+            break;
+        case NodeConstruct:
+            for (int i = 0; i < node->construct.arg_count; i++) cost += estimate_cost(node->construct.args[i]);
+            break;
+        case NodeIf:
+            cost += estimate_cost(node->if_expr.condition) + estimate_cost(node->if_expr.then_branch) +
+                    estimate_cost(node->if_expr.else_branch);
+            break;
+        default:
+            break;
+    }
+    return cost;
+}
+
+/* Roughly how much code node compiles to, counting a call as one node. */
+static unsigned int estimate_size(ASTNode *node) {
+    if (!node) return 0;
+    unsigned int size = 1;
+    switch (node->type) {
+        case NodeBinaryExpr:
+            size += estimate_size(node->binary_expr.left) + estimate_size(node->binary_expr.right);
+            break;
+        case NodeUnaryExpr:
+            size += estimate_size(node->unary_expr.operand);
+            break;
+        case NodeVarDecl:
+            size += estimate_size(node->var_decl.expr);
+            break;
+        case NodeBlock:
+            for (int i = 0; i < node->block.count; i++) size += estimate_size(node->block.statements[i]);
+            break;
+        case NodeList:
+            for (int i = 0; i < node->list.count; i++) size += estimate_size(node->list.elements[i]);
+            break;
+        case NodeListOp:
+            size += estimate_size(node->list_op.list) + estimate_size(node->list_op.init);
+            break;
+        case NodeListPipeline:
+            size += estimate_size(node->pipeline.source) + (unsigned int)node->pipeline.stage_count;
+            break;
+        case NodeCall:
+            for (int i = 0; i < node->call.arg_count; i++) size += estimate_size(node->call.args[i]);
+            break;
+        case NodePrint:
+            size += estimate_size(node->print.value);
+            break;
+        case NodeMatch:
+            size += estimate_size(node->match.scrutinee);
+            for (int i = 0; i < node->match.arm_count; i++) size += estimate_size(node->match.arms[i]);
+            break;
+        case NodeConstruct:
+            for (int i = 0; i < node->construct.arg_count; i++) size += estimate_size(node->construct.args[i]);
+            break;
+        case NodeIf:
+            size += estimate_size(node->if_expr.condition) + estimate_size(node->if_expr.then_branch) +
+                    estimate_size(node->if_expr.else_branch);
+            break;
+        default:
+            break;
+    }
+    return size;
+}
+
+static bool worth_spawning(ASTNode *node) {
+    return llvm_auto_par && !par_sequential && estimate_cost(node) >= PAR_MIN_COST && is_pure(node);
+}
+
+/* Whether lower_operands forks these: it takes at least two worth spawning. */
+static bool forks_operands(ASTNode **operands, int count) {
+    int spawnable = 0;
+    for (int i = 0; i < count && spawnable < 2; i++) {
+        if (worth_spawning(operands[i])) spawnable++;
+    }
+    return spawnable > 1;
+}
+
+/* Whether lowering node forks anywhere, not counting the functions it calls. */
+static bool has_fork(ASTNode *node) {
+    if (!node) return false;
+    switch (node->type) {
+        case NodeBinaryExpr: {
+            ASTNode *operands[] = { node->binary_expr.left, node->binary_expr.right };
+            return forks_operands(operands, 2) || has_fork(operands[0]) || has_fork(operands[1]);
+        }
+        case NodeUnaryExpr:
+            return has_fork(node->unary_expr.operand);
+        case NodeVarDecl:
+            return has_fork(node->var_decl.expr);
+        case NodeBlock:
+            for (int i = 0; i < node->block.count; i++) {
+                if (has_fork(node->block.statements[i])) return true;
+            }
+            return false;
+        case NodeList:
+            for (int i = 0; i < node->list.count; i++) {
+                if (has_fork(node->list.elements[i])) return true;
+            }
+            return false;
+        case NodeListOp:
+            return has_fork(node->list_op.list) || has_fork(node->list_op.init);
+        case NodeListPipeline:
+            return has_fork(node->pipeline.source);
+        case NodeCall:
+            if (forks_operands(node->call.args, node->call.arg_count)) return true;
+            for (int i = 0; i < node->call.arg_count; i++) {
+                if (has_fork(node->call.args[i])) return true;
+            }
+            return false;
+        case NodePrint:
+            return has_fork(node->print.value);
+        case NodeMatch:
+            for (int i = 0; i < node->match.arm_count; i++) {
+                if (has_fork(node->match.arms[i])) return true;
+            }
+            return has_fork(node->match.scrutinee);
+        case NodeConstruct:
+            if (forks_operands(node->construct.args, node->construct.arg_count)) return true;
+            for (int i = 0; i < node->construct.arg_count; i++) {
+                if (has_fork(node->construct.args[i])) return true;
+            }
+            return false;
+        case NodeIf:
+            return has_fork(node->if_expr.condition) || has_fork(node->if_expr.then_branch) || has_fork(node->if_expr.else_branch);
+        default:
+            return false;
+    }
+}
+
+/*
+ * Whether node may be computed even where its value is not needed: it
+ * cannot trap, print, call or allocate. Integer division is left out
+ * because it traps on zero, and so is any constructor that has to box.
+ */
+static bool is_speculatable(ASTNode *node) {
+    switch (node->type) {
+        case NodeIntLit:
+        case NodeFloatLit:
+        case NodeCharLit:
+        case NodeStringLit:
+        case NodeBoolLit:
+        case NodeIdentifier:
+            return true;
+
+        case NodeBinaryExpr: {
+            const char *op = node->binary_expr.op;
+            if (node->tc_type->kind == TypeList || strcmp(op, "/") == 0 || strcmp(op, "^") == 0) return false;
+            return is_speculatable(node->binary_expr.left) && is_speculatable(node->binary_expr.right);
+        }
+
+        case NodeConstruct: {
+            const VariantConstructor *constructor = node->construct.constructor;
+            if (constructor->type->layout == VariantTagged && constructor->repr == ConstructorBoxed) return false;
+            for (int i = 0; i < node->construct.arg_count; i++) {
+                ASTNode *arg = node->construct.args[i];
+                if (arg->tc_type->kind == TypeVariant || !is_speculatable(arg)) return false;
+            }
+            return true;
+        }
+
+        case NodeIf:
+            return is_speculatable(node->if_expr.condition) && is_speculatable(node->if_expr.then_branch) &&
+                   is_speculatable(node->if_expr.else_branch);
+
+        default:
+            return false;
+    }
+}
+
+static bool worth_selecting(ASTNode **nodes, int count) {
+    unsigned int cost = 0;
+    for (int i = 0; i < count; i++) {
+        if (!is_speculatable(nodes[i])) return false;
+        cost += estimate_cost(nodes[i]);
+    }
+    return cost <= SELECT_MAX_COST;
+}
+
+static void collect_captures(ASTNode *node, ParCapture **captures, int *count) {
+    switch (node->type) {
+        case NodeIdentifier: {
+            LLVMValueRef value = get_variable(node->strval);
+            if (!value) return;
+            for (int i = 0; i < *count; i++) {
+                if (strcmp((*captures)[i].name, node->strval) == 0) return;
+            }
+            *captures = realloc(*captures, sizeof(ParCapture) * (size_t)(*count + 1));
+            (*captures)[(*count)++] = (ParCapture){ node->strval, value };
+            return;
+        }
+        case NodeBinaryExpr:
+            collect_captures(node->binary_expr.left, captures, count);
+            collect_captures(node->binary_expr.right, captures, count);
+            return;
+        case NodeVarDecl:
+            collect_captures(node->var_decl.expr, captures, count);
+            return;
+        case NodeBlock:
+            for (int i = 0; i < node->block.count; i++) collect_captures(node->block.statements[i], captures, count);
+            return;
+        case NodeList:
+            for (int i = 0; i < node->list.count; i++) collect_captures(node->list.elements[i], captures, count);
+            return;
+        case NodeListOp:
+            collect_captures(node->list_op.function, captures, count);
+            if (node->list_op.init) collect_captures(node->list_op.init, captures, count);
+            collect_captures(node->list_op.list, captures, count);
+            return;
+        case NodeListPipeline:
+            collect_captures(node->pipeline.source, captures, count);
+            if (node->pipeline.sink && node->pipeline.sink->type == NodeListOp) {
+                collect_captures(node->pipeline.sink->list_op.init, captures, count);
+            }
+            return;
+        case NodeCall:
+            collect_captures(node->call.callee, captures, count);
+            for (int i = 0; i < node->call.arg_count; i++) collect_captures(node->call.args[i], captures, count);
+            return;
+        case NodeMatch:
+            collect_captures(node->match.scrutinee, captures, count);
+            for (int i = 0; i < node->match.arm_count; i++) collect_captures(node->match.arms[i], captures, count);
+            return;
+        case NodeConstruct:
+            for (int i = 0; i < node->construct.arg_count; i++) collect_captures(node->construct.args[i], captures, count);
+            return;
+        case NodeIf:
+            collect_captures(node->if_expr.condition, captures, count);
+            collect_captures(node->if_expr.then_branch, captures, count);
+            collect_captures(node->if_expr.else_branch, captures, count);
+            return;
+        default:
+            return;
+    }
+}
+
+static LLVMValueRef declare_runtime(const char *name, LLVMTypeRef ret, LLVMTypeRef *params, unsigned int count) {
+    LLVMTypeRef type = LLVMFunctionType(ret, params, count, 0);
+    LLVMValueRef function = LLVMGetNamedFunction(TheModule, name);
+    return function ? function : LLVMAddFunction(TheModule, name, type);
+}
+
+/*
+ * Collections only happen where compiled code polls vex_gc_pending, which
+ * is just before a function that calls the allocating runtime returns.
+ * Every list a function produces is
+ * stored in its shadow frame, an array alloca laid out as a VexGcFrame,
+ * so the collector can find whatever the function still holds across the
+ * calls it makes. The frame is sized and initialised once the body is
+ * lowered, and left out entirely when the function roots nothing.
+ */
+void gc_frame_begin(GcFrame *frame, LLVMValueRef function) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    frame->function = function;
+    frame->slots = LLVMBuildArrayAlloca(Builder, i8_ptr, LLVMConstInt(LLVMInt64TypeInContext(TheContext), 2, false), "gc.frame");
+    frame->count = 0;
+    frame->parent = gc_frame;
+    gc_frame = frame;
+}
+
+static bool in_frame_function(void) {
+    LLVMBasicBlockRef block = LLVMGetInsertBlock(Builder);
+    return gc_frame && block && LLVMGetBasicBlockParent(block) == gc_frame->function;
+}
+
+/* What the collector has to see of a flagged value: its payload when that is a reference, or NULL when it never is. */
+LLVMValueRef outcome_reference(LLVMValueRef value) {
+    const VariantType *variant = find_variant_type(LLVMGetStructName(LLVMTypeOf(value)));
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    int references = 0, scalars = 0;
+    uint32_t reference_tag = 0;
+    for (int i = 0; i < variant->constructor_count; i++) {
+        const VariantConstructor *constructor = &variant->constructors[i];
+        if (!constructor->field_count) continue;
+        if (constructor->references) {
+            references++;
+            reference_tag = constructor->tag;
+        } else {
+            scalars++;
+        }
+    }
+    if (!references) return NULL;
+
+    LLVMValueRef payload = LLVMBuildExtractValue(Builder, value, 1, "payload");
+    if (scalars) {
+        LLVMValueRef flag = LLVMBuildExtractValue(Builder, value, 0, "flag");
+        LLVMValueRef is_reference = LLVMBuildICmp(Builder, LLVMIntEQ, flag, LLVMConstInt(LLVMTypeOf(flag), reference_tag, false), "");
+        payload = LLVMBuildSelect(Builder, is_reference, payload, LLVMConstInt(i64, 0, false), "");
+    }
+    return LLVMBuildIntToPtr(Builder, payload, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0), "");
+}
+
+void gc_root(LLVMValueRef value) {
+    if (!in_frame_function() || LLVMIsConstant(value)) return;
+    if (LLVMGetTypeKind(LLVMTypeOf(value)) == LLVMStructTypeKind && !(value = outcome_reference(value))) return;
+
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMValueRef index = LLVMConstInt(LLVMInt64TypeInContext(TheContext), 2 + gc_frame->count++, false);
+    LLVMValueRef slot = LLVMBuildGEP2(Builder, i8_ptr, gc_frame->slots, &index, 1, "gc.slot");
+    LLVMBuildStore(Builder, LLVMBuildBitCast(Builder, value, i8_ptr, ""), slot);
+}
+
+/* Runtime functions compiled code calls that never allocate from the collected heap. */
+static const char *const non_allocating_runtime[] = {
+    "vex_division_by_zero", "vex_gc_pop_frame", "vex_gc_push_frame", "vex_list_head", "vex_list_index",
+    "vex_list_zip_length", "vex_par_should_spawn", "vex_string_length", "vex_variant_unbox_payload",
+    "vex_variant_unbox_tag",
+};
+
+/*
+ * Whether function calls into the runtime in a way that can fill the
+ * nursery. Calls to other Vex functions do not count: one that allocates
+ * polls before it returns, so nothing is left pending when it comes back.
+ */
+static bool calls_allocator(LLVMValueRef function) {
+    for (LLVMBasicBlockRef block = LLVMGetFirstBasicBlock(function); block; block = LLVMGetNextBasicBlock(block)) {
+        for (LLVMValueRef inst = LLVMGetFirstInstruction(block); inst; inst = LLVMGetNextInstruction(inst)) {
+            if (!LLVMIsACallInst(inst)) continue;
+            LLVMValueRef callee = LLVMGetCalledValue(inst);
+            if (!LLVMIsAFunction(callee)) continue;
+
+            size_t length;
+            const char *name = LLVMGetValueName2(callee, &length);
+            if (strncmp(name, "vex_", 4) != 0) continue;
+            bool allocates = true;
+            for (size_t i = 0; i < sizeof(non_allocating_runtime) / sizeof(*non_allocating_runtime); i++) {
+                if (strcmp(name, non_allocating_runtime[i]) == 0) allocates = false;
+            }
+            if (allocates) return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Polls for a pending collection if the function may have caused one,
+ * pops the frame and returns result, or void when result is NULL.
+ */
+void gc_frame_end(GcFrame *frame, LLVMValueRef result) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef void_type = LLVMVoidTypeInContext(TheContext);
+
+    if (calls_allocator(frame->function)) {
+        LLVMValueRef pending = LLVMGetNamedGlobal(TheModule, "vex_gc_pending");
+        if (!pending) pending = LLVMAddGlobal(TheModule, i32, "vex_gc_pending");
+        LLVMValueRef flag = LLVMBuildLoad2(Builder, i32, pending, "gc.pending");
+        LLVMSetOrdering(flag, LLVMAtomicOrderingMonotonic);
+        LLVMSetAlignment(flag, 4);
+
+        LLVMBasicBlockRef collect = LLVMAppendBasicBlockInContext(TheContext, frame->function, "gc.collect");
+        LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(TheContext, frame->function, "gc.return");
+        LLVMBuildCondBr(Builder, LLVMBuildICmp(Builder, LLVMIntNE, flag, LLVMConstInt(i32, 0, false), ""), collect, done);
+
+        LLVMPositionBuilderAtEnd(Builder, collect);
+        LLVMValueRef safepoint = declare_runtime("vex_gc_safepoint", void_type, NULL, 0);
+        LLVMBuildCall2(Builder, LLVMGlobalGetValueType(safepoint), safepoint, NULL, 0, "");
+        LLVMBuildBr(Builder, done);
+        LLVMPositionBuilderAtEnd(Builder, done);
+    }
+
+    if (frame->count) {
+        LLVMValueRef slots = LLVMBuildBitCast(Builder, frame->slots, i8_ptr, "");
+        LLVMValueRef pop = declare_runtime("vex_gc_pop_frame", void_type, &i8_ptr, 1);
+        LLVMBuildCall2(Builder, LLVMGlobalGetValueType(pop), pop, &slots, 1, "");
+    }
+    if (result) LLVMBuildRet(Builder, result);
+    else LLVMBuildRetVoid(Builder);
+
+    gc_frame = frame->parent;
+    if (!frame->count) {
+        LLVMInstructionEraseFromParent(frame->slots);
+        return;
+    }
+
+    /* Size the frame and push it straight after its alloca, before any slot is written. */
+    LLVMBasicBlockRef saved_block = LLVMGetInsertBlock(Builder);
+    LLVMSetOperand(frame->slots, 0, LLVMConstInt(i64, 2 + frame->count, false));
+    LLVMPositionBuilderBefore(Builder, LLVMGetNextInstruction(frame->slots));
+    LLVMValueRef one = LLVMConstInt(i64, 1, false);
+    LLVMValueRef header = LLVMBuildGEP2(Builder, i8_ptr, frame->slots, &one, 1, "");
+    LLVMBuildMemSet(Builder, header, LLVMConstInt(LLVMInt8TypeInContext(TheContext), 0, false),
+                    LLVMConstInt(i64, (1 + frame->count) * sizeof(void *), false), 8);
+    LLVMBuildStore(Builder, LLVMBuildIntToPtr(Builder, LLVMConstInt(i64, frame->count, false), i8_ptr, ""), header);
+    LLVMValueRef slots = LLVMBuildBitCast(Builder, frame->slots, i8_ptr, "");
+    LLVMValueRef push = declare_runtime("vex_gc_push_frame", void_type, &i8_ptr, 1);
+    LLVMBuildCall2(Builder, LLVMGlobalGetValueType(push), push, &slots, 1, "");
+    LLVMPositionBuilderAtEnd(Builder, saved_block);
+}
+
+/* Allocas go at the top of the entry block, where LLVM treats them as fixed stack slots. */
+static LLVMValueRef build_entry_alloca(LLVMTypeRef type, const char *name) {
+    LLVMBasicBlockRef block = LLVMGetInsertBlock(Builder);
+    LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(LLVMGetBasicBlockParent(block));
+    LLVMPositionBuilderBefore(Builder, LLVMGetFirstInstruction(entry));
+    LLVMValueRef alloca = LLVMBuildAlloca(Builder, type, name);
+    LLVMPositionBuilderAtEnd(Builder, block);
+    return alloca;
+}
+
+/*
+ * Outlines expr into "void vex_par_task(i8 *env)" and spawns it. The env is
+ * a stack struct holding a pointer to the result slot followed by copies of
+ * every local the expression reads; the spawning frame joins before it
+ * returns, so nothing here outlives it.
+ */
+static bool spawn_task(ASTNode *expr, ParTask *task) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+
+    ParCapture *captures = NULL;
+    int capture_count = 0;
+    collect_captures(expr, &captures, &capture_count);
+
+    LLVMTypeRef *fields = malloc(sizeof(LLVMTypeRef) * (size_t)(capture_count + 1));
+    fields[0] = i8_ptr;
+    for (int i = 0; i < capture_count; i++) {
+        fields[i + 1] = LLVMTypeOf(captures[i].value);
+    }
+    LLVMTypeRef env_type = LLVMStructTypeInContext(TheContext, fields, (unsigned int)capture_count + 1, 0);
+    free(fields);
+
+    LLVMBasicBlockRef parent_block = LLVMGetInsertBlock(Builder);
+    VarBinding *parent_variables = variables;
+    variables = NULL;
+
+    LLVMTypeRef task_type = LLVMFunctionType(LLVMVoidTypeInContext(TheContext), &i8_ptr, 1, 0);
+    LLVMValueRef function = LLVMAddFunction(TheModule, "vex_par_task", task_type);
+    LLVMSetLinkage(function, LLVMInternalLinkage);
+    LLVMPositionBuilderAtEnd(Builder, LLVMAppendBasicBlockInContext(TheContext, function, "entry"));
+
+    LLVMValueRef env = LLVMBuildBitCast(Builder, LLVMGetParam(function, 0), LLVMPointerType(env_type, 0), "env");
+    for (int i = 0; i < capture_count; i++) {
+        LLVMValueRef field = LLVMBuildStructGEP2(Builder, env_type, env, (unsigned int)i + 1, "");
+        insert_variable(captures[i].name, LLVMBuildLoad2(Builder, LLVMTypeOf(captures[i].value), field, captures[i].name));
+    }
+
+    LLVMValueRef result = llvm_eval_ast(expr);
+    if (result) {
+        LLVMValueRef out = LLVMBuildLoad2(Builder, i8_ptr, LLVMBuildStructGEP2(Builder, env_type, env, 0, ""), "out");
+        LLVMBuildStore(Builder, result, LLVMBuildBitCast(Builder, out, LLVMPointerType(LLVMTypeOf(result), 0), ""));
+        LLVMBuildRetVoid(Builder);
+    }
+
+    free_variables();
+    variables = parent_variables;
+    LLVMPositionBuilderAtEnd(Builder, parent_block);
+
+    if (!result) {
+        LLVMDeleteFunction(function);
+        free(captures);
+        return false;
+    }
+
+    task->result_type = LLVMTypeOf(result);
+    task->result = build_entry_alloca(task->result_type, "par.result");
+    task->storage = build_entry_alloca(LLVMArrayType(i64, VEX_TASK_WORDS), "par.task");
+    LLVMValueRef env_alloca = build_entry_alloca(env_type, "par.env");
+
+    LLVMBuildStore(Builder, LLVMBuildBitCast(Builder, task->result, i8_ptr, ""), LLVMBuildStructGEP2(Builder, env_type, env_alloca, 0, ""));
+    for (int i = 0; i < capture_count; i++) {
+        LLVMBuildStore(Builder, captures[i].value, LLVMBuildStructGEP2(Builder, env_type, env_alloca, (unsigned int)i + 1, ""));
+    }
+    free(captures);
+
+    LLVMTypeRef spawn_params[] = { i8_ptr, i8_ptr, i8_ptr };
+    LLVMValueRef spawn = declare_runtime("vex_par_spawn", LLVMVoidTypeInContext(TheContext), spawn_params, 3);
+    LLVMValueRef spawn_args[] = {
+        LLVMBuildBitCast(Builder, task->storage, i8_ptr, ""),
+        LLVMBuildBitCast(Builder, function, i8_ptr, ""),
+        LLVMBuildBitCast(Builder, env_alloca, i8_ptr, ""),
+    };
+    LLVMBuildCall2(Builder, LLVMGlobalGetValueType(spawn), spawn, spawn_args, 3, "");
+    return true;
+}
+
+static LLVMValueRef join_task(ParTask *task) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMValueRef join = declare_runtime("vex_par_join", LLVMVoidTypeInContext(TheContext), &i8_ptr, 1);
+    LLVMValueRef storage = LLVMBuildBitCast(Builder, task->storage, i8_ptr, "");
+    LLVMBuildCall2(Builder, LLVMGlobalGetValueType(join), join, &storage, 1, "");
+    return LLVMBuildLoad2(Builder, task->result_type, task->result, "par.value");
+}
+
+/* Values of these types may point into the collected heap, so compiled code roots them. */
+static bool is_heap_type(const TypeTC *type) {
+    if (type && type->kind == TypeVariant) {
+        const VariantType *variant = type->variant;
+        if (variant->layout == VariantNullable) return is_heap_type(variant->constructors[1].fields[0]);
+        if (variant->layout == VariantFlagged) return variant->constructors[0].references || variant->constructors[1].references;
+        return variant->boxed_count > 0;
+    }
+    return type && (type->kind == TypeList || type->kind == TypeString);
+}
+
+/* Lowers operands in order; with fork, every expensive pure one but the last is spawned and joined at the end. */
+static bool lower_operand_list(ASTNode **operands, int count, LLVMValueRef *values, bool fork) {
+    ParTask *tasks = calloc((size_t)(count ? count : 1), sizeof(ParTask));
+    int last_spawnable = -1;
+    for (int i = 0; fork && i < count; i++) {
+        if (worth_spawning(operands[i])) last_spawnable = i;
+    }
+
+    bool ok = true;
+    for (int i = 0; ok && i < count; i++) {
+        values[i] = NULL;
+        if (fork && i != last_spawnable && worth_spawning(operands[i])) {
+            ok = spawn_task(operands[i], &tasks[i]);
+            continue;
+        }
+        values[i] = llvm_eval_ast(operands[i]);
+        ok = values[i] != NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        if (tasks[i].storage) {
+            LLVMValueRef value = join_task(&tasks[i]);
+            if (is_heap_type(operands[i]->tc_type)) gc_root(value);
+            if (ok) values[i] = value;
+        }
+    }
+    free(tasks);
+    return ok;
+}
+
+/*
+ * Lowers a list of independent operands. Under --auto-par, when several
+ * of them are expensive and pure, the runtime decides whether a fork still
+ * pays: if it does they are forked as above, and if not all of them run
+ * sequential code, so recursion below the cutoff never checks again.
+ */
+static bool lower_operands(ASTNode **operands, int count, LLVMValueRef *values) {
+    if (!forks_operands(operands, count)) return lower_operand_list(operands, count, values, false);
+
+    LLVMTypeRef i8 = LLVMInt8TypeInContext(TheContext);
+    LLVMValueRef should = declare_runtime("vex_par_should_spawn", i8, NULL, 0);
+    LLVMValueRef answer = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(should), should, NULL, 0, "");
+    LLVMValueRef function = LLVMGetBasicBlockParent(LLVMGetInsertBlock(Builder));
+    LLVMBasicBlockRef blocks[] = {
+        LLVMAppendBasicBlockInContext(TheContext, function, "par.fork"),
+        LLVMAppendBasicBlockInContext(TheContext, function, "par.sequential"),
+    };
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(TheContext, function, "par.end");
+    LLVMBuildCondBr(Builder, LLVMBuildICmp(Builder, LLVMIntNE, answer, LLVMConstNull(i8), ""), blocks[0], blocks[1]);
+
+    LLVMValueRef *forked = malloc(sizeof(LLVMValueRef) * (size_t)count);
+    LLVMPositionBuilderAtEnd(Builder, blocks[0]);
+    bool ok = lower_operand_list(operands, count, forked, true);
+    blocks[0] = LLVMGetInsertBlock(Builder);
+    LLVMBuildBr(Builder, done);
+
+    LLVMPositionBuilderAtEnd(Builder, blocks[1]);
+    par_sequential = true;
+    ok = ok && lower_operand_list(operands, count, values, false);
+    par_sequential = false;
+    blocks[1] = LLVMGetInsertBlock(Builder);
+    LLVMBuildBr(Builder, done);
+
+    LLVMPositionBuilderAtEnd(Builder, done);
+    for (int i = 0; ok && i < count; i++) {
+        LLVMValueRef incoming[] = { forked[i], values[i] };
+        values[i] = LLVMBuildPhi(Builder, LLVMTypeOf(forked[i]), "par.value");
+        LLVMAddIncoming(values[i], incoming, blocks, 2);
+    }
+    free(forked);
+    return ok;
+}
+
+/* A flagged value as one word, laid out as a declared type's value would be; see vex_variant_box. */
+static LLVMValueRef box_outcome(LLVMValueRef value) {
+    const VariantType *variant = find_variant_type(LLVMGetStructName(LLVMTypeOf(value)));
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    uint32_t boxed_tags = 0, reference_tags = 0;
+    for (int i = 0; i < variant->constructor_count; i++) {
+        if (variant->constructors[i].repr == ConstructorBoxed) boxed_tags |= UINT32_C(1) << i;
+        if (variant->constructors[i].references) reference_tags |= UINT32_C(1) << i;
+    }
+
+    LLVMTypeRef params[] = { i32, i64, i32, i32 };
+    LLVMValueRef box = declare_runtime("vex_variant_box", i64, params, 4);
+    LLVMValueRef args[] = {
+        LLVMBuildZExt(Builder, LLVMBuildExtractValue(Builder, value, 0, "flag"), i32, ""),
+        LLVMBuildExtractValue(Builder, value, 1, "payload"),
+        LLVMConstInt(i32, boxed_tags, false),
+        LLVMConstInt(i32, reference_tags, false),
+    };
+    return LLVMBuildCall2(Builder, LLVMGlobalGetValueType(box), box, args, 4, "boxed");
+}
+
+static LLVMValueRef unbox_outcome(LLVMValueRef word, LLVMTypeRef type) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMValueRef unbox_tag = declare_runtime("vex_variant_unbox_tag", i32, &i64, 1);
+    LLVMValueRef unbox_payload = declare_runtime("vex_variant_unbox_payload", i64, &i64, 1);
+    LLVMValueRef tag = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(unbox_tag), unbox_tag, &word, 1, "tag");
+    LLVMValueRef payload = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(unbox_payload), unbox_payload, &word, 1, "payload");
+    LLVMValueRef value = LLVMBuildInsertValue(Builder, LLVMGetUndef(type), LLVMBuildTrunc(Builder, tag, LLVMInt1TypeInContext(TheContext), "flag"), 0, "");
+    return LLVMBuildInsertValue(Builder, value, payload, 1, "");
+}
+
+LLVMValueRef word_to_native(LLVMValueRef word, LLVMTypeRef type) {
+    switch (LLVMGetTypeKind(type)) {
+        case LLVMStructTypeKind:
+            return unbox_outcome(word, type);
+        case LLVMDoubleTypeKind:
+            return LLVMBuildBitCast(Builder, word, type, "");
+        case LLVMPointerTypeKind:
+            return LLVMBuildIntToPtr(Builder, word, type, "");
+        default:
+            return LLVMGetIntTypeWidth(type) < 64 ? LLVMBuildTrunc(Builder, word, type, "") : word;
+    }
+}
+
+LLVMValueRef native_to_word(LLVMValueRef value) {
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef type = LLVMTypeOf(value);
+    switch (LLVMGetTypeKind(type)) {
+        case LLVMStructTypeKind:
+            return box_outcome(value);
+        case LLVMDoubleTypeKind:
+            return LLVMBuildBitCast(Builder, value, i64, "");
+        case LLVMPointerTypeKind:
+            return LLVMBuildPtrToInt(Builder, value, i64, "");
+        default:
+            /* An int is signed; a bool or char is widened as the unsigned byte it is. */
+            if (LLVMGetIntTypeWidth(type) == 32) return LLVMBuildSExt(Builder, value, i64, "");
+            return LLVMGetIntTypeWidth(type) < 64 ? LLVMBuildZExt(Builder, value, i64, "") : value;
+    }
+}
+
+/* i64 name(i64 *args): unpacks the word arguments, calls the target and packs its result. */
+LLVMValueRef build_word_thunk(const char *name, LLVMValueRef target) {
+    LLVMBasicBlockRef saved_block = LLVMGetInsertBlock(Builder);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef args_type = LLVMPointerType(i64, 0);
+    LLVMValueRef thunk = LLVMAddFunction(TheModule, name, LLVMFunctionType(i64, &args_type, 1, 0));
+    LLVMPositionBuilderAtEnd(Builder, LLVMAppendBasicBlockInContext(TheContext, thunk, "entry"));
+
+    LLVMTypeRef target_type = LLVMGlobalGetValueType(target);
+    unsigned int param_count = LLVMCountParamTypes(target_type);
+    LLVMTypeRef *param_types = malloc(sizeof(LLVMTypeRef) * (param_count ? param_count : 1));
+    LLVMValueRef *call_args = malloc(sizeof(LLVMValueRef) * (param_count ? param_count : 1));
+    LLVMGetParamTypes(target_type, param_types);
+
+    for (unsigned int i = 0; i < param_count; i++) {
+        LLVMValueRef index = LLVMConstInt(i64, i, false);
+        LLVMValueRef slot = LLVMBuildGEP2(Builder, i64, LLVMGetParam(thunk, 0), &index, 1, "");
+        call_args[i] = word_to_native(LLVMBuildLoad2(Builder, i64, slot, ""), param_types[i]);
+    }
+
+    LLVMValueRef result = LLVMBuildCall2(Builder, target_type, target, call_args, param_count, "");
+    LLVMBuildRet(Builder, native_to_word(result));
+    free(param_types);
+    free(call_args);
+
+    if (saved_block) LLVMPositionBuilderAtEnd(Builder, saved_block);
+    return thunk;
+}
+
+static VexElemKind elem_kind_of(const TypeTC *type) {
+    switch (type->kind) {
+        case TypeFloat: return VEX_ELEM_FLOAT;
+        case TypeBool: return VEX_ELEM_BOOL;
+        case TypeChar: return VEX_ELEM_CHAR;
+        case TypeString: return VEX_ELEM_STRING;
+        case TypeList: return VEX_ELEM_LIST;
+        default: return VEX_ELEM_INT;
+    }
+}
+
+/* How an element is laid out in a list buffer; bools widen from i1 to a byte. */
+static LLVMTypeRef elem_storage_type(VexElemKind kind) {
+    switch (kind) {
+        case VEX_ELEM_FLOAT: return LLVMDoubleTypeInContext(TheContext);
+        case VEX_ELEM_BOOL:
+        case VEX_ELEM_CHAR: return LLVMInt8TypeInContext(TheContext);
+        case VEX_ELEM_STRING: return LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+        case VEX_ELEM_LIST: return LLVMPointerType(get_list_type(), 0);
+        default: return LLVMInt32TypeInContext(TheContext);
+    }
+}
+
+static LLVMTypeRef native_type_of(const TypeTC *type) {
+    if (type->kind == TypeVariant) return get_llvm_type(type->variant->name);
+    return get_llvm_type(type->kind == TypeList ? "<list>" : type_to_string(type->kind));
+}
+
+/*
+ * Literals made only of constants become read-only globals. One that
+ * escape.c found never outlives its function is built in the function's
+ * frame; a spawned task's frame is gone before its result is used, so
+ * that only happens in the function itself. Anything else is built with
+ * vex_list_new.
+ */
+static LLVMValueRef lower_list_literal(ASTNode *node) {
+    VexElemKind kind = elem_kind_of(node->tc_type->element_type);
+    LLVMTypeRef storage_type = elem_storage_type(kind);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    unsigned int count = (unsigned int)node->list.count;
+
+    LLVMValueRef *values = malloc(sizeof(LLVMValueRef) * (count ? count : 1));
+    bool constant = true;
+    for (unsigned int i = 0; i < count; i++) {
+        LLVMValueRef value = llvm_eval_ast(node->list.elements[i]);
+        if (!value) {
+            free(values);
+            return NULL;
+        }
+        if (kind == VEX_ELEM_BOOL) value = LLVMBuildZExt(Builder, value, storage_type, "");
+        values[i] = value;
+        constant = constant && LLVMIsConstant(value);
+    }
+
+    LLVMValueRef list;
+    if (constant) {
+        LLVMTypeRef data_type = LLVMArrayType(storage_type, count);
+        LLVMValueRef data = LLVMAddGlobal(TheModule, data_type, "list.data");
+        LLVMSetInitializer(data, LLVMConstArray(storage_type, values, count));
+        LLVMSetGlobalConstant(data, 1);
+        LLVMSetLinkage(data, LLVMPrivateLinkage);
+        LLVMSetUnnamedAddress(data, LLVMGlobalUnnamedAddr);
+
+        LLVMValueRef fields[] = {
+            LLVMConstInt(i64, count, false),
+            LLVMConstInt(i32, (unsigned long long)vex_elem_size(kind), false),
+            LLVMConstInt(i32, (unsigned long long)kind | VEX_LIST_STATIC, false),
+            LLVMConstBitCast(data, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0)),
+        };
+        list = LLVMAddGlobal(TheModule, get_list_type(), "list");
+        LLVMSetInitializer(list, LLVMConstNamedStruct(get_list_type(), fields, 4));
+        LLVMSetGlobalConstant(list, 1);
+        LLVMSetLinkage(list, LLVMPrivateLinkage);
+        LLVMSetUnnamedAddress(list, LLVMGlobalUnnamedAddr);
+    } else if (node->local && count <= VEX_LIST_FLAT_MAX && in_frame_function()) {
+        LLVMTypeRef fields[] = { get_list_type(), LLVMArrayType(storage_type, count) };
+        LLVMTypeRef local_type = LLVMStructTypeInContext(TheContext, fields, 2, 0);
+        LLVMValueRef local = build_entry_alloca(local_type, "list.local");
+        list = LLVMBuildStructGEP2(Builder, local_type, local, 0, "list");
+        LLVMValueRef header[] = {
+            LLVMConstInt(i64, count, false),
+            LLVMConstInt(i32, (unsigned long long)vex_elem_size(kind), false),
+            LLVMConstInt(i32, (unsigned long long)kind | VEX_LIST_LOCAL, false),
+        };
+        for (unsigned int i = 0; i < 3; i++) {
+            LLVMBuildStore(Builder, header[i], LLVMBuildStructGEP2(Builder, get_list_type(), list, i, ""));
+        }
+        LLVMValueRef data = LLVMBuildStructGEP2(Builder, local_type, local, 1, "list.data");
+        LLVMBuildStore(Builder, LLVMBuildBitCast(Builder, data, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0), ""),
+                       LLVMBuildStructGEP2(Builder, get_list_type(), list, 3, ""));
+        data = LLVMBuildBitCast(Builder, data, LLVMPointerType(storage_type, 0), "");
+        for (unsigned int i = 0; i < count; i++) {
+            LLVMValueRef index = LLVMConstInt(i64, i, false);
+            LLVMBuildStore(Builder, values[i], LLVMBuildGEP2(Builder, storage_type, data, &index, 1, ""));
+        }
+    } else {
+        LLVMTypeRef params[] = { i32, i64 };
+        LLVMValueRef new_list = declare_runtime("vex_list_new", LLVMPointerType(get_list_type(), 0), params, 2);
+        LLVMValueRef args[] = { LLVMConstInt(i32, (unsigned long long)kind, false), LLVMConstInt(i64, count, false) };
+        list = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(new_list), new_list, args, 2, "list");
+
+        LLVMValueRef data_field = LLVMBuildStructGEP2(Builder, get_list_type(), list, 3, "");
+        LLVMValueRef data = LLVMBuildLoad2(Builder, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0), data_field, "list.data");
+        data = LLVMBuildBitCast(Builder, data, LLVMPointerType(storage_type, 0), "");
+        for (unsigned int i = 0; i < count; i++) {
+            LLVMValueRef index = LLVMConstInt(i64, i, false);
+            LLVMBuildStore(Builder, values[i], LLVMBuildGEP2(Builder, storage_type, data, &index, 1, ""));
+        }
+    }
+
+    free(values);
+    return list;
+}
+
+static LLVMValueRef lower_list_builtin(ASTNode *node) {
+    const char *name = node->call.callee->strval;
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef list_ptr = LLVMPointerType(get_list_type(), 0);
+
+    LLVMValueRef list = llvm_eval_ast(node->call.args[0]);
+    if (!list) return NULL;
+
+    if (strcmp(name, "length") == 0 && node->call.args[0]->tc_type->kind == TypeString) {
+        LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+        LLVMValueRef string_length = declare_runtime("vex_string_length", i64, &i8_ptr, 1);
+        LLVMValueRef length = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(string_length), string_length, &list, 1, "");
+        return LLVMBuildTrunc(Builder, length, i32, "length");
+    }
+    if (strcmp(name, "length") == 0) {
+        LLVMValueRef length = LLVMBuildLoad2(Builder, i64, LLVMBuildStructGEP2(Builder, get_list_type(), list, 0, ""), "");
+        return LLVMBuildTrunc(Builder, length, i32, "length");
+    }
+    if (strcmp(name, "tail") == 0) {
+        LLVMValueRef tail = declare_runtime("vex_list_tail", list_ptr, &list_ptr, 1);
+        return LLVMBuildCall2(Builder, LLVMGlobalGetValueType(tail), tail, &list, 1, "tail");
+    }
+    if (strcmp(name, "head") == 0) {
+        LLVMValueRef head = declare_runtime("vex_list_head", i64, &list_ptr, 1);
+        LLVMValueRef word = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(head), head, &list, 1, "");
+        return word_to_native(word, native_type_of(node->tc_type));
+    }
+
+    bool owned = is_owned_list(node->call.args[0]);
+    LLVMValueRef args[3] = { list };
+    for (int i = 1; i < node->call.arg_count; i++) {
+        args[i] = llvm_eval_ast(node->call.args[i]);
+        if (!args[i]) return NULL;
+    }
+
+    /* Elements and indices travel as words; the runtime hands back a new list header. */
+    if (node->call.arg_count > 1 && strcmp(name, "concat") != 0) args[1] = native_to_word(args[1]);
+    if (strcmp(name, "update") == 0) args[2] = native_to_word(args[2]);
+    if (strcmp(name, "nth") != 0) {
+        bool reuses = owned && strcmp(name, "drop") != 0 && strcmp(name, "tail") != 0;
+        char runtime_name[32];
+        snprintf(runtime_name, sizeof(runtime_name), "vex_list_%s%s", name, reuses ? "_owned" : "");
+        LLVMTypeRef params[] = { list_ptr, strcmp(name, "concat") == 0 ? list_ptr : i64, i64 };
+        LLVMValueRef function = declare_runtime(runtime_name, list_ptr, params, (unsigned int)node->call.arg_count);
+        return LLVMBuildCall2(Builder, LLVMGlobalGetValueType(function), function, args, (unsigned int)node->call.arg_count, name);
+    }
+
+    LLVMTypeRef params[] = { list_ptr, i64 };
+    LLVMValueRef nth = declare_runtime("vex_list_index", i64, params, 2);
+    LLVMValueRef word = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(nth), nth, args, 2, "");
+    return word_to_native(word, native_type_of(node->tc_type));
+}
+
+/*
+ * Widest vector register to target, from the host's CPU features. Like
+ * LLVM's own x86 tuning, AVX-512 parts still get 256-bit vectors.
+ */
+static unsigned int host_vector_bits(void) {
+    static unsigned int bits = 0;
+    if (bits) return bits;
+
+    char *features = LLVMGetHostCPUFeatures();
+    bits = features && strstr(features, "+avx") ? 256 : 128;
+    LLVMDisposeMessage(features);
+    return bits;
+}
 
-void insert_variable(const char *name, LLVMValueRef value) {
-    VarBinding *entry = malloc(sizeof(VarBinding));
-    entry->name = name;
-    entry->value = value;
-    HASH_ADD_KEYPTR(hh, variables, entry->name, strlen(entry->name), entry);
+static unsigned int element_bits(LLVMTypeRef type) {
+    return LLVMGetTypeKind(type) == LLVMDoubleTypeKind ? 64 : LLVMGetIntTypeWidth(type);
 }
 
-LLVMValueRef get_variable(const char *name) {
-    VarBinding *entry;
-    HASH_FIND_STR(variables, name, entry);
-    return entry ? entry->value : NULL;
+static LLVMValueRef list_elements(LLVMValueRef list, LLVMTypeRef elem_type) {
+    LLVMValueRef field = LLVMBuildStructGEP2(Builder, get_list_type(), list, 3, "");
+    LLVMValueRef data = LLVMBuildLoad2(Builder, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0), field, "list.data");
+    return LLVMBuildBitCast(Builder, data, LLVMPointerType(elem_type, 0), "");
 }
 
-void free_variables(void) {
+static LLVMValueRef splat(LLVMValueRef scalar, unsigned int lanes) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMValueRef vector = LLVMGetUndef(LLVMVectorType(LLVMTypeOf(scalar), lanes));
+    vector = LLVMBuildInsertElement(Builder, vector, scalar, LLVMConstInt(i32, 0, false), "");
+    return LLVMBuildShuffleVector(Builder, vector, vector, LLVMConstNull(LLVMVectorType(i32, lanes)), "splat");
+}
+
+/* Loads `width` elements at index, or a single one when width is 0. */
+static LLVMValueRef load_elements(LLVMValueRef data, LLVMTypeRef elem_type, LLVMValueRef index, unsigned int width) {
+    LLVMValueRef ptr = LLVMBuildGEP2(Builder, elem_type, data, &index, 1, "");
+    if (!width) return LLVMBuildLoad2(Builder, elem_type, ptr, "");
+
+    LLVMTypeRef vector_type = LLVMVectorType(elem_type, width);
+    LLVMValueRef load = LLVMBuildLoad2(Builder, vector_type, LLVMBuildBitCast(Builder, ptr, LLVMPointerType(vector_type, 0), ""), "");
+    LLVMSetAlignment(load, element_bits(elem_type) / 8);
+    return load;
+}
+
+static void store_elements(LLVMValueRef value, LLVMValueRef data, LLVMTypeRef elem_type, LLVMValueRef index) {
+    LLVMValueRef ptr = LLVMBuildGEP2(Builder, elem_type, data, &index, 1, "");
+    ptr = LLVMBuildBitCast(Builder, ptr, LLVMPointerType(LLVMTypeOf(value), 0), "");
+    LLVMSetAlignment(LLVMBuildStore(Builder, value, ptr), element_bits(elem_type) / 8);
+}
+
+/* A comparison of two ints or floats, or of two vectors of them, as i1s; NULL when op is not a comparison. */
+static LLVMValueRef build_compare(const char *op, LLVMValueRef a, LLVMValueRef b) {
+    bool is_float = LLVMGetTypeKind(LLVMTypeOf(a)) == LLVMDoubleTypeKind ||
+        (LLVMGetTypeKind(LLVMTypeOf(a)) == LLVMVectorTypeKind && LLVMGetTypeKind(LLVMGetElementType(LLVMTypeOf(a))) == LLVMDoubleTypeKind);
+
+    static const struct { const char *op; LLVMIntPredicate int_pred; LLVMRealPredicate real_pred; } predicates[] = {
+        { "<", LLVMIntSLT, LLVMRealOLT }, { ">", LLVMIntSGT, LLVMRealOGT },
+        { "<=", LLVMIntSLE, LLVMRealOLE }, { ">=", LLVMIntSGE, LLVMRealOGE },
+        { "==", LLVMIntEQ, LLVMRealOEQ }, { "!=", LLVMIntNE, LLVMRealUNE },
+    };
+    for (size_t i = 0; i < sizeof(predicates) / sizeof(predicates[0]); i++) {
+        if (strcmp(op, predicates[i].op) != 0) continue;
+        return is_float ? LLVMBuildFCmp(Builder, predicates[i].real_pred, a, b, "cmptmp")
+                        : LLVMBuildICmp(Builder, predicates[i].int_pred, a, b, "cmptmp");
+    }
+    return NULL;
+}
+
+/*
+ * a / b on ints or vectors of them. A zero divisor gives 0 and reports
+ * the interpreter's runtime error instead of trapping; the check is one
+ * compare and a branch that is never taken in a correct program. The one
+ * quotient that overflows, INT_MIN / -1, wraps to INT_MIN as it does in
+ * the interpreter instead of trapping.
+ */
+static LLVMValueRef build_int_div(LLVMValueRef a, LLVMValueRef b) {
+    LLVMTypeRef type = LLVMTypeOf(b);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    bool is_vector = LLVMGetTypeKind(type) == LLVMVectorTypeKind;
+    LLVMValueRef zero = LLVMConstNull(type);
+    LLVMValueRef is_zero = LLVMBuildICmp(Builder, LLVMIntEQ, b, zero, "div.zero");
+
+    LLVMValueRef any = is_zero, count = NULL;
+    if (is_vector) {
+        unsigned int lanes = LLVMGetVectorSize(type);
+        LLVMTypeRef bits = LLVMIntTypeInContext(TheContext, lanes);
+        char name[32];
+        snprintf(name, sizeof(name), "llvm.ctpop.i%u", lanes);
+        LLVMValueRef ctpop = declare_runtime(name, bits, &bits, 1);
+        LLVMValueRef mask = LLVMBuildBitCast(Builder, is_zero, bits, "");
+        any = LLVMBuildICmp(Builder, LLVMIntNE, mask, LLVMConstNull(bits), "");
+        count = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(ctpop), ctpop, &mask, 1, "");
+        count = LLVMBuildZExt(Builder, count, i64, "");
+    } else {
+        count = LLVMBuildZExt(Builder, is_zero, i64, "");
+    }
+
+    LLVMValueRef function = LLVMGetBasicBlockParent(LLVMGetInsertBlock(Builder));
+    LLVMBasicBlockRef report = LLVMAppendBasicBlockInContext(TheContext, function, "div.report");
+    LLVMBasicBlockRef rest = LLVMAppendBasicBlockInContext(TheContext, function, "div.rest");
+    LLVMBuildCondBr(Builder, any, report, rest);
+    LLVMPositionBuilderAtEnd(Builder, report);
+    LLVMValueRef report_fn = declare_runtime("vex_division_by_zero", LLVMVoidTypeInContext(TheContext), &i64, 1);
+    LLVMBuildCall2(Builder, LLVMGlobalGetValueType(report_fn), report_fn, &count, 1, "");
+    LLVMBuildBr(Builder, rest);
+    LLVMPositionBuilderAtEnd(Builder, rest);
+
+    LLVMValueRef one = LLVMConstInt(is_vector ? LLVMGetElementType(type) : type, 1, false);
+    if (is_vector) {
+        unsigned int lanes = LLVMGetVectorSize(type);
+        LLVMValueRef *ones = malloc(sizeof(LLVMValueRef) * lanes);
+        for (unsigned int i = 0; i < lanes; i++) ones[i] = one;
+        one = LLVMConstVector(ones, lanes);
+        free(ones);
+    }
+    LLVMValueRef is_minus_one = LLVMBuildICmp(Builder, LLVMIntEQ, b, LLVMConstAllOnes(type), "div.negate");
+    LLVMValueRef divisor = LLVMBuildSelect(Builder, LLVMBuildOr(Builder, is_zero, is_minus_one, ""), one, b, "");
+    LLVMValueRef quotient = LLVMBuildSDiv(Builder, a, divisor, "divtmp");
+    quotient = LLVMBuildSelect(Builder, is_minus_one, LLVMBuildNeg(Builder, a, ""), quotient, "");
+    return LLVMBuildSelect(Builder, is_zero, zero, quotient, "");
+}
+
+/* One elementwise operator on scalars or on whole vectors; comparisons yield 0/1 bytes. */
+static LLVMValueRef build_elementwise_op(const char *op, LLVMValueRef a, LLVMValueRef b, LLVMTypeRef out_type) {
+    if (strcmp(op, "+") == 0) return LLVMBuildAdd(Builder, a, b, "addtmp");
+    if (strcmp(op, "-") == 0) return LLVMBuildSub(Builder, a, b, "subtmp");
+    if (strcmp(op, "*") == 0) return LLVMBuildMul(Builder, a, b, "multmp");
+    if (strcmp(op, "/") == 0) return build_int_div(a, b);
+    if (strcmp(op, "+.") == 0) return fast_math(LLVMBuildFAdd(Builder, a, b, "faddtmp"));
+    if (strcmp(op, "-.") == 0) return fast_math(LLVMBuildFSub(Builder, a, b, "fsubtmp"));
+    if (strcmp(op, "*.") == 0) return fast_math(LLVMBuildFMul(Builder, a, b, "fmultmp"));
+    if (strcmp(op, "/.") == 0) return fast_math(LLVMBuildFDiv(Builder, a, b, "fdivtmp"));
+    if (strcmp(op, "&&") == 0) return LLVMBuildAnd(Builder, a, b, "andtmp");
+    if (strcmp(op, "||") == 0) return LLVMBuildOr(Builder, a, b, "ortmp");
+
+    LLVMValueRef mask = build_compare(op, a, b);
+    return mask ? LLVMBuildZExt(Builder, mask, out_type, "mask") : NULL;
+}
+
+/*
+ * xs + ys, xs *. 2.0, xs < ys: a loop over native-width vectors of the
+ * contiguous elements, then a scalar loop for the remainder. A scalar
+ * operand is broadcast across every lane.
+ */
+static LLVMValueRef lower_string_concat(LLVMValueRef left, LLVMValueRef right) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMTypeRef params[] = { i8_ptr, i8_ptr };
+    LLVMValueRef concat = declare_runtime("vex_string_concat", i8_ptr, params, 2);
+    LLVMValueRef args[] = { left, right };
+    return LLVMBuildCall2(Builder, LLVMGlobalGetValueType(concat), concat, args, 2, "concat");
+}
+
+static LLVMValueRef lower_elementwise(ASTNode *node, LLVMValueRef left, LLVMValueRef right) {
+    const char *op = node->binary_expr.op;
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef list_ptr = LLVMPointerType(get_list_type(), 0);
+
+    bool left_list = node->binary_expr.left->tc_type->kind == TypeList;
+    bool right_list = node->binary_expr.right->tc_type->kind == TypeList;
+    TypeTC *in_type = left_list ? node->binary_expr.left->tc_type->element_type : node->binary_expr.left->tc_type;
+    VexElemKind in_kind = elem_kind_of(in_type), out_kind = elem_kind_of(node->tc_type->element_type);
+    LLVMTypeRef in_elem = elem_storage_type(in_kind), out_elem = elem_storage_type(out_kind);
+    unsigned int lanes = host_vector_bits() / element_bits(in_elem);
+
+    LLVMValueRef contiguous = declare_runtime("vex_list_contiguous", list_ptr, &list_ptr, 1);
+    LLVMValueRef operands[2] = { left, right };
+    bool is_list[2] = { left_list, right_list };
+    LLVMValueRef shape = NULL;
+    for (int i = 0; i < 2; i++) {
+        if (is_list[i]) {
+            operands[i] = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(contiguous), contiguous, &operands[i], 1, "");
+            shape = shape ? shape : operands[i];
+        } else if (in_kind == VEX_ELEM_BOOL) {
+            operands[i] = LLVMBuildZExt(Builder, operands[i], in_elem, "");
+        }
+    }
+
+    LLVMValueRef length;
+    if (left_list && right_list) {
+        LLVMTypeRef params[] = { list_ptr, list_ptr };
+        LLVMValueRef zip = declare_runtime("vex_list_zip_length", i64, params, 2);
+        length = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(zip), zip, operands, 2, "length");
+    } else {
+        length = LLVMBuildLoad2(Builder, i64, LLVMBuildStructGEP2(Builder, get_list_type(), shape, 0, ""), "length");
+    }
+
+    /* An owned operand is overwritten with the result; each element is read before its slot is written. */
+    LLVMValueRef kind = LLVMConstInt(i32, (unsigned long long)out_kind, false);
+    int owned = left_list && is_owned_list(node->binary_expr.left) ? 0 : right_list && is_owned_list(node->binary_expr.right) ? 1 : -1;
+    LLVMValueRef out;
+    if (owned >= 0) {
+        LLVMTypeRef reuse_params[] = { list_ptr, i32 };
+        LLVMValueRef reuse = declare_runtime("vex_list_reuse", list_ptr, reuse_params, 2);
+        LLVMValueRef reuse_args[] = { operands[owned], kind };
+        out = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(reuse), reuse, reuse_args, 2, "elementwise");
+    } else {
+        LLVMTypeRef new_params[] = { i32, i64 };
+        LLVMValueRef new_list = declare_runtime("vex_list_new", list_ptr, new_params, 2);
+        LLVMValueRef new_args[] = { kind, length };
+        out = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(new_list), new_list, new_args, 2, "elementwise");
+    }
+    LLVMValueRef out_data = list_elements(out, out_elem);
+
+    LLVMValueRef data[2], broadcast[2];
+    for (int i = 0; i < 2; i++) {
+        data[i] = is_list[i] ? list_elements(operands[i], in_elem) : NULL;
+        broadcast[i] = is_list[i] ? NULL : splat(operands[i], lanes);
+    }
+    LLVMValueRef vector_end = LLVMBuildAnd(Builder, length, LLVMConstInt(i64, ~(unsigned long long)(lanes - 1), false), "vector.end");
+
+    LLVMValueRef function = LLVMGetBasicBlockParent(LLVMGetInsertBlock(Builder));
+    LLVMBasicBlockRef entry = LLVMGetInsertBlock(Builder);
+    LLVMBasicBlockRef vector_cond = LLVMAppendBasicBlockInContext(TheContext, function, "vector.cond");
+    LLVMBasicBlockRef vector_body = LLVMAppendBasicBlockInContext(TheContext, function, "vector.body");
+    LLVMBasicBlockRef scalar_cond = LLVMAppendBasicBlockInContext(TheContext, function, "scalar.cond");
+    LLVMBasicBlockRef scalar_body = LLVMAppendBasicBlockInContext(TheContext, function, "scalar.body");
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(TheContext, function, "elementwise.end");
+    LLVMBuildBr(Builder, vector_cond);
+
+    LLVMPositionBuilderAtEnd(Builder, vector_cond);
+    LLVMValueRef i = LLVMBuildPhi(Builder, i64, "i");
+    LLVMBuildCondBr(Builder, LLVMBuildICmp(Builder, LLVMIntULT, i, vector_end, ""), vector_body, scalar_cond);
+
+    LLVMPositionBuilderAtEnd(Builder, vector_body);
+    LLVMValueRef a = data[0] ? load_elements(data[0], in_elem, i, lanes) : broadcast[0];
+    LLVMValueRef b = data[1] ? load_elements(data[1], in_elem, i, lanes) : broadcast[1];
+    store_elements(build_elementwise_op(op, a, b, LLVMVectorType(out_elem, lanes)), out_data, out_elem, i);
+    LLVMValueRef i_next = LLVMBuildAdd(Builder, i, LLVMConstInt(i64, lanes, false), "");
+    LLVMBasicBlockRef vector_latch = LLVMGetInsertBlock(Builder);
+    LLVMBuildBr(Builder, vector_cond);
+
+    LLVMValueRef i_values[] = { LLVMConstInt(i64, 0, false), i_next };
+    LLVMBasicBlockRef i_blocks[] = { entry, vector_latch };
+    LLVMAddIncoming(i, i_values, i_blocks, 2);
+
+    LLVMPositionBuilderAtEnd(Builder, scalar_cond);
+    LLVMValueRef j = LLVMBuildPhi(Builder, i64, "j");
+    LLVMBuildCondBr(Builder, LLVMBuildICmp(Builder, LLVMIntULT, j, length, ""), scalar_body, done);
+
+    LLVMPositionBuilderAtEnd(Builder, scalar_body);
+    a = data[0] ? load_elements(data[0], in_elem, j, 0) : operands[0];
+    b = data[1] ? load_elements(data[1], in_elem, j, 0) : operands[1];
+    store_elements(build_elementwise_op(op, a, b, out_elem), out_data, out_elem, j);
+    LLVMValueRef j_next = LLVMBuildAdd(Builder, j, LLVMConstInt(i64, 1, false), "");
+    LLVMBasicBlockRef scalar_latch = LLVMGetInsertBlock(Builder);
+    LLVMBuildBr(Builder, scalar_cond);
+
+    LLVMValueRef j_values[] = { i, j_next };
+    LLVMBasicBlockRef j_blocks[] = { vector_cond, scalar_latch };
+    LLVMAddIncoming(j, j_values, j_blocks, 2);
+
+    LLVMPositionBuilderAtEnd(Builder, done);
+    return out;
+}
+
+static LLVMValueRef lower_stage_function(ASTNode *function_node) {
+    LLVMValueRef function = llvm_eval_ast(function_node);
+    if (!function || !LLVMIsAFunction(function)) {
+        fprintf(stderr, "LLVM error: map, filter and reduce need a named function\n");
+        return NULL;
+    }
+    return function;
+}
+
+/* The "<name>.word" thunk of a function, built once per module. */
+static LLVMValueRef word_callback(LLVMValueRef function) {
+    size_t length;
+    const char *function_name = LLVMGetValueName2(function, &length);
+    char thunk_name[256];
+    snprintf(thunk_name, sizeof(thunk_name), "%.*s.word", (int)length, function_name);
+    LLVMValueRef thunk = LLVMGetNamedFunction(TheModule, thunk_name);
+    if (!thunk) {
+        thunk = build_word_thunk(thunk_name, function);
+        LLVMSetLinkage(thunk, LLVMInternalLinkage);
+    }
+    return LLVMBuildBitCast(Builder, thunk, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0), "");
+}
+
+/* One element of a list buffer as a native value; bools are stored as bytes. */
+static LLVMValueRef load_element(LLVMValueRef data, VexElemKind kind, LLVMValueRef index) {
+    LLVMValueRef value = load_elements(data, elem_storage_type(kind), index, 0);
+    return kind == VEX_ELEM_BOOL ? LLVMBuildTrunc(Builder, value, LLVMInt1TypeInContext(TheContext), "") : value;
+}
+
+static void store_element(LLVMValueRef value, LLVMValueRef data, VexElemKind kind, LLVMValueRef index) {
+    if (kind == VEX_ELEM_BOOL) value = LLVMBuildZExt(Builder, value, elem_storage_type(kind), "");
+    store_elements(value, data, elem_storage_type(kind), index);
+}
+
+/* The loop over [begin, end) of a kernel, optionally carrying an accumulator from one element to the next. */
+typedef struct KernelLoop {
+    LLVMValueRef index, acc;
+    LLVMBasicBlockRef cond, done;
+} KernelLoop;
+
+static void begin_kernel_loop(KernelLoop *loop, LLVMValueRef kernel, LLVMValueRef begin, LLVMValueRef end, LLVMValueRef acc) {
+    LLVMBasicBlockRef entry = LLVMGetInsertBlock(Builder);
+    loop->cond = LLVMAppendBasicBlockInContext(TheContext, kernel, "loop.cond");
+    LLVMBasicBlockRef body = LLVMAppendBasicBlockInContext(TheContext, kernel, "loop.body");
+    loop->done = LLVMAppendBasicBlockInContext(TheContext, kernel, "loop.done");
+    LLVMBuildBr(Builder, loop->cond);
+
+    LLVMPositionBuilderAtEnd(Builder, loop->cond);
+    loop->index = LLVMBuildPhi(Builder, LLVMInt64TypeInContext(TheContext), "i");
+    LLVMAddIncoming(loop->index, &begin, &entry, 1);
+    loop->acc = NULL;
+    if (acc) {
+        loop->acc = LLVMBuildPhi(Builder, LLVMTypeOf(acc), "acc");
+        LLVMAddIncoming(loop->acc, &acc, &entry, 1);
+    }
+    LLVMBuildCondBr(Builder, LLVMBuildICmp(Builder, LLVMIntSLT, loop->index, end, ""), body, loop->done);
+    LLVMPositionBuilderAtEnd(Builder, body);
+}
+
+static void end_kernel_loop(KernelLoop *loop, LLVMValueRef acc) {
+    LLVMBasicBlockRef latch = LLVMGetInsertBlock(Builder);
+    LLVMValueRef next = LLVMBuildAdd(Builder, loop->index, LLVMConstInt(LLVMInt64TypeInContext(TheContext), 1, false), "");
+    LLVMBuildBr(Builder, loop->cond);
+    LLVMAddIncoming(loop->index, &next, &latch, 1);
+    if (loop->acc) LLVMAddIncoming(loop->acc, &acc, &latch, 1);
+    LLVMPositionBuilderAtEnd(Builder, loop->done);
+}
+
+/*
+ * The runtime's map, filter and reduce loops cloned for one function: a
+ * VexMapKernel, VexFilterKernel or VexReduceKernel (see list.h) that calls
+ * function directly for each element, so LLVM can inline it into the loop
+ * instead of calling through a word thunk every time.
+ */
+static LLVMValueRef build_kernel(const char *name, ListOpKind op, LLVMValueRef function, VexElemKind in_kind, VexElemKind out_kind) {
+    LLVMBasicBlockRef saved_block = LLVMGetInsertBlock(Builder);
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef list_ptr = LLVMPointerType(get_list_type(), 0);
+    LLVMTypeRef function_type = LLVMGlobalGetValueType(function);
+
+    LLVMTypeRef kernel_type;
+    if (op == ListMap) {
+        LLVMTypeRef params[] = { list_ptr, list_ptr, i64, i64 };
+        kernel_type = LLVMFunctionType(LLVMVoidTypeInContext(TheContext), params, 4, 0);
+    } else if (op == ListFilter) {
+        LLVMTypeRef params[] = { list_ptr, i8_ptr, i64, i64 };
+        kernel_type = LLVMFunctionType(i64, params, 4, 0);
+    } else {
+        LLVMTypeRef params[] = { list_ptr, i64, i64, i64 };
+        kernel_type = LLVMFunctionType(i64, params, 4, 0);
+    }
+    LLVMValueRef kernel = LLVMAddFunction(TheModule, name, kernel_type);
+    LLVMSetLinkage(kernel, LLVMInternalLinkage);
+    LLVMPositionBuilderAtEnd(Builder, LLVMAppendBasicBlockInContext(TheContext, kernel, "entry"));
+
+    LLVMValueRef in = list_elements(LLVMGetParam(kernel, 0), elem_storage_type(in_kind));
+    KernelLoop loop;
+    switch (op) {
+        case ListMap: {
+            LLVMValueRef out = list_elements(LLVMGetParam(kernel, 1), elem_storage_type(out_kind));
+            begin_kernel_loop(&loop, kernel, LLVMGetParam(kernel, 2), LLVMGetParam(kernel, 3), NULL);
+            LLVMValueRef value = load_element(in, in_kind, loop.index);
+            store_element(LLVMBuildCall2(Builder, function_type, function, &value, 1, ""), out, out_kind, loop.index);
+            end_kernel_loop(&loop, NULL);
+            LLVMBuildRetVoid(Builder);
+            break;
+        }
+        case ListFilter: {
+            begin_kernel_loop(&loop, kernel, LLVMGetParam(kernel, 2), LLVMGetParam(kernel, 3), LLVMConstInt(i64, 0, false));
+            LLVMValueRef value = load_element(in, in_kind, loop.index);
+            LLVMValueRef keep = LLVMBuildCall2(Builder, function_type, function, &value, 1, "");
+            store_element(keep, LLVMGetParam(kernel, 1), VEX_ELEM_BOOL, loop.index);
+            end_kernel_loop(&loop, LLVMBuildAdd(Builder, loop.acc, LLVMBuildZExt(Builder, keep, i64, ""), ""));
+            LLVMBuildRet(Builder, loop.acc);
+            break;
+        }
+        case ListReduce: {
+            LLVMTypeRef acc_type = in_kind == VEX_ELEM_BOOL ? LLVMInt1TypeInContext(TheContext) : elem_storage_type(in_kind);
+            LLVMValueRef init = word_to_native(LLVMGetParam(kernel, 3), acc_type);
+            begin_kernel_loop(&loop, kernel, LLVMGetParam(kernel, 1), LLVMGetParam(kernel, 2), init);
+            LLVMValueRef args[] = { loop.acc, load_element(in, in_kind, loop.index) };
+            end_kernel_loop(&loop, LLVMBuildCall2(Builder, function_type, function, args, 2, ""));
+            LLVMBuildRet(Builder, native_to_word(loop.acc));
+            break;
+        }
+    }
+
+    if (saved_block) LLVMPositionBuilderAtEnd(Builder, saved_block);
+    return kernel;
+}
+
+/*
+ * The kernel of function for this operation, built once per module, or
+ * NULL to use the generic runtime loop. Only functions with a known body
+ * qualify, and only small ones: the body may be inlined into every
+ * kernel, so their total size per module is capped.
+ */
+static LLVMValueRef specialized_kernel(ASTNode *node, LLVMValueRef function) {
+    static const char *suffixes[] = { "map", "filter", "reduce" };
+    size_t length;
+    const char *function_name = LLVMGetValueName2(function, &length);
+    char name[256];
+    snprintf(name, sizeof(name), "%.*s.%s", (int)length, function_name, suffixes[node->list_op.op]);
+
+    LLVMValueRef kernel = LLVMGetNamedFunction(TheModule, name);
+    if (!kernel) {
+        FunctionDef *def;
+        HASH_FIND(hh, function_defs, function_name, length, def);
+        if (!def) return NULL;
+        unsigned int size = estimate_size(def->node->function.expr);
+        if (size > SPECIALIZE_MAX_SIZE || specialize_spent + size > SPECIALIZE_BUDGET) return NULL;
+        specialize_spent += size;
+
+        VexElemKind in_kind = elem_kind_of(node->list_op.list->tc_type->element_type);
+        VexElemKind out_kind = node->list_op.op == ListMap ? elem_kind_of(node->tc_type->element_type) : in_kind;
+        kernel = build_kernel(name, node->list_op.op, function, in_kind, out_kind);
+    }
+    return LLVMBuildBitCast(Builder, kernel, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0), "");
+}
+
+/*
+ * map, filter and reduce call into the parallel list runtime, with a
+ * kernel specialized for the function when there is one and otherwise a
+ * word-ABI thunk of it.
+ */
+static LLVMValueRef lower_list_op(ASTNode *node) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef list_ptr = LLVMPointerType(get_list_type(), 0);
+
+    LLVMValueRef function = lower_stage_function(node->list_op.function);
+    if (!function) return NULL;
+    LLVMValueRef list = llvm_eval_ast(node->list_op.list);
+    if (!list) return NULL;
+    LLVMValueRef kernel = specialized_kernel(node, function);
+    /* reduce still needs the thunk to combine the chunk results. */
+    LLVMValueRef callback = kernel && node->list_op.op != ListReduce ? NULL : word_callback(function);
+
+    switch (node->list_op.op) {
+        case ListMap: {
+            LLVMTypeRef params[] = { list_ptr, i32, i8_ptr };
+            bool owned = is_owned_list(node->list_op.list);
+            const char *runtime_name = kernel ? (owned ? "vex_list_map_kernel_owned" : "vex_list_map_kernel")
+                                              : (owned ? "vex_list_map_owned" : "vex_list_map");
+            LLVMValueRef map = declare_runtime(runtime_name, list_ptr, params, 3);
+            LLVMValueRef out_kind = LLVMConstInt(i32, (unsigned long long)elem_kind_of(node->tc_type->element_type), false);
+            LLVMValueRef args[] = { list, out_kind, kernel ? kernel : callback };
+            return LLVMBuildCall2(Builder, LLVMGlobalGetValueType(map), map, args, 3, "map");
+        }
+
+        case ListFilter: {
+            LLVMTypeRef params[] = { list_ptr, i8_ptr };
+            LLVMValueRef filter = declare_runtime(kernel ? "vex_list_filter_kernel" : "vex_list_filter", list_ptr, params, 2);
+            LLVMValueRef args[] = { list, kernel ? kernel : callback };
+            return LLVMBuildCall2(Builder, LLVMGlobalGetValueType(filter), filter, args, 2, "filter");
+        }
+
+        case ListReduce: {
+            LLVMValueRef init = llvm_eval_ast(node->list_op.init);
+            if (!init) return NULL;
+            LLVMValueRef word;
+            if (kernel) {
+                LLVMTypeRef params[] = { list_ptr, i64, i8_ptr, i8_ptr };
+                LLVMValueRef reduce = declare_runtime("vex_list_reduce_kernel", i64, params, 4);
+                LLVMValueRef args[] = { list, native_to_word(init), kernel, callback };
+                word = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(reduce), reduce, args, 4, "");
+            } else {
+                LLVMTypeRef params[] = { list_ptr, i64, i8_ptr };
+                LLVMValueRef reduce = declare_runtime("vex_list_reduce", i64, params, 3);
+                LLVMValueRef args[] = { list, native_to_word(init), callback };
+                word = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(reduce), reduce, args, 3, "");
+            }
+            return word_to_native(word, native_type_of(node->tc_type));
+        }
+    }
+    return NULL;
+}
+
+/* "i64 list.sum.<type>(i64 *args)": the combine step of a fused sum. */
+static LLVMValueRef sum_callback(LLVMTypeRef type) {
+    bool is_float = LLVMGetTypeKind(type) == LLVMDoubleTypeKind;
+    const char *name = is_float ? "list.sum.float" : "list.sum.int";
+    LLVMValueRef thunk = LLVMGetNamedFunction(TheModule, name);
+    if (!thunk) {
+        LLVMBasicBlockRef saved_block = LLVMGetInsertBlock(Builder);
+        LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+        LLVMTypeRef args_type = LLVMPointerType(i64, 0);
+        thunk = LLVMAddFunction(TheModule, name, LLVMFunctionType(i64, &args_type, 1, 0));
+        LLVMSetLinkage(thunk, LLVMInternalLinkage);
+        LLVMPositionBuilderAtEnd(Builder, LLVMAppendBasicBlockInContext(TheContext, thunk, "entry"));
+
+        LLVMValueRef one = LLVMConstInt(i64, 1, false);
+        LLVMValueRef a = word_to_native(LLVMBuildLoad2(Builder, i64, LLVMGetParam(thunk, 0), ""), type);
+        LLVMValueRef b_slot = LLVMBuildGEP2(Builder, i64, LLVMGetParam(thunk, 0), &one, 1, "");
+        LLVMValueRef b = word_to_native(LLVMBuildLoad2(Builder, i64, b_slot, ""), type);
+        LLVMValueRef sum = is_float ? fast_math(LLVMBuildFAdd(Builder, a, b, "")) : LLVMBuildAdd(Builder, a, b, "");
+        LLVMBuildRet(Builder, native_to_word(sum));
+
+        if (saved_block) LLVMPositionBuilderAtEnd(Builder, saved_block);
+    }
+    return LLVMBuildBitCast(Builder, thunk, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0), "");
+}
+
+/*
+ * "i1 list.stage(i64 *word, i8 *ctx)": one element through every map and
+ * filter of a pipeline, with the stage functions called directly so LLVM
+ * can inline them into a single loop body. Returns 0 once a filter
+ * rejects the element.
+ */
+static LLVMValueRef build_stage_kernel(ASTNode *node, LLVMValueRef *functions, const TypeTC *input_type) {
+    LLVMBasicBlockRef saved_block = LLVMGetInsertBlock(Builder);
+    LLVMTypeRef i1 = LLVMInt1TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef params[] = { LLVMPointerType(i64, 0), LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0) };
+    LLVMValueRef kernel = LLVMAddFunction(TheModule, "list.stage", LLVMFunctionType(i1, params, 2, 0));
+    LLVMSetLinkage(kernel, LLVMInternalLinkage);
+    unsigned int zeroext = LLVMGetEnumAttributeKindForName("zeroext", 7);
+    LLVMAddAttributeAtIndex(kernel, LLVMAttributeReturnIndex, LLVMCreateEnumAttribute(TheContext, zeroext, 0));
+
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(TheContext, kernel, "entry");
+    LLVMBasicBlockRef reject = LLVMAppendBasicBlockInContext(TheContext, kernel, "reject");
+    LLVMPositionBuilderAtEnd(Builder, reject);
+    LLVMBuildRet(Builder, LLVMConstInt(i1, 0, false));
+
+    LLVMPositionBuilderAtEnd(Builder, entry);
+    LLVMValueRef slot = LLVMGetParam(kernel, 0);
+    LLVMValueRef value = word_to_native(LLVMBuildLoad2(Builder, i64, slot, ""), native_type_of(input_type));
+    for (int i = 0; i < node->pipeline.stage_count; i++) {
+        LLVMTypeRef type = LLVMGlobalGetValueType(functions[i]);
+        LLVMValueRef result = LLVMBuildCall2(Builder, type, functions[i], &value, 1, "");
+        if (node->pipeline.stages[i]->list_op.op == ListMap) {
+            value = result;
+            continue;
+        }
+        LLVMBasicBlockRef next = LLVMAppendBasicBlockInContext(TheContext, kernel, "keep");
+        LLVMBuildCondBr(Builder, result, next, reject);
+        LLVMPositionBuilderAtEnd(Builder, next);
+    }
+    LLVMBuildStore(Builder, native_to_word(value), slot);
+    LLVMBuildRet(Builder, LLVMConstInt(i1, 1, false));
+
+    if (saved_block) LLVMPositionBuilderAtEnd(Builder, saved_block);
+    return kernel;
+}
+
+/* A fused chain (see fusion.c) makes one parallel pass with a stage kernel and no intermediate lists. */
+static LLVMValueRef lower_list_pipeline(ASTNode *node) {
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMTypeRef list_ptr = LLVMPointerType(get_list_type(), 0);
+    ASTNode *sink = node->pipeline.sink;
+    int count = node->pipeline.stage_count;
+
+    LLVMValueRef list = llvm_eval_ast(node->pipeline.source);
+    if (!list) return NULL;
+    LLVMValueRef *functions = malloc(sizeof(LLVMValueRef) * (size_t)(count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        functions[i] = lower_stage_function(node->pipeline.stages[i]->list_op.function);
+        if (!functions[i]) {
+            free(functions);
+            return NULL;
+        }
+    }
+    LLVMValueRef kernel = build_stage_kernel(node, functions, node->pipeline.source->tc_type->element_type);
+    LLVMValueRef stage = LLVMBuildBitCast(Builder, kernel, i8_ptr, "");
+    LLVMValueRef ctx = LLVMConstNull(i8_ptr);
+    free(functions);
+
+    if (!sink) {
+        LLVMTypeRef params[] = { list_ptr, i32, i8_ptr, i8_ptr };
+        LLVMValueRef pipeline = declare_runtime("vex_list_pipeline", list_ptr, params, 4);
+        LLVMValueRef out_kind = LLVMConstInt(i32, (unsigned long long)elem_kind_of(node->tc_type->element_type), false);
+        LLVMValueRef args[] = { list, out_kind, stage, ctx };
+        return LLVMBuildCall2(Builder, LLVMGlobalGetValueType(pipeline), pipeline, args, 4, "pipeline");
+    }
+
+    LLVMTypeRef result_type = native_type_of(node->tc_type);
+    LLVMValueRef init, combine;
+    if (sink->type == NodeListOp) {
+        LLVMValueRef function = lower_stage_function(sink->list_op.function);
+        init = function ? llvm_eval_ast(sink->list_op.init) : NULL;
+        if (!init) return NULL;
+        combine = word_callback(function);
+    } else {
+        init = LLVMConstNull(result_type);
+        combine = sum_callback(result_type);
+    }
+
+    LLVMTypeRef params[] = { list_ptr, i8_ptr, i8_ptr, i64, i8_ptr };
+    LLVMValueRef reduce = declare_runtime("vex_list_pipeline_reduce", i64, params, 5);
+    LLVMValueRef args[] = { list, stage, ctx, native_to_word(init), combine };
+    LLVMValueRef word = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(reduce), reduce, args, 5, "");
+    return word_to_native(word, result_type);
+}
+
+/* One arm of a match being lowered: its block and a phi for each name it binds, all made at its first leaf. */
+typedef struct MatchArm {
+    LLVMBasicBlockRef block;
+    const char **names;
+    LLVMValueRef *values;
+    int count;
+} MatchArm;
+
+typedef struct MatchLowering {
+    const MatchPlan *plan;
+    LLVMValueRef function;
+    MatchArm *arms;
+} MatchLowering;
+
+/* A field of a constructor the decision tree has already matched: the immediate's payload, or a word of the object. */
+static LLVMValueRef lower_variant_field(LLVMValueRef parent, const VariantType *type, const MatchOccurrence *field) {
+    LLVMTypeRef i8 = LLVMInt8TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    const VariantConstructor *constructor = &type->constructors[field->tag];
+    LLVMTypeRef type_of_field = native_type_of(field->type);
+
+    if (type->layout == VariantNullable) return parent;
+    if (type->layout == VariantFlagged) return word_to_native(LLVMBuildExtractValue(Builder, parent, 1, "payload"), type_of_field);
+    if (constructor->repr == ConstructorUnboxed) {
+        LLVMValueRef word = LLVMBuildPtrToInt(Builder, parent, i64, "");
+        LLVMValueRef payload = LLVMBuildAShr(Builder, word, LLVMConstInt(i64, VEX_VARIANT_PAYLOAD_SHIFT, false), "payload");
+        return word_to_native(payload, type_of_field);
+    }
+
+    /* A tagged pointer is off by the tag, which folds into the field's offset. */
+    uint64_t offset = sizeof(VexVariant) + sizeof(int64_t) * (uint64_t)field->field;
+    if (type->pointer_tagged) offset -= (uint64_t)constructor->tag << 1;
+    LLVMValueRef index = LLVMConstInt(i64, offset, false);
+    LLVMValueRef address = LLVMBuildGEP2(Builder, i8, parent, &index, 1, "");
+    address = LLVMBuildBitCast(Builder, address, LLVMPointerType(i64, 0), "");
+    return word_to_native(LLVMBuildLoad2(Builder, i64, address, "field"), type_of_field);
+}
+
+/* An occurrence's value on the current path, read out of its parent there the first time it is needed. */
+static LLVMValueRef lower_occurrence(MatchLowering *match, LLVMValueRef *values, int occurrence) {
+    if (values[occurrence]) return values[occurrence];
+
+    LLVMTypeRef list_ptr = LLVMPointerType(get_list_type(), 0);
+    const MatchOccurrence *field = &match->plan->occurrences[occurrence];
+    const TypeTC *parent_type = match->plan->occurrences[field->parent].type;
+    LLVMValueRef parent = lower_occurrence(match, values, field->parent);
+    LLVMValueRef value;
+    if (parent_type->kind == TypeVariant) {
+        value = lower_variant_field(parent, parent_type->variant, field);
+    } else if (field->field == 0) {
+        LLVMValueRef head = declare_runtime("vex_list_head", LLVMInt64TypeInContext(TheContext), &list_ptr, 1);
+        value = word_to_native(LLVMBuildCall2(Builder, LLVMGlobalGetValueType(head), head, &parent, 1, ""), native_type_of(field->type));
+    } else {
+        LLVMValueRef tail = declare_runtime("vex_list_tail", list_ptr, &list_ptr, 1);
+        value = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(tail), tail, &parent, 1, "tail");
+    }
+    if (is_heap_type(field->type)) gc_root(value);
+    return values[occurrence] = value;
+}
+
+/*
+ * A variant's tag without touching memory when the layout allows it: from
+ * the immediate's bits 1-7, from a tagged pointer's bits 1-2, or, when
+ * the type has both, through a mask picked by the low bit. Only a type
+ * with too many boxed constructors to tag its pointers loads the header.
+ */
+static LLVMValueRef lower_variant_tag(LLVMValueRef value, const VariantType *type) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    if (type->layout == VariantNullable) return LLVMBuildZExt(Builder, LLVMBuildIsNotNull(Builder, value, ""), i64, "tag");
+    if (type->layout == VariantFlagged) return LLVMBuildZExt(Builder, LLVMBuildExtractValue(Builder, value, 0, "flag"), i64, "tag");
+
+    bool has_immediates = type->boxed_count < type->constructor_count;
+    LLVMValueRef word = LLVMBuildPtrToInt(Builder, value, i64, "");
+    LLVMValueRef shifted = LLVMBuildLShr(Builder, word, LLVMConstInt(i64, 1, false), "");
+    LLVMValueRef immediate_mask = LLVMConstInt(i64, VEX_VARIANT_TAG_MASK, false);
+    if (type->boxed_count == 0) return LLVMBuildAnd(Builder, shifted, immediate_mask, "tag");
+
+    if (type->pointer_tagged) {
+        LLVMValueRef pointer_mask = LLVMConstInt(i64, VEX_VARIANT_POINTER_TAGS - 1, false);
+        if (!has_immediates) return LLVMBuildAnd(Builder, shifted, pointer_mask, "tag");
+        LLVMValueRef is_immediate = LLVMBuildTrunc(Builder, word, LLVMInt1TypeInContext(TheContext), "is.immediate");
+        return LLVMBuildAnd(Builder, shifted, LLVMBuildSelect(Builder, is_immediate, immediate_mask, pointer_mask, ""), "tag");
+    }
+
+    LLVMValueRef header = LLVMBuildBitCast(Builder, value, LLVMPointerType(i32, 0), "");
+    if (!has_immediates) return LLVMBuildZExt(Builder, LLVMBuildLoad2(Builder, i32, header, "header.tag"), i64, "tag");
+
+    LLVMValueRef function = LLVMGetBasicBlockParent(LLVMGetInsertBlock(Builder));
+    LLVMBasicBlockRef immediate_block = LLVMGetInsertBlock(Builder);
+    LLVMBasicBlockRef boxed_block = LLVMAppendBasicBlockInContext(TheContext, function, "variant.boxed");
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(TheContext, function, "variant.tag");
+    LLVMValueRef is_immediate = LLVMBuildTrunc(Builder, word, LLVMInt1TypeInContext(TheContext), "is.immediate");
+    LLVMValueRef immediate_tag = LLVMBuildAnd(Builder, shifted, immediate_mask, "");
+    LLVMBuildCondBr(Builder, is_immediate, done, boxed_block);
+
+    LLVMPositionBuilderAtEnd(Builder, boxed_block);
+    LLVMValueRef boxed_tag = LLVMBuildZExt(Builder, LLVMBuildLoad2(Builder, i32, header, "header.tag"), i64, "");
+    LLVMBuildBr(Builder, done);
+
+    LLVMPositionBuilderAtEnd(Builder, done);
+    LLVMValueRef tag = LLVMBuildPhi(Builder, i64, "tag");
+    LLVMValueRef incoming[] = { immediate_tag, boxed_tag };
+    LLVMBasicBlockRef blocks[] = { immediate_block, boxed_block };
+    LLVMAddIncoming(tag, incoming, blocks, 2);
+    return tag;
+}
+
+/* The tag a decision switches on (see match.h): a list's emptiness, a constructor's tag, or the bool, char or int itself. */
+static LLVMValueRef lower_match_tag(LLVMValueRef value, const TypeTC *type) {
+    if (type->kind == TypeVariant) return lower_variant_tag(value, type->variant);
+    if (type->kind != TypeList) return value;
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMValueRef length = LLVMBuildLoad2(Builder, i64, LLVMBuildStructGEP2(Builder, get_list_type(), value, 0, ""), "length");
+    return LLVMBuildICmp(Builder, LLVMIntNE, length, LLVMConstInt(i64, 0, false), "is.cons");
+}
+
+/*
+ * Sparse cases: a balanced tree of comparisons over cases [low, high),
+ * ending in an equality test against the one case left. Without a
+ * fallback the cases cover every tag, so that last test is left out.
+ */
+static void branch_to_case(LLVMValueRef function, LLVMValueRef tag, bool is_signed, const DecisionCase *cases,
+                           LLVMBasicBlockRef *blocks, int low, int high, LLVMBasicBlockRef fallback) {
+    LLVMTypeRef type = LLVMTypeOf(tag);
+    if (high - low == 1) {
+        if (!fallback) {
+            LLVMBuildBr(Builder, blocks[low]);
+            return;
+        }
+        LLVMValueRef equal = LLVMBuildICmp(Builder, LLVMIntEQ, tag, LLVMConstInt(type, (unsigned long long)cases[low].tag, false), "");
+        LLVMBuildCondBr(Builder, equal, blocks[low], fallback);
+        return;
+    }
+
+    int mid = low + (high - low) / 2;
+    LLVMValueRef below = LLVMBuildICmp(Builder, is_signed ? LLVMIntSLT : LLVMIntULT, tag,
+                                       LLVMConstInt(type, (unsigned long long)cases[mid].tag, false), "");
+    LLVMBasicBlockRef left = LLVMAppendBasicBlockInContext(TheContext, function, "match.below");
+    LLVMBasicBlockRef right = LLVMAppendBasicBlockInContext(TheContext, function, "match.above");
+    LLVMBuildCondBr(Builder, below, left, right);
+    LLVMPositionBuilderAtEnd(Builder, left);
+    branch_to_case(function, tag, is_signed, cases, blocks, low, mid, fallback);
+    LLVMPositionBuilderAtEnd(Builder, right);
+    branch_to_case(function, tag, is_signed, cases, blocks, mid, high, fallback);
+}
+
+/* Every leaf of an arm binds each of its names exactly once, so a name is a phi at the top of the arm's block. */
+static LLVMValueRef match_value(MatchLowering *match, MatchArm *arm, const MatchBinding *binding) {
+    int slot = 0;
+    while (strcmp(arm->names[slot], binding->name) != 0) slot++;
+    if (!arm->values[slot]) {
+        LLVMBasicBlockRef block = LLVMGetInsertBlock(Builder);
+        LLVMPositionBuilderAtEnd(Builder, arm->block);
+        arm->values[slot] = LLVMBuildPhi(Builder, native_type_of(match->plan->occurrences[binding->occurrence].type), binding->name);
+        LLVMPositionBuilderAtEnd(Builder, block);
+    }
+    return arm->values[slot];
+}
+
+static void lower_decision(MatchLowering *match, const Decision *decision, LLVMValueRef *values) {
+    if (decision->kind == DecisionFail) {
+        LLVMBuildUnreachable(Builder);
+        return;
+    }
+
+    if (decision->kind == DecisionLeaf) {
+        MatchArm *arm = &match->arms[decision->arm];
+        if (!arm->block) arm->block = LLVMAppendBasicBlockInContext(TheContext, match->function, "match.arm");
+        int count = decision->binding_count;
+        LLVMValueRef *bound = malloc(sizeof(LLVMValueRef) * (size_t)(count ? count : 1));
+        for (int i = 0; i < count; i++) bound[i] = lower_occurrence(match, values, decision->bindings[i].occurrence);
+        LLVMBasicBlockRef leaf = LLVMGetInsertBlock(Builder);
+        for (int i = 0; i < count; i++) LLVMAddIncoming(match_value(match, arm, &decision->bindings[i]), &bound[i], &leaf, 1);
+        free(bound);
+        LLVMBuildBr(Builder, arm->block);
+        return;
+    }
+
+    const TypeTC *type = match->plan->occurrences[decision->occurrence].type;
+    LLVMValueRef tag = lower_match_tag(lower_occurrence(match, values, decision->occurrence), type);
+    int count = decision->case_count;
+    LLVMBasicBlockRef *blocks = malloc(sizeof(LLVMBasicBlockRef) * (size_t)count);
+    for (int i = 0; i < count; i++) {
+        blocks[i] = LLVMAppendBasicBlockInContext(TheContext, match->function, "match.case");
+    }
+    LLVMBasicBlockRef fallback = decision->fallback ? LLVMAppendBasicBlockInContext(TheContext, match->function, "match.default") : NULL;
+
+    /* Dense tags go to an LLVM switch, which the backend turns into a jump table. */
+    if (decision->table) {
+        LLVMValueRef dispatch = LLVMBuildSwitch(Builder, tag, fallback ? fallback : blocks[count - 1], (unsigned int)count);
+        for (int i = 0; i < count; i++) {
+            LLVMAddCase(dispatch, LLVMConstInt(LLVMTypeOf(tag), (unsigned long long)decision->cases[i].tag, false), blocks[i]);
+        }
+    } else {
+        branch_to_case(match->function, tag, type->kind == TypeInt, decision->cases, blocks, 0, count, fallback);
+    }
+
+    int occurrence_count = match->plan->occurrence_count;
+    LLVMValueRef *path = malloc(sizeof(LLVMValueRef) * (size_t)occurrence_count);
+    for (int i = 0; i <= count; i++) {
+        const Decision *next = i < count ? decision->cases[i].next : decision->fallback;
+        if (!next) continue;
+        memcpy(path, values, sizeof(LLVMValueRef) * (size_t)occurrence_count);
+        LLVMPositionBuilderAtEnd(Builder, i < count ? blocks[i] : fallback);
+        lower_decision(match, next, path);
+    }
+    free(path);
+    free(blocks);
+}
+
+/* Drops the variables of one match arm again once its body is lowered. */
+static void unbind_match_arm(const MatchArm *arm) {
     VarBinding *current, *tmp;
     HASH_ITER(hh, variables, current, tmp) {
-        HASH_DEL(variables, current);
-        free(current);
+        for (int i = 0; i < arm->count; i++) {
+            if (current->value != arm->values[i]) continue;
+            HASH_DEL(variables, current);
+            free(current);
+            break;
+        }
     }
 }
 
-LLVMValueRef create_printf_function_type(LLVMTypeRef *out_type) {
-    if (printf_func != NULL) {
-        if (out_type) {
-            LLVMTypeRef printf_arg_types[] = {
-                LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0)
-            };
-            *out_type = LLVMFunctionType(
-                LLVMInt32TypeInContext(TheContext), printf_arg_types, 1, true
-            );
+/*
+ * A match lowers its decision tree (see match.c) into branches and
+ * switches, then each arm's body once, in a block every leaf for that arm
+ * jumps to; the values a leaf binds reach the body through phis at the
+ * top of that block. The arms' results meet in a phi.
+ */
+static LLVMValueRef lower_match(ASTNode *node) {
+    const MatchPlan *plan = node->match.plan;
+    int arm_count = node->match.arm_count;
+    LLVMValueRef scrutinee = llvm_eval_ast(node->match.scrutinee);
+    if (!scrutinee) return NULL;
+
+    MatchLowering match = { plan, LLVMGetBasicBlockParent(LLVMGetInsertBlock(Builder)), calloc((size_t)arm_count, sizeof(MatchArm)) };
+    for (int i = 0; i < arm_count; i++) {
+        MatchArm *arm = &match.arms[i];
+        int count = pattern_binding_count(node->match.patterns[i]);
+        arm->names = malloc(sizeof(const char *) * (size_t)(count ? count : 1));
+        arm->values = calloc((size_t)(count ? count : 1), sizeof(LLVMValueRef));
+        pattern_bindings(node->match.patterns[i], arm->names, &arm->count);
+    }
+
+    LLVMValueRef *values = calloc((size_t)plan->occurrence_count, sizeof(LLVMValueRef));
+    values[0] = scrutinee;
+    lower_decision(&match, plan->tree, values);
+    free(values);
+
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(TheContext, match.function, "match.end");
+    LLVMValueRef *results = malloc(sizeof(LLVMValueRef) * (size_t)arm_count);
+    LLVMBasicBlockRef *result_blocks = malloc(sizeof(LLVMBasicBlockRef) * (size_t)arm_count);
+    unsigned int result_count = 0;
+    bool ok = true;
+    for (int i = 0; ok && i < arm_count; i++) {
+        MatchArm *arm = &match.arms[i];
+        if (!arm->block) continue;
+        LLVMPositionBuilderAtEnd(Builder, arm->block);
+        for (int j = 0; j < arm->count; j++) {
+            if (arm->values[j]) insert_variable(arm->names[j], arm->values[j]);
+        }
+        LLVMValueRef value = llvm_eval_ast(node->match.arms[i]);
+        unbind_match_arm(arm);
+        if (!value) {
+            ok = false;
+            break;
         }
-        return printf_func;
+        results[result_count] = value;
+        result_blocks[result_count++] = LLVMGetInsertBlock(Builder);
+        LLVMBuildBr(Builder, done);
     }
 
-    LLVMTypeRef printf_arg_types[] = {
-        LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0)
+    LLVMValueRef result = NULL;
+    if (ok) {
+        LLVMPositionBuilderAtEnd(Builder, done);
+        result = LLVMBuildPhi(Builder, LLVMTypeOf(results[0]), "match");
+        LLVMAddIncoming(result, results, result_blocks, result_count);
+    }
+
+    for (int i = 0; i < arm_count; i++) {
+        free(match.arms[i].names);
+        free(match.arms[i].values);
+    }
+    free(match.arms);
+    free(results);
+    free(result_blocks);
+    return result;
+}
+
+/*
+ * None of a nullable option is null and its Some the payload itself; a
+ * flagged value is built in registers. Only a payload that is itself
+ * flagged has to be boxed, and that box is rooted here.
+ */
+static LLVMValueRef lower_outcome(ASTNode *node) {
+    const VariantConstructor *constructor = node->construct.constructor;
+    LLVMTypeRef type = get_llvm_type(constructor->type->name);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMValueRef payload = NULL;
+    if (constructor->field_count && !(payload = llvm_eval_ast(node->construct.args[0]))) return NULL;
+    if (constructor->type->layout == VariantNullable) return payload ? payload : LLVMConstNull(type);
+
+    LLVMValueRef flag = LLVMConstInt(LLVMInt1TypeInContext(TheContext), constructor->tag, false);
+    if (!payload) {
+        LLVMValueRef fields[] = { flag, LLVMConstInt(i64, 0, false) };
+        return LLVMConstNamedStruct(type, fields, 2);
+    }
+    LLVMValueRef word = native_to_word(payload);
+    if (LLVMGetTypeKind(LLVMTypeOf(payload)) == LLVMStructTypeKind) {
+        gc_root(LLVMBuildIntToPtr(Builder, word, LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0), ""));
+    }
+    LLVMValueRef value = LLVMBuildInsertValue(Builder, LLVMGetUndef(type), flag, 0, "");
+    return LLVMBuildInsertValue(Builder, value, word, 1, "outcome");
+}
+
+/*
+ * Builds a constructor in the layout the type checker picked for it (see
+ * variant.h). A boxed one is rooted as its untagged object, since the
+ * tagged word is not a pointer the collector can find a header from.
+ */
+static LLVMValueRef lower_construct(ASTNode *node) {
+    const VariantConstructor *constructor = node->construct.constructor;
+    if (constructor->type->layout != VariantTagged) return lower_outcome(node);
+    LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(TheContext);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(TheContext);
+    LLVMValueRef immediate = LLVMConstInt(i64, (uint64_t)vex_variant_immediate(constructor->tag, 0), false);
+
+    if (constructor->repr == ConstructorImmediate) return LLVMConstIntToPtr(immediate, i8_ptr);
+
+    int count = constructor->field_count;
+    LLVMValueRef *fields = malloc(sizeof(LLVMValueRef) * (size_t)count);
+    if (!lower_operands(node->construct.args, count, fields)) {
+        free(fields);
+        return NULL;
+    }
+
+    LLVMValueRef result;
+    if (constructor->repr == ConstructorUnboxed) {
+        LLVMValueRef payload = LLVMBuildShl(Builder, native_to_word(fields[0]), LLVMConstInt(i64, VEX_VARIANT_PAYLOAD_SHIFT, false), "");
+        result = LLVMBuildIntToPtr(Builder, LLVMBuildOr(Builder, payload, immediate, ""), i8_ptr, "variant");
+    } else {
+        LLVMTypeRef params[] = { i32, i32, i32 };
+        LLVMValueRef variant_new = declare_runtime("vex_variant_new", i8_ptr, params, 3);
+        LLVMValueRef args[] = {
+            LLVMConstInt(i32, constructor->tag, false),
+            LLVMConstInt(i32, (unsigned long long)count, false),
+            LLVMConstInt(i32, constructor->references, false),
+        };
+        LLVMValueRef object = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(variant_new), variant_new, args, 3, "variant");
+        gc_root(object);
+        for (int i = 0; i < count; i++) {
+            LLVMValueRef offset = LLVMConstInt(i64, sizeof(VexVariant) + sizeof(int64_t) * (uint64_t)i, false);
+            LLVMValueRef slot = LLVMBuildBitCast(Builder, LLVMBuildGEP2(Builder, LLVMInt8TypeInContext(TheContext), object, &offset, 1, ""),
+                                                 LLVMPointerType(i64, 0), "");
+            LLVMBuildStore(Builder, native_to_word(fields[i]), slot);
+        }
+        result = object;
+        if (constructor->type->pointer_tagged && constructor->tag) {
+            LLVMValueRef tag = LLVMConstInt(i64, (uint64_t)constructor->tag << 1, false);
+            result = LLVMBuildGEP2(Builder, LLVMInt8TypeInContext(TheContext), object, &tag, 1, "tagged");
+        }
+    }
+    free(fields);
+    return result;
+}
+
+/*
+ * An if whose branches are both small and safe to compute either way (see
+ * is_speculatable) computes them both and picks one with a select, which
+ * leaves no branch to mispredict. Otherwise each branch gets a block and
+ * their results meet in a phi.
+ */
+static LLVMValueRef lower_if(ASTNode *node) {
+    LLVMValueRef condition = llvm_eval_ast(node->if_expr.condition);
+    if (!condition) return NULL;
+
+    ASTNode *branches[] = { node->if_expr.then_branch, node->if_expr.else_branch };
+    LLVMValueRef values[2];
+    if (worth_selecting(branches, 2)) {
+        if (!(values[0] = llvm_eval_ast(branches[0])) || !(values[1] = llvm_eval_ast(branches[1]))) return NULL;
+        return LLVMBuildSelect(Builder, condition, values[0], values[1], "if");
+    }
+
+    LLVMValueRef function = LLVMGetBasicBlockParent(LLVMGetInsertBlock(Builder));
+    LLVMBasicBlockRef blocks[] = {
+        LLVMAppendBasicBlockInContext(TheContext, function, "if.then"),
+        LLVMAppendBasicBlockInContext(TheContext, function, "if.else"),
     };
-    LLVMTypeRef printf_type = LLVMFunctionType(
-        LLVMInt32TypeInContext(TheContext), printf_arg_types, 1, true
-    );
-    printf_func = LLVMAddFunction(TheModule, "printf", printf_type);
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(TheContext, function, "if.end");
+    LLVMBuildCondBr(Builder, condition, blocks[0], blocks[1]);
+    for (int i = 0; i < 2; i++) {
+        LLVMPositionBuilderAtEnd(Builder, blocks[i]);
+        if (!(values[i] = llvm_eval_ast(branches[i]))) return NULL;
+        blocks[i] = LLVMGetInsertBlock(Builder);
+        LLVMBuildBr(Builder, done);
+    }
 
-    if (out_type) *out_type = printf_type;
-    return printf_func;
+    LLVMPositionBuilderAtEnd(Builder, done);
+    LLVMValueRef result = LLVMBuildPhi(Builder, LLVMTypeOf(values[0]), "if");
+    LLVMAddIncoming(result, values, blocks, 2);
+    return result;
 }
 
+/* && and || on bools skip their right operand once the left one decides, unless it is cheap enough to just compute. */
+static LLVMValueRef lower_logical(ASTNode *node) {
+    bool is_and = strcmp(node->binary_expr.op, "&&") == 0;
+    LLVMValueRef left = llvm_eval_ast(node->binary_expr.left);
+    if (!left) return NULL;
+
+    ASTNode *right_node = node->binary_expr.right;
+    if (worth_selecting(&right_node, 1)) {
+        LLVMValueRef right = llvm_eval_ast(right_node);
+        if (!right) return NULL;
+        return is_and ? LLVMBuildAnd(Builder, left, right, "andtmp") : LLVMBuildOr(Builder, left, right, "ortmp");
+    }
+
+    LLVMBasicBlockRef from = LLVMGetInsertBlock(Builder);
+    LLVMValueRef function = LLVMGetBasicBlockParent(from);
+    LLVMBasicBlockRef rest = LLVMAppendBasicBlockInContext(TheContext, function, is_and ? "and.rhs" : "or.rhs");
+    LLVMBasicBlockRef done = LLVMAppendBasicBlockInContext(TheContext, function, is_and ? "and.end" : "or.end");
+    if (is_and) LLVMBuildCondBr(Builder, left, rest, done);
+    else LLVMBuildCondBr(Builder, left, done, rest);
 
-void init_llvm_codegen(void) {
+    LLVMPositionBuilderAtEnd(Builder, rest);
+    LLVMValueRef right = llvm_eval_ast(right_node);
+    if (!right) return NULL;
+    rest = LLVMGetInsertBlock(Builder);
+    LLVMBuildBr(Builder, done);
+
+    LLVMPositionBuilderAtEnd(Builder, done);
+    LLVMValueRef values[] = { LLVMConstInt(LLVMInt1TypeInContext(TheContext), !is_and, false), right };
+    LLVMBasicBlockRef blocks[] = { from, rest };
+    LLVMValueRef result = LLVMBuildPhi(Builder, LLVMTypeOf(right), is_and ? "and" : "or");
+    LLVMAddIncoming(result, values, blocks, 2);
+    return result;
+}
+
+void init_llvm_codegen(const char *module_name) {
     LLVMInitializeNativeTarget();
     LLVMInitializeNativeAsmPrinter();
     LLVMInitializeNativeAsmParser();
 
     TheContext = LLVMContextCreate();
-    TheModule = LLVMModuleCreateWithNameInContext("vex_module", TheContext);
+    LLVMContextSetDiscardValueNames(TheContext, !llvm_keep_names);
+    TheModule = LLVMModuleCreateWithNameInContext(module_name, TheContext);
     Builder = LLVMCreateBuilderInContext(TheContext);
 }
 
-LLVMValueRef llvm_eval_ast(ASTNode *node) {
+/* Lowers node's body into function, which takes node's parameters. */
+static bool lower_function_body(ASTNode *node, LLVMValueRef function) {
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(TheContext, function, "entry");
+    LLVMPositionBuilderAtEnd(Builder, entry);
+    GcFrame frame;
+    gc_frame_begin(&frame, function);
+
+    for (int i = 0; i < node->function.param_count; i++) {
+        const char *name = node->function.param_names[i];
+        LLVMValueRef param = LLVMGetParam(function, (unsigned int)i);
+        LLVMSetValueName2(param, name, strlen(name));
+        insert_variable(name, param);
+    }
+
+    LLVMValueRef body = llvm_eval_ast(node->function.expr);
+    free_variables();
+    if (!body) {
+        gc_frame = frame.parent;
+        fprintf(stderr, "LLVM error: failed to lower body of '%s'\n", node->function.name);
+        return false;
+    }
+    gc_frame_end(&frame, body);
+    return true;
+}
+
+/*
+ * What a call to callee runs in code the runtime declined to fork: for a
+ * function that forks itself, its sequential clone "name.seq", built once
+ * per module with no forks in it; for any other function, callee.
+ */
+static LLVMValueRef sequential_callee(ASTNode *node, LLVMValueRef callee) {
+    ASTNode *name = node->call.callee;
+    if (name->type != NodeIdentifier || get_variable(name->strval)) return callee;
+    FunctionDef *def;
+    HASH_FIND_STR(function_defs, name->strval, def);
+    if (!def || !def->node->function.expr) return callee;
+    if (def->forks < 0) {
+        bool saved = par_sequential;
+        par_sequential = false;
+        def->forks = has_fork(def->node->function.expr);
+        par_sequential = saved;
+    }
+    if (!def->forks) return callee;
+
+    char clone_name[256];
+    snprintf(clone_name, sizeof(clone_name), "%s.seq", def->name);
+    LLVMValueRef clone = LLVMGetNamedFunction(TheModule, clone_name);
+    if (clone) return clone;
+
+    clone = LLVMAddFunction(TheModule, clone_name, LLVMGlobalGetValueType(callee));
+    LLVMSetLinkage(clone, LLVMInternalLinkage);
+    LLVMBasicBlockRef saved_block = LLVMGetInsertBlock(Builder);
+    VarBinding *saved_variables = variables;
+    variables = NULL;
+    bool ok = lower_function_body(def->node, clone);
+    variables = saved_variables;
+    LLVMPositionBuilderAtEnd(Builder, saved_block);
+    if (!ok) {
+        LLVMDeleteFunction(clone);
+        return callee;
+    }
+    return clone;
+}
+
+static LLVMValueRef lower_node(ASTNode *node) {
     switch (node->type) {
         case NodeIntLit: {
-            return LLVMConstInt(LLVMInt64TypeInContext(TheContext), (long long unsigned int)node->intval, 0);
+            return LLVMConstInt(LLVMInt32TypeInContext(TheContext), (long long unsigned int)node->intval, 0);
         }
 
         case NodeFloatLit: {
@@ -84,7 +2452,7 @@ LLVMValueRef llvm_eval_ast(ASTNode *node) {
         }
 
         case NodeStringLit: {
-            return LLVMBuildGlobalStringPtr(Builder, node->strval, "strtmp");
+            return string_constant(node->string_lit.value);
         }
 
         case NodeBoolLit: {
@@ -92,27 +2460,31 @@ LLVMValueRef llvm_eval_ast(ASTNode *node) {
         }
 
         case NodeBinaryExpr: {
-            LLVMValueRef left = llvm_eval_ast(node->binary_expr.left);
-            LLVMValueRef right = llvm_eval_ast(node->binary_expr.right);
+            ASTNode *operands[] = { node->binary_expr.left, node->binary_expr.right };
+            LLVMValueRef values[2];
             const char *op = node->binary_expr.op;
 
-            if (left && right) {
-                if (strcmp(op, "+") == 0)
-                    return LLVMBuildAdd(Builder, left, right, "addtmp");
-                else if (strcmp(op, "-") == 0)
-                    return LLVMBuildSub(Builder, left, right, "subtmp");
-                else if (strcmp(op, "*") == 0)
-                    return LLVMBuildMul(Builder, left, right, "multmp");
-                else if (strcmp(op, "/") == 0)
-                    return LLVMBuildSDiv(Builder, left, right, "divtmp");
+            if (node->tc_type && node->tc_type->kind == TypeBool && (strcmp(op, "&&") == 0 || strcmp(op, "||") == 0))
+                return lower_logical(node);
+            if (lower_operands(operands, 2, values)) {
+                LLVMValueRef left = values[0], right = values[1];
+                if (node->tc_type && node->tc_type->kind == TypeList)
+                    return lower_elementwise(node, left, right);
+                if (strcmp(op, "^") == 0)
+                    return lower_string_concat(left, right);
+                if (strcmp(op, "+") == 0 || strcmp(op, "-") == 0 || strcmp(op, "*") == 0 || strcmp(op, "/") == 0)
+                    return build_elementwise_op(op, left, right, NULL);
                 else if (strcmp(op, "+.") == 0)
-                    return LLVMBuildFAdd(Builder, left, right, "faddtmp");
+                    return fast_math(LLVMBuildFAdd(Builder, left, right, "faddtmp"));
                 else if (strcmp(op, "-.") == 0)
-                    return LLVMBuildFSub(Builder, left, right, "fsubtmp");
+                    return fast_math(LLVMBuildFSub(Builder, left, right, "fsubtmp"));
                 else if (strcmp(op, "*.") == 0)
-                    return LLVMBuildFMul(Builder, left, right, "fmultmp");
+                    return fast_math(LLVMBuildFMul(Builder, left, right, "fmultmp"));
                 else if (strcmp(op, "/.") == 0)
-                    return LLVMBuildFDiv(Builder, left, right, "fdivtmp");
+                    return fast_math(LLVMBuildFDiv(Builder, left, right, "fdivtmp"));
+
+                LLVMValueRef compare = build_compare(op, left, right);
+                if (compare) return compare;
             }
 
             fprintf(stderr, "LLVM error: unsupported binary operator '%s'\n", op);
@@ -131,29 +2503,31 @@ LLVMValueRef llvm_eval_ast(ASTNode *node) {
             LLVMValueRef val = llvm_eval_ast(node->print.value);
         
             LLVMTypeRef printf_type = NULL;
-            printf_func = create_printf_function_type(&printf_type);
+            LLVMValueRef printf_func = create_printf_function_type(&printf_type);
         
             LLVMValueRef format_str = NULL;
             LLVMValueRef args[2];
         
             if (strcmp(node->print.type, "int") == 0) {
-                format_str = LLVMBuildGlobalStringPtr(Builder, "%ld\n", "fmt");
+                format_str = build_print_format("%d\n", node->print.type);
                 args[0] = format_str;
                 args[1] = val;
             } else if (strcmp(node->print.type, "float") == 0) {
-                format_str = LLVMBuildGlobalStringPtr(Builder, "%lf\n", "fmt");
+                format_str = build_print_format("%lf\n", node->print.type);
                 args[0] = format_str;
                 args[1] = val;
             } else if (strcmp(node->print.type, "char") == 0) {
-                format_str = LLVMBuildGlobalStringPtr(Builder, "%c\n", "fmt");
+                format_str = build_print_format("%c\n", node->print.type);
                 args[0] = format_str;
                 args[1] = val;
             } else if (strcmp(node->print.type, "string") == 0) {
-                format_str = LLVMBuildGlobalStringPtr(Builder, "%s\n", "fmt");
+                LLVMTypeRef i8_ptr = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
+                LLVMValueRef cstr = declare_runtime("vex_string_cstr", i8_ptr, &i8_ptr, 1);
+                format_str = build_print_format("%s\n", node->print.type);
                 args[0] = format_str;
-                args[1] = val;
+                args[1] = LLVMBuildCall2(Builder, LLVMGlobalGetValueType(cstr), cstr, &val, 1, "cstr");
             } else if (strcmp(node->print.type, "bool") == 0) {
-                format_str = LLVMBuildGlobalStringPtr(Builder, "%d\n", "fmt");
+                format_str = build_print_format("%d\n", node->print.type);
                 args[0] = format_str;
                 args[1] = LLVMBuildZExt(Builder, val, LLVMInt32TypeInContext(TheContext), "bool2i32");
             } else {
@@ -165,117 +2539,76 @@ LLVMValueRef llvm_eval_ast(ASTNode *node) {
             return LLVMConstInt(LLVMInt64TypeInContext(TheContext), 0, false);
         }
         
+        /* Bindings never change, so a name is bound straight to the SSA value of its initializer. */
         case NodeVarDecl : {
             LLVMValueRef init = llvm_eval_ast(node->var_decl.expr);
-            LLVMTypeRef type;
-
-            if (strcmp(node->var_decl.type, "int") == 0) {
-                type = LLVMInt64TypeInContext(TheContext);
-            } else if (strcmp(node->var_decl.type, "float") == 0) {
-                type = LLVMDoubleTypeInContext(TheContext);
-            } else if (strcmp(node->var_decl.type, "char") == 0) {
-                type = LLVMInt8TypeInContext(TheContext);
-            } else if (strcmp(node->var_decl.type, "string") == 0) {
-                type = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
-            } else if (strcmp(node->var_decl.type, "bool") == 0) {
-                type = LLVMInt1TypeInContext(TheContext);
-            } else {
-                fprintf(stderr, "LLVM error: unknown variable type '%s'\n", node->var_decl.type);
-                break;
-            }
-
-            LLVMValueRef alloc = LLVMBuildAlloca(Builder, type, node->var_decl.value);
-            LLVMBuildStore(Builder, init, alloc);
-            insert_variable(node->var_decl.value, alloc);
-            return alloc;
+            if (!init) return NULL;
+            insert_variable(node->var_decl.value, init);
+            return init;
         }
 
         case NodeIdentifier: {
-            LLVMValueRef alloc = get_variable(node->strval);
-            if (!alloc) {
+            LLVMValueRef value = get_variable(node->strval);
+            if (value) return value;
+            value = get_global(node->strval);
+            if (!value) value = LLVMGetNamedFunction(TheModule, node->strval);
+            if (!value) {
                 fprintf(stderr, "LLVM error: unknown identifier '%s'\n", node->strval);
                 break;
             }
-            LLVMTypeRef elem_type = LLVMGetAllocatedType(alloc);
-            return LLVMBuildLoad2(Builder, elem_type, alloc, "loadtmp");
+            if (LLVMIsAGlobalVariable(value)) return LLVMBuildLoad2(Builder, LLVMGlobalGetValueType(value), value, node->strval);
+            return value;
         }
 
         case NodeFunction: {
-            LLVMTypeRef *param_types = malloc(sizeof(LLVMTypeRef) * (size_t)node->function.param_count);
-            for (int i = 0; i < node->function.param_count; i++) {
-                const char *type_str = node->function.param_types[i];
-                if (strcmp(type_str, "int") == 0) {
-                    param_types[i] = LLVMInt64TypeInContext(TheContext);
-                } else if (strcmp(type_str, "float") == 0) {
-                    param_types[i] = LLVMDoubleTypeInContext(TheContext);
-                } else if (strcmp(type_str, "char") == 0) {
-                    param_types[i] = LLVMInt8TypeInContext(TheContext);
-                } else if (strcmp(type_str, "string") == 0) {
-                    param_types[i] = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
-                } else if (strcmp(type_str, "bool") == 0) {
-                    param_types[i] = LLVMInt1TypeInContext(TheContext);
-                } else {
-                    fprintf(stderr, "LLVM error: unsupported parameter type '%s'\n", type_str);
-                    return NULL;
-                }
-            }
+            LLVMValueRef function = declare_function(node);
+            if (!function || !node->function.expr) return function;
+            return lower_function_body(node, function) ? function : NULL;
+        }
 
-            LLVMTypeRef ret_type;
-            if (strcmp(node->function.return_type, "int") == 0) {
-                ret_type = LLVMInt64TypeInContext(TheContext);
-            } else if (strcmp(node->function.return_type, "float") == 0) {
-                ret_type = LLVMDoubleTypeInContext(TheContext);
-            } else if (strcmp(node->function.return_type, "char") == 0) {
-                ret_type = LLVMInt8TypeInContext(TheContext);
-            } else if (strcmp(node->function.return_type, "string") == 0) {
-                ret_type = LLVMPointerType(LLVMInt8TypeInContext(TheContext), 0);
-            } else if (strcmp(node->function.return_type, "bool") == 0) {
-                ret_type = LLVMInt1TypeInContext(TheContext);
-            } else {
-                fprintf(stderr, "LLVM error: unsupported return type '%s'\n", node->function.return_type);
-                return NULL;
-            }
+        case NodeList:
+            return lower_list_literal(node);
 
-            LLVMTypeRef func_type = LLVMFunctionType(ret_type, param_types, (unsigned int)node->function.param_count, 0);
-            LLVMValueRef function = LLVMAddFunction(TheModule, node->function.name, func_type);
+        case NodeListOp:
+            return lower_list_op(node);
 
-            LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(TheContext, function, "entry");
-            LLVMPositionBuilderAtEnd(Builder, entry);
+        case NodeListPipeline:
+            return lower_list_pipeline(node);
 
-            for (int i = 0; i < node->function.param_count; i++) {
-                LLVMValueRef param = LLVMGetParam(function, (unsigned int)i);
-                LLVMValueRef alloca = LLVMBuildAlloca(Builder, param_types[i], node->function.param_names[i]);
-                LLVMBuildStore(Builder, param, alloca);
-                insert_variable(node->function.param_names[i], alloca);
-            }
+        case NodeMatch:
+            return lower_match(node);
 
-            LLVMValueRef body = llvm_eval_ast(node->function.expr);
-            LLVMBuildRet(Builder, body);
-            free_variables();
+        case NodeIf:
+            return lower_if(node);
 
-            return function;
-        }
+        case NodeConstruct:
+            return lower_construct(node);
+
+        case NodeTypeDecl:
+            return LLVMConstInt(LLVMInt64TypeInContext(TheContext), 0, false);
 
         case NodeCall: {
+            if (is_list_builtin_call(node)) return lower_list_builtin(node);
+
             LLVMValueRef callee = llvm_eval_ast(node->call.callee);
             if (!callee) {
                 fprintf(stderr, "LLVM error: failed to evaluate function callee\n");
                 return NULL;
             }
+            if (par_sequential) callee = sequential_callee(node, callee);
 
-            LLVMTypeRef func_type = LLVMGetElementType(LLVMTypeOf(callee));
+            LLVMTypeRef func_type = LLVMGlobalGetValueType(callee);
             unsigned param_count = (unsigned int)node->call.arg_count;
-            LLVMValueRef *args = malloc(sizeof(LLVMValueRef) * param_count);
-            for (unsigned int i = 0; i < param_count; i++) {
-                args[i] = llvm_eval_ast(node->call.args[i]);
-                if (!args[i]) {
-                    fprintf(stderr, "LLVM error: failed to evaluate argument %d\n", i);
-                    free(args);
-                    return NULL;
-                }
+            LLVMValueRef *args = malloc(sizeof(LLVMValueRef) * (param_count ? param_count : 1));
+            if (!lower_operands(node->call.args, node->call.arg_count, args)) {
+                fprintf(stderr, "LLVM error: failed to evaluate call arguments\n");
+                free(args);
+                return NULL;
             }
 
-            return LLVMBuildCall2(Builder, func_type, callee, args, param_count, "calltmp");
+            LLVMValueRef call = LLVMBuildCall2(Builder, func_type, callee, args, param_count, "calltmp");
+            free(args);
+            return call;
         }
 
         default:
@@ -286,18 +2619,42 @@ LLVMValueRef llvm_eval_ast(ASTNode *node) {
     return NULL;
 }
 
+/*
+ * Lists fresh from a call stay in the shadow frame; names are already held
+ * wherever they were bound, and a constructor roots its own object.
+ */
+LLVMValueRef llvm_eval_ast(ASTNode *node) {
+    LLVMValueRef value = lower_node(node);
+    if (value && node->type != NodeIdentifier && node->type != NodeConstruct && is_heap_type(node->tc_type) &&
+        (LLVMIsACallInst(value) || LLVMIsAIntToPtrInst(value))) {
+        gc_root(value);
+    }
+    return value;
+}
+
 void compile_root(void) {
     if (!root) return;
+    if (root->type == NodeBlock) {
+        for (int i = 0; i < root->block.count; i++) {
+            if (root->block.statements[i]->type == NodeFunction) {
+                declare_function(root->block.statements[i]);
+            }
+        }
+    }
     llvm_eval_ast(root);
 }
 
-void write_llvm_ir_to_file(const char *filename) {
-    if (LLVMPrintModuleToFile(TheModule, filename, NULL) != 0) {
-        fprintf(stderr, "Error writing IR to file %s\n", filename);
+bool write_llvm_ir_to_file(const char *filename) {
+    char *message = NULL;
+    if (LLVMPrintModuleToFile(TheModule, filename, &message) != 0) {
+        fprintf(stderr, "vex: error: could not write '%s': %s\n", filename, message);
+        LLVMDisposeMessage(message);
+        return false;
     }
+    return true;
 }
 
-void print_llvm_ir() {
+void print_llvm_ir(void) {
     char *ir = LLVMPrintModuleToString(TheModule);
     printf("%s\n", ir);
     LLVMDisposeMessage(ir);
@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+#include "common.h"
+#include "target.h"
+
+#ifndef VEX_RUNTIME_BUILD_DIR
+#define VEX_RUNTIME_BUILD_DIR "."
+#endif
+#ifndef VEX_RUNTIME_INSTALL_DIR
+#define VEX_RUNTIME_INSTALL_DIR "/usr/local/lib"
+#endif
+
+static int opt_level = -1;
+static bool opt_size = false, opt_fast_math = false;
+static const char *output_cpu = NULL;
+static LLVMTargetMachineRef host_machines[4] = { NULL }, output_machines[4] = { NULL };
+
+void target_configure(int level, bool size, bool fast_math_enabled, const char *cpu) {
+    opt_level = level;
+    opt_size = size;
+    opt_fast_math = fast_math_enabled;
+    output_cpu = cpu;
+}
+
+static LLVMCodeGenOptLevel codegen_level(int level) {
+    switch (level) {
+        case 0: return LLVMCodeGenLevelNone;
+        case 1: return LLVMCodeGenLevelLess;
+        case 3: return LLVMCodeGenLevelAggressive;
+        default: return LLVMCodeGenLevelDefault;
+    }
+}
+
+/* The level a caller whose own default is default_level builds at. */
+static int effective_level(int default_level) {
+    return opt_level < 0 ? default_level : opt_level;
+}
+
+/* A machine for the default triple, or NULL when LLVM has no target for it. */
+static LLVMTargetMachineRef create_machine(const char *cpu, const char *features, int level) {
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    char *triple = LLVMGetDefaultTargetTriple();
+    char *message = NULL;
+    LLVMTargetRef target;
+    if (LLVMGetTargetFromTriple(triple, &target, &message)) {
+        fprintf(stderr, "vex: error: no target for '%s': %s\n", triple, message);
+        LLVMDisposeMessage(message);
+        LLVMDisposeMessage(triple);
+        return NULL;
+    }
+
+    LLVMTargetMachineRef machine = LLVMCreateTargetMachine(target, triple, cpu, features, codegen_level(level), LLVMRelocPIC, LLVMCodeModelDefault);
+    LLVMDisposeMessage(triple);
+    return machine;
+}
+
+/*
+ * The machine vex runs on, with its CPU's features so the vectorizers know
+ * what they can use, generating code at level. There is one per level, as
+ * the JIT builds at -O2 without an option while files default to -O0.
+ * Only code run in this process, or cached for it, is built for it.
+ */
+LLVMTargetMachineRef host_target_machine(int level) {
+    if (host_machines[level]) return host_machines[level];
+
+    char *cpu = LLVMGetHostCPUName();
+    char *features = LLVMGetHostCPUFeatures();
+    host_machines[level] = create_machine(cpu, features, level);
+    LLVMDisposeMessage(features);
+    LLVMDisposeMessage(cpu);
+    return host_machines[level];
+}
+
+/*
+ * The machine executables, objects and assembly are written for: the
+ * triple's generic CPU, so they run on any machine vex's own triple
+ * names, unless -mcpu or -march picked one ("native" being the host).
+ */
+static LLVMTargetMachineRef output_target_machine(int level) {
+    if (output_cpu && strcmp(output_cpu, "native") == 0) return host_target_machine(level);
+    if (output_machines[level]) return output_machines[level];
+    output_machines[level] = create_machine(output_cpu ? output_cpu : "generic", "", level);
+    return output_machines[level];
+}
+
+/* Function attributes the code generator reads; LLVM before 18 has no C API for the instruction flags. */
+static void add_fast_math_attributes(LLVMModuleRef module) {
+    static const char *attributes[] = {
+        "unsafe-fp-math", "no-nans-fp-math", "no-infs-fp-math", "no-signed-zeros-fp-math", "approx-func-fp-math",
+    };
+    LLVMContextRef context = LLVMGetModuleContext(module);
+    for (LLVMValueRef function = LLVMGetFirstFunction(module); function; function = LLVMGetNextFunction(function)) {
+        if (LLVMIsDeclaration(function)) continue;
+        for (size_t i = 0; i < sizeof(attributes) / sizeof(attributes[0]); i++) {
+            LLVMAttributeRef attribute = LLVMCreateStringAttribute(context, attributes[i], (unsigned int)strlen(attributes[i]), "true", 4);
+            LLVMAddAttributeAtIndex(function, (LLVMAttributeIndex)LLVMAttributeFunctionIndex, attribute);
+        }
+    }
+}
+
+/* The module is retargeted to machine first so the passes see its data layout and cost model. */
+static bool run_pipeline(LLVMModuleRef module, LLVMTargetMachineRef machine, int level) {
+    if (!machine) return false;
+
+    char *triple = LLVMGetTargetMachineTriple(machine);
+    LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(machine);
+    LLVMSetTarget(module, triple);
+    LLVMSetModuleDataLayout(module, layout);
+    LLVMDisposeTargetData(layout);
+    LLVMDisposeMessage(triple);
+
+    char pipeline[16];
+    if (opt_size) snprintf(pipeline, sizeof(pipeline), "default<Os>");
+    else snprintf(pipeline, sizeof(pipeline), "default<O%d>", level);
+    if (opt_fast_math) add_fast_math_attributes(module);
+
+    LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+    LLVMPassBuilderOptionsSetLoopVectorization(options, level >= 2);
+    LLVMPassBuilderOptionsSetSLPVectorization(options, level >= 2);
+    LLVMPassBuilderOptionsSetLoopUnrolling(options, level >= 2 && !opt_size);
+    LLVMErrorRef err = LLVMRunPasses(module, pipeline, machine, options);
+    LLVMDisposePassBuilderOptions(options);
+    if (err) {
+        char *message = LLVMGetErrorMessage(err);
+        fprintf(stderr, "vex: error: optimization failed: %s\n", message);
+        LLVMDisposeErrorMessage(message);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Runs the standard pipeline for the configured level over module, or for
+ * default_level when no -O option was given, tuned for the host.
+ */
+bool optimize_module(LLVMModuleRef module, int default_level) {
+    int level = effective_level(default_level);
+    return run_pipeline(module, host_target_machine(level), level);
+}
+
+/* The same for a module that is written out, which is tuned for the machine it is written for. */
+bool optimize_output_module(LLVMModuleRef module) {
+    int level = effective_level(0);
+    return run_pipeline(module, output_target_machine(level), level);
+}
+
+/* Marks a float operator built under -Ofast as free to reassociate, contract and ignore NaNs and signed zeros. */
+LLVMValueRef fast_math(LLVMValueRef value) {
+#if LLVM_VERSION_MAJOR >= 18
+    if (opt_fast_math && LLVMIsAInstruction(value)) LLVMSetFastMathFlags(value, LLVMFastMathAll);
+#endif
+    return value;
+}
+
+/*
+ * Writes module as assembly or as an object file for the output machine,
+ * at the level it was optimized at (-O0 without an option), beside path
+ * first and then renamed over it, since modules built in parallel may
+ * both bring a shared import up to date.
+ */
+bool emit_native_file(LLVMModuleRef module, const char *path, LLVMCodeGenFileType type) {
+    LLVMTargetMachineRef machine = output_target_machine(effective_level(0));
+    if (!machine) return false;
+
+    char temp[4224];
+    snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+    char *message = NULL;
+    if (LLVMTargetMachineEmitToFile(machine, module, temp, type, &message)) {
+        fprintf(stderr, "vex: error: could not write '%s': %s\n", path, message);
+        LLVMDisposeMessage(message);
+        remove(temp);
+        return false;
+    }
+    if (rename(temp, path) != 0) {
+        fprintf(stderr, "vex: error: could not write '%s': %s\n", path, strerror(errno));
+        remove(temp);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Objects compiled for the JIT are kept in $VEX_CACHE_DIR, or vex/ under
+ * the user's cache directory, so running the same program again skips
+ * optimization and code generation. An empty $VEX_CACHE_DIR turns the
+ * cache off.
+ */
+static bool cache_dir(char *dir, size_t size) {
+    const char *configured = getenv("VEX_CACHE_DIR");
+    if (configured) {
+        if (!*configured) return false;
+        snprintf(dir, size, "%s", configured);
+    } else if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME")) {
+        snprintf(dir, size, "%s/vex", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME") && *getenv("HOME")) {
+        snprintf(dir, size, "%s/.cache/vex", getenv("HOME"));
+    } else {
+        return false;
+    }
+
+    for (char *slash = strchr(dir + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash) *slash = '\0';
+        bool made = mkdir(dir, 0755) == 0 || errno == EEXIST;
+        if (slash) *slash = '/';
+        if (!made) return false;
+        if (!slash) return true;
+    }
+}
+
+static uint64_t hash_bytes(uint64_t hash, const char *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)bytes[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+/* FNV-1a over the unoptimized IR and everything else that decides the code it becomes. */
+static uint64_t object_key(LLVMModuleRef module, LLVMTargetMachineRef machine, int level) {
+    char *ir = LLVMPrintModuleToString(module);
+    char *triple = LLVMGetTargetMachineTriple(machine);
+    char *cpu = LLVMGetTargetMachineCPU(machine);
+    char *features = LLVMGetTargetMachineFeatureString(machine);
+    char config[64];
+    snprintf(config, sizeof(config), "vex %d.%d.%d llvm %s O%d%s%s codegen %d", MAJOR_VERSION, MINOR_VERSION, PATCH_VERSION,
+             LLVM_VERSION_STRING, level, opt_size ? "s" : "", opt_fast_math ? " fast" : "", (int)codegen_level(level));
+
+    const char *parts[] = { config, triple, cpu, features, ir };
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        hash = hash_bytes(hash, parts[i], strlen(parts[i]) + 1);
+    }
+    LLVMDisposeMessage(features);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(triple);
+    LLVMDisposeMessage(ir);
+    return hash;
+}
+
+/* Written beside its final name and renamed, so a reader never sees half an object. */
+static void store_object(const char *path, LLVMMemoryBufferRef object) {
+    char temp[4224];
+    snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+    FILE *file = fopen(temp, "wb");
+    if (!file) return;
+    size_t size = LLVMGetBufferSize(object);
+    bool written = fwrite(LLVMGetBufferStart(object), 1, size, file) == size;
+    if (fclose(file) != 0 || !written || rename(temp, path) != 0) remove(temp);
+}
+
+/*
+ * The object the host would run for module, from the cache when the same
+ * module was compiled before, otherwise optimized at the configured level
+ * (default_level without an -O option), emitted and cached. The module
+ * is left optimized or untouched accordingly; the caller still owns it.
+ */
+LLVMMemoryBufferRef compile_to_object(LLVMModuleRef module, int default_level) {
+    int level = effective_level(default_level);
+    LLVMTargetMachineRef machine = host_target_machine(level);
+    if (!machine) return NULL;
+
+    char dir[4096], path[4200];
+    bool cached = cache_dir(dir, sizeof(dir));
+    if (cached) {
+        uint64_t key = object_key(module, machine, level);
+        snprintf(path, sizeof(path), "%s/%016" PRIx64 ".o", dir, key);
+        LLVMMemoryBufferRef object = NULL;
+        char *message = NULL;
+        if (!LLVMCreateMemoryBufferWithContentsOfFile(path, &object, &message)) return object;
+        LLVMDisposeMessage(message);
+    }
+
+    if (!optimize_module(module, default_level)) return NULL;
+    LLVMMemoryBufferRef object = NULL;
+    char *message = NULL;
+    if (LLVMTargetMachineEmitToMemoryBuffer(machine, module, LLVMObjectFile, &message, &object)) {
+        fprintf(stderr, "vex: error: code generation failed: %s\n", message);
+        LLVMDisposeMessage(message);
+        return NULL;
+    }
+    if (cached) store_object(path, object);
+    return object;
+}
+
+/*
+ * Links the objects against the vex runtime with the system C compiler driver
+ * ($VEX_CC, or cc), which knows where the C library and start files are.
+ * The runtime is looked for in $VEX_RUNTIME_DIR, then in the build tree
+ * and the install directory vex was configured with.
+ */
+bool link_executable(const char **objects, int object_count, const char *output) {
+    const char *driver = getenv("VEX_CC");
+    const char *runtime_dir = getenv("VEX_RUNTIME_DIR");
+    if (!driver || !*driver) driver = "cc";
+
+    char env_dir[4096], build_dir[4096], install_dir[4096];
+    snprintf(env_dir, sizeof(env_dir), "-L%s", runtime_dir ? runtime_dir : "");
+    snprintf(build_dir, sizeof(build_dir), "-L%s", VEX_RUNTIME_BUILD_DIR);
+    snprintf(install_dir, sizeof(install_dir), "-L%s", VEX_RUNTIME_INSTALL_DIR);
+
+    char **argv = malloc(sizeof(char *) * (size_t)(object_count + 16));
+    int argc = 0;
+    argv[argc++] = (char *)driver;
+    for (int i = 0; i < object_count; i++) argv[argc++] = (char *)objects[i];
+    argv[argc++] = (char *)"-o";
+    argv[argc++] = (char *)output;
+    if (runtime_dir && *runtime_dir) argv[argc++] = env_dir;
+    argv[argc++] = build_dir;
+    argv[argc++] = install_dir;
+    argv[argc++] = (char *)"-lvexrt";
+    argv[argc++] = (char *)"-lpthread";
+    argv[argc++] = (char *)"-lm";
+    argv[argc] = NULL;
+
+    pid_t pid;
+    int status = posix_spawnp(&pid, driver, NULL, NULL, argv, environ);
+    free(argv);
+    if (status != 0) {
+        fprintf(stderr, "vex: error: could not run linker '%s': %s\n", driver, strerror(status));
+        return false;
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "vex: error: linking '%s' failed\n", output);
+        return false;
+    }
+    return true;
+}
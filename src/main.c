@@ -3,11 +3,18 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif // _WIN32
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "common.h"
 #include "parser.h"
 #include "memory.h"
+#include "profile.h"
+#include "eval.h"
+#include "jit.h"
 #include "llvm.h"
+#include "module.h"
+#include "target.h"
 #include "tc.h"
 
 Arena *global_arena = NULL;
@@ -16,6 +23,100 @@ extern ASTNode *root;
 extern const char *filename;
 extern void yylex_destroy(void);
 
+static int run_program(void) {
+    eval_echo_types = false;
+    eval_tier_threshold = vex_options.profile ? 0 : vex_options.jit_threshold;
+    if (vex_options.profile) profile_start();
+
+    int object_count;
+    const char **objects = module_objects(&object_count);
+    for (int i = 0; i < object_count; i++) jit_add_object_file(objects[i]);
+
+    eval_program(root);
+    if (eval_tier_threshold) eval_compile_global("main");
+    Value exit_value = VALUE_UNIT;
+    bool has_main = eval_call_global("main", &exit_value);
+
+    if (vex_options.profile) profile_report(stderr, vex_options.profile_output);
+    jit_shutdown();
+
+    if (!has_main) return EXIT_SUCCESS;
+    return value_has_tag(exit_value, VALUE_TAG_INT) ? value_as_int(exit_value) : EXIT_SUCCESS;
+}
+
+/* <input's name without directory or .vex><extension>, in the current directory. */
+static char *derived_path(const char *input, const char *extension) {
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    size_t length = strlen(base);
+    if (length > 4 && strcmp(base + length - 4, ".vex") == 0) length -= 4;
+
+    char *path = malloc(length + strlen(extension) + 1);
+    memcpy(path, base, length);
+    strcpy(path + length, extension);
+    return path;
+}
+
+/* Writes whatever -c, -S, --emit-ir or the default executable asks for from the optimized module. */
+static bool emit_output(void) {
+    const char *output = vex_options.output;
+    char *derived = NULL;
+    bool ok;
+
+    switch (vex_options.emit) {
+        case EmitIR:
+            if (output && strcmp(output, "-") == 0) {
+                print_llvm_ir();
+                return true;
+            }
+            if (!output) output = derived = derived_path(filename, ".ll");
+            ok = write_llvm_ir_to_file(output);
+            break;
+
+        case EmitAssembly:
+            if (!output) output = derived = derived_path(filename, ".s");
+            ok = emit_native_file(TheModule, output, LLVMAssemblyFile);
+            break;
+
+        case EmitObject: {
+            if (!output) output = derived = derived_path(filename, ".o");
+            /* The interface goes beside the object, as <name>.vexi for <name>.o. */
+            size_t length = strlen(output);
+            if (length > 2 && strcmp(output + length - 2, ".o") == 0) length -= 2;
+            char *interface = malloc(length + 6);
+            snprintf(interface, length + 6, "%.*s.vexi", (int)length, output);
+            ok = emit_native_file(TheModule, output, LLVMObjectFile) && write_interface(root, interface);
+            free(interface);
+            break;
+        }
+
+        default: {
+            if (!output) output = "a.out";
+            size_t size = strlen(output) + 4;
+            char *object = malloc(size);
+            snprintf(object, size, "%s.o", output);
+            if (vex_options.save_temps) {
+                char *ir = malloc(size + 1);
+                snprintf(ir, size + 1, "%s.ll", output);
+                write_llvm_ir_to_file(ir);
+                free(ir);
+            }
+            int import_count;
+            const char **imports = module_objects(&import_count);
+            const char **objects = malloc(sizeof(const char *) * (size_t)(import_count + 1));
+            objects[0] = object;
+            if (import_count) memcpy(objects + 1, imports, sizeof(const char *) * (size_t)import_count);
+            ok = emit_native_file(TheModule, object, LLVMObjectFile) && link_executable(objects, import_count + 1, output);
+            free(objects);
+            if (!vex_options.save_temps) remove(object);
+            free(object);
+            break;
+        }
+    }
+    free(derived);
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         fputs("vex: error: no input file\n", stderr);
@@ -23,14 +124,45 @@ int main(int argc, char *argv[]) {
     }
 
     for (int i = 1; i < argc; i++) {
-        if (handleCliOption(argv[i])) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 == argc) {
+                fputs("vex: error: missing filename after '-o'\n", stderr);
+                return EXIT_FAILURE;
+            }
+            vex_options.output = argv[++i];
+            continue;
+        }
+        if (argv[i][0] == '-' && handleCliOption(argv[i])) {
             return EXIT_SUCCESS;
         }
     }
+    target_configure(vex_options.opt_level, vex_options.opt_size, vex_options.fast_math, vex_options.cpu);
+
+    bool run = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            i++;
+            continue;
+        }
+        if (argv[i][0] == '-') continue;
+        if (!run && !filename && strcmp(argv[i], "run") == 0) {
+            run = true;
+            continue;
+        }
+        if (!run && handleCliOption(argv[i])) {
+            return EXIT_SUCCESS;
+        }
+        if (!filename) filename = argv[i];
+    }
+
+    if (!filename) {
+        fputs("vex: error: no input file\n", stderr);
+        return EXIT_FAILURE;
+    }
 
     global_arena = arena_create(1024 * 1024);
+    llvm_auto_par = vex_options.auto_par;
 
-    filename = argv[1];
     FILE *file = fopen(filename, "r");
     if (!file) {
         fprintf(stderr, "vex: error: could not read file '%s'\n", filename);
@@ -40,26 +172,60 @@ int main(int argc, char *argv[]) {
     yyin = file;
     root = NULL;
 
-    if (yyparse() == 0) {
+    if (run) {
+        if (yyparse() != 0 || !load_imports(root, filename, argv[0])) {
+            fclose(file);
+            return EXIT_FAILURE;
+        }
+        typecheck(root);
+        root = fuse_list_pipelines(root);
+        mark_local_lists(root);
+        int status = run_program();
+        free_modules();
+        fclose(file);
+        arena_destroy(global_arena);
+        yylex_destroy();
+        return status;
+    }
+
+    if (yyparse() != 0) {
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+    if (vex_options.emit == EmitAST) {
         printAST(root, 0);
-        arena_new_line();
-    } else {
-        printf("Parsing failed.\n");
+        fclose(file);
+        arena_destroy(global_arena);
+        yylex_destroy();
+        return EXIT_SUCCESS;
+    }
+    if (!load_imports(root, filename, argv[0])) {
+        fclose(file);
+        return EXIT_FAILURE;
     }
     typecheck(root);
+    root = fuse_list_pipelines(root);
+    mark_local_lists(root);
 
-    init_llvm_codegen();
+    llvm_keep_names = vex_options.emit == EmitIR || vex_options.save_temps;
+    char *module_name = derived_path(filename, "");
+    init_llvm_codegen(module_name);
+    free(module_name);
     compile_root();
-    write_llvm_ir_to_file("output.ll");
-    print_llvm_ir();
+    /* An imported module's main stays its own, so it cannot clash with the program's when they are linked. */
+    LLVMValueRef module_main = is_building_import() ? LLVMGetNamedFunction(TheModule, "main") : NULL;
+    if (module_main) LLVMSetLinkage(module_main, LLVMInternalLinkage);
+    int status = optimize_output_module(TheModule) && emit_output() ? EXIT_SUCCESS : EXIT_FAILURE;
 
+    free_modules();
     fclose(file);
     arena_destroy(global_arena);
     yylex_destroy();
+    free_function_defs();
     LLVMDisposeBuilder(Builder);
     LLVMDisposeModule(TheModule);
     LLVMContextDispose(TheContext);
     LLVMShutdown();
 
-    return EXIT_SUCCESS;
+    return status;
 }
@@ -17,6 +17,8 @@ void yyerror(const char *s) {
 }
 %}
 
+%locations
+
 %union {
     int intval;
     double floatval;
@@ -24,9 +26,14 @@ void yyerror(const char *s) {
     char charval;
     int boolval;
     struct ASTNode* node;
-    struct NodeList { struct ASTNode **elements; int count; } node_list;
+    struct NodeList { struct ASTNode **elements; int count, capacity; } node_list;
     struct ParamList { struct Param *elements; int count; } param_list;
     struct { const char **elements; int count; } type_list;
+    struct Pattern *pattern;
+    struct PatternList { struct Pattern **elements; int count; } pattern_list;
+    struct MatchCases { struct Pattern **patterns; struct ASTNode **arms; int count; } match_cases;
+    struct Variant *variant;
+    struct VariantList { struct Variant *elements; int count; } variant_list;
 }
 
 %token <intval> IntLit
@@ -36,10 +43,16 @@ void yyerror(const char *s) {
 %token <boolval> BoolLit
 %token <strval> Ident
 
+%nonassoc With ThiccArrow
+%left Pipe
+%right Print
+%left PipeForward
 %left LogicalOr
 %left LogicalAnd
 %left Equal NotEqual
 %left Less Greater LessEqual GreaterEqual
+%right Caret
+%right Cons
 %left Plus Minus
 %left Star Slash
 %left PlusFloat MinusFloat
@@ -49,15 +62,20 @@ void yyerror(const char *s) {
 
 %token LParen RParen LBracket RBracket LBrace RBrace Plus Minus Star Slash Assignment Comma Dot Underscore Pipe Less Greater Colon Semi
 %token Equal NotEqual LessEqual GreaterEqual ThiccArrow SkinnyArrow Spread PlusFloat MinusFloat StarFloat SlashFloat LogicalAnd LogicalOr 
-%token Val Type Match With If Else None Some Ok Error Then Not Fn List
+%token Val Type Import Match With If Else None Some Ok Error Then Not Fn List
 %token Int Float Char String Bool
-%token Print Map Filter
+%token Print Map Filter Reduce PipeForward Caret Cons
 
-%type <node> statement expr var_decl primary_expr func_def
+%type <node> statement expr var_decl primary_expr func_def type_decl
 %type <node_list> statement_list expr_list
 %type <param_list> param_list
 %type <type_list> type_list
 %type <strval> type list_type
+%type <pattern> pattern simple_pattern
+%type <pattern_list> pattern_list
+%type <match_cases> match_cases
+%type <variant> variant
+%type <variant_list> variant_list
 
 %%
 
@@ -72,6 +90,8 @@ statement:
     expr Semi { $$ = $1; }
     | var_decl Semi { $$ = $1; }
     | func_def Semi { $$ = $1; }
+    | type_decl Semi { $$ = $1; }
+    | Import Ident Semi { $$ = create_import_node($2); }
 
 type:
     Int { $$ = "int"; }
@@ -79,6 +99,10 @@ type:
     | Char { $$ = "char"; }
     | String { $$ = "string"; }
     | Bool { $$ = "bool"; }
+    | Ident { $$ = $1; }
+    | list_type { $$ = $1; }
+    | Ident Less type Greater { size_t size = strlen($1) + strlen($3) + 3; char *buf = arena_alloc(global_arena, size); snprintf(buf, size, "%s<%s>", $1, $3); $$ = buf; }
+    | Ident Less type Comma type Greater { size_t size = strlen($1) + strlen($3) + strlen($5) + 4; char *buf = arena_alloc(global_arena, size); snprintf(buf, size, "%s<%s,%s>", $1, $3, $5); $$ = buf; }
 
 expr:
     expr Plus expr { $$ = create_binary_node("+", $1, $3); }
@@ -95,11 +119,15 @@ expr:
   | expr NotEqual expr { $$ = create_binary_node("!=", $1, $3); }
   | expr LessEqual expr { $$ = create_binary_node("<=", $1, $3); }
   | expr GreaterEqual expr { $$ = create_binary_node(">=", $1, $3); }
+  | expr Caret expr { $$ = create_binary_node("^", $1, $3); }
   | expr LogicalAnd expr { $$ = create_binary_node("&&", $1, $3); }
   | expr LogicalOr expr { $$ = create_binary_node("||", $1, $3); }
+  | expr PipeForward expr { $$ = build_pipe($1, $3); }
   | Minus expr { $$ = create_unary_node("-", $2); }
   | Not expr { $$ = create_unary_node("not", $2); }
   | LBrace statement_list RBrace { $$ = create_block_node($2.elements, $2.count); }
+  | Match expr With match_cases %prec With { $$ = create_match_node($2, $4.patterns, $4.arms, $4.count); }
+  | If expr Then expr Else expr %prec With { $$ = create_if_node($2, $4, $6); }
   | primary_expr { $$ = $1; }
 
 primary_expr:
@@ -109,17 +137,56 @@ primary_expr:
   | StringLit { $$ = create_string_node($1); }
   | Ident { $$ = create_identifier_node($1); }
   | BoolLit { $$ = create_bool_node($1); }
-  | Print Less type Greater expr { $$ = create_print_node($5, $3); }
+  | None { $$ = create_construct_node("None", NULL, 0); }
+  | Some LParen expr RParen { ASTNode **args = arena_alloc(global_arena, sizeof(ASTNode *)); args[0] = $3; $$ = create_construct_node("Some", args, 1); }
+  | Ok LParen expr RParen { ASTNode **args = arena_alloc(global_arena, sizeof(ASTNode *)); args[0] = $3; $$ = create_construct_node("Ok", args, 1); }
+  | Error LParen expr RParen { ASTNode **args = arena_alloc(global_arena, sizeof(ASTNode *)); args[0] = $3; $$ = create_construct_node("Error", args, 1); }
+  | Print Less type Greater expr %prec Print { $$ = create_print_node($5, $3); }
   | LParen expr RParen { $$ = $2; }
   | LBracket expr_list RBracket { $$ = build_list($2.elements, $2.count); }
   | Ident LParen expr_list RParen { $$ = create_call_node(create_identifier_node($1), $3.elements, $3.count); }
   | Ident LParen RParen { $$ = create_call_node(create_identifier_node($1), NULL, 0); }
   | LParen expr RParen LParen expr_list RParen { $$ = create_call_node($2, $5.elements, $5.count); }
   | LParen expr RParen LParen RParen { $$ = create_call_node($2, NULL, 0); }
+  | Map LParen expr Comma expr RParen { $$ = create_list_op_node(ListMap, $3, NULL, $5); }
+  | Filter LParen expr Comma expr RParen { $$ = create_list_op_node(ListFilter, $3, NULL, $5); }
+  | Reduce LParen expr Comma expr Comma expr RParen { $$ = create_list_op_node(ListReduce, $3, $5, $7); }
+  | Map LParen expr RParen { $$ = create_list_op_node(ListMap, $3, NULL, NULL); }
+  | Filter LParen expr RParen { $$ = create_list_op_node(ListFilter, $3, NULL, NULL); }
+  | Reduce LParen expr Comma expr RParen { $$ = create_list_op_node(ListReduce, $3, $5, NULL); }
 
 expr_list:
-    expr { ASTNode **arr = arena_alloc(global_arena, sizeof(ASTNode *) * 1); arr[0] = $1; $$.elements = arr; $$.count = 1; }
-    | expr_list Comma expr { size_t new_count = (size_t)$1.count + 1; ASTNode **arr = arena_alloc(global_arena, sizeof(ASTNode *) * new_count); memcpy(arr, $1.elements, sizeof(ASTNode *) * (size_t)$1.count); arr[$1.count] = $3; $$.elements = arr; $$.count = (int)new_count; }
+    expr { ASTNode **arr = arena_alloc(global_arena, sizeof(ASTNode *) * 4); arr[0] = $1; $$.elements = arr; $$.count = 1; $$.capacity = 4; }
+    | expr_list Comma expr { $$ = $1; if ($$.count == $$.capacity) { $$.capacity *= 2; ASTNode **arr = arena_alloc(global_arena, sizeof(ASTNode *) * (size_t)$$.capacity); memcpy(arr, $1.elements, sizeof(ASTNode *) * (size_t)$1.count); $$.elements = arr; } $$.elements[$$.count++] = $3; }
+
+match_cases:
+    pattern ThiccArrow expr { $$.patterns = arena_alloc(global_arena, sizeof(Pattern *)); $$.arms = arena_alloc(global_arena, sizeof(ASTNode *)); $$.patterns[0] = $1; $$.arms[0] = $3; $$.count = 1; }
+  | Pipe pattern ThiccArrow expr { $$.patterns = arena_alloc(global_arena, sizeof(Pattern *)); $$.arms = arena_alloc(global_arena, sizeof(ASTNode *)); $$.patterns[0] = $2; $$.arms[0] = $4; $$.count = 1; }
+  | match_cases Pipe pattern ThiccArrow expr { size_t new_count = (size_t)$1.count + 1; $$.patterns = arena_alloc(global_arena, sizeof(Pattern *) * new_count); $$.arms = arena_alloc(global_arena, sizeof(ASTNode *) * new_count); memcpy($$.patterns, $1.patterns, sizeof(Pattern *) * (size_t)$1.count); memcpy($$.arms, $1.arms, sizeof(ASTNode *) * (size_t)$1.count); $$.patterns[$1.count] = $3; $$.arms[$1.count] = $5; $$.count = (int)new_count; }
+
+pattern:
+    simple_pattern { $$ = $1; }
+  | simple_pattern Cons pattern { $$ = create_cons_pattern($1, $3); }
+
+simple_pattern:
+    Underscore { $$ = create_pattern(PatternWildcard); }
+  | Ident { $$ = create_bind_pattern($1); }
+  | IntLit { $$ = create_pattern(PatternInt); $$->intval = $1; }
+  | Minus IntLit { $$ = create_pattern(PatternInt); $$->intval = -$2; }
+  | CharLit { $$ = create_pattern(PatternChar); $$->charval = $1; }
+  | BoolLit { $$ = create_pattern(PatternBool); $$->boolval = $1; }
+  | LBracket RBracket { $$ = create_pattern(PatternNil); }
+  | LBracket pattern_list RBracket { $$ = build_list_pattern($2.elements, $2.count); }
+  | Ident LParen pattern_list RParen { $$ = create_constructor_pattern($1, $3.elements, $3.count); }
+  | None { $$ = create_constructor_pattern("None", NULL, 0); }
+  | Some LParen pattern RParen { Pattern **args = arena_alloc(global_arena, sizeof(Pattern *)); args[0] = $3; $$ = create_constructor_pattern("Some", args, 1); }
+  | Ok LParen pattern RParen { Pattern **args = arena_alloc(global_arena, sizeof(Pattern *)); args[0] = $3; $$ = create_constructor_pattern("Ok", args, 1); }
+  | Error LParen pattern RParen { Pattern **args = arena_alloc(global_arena, sizeof(Pattern *)); args[0] = $3; $$ = create_constructor_pattern("Error", args, 1); }
+  | LParen pattern RParen { $$ = $2; }
+
+pattern_list:
+    pattern { $$.elements = arena_alloc(global_arena, sizeof(Pattern *)); $$.elements[0] = $1; $$.count = 1; }
+  | pattern_list Comma pattern { size_t new_count = (size_t)$1.count + 1; Pattern **arr = arena_alloc(global_arena, sizeof(Pattern *) * new_count); memcpy(arr, $1.elements, sizeof(Pattern *) * (size_t)$1.count); arr[$1.count] = $3; $$.elements = arr; $$.count = (int)new_count; }
 
 param_list:
     Ident { struct Param *arr = arena_alloc(global_arena, sizeof(struct Param)); arr[0].name = $1; arr[0].type = NULL; $$.elements = arr; $$.count = 1; }
@@ -130,14 +197,25 @@ type_list:
   | type_list Comma type { size_t new_count = (size_t)$1.count + 1; const char **arr = arena_alloc(global_arena, sizeof(char*) * new_count); memcpy(arr, $1.elements, sizeof(char*) * (size_t)$1.count); arr[$1.count] = $3; $$.elements = arr; $$.count = (int)new_count; }
 
 list_type:
-    List Less type Greater { char *buf = arena_alloc(global_arena, 32); snprintf(buf, 32, "<%s>", $3); $$ = buf; }
+    List Less type Greater { size_t size = strlen($3) + 3; char *buf = arena_alloc(global_arena, size); snprintf(buf, size, "<%s>", $3); $$ = buf; }
 
 var_decl:
     Val type Colon Ident Assignment expr { $$ = create_var_decl_node($4, $2, $6); }
-    | Val list_type Colon Ident Assignment expr { $$ = create_var_decl_node($4, $2, $6); }
+
+type_decl:
+    Type Ident Assignment variant_list { $$ = create_type_decl_node($2, $4.elements, $4.count); }
+
+variant_list:
+    variant { $$.elements = arena_alloc(global_arena, sizeof(struct Variant)); $$.elements[0] = *$1; $$.count = 1; }
+  | Pipe variant { $$.elements = arena_alloc(global_arena, sizeof(struct Variant)); $$.elements[0] = *$2; $$.count = 1; }
+  | variant_list Pipe variant { size_t new_count = (size_t)$1.count + 1; struct Variant *arr = arena_alloc(global_arena, sizeof(struct Variant) * new_count); memcpy(arr, $1.elements, sizeof(struct Variant) * (size_t)$1.count); arr[$1.count] = *$3; $$.elements = arr; $$.count = (int)new_count; }
+
+variant:
+    Ident { $$ = arena_alloc(global_arena, sizeof(struct Variant)); $$->name = $1; $$->field_types = NULL; $$->field_count = 0; }
+  | Ident LParen type_list RParen { $$ = arena_alloc(global_arena, sizeof(struct Variant)); $$->name = $1; $$->field_types = $3.elements; $$->field_count = $3.count; }
 
 func_def:
-    Val LParen type_list RParen SkinnyArrow type Colon Ident Fn LParen param_list RParen ThiccArrow expr { for (int i = 0; i < $11.count; i++) { $11.elements[i].type = $3.elements[i]; } $$ = create_function_node($8, $11.elements, $11.count, $3.elements, $6, $14); }
-    | Val LParen RParen SkinnyArrow type Colon Ident Fn LParen RParen ThiccArrow expr { $$ = create_function_node($7, NULL, 0, NULL, $5, $12); }
+    Val LParen type_list RParen SkinnyArrow type Colon Ident Fn LParen param_list RParen ThiccArrow expr { for (int i = 0; i < $11.count; i++) { $11.elements[i].type = $3.elements[i]; } $$ = create_function_node($8, $11.elements, $11.count, $3.elements, $6, $14); $$->line = @1.first_line; }
+    | Val LParen RParen SkinnyArrow type Colon Ident Fn LParen RParen ThiccArrow expr { $$ = create_function_node($7, NULL, 0, NULL, $5, $12); $$->line = @1.first_line; }
 
 %%
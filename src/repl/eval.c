@@ -1,126 +1,983 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "eval.h"
 #include "ast.h"
+#include "gc.h"
+#include "jit.h"
+#include "list.h"
+#include "match.h"
+#include "memory.h"
+#include "profile.h"
+#include "tc.h"
+#include "variant.h"
+
+#define EVAL_INLINE_ARGS 8
+
+extern Arena *global_arena;
+
+bool eval_echo_types = true;
+uint32_t eval_tier_threshold = 0;
+
+static EvalEnv default_env;
+static EvalEnv *env = &default_env;
+
+static void bind(const char *name, Value value) {
+    if (env->binding_count == env->binding_capacity) {
+        env->binding_capacity = env->binding_capacity ? env->binding_capacity * 2 : 256;
+        env->bindings = realloc(env->bindings, sizeof(Binding) * env->binding_capacity);
+        if (!env->bindings) {
+            fprintf(stderr, "Runtime error: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    env->bindings[env->binding_count++] = (Binding){ name, value };
+    if (env->call_depth == 0) env->global_count = env->binding_count;
+}
+
+static void unwind_bindings(size_t count) {
+    env->binding_count = count;
+    if (env->call_depth == 0) env->global_count = count;
+}
+
+static bool is_heap_value(Value value) {
+    if (value_is_variant(value)) return !vex_variant_is_immediate(value_as_variant(value));
+    return value_has_tag(value, VALUE_TAG_LIST) || value_has_tag(value, VALUE_TAG_STRING);
+}
+
+static Value keep(Value value) {
+    if (!is_heap_value(value)) return value;
+    if (env->temp_count == env->temp_capacity) {
+        env->temp_capacity = env->temp_capacity ? env->temp_capacity * 2 : 256;
+        env->temps = realloc(env->temps, sizeof(Value) * env->temp_capacity);
+        if (!env->temps) {
+            fprintf(stderr, "Runtime error: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    env->temps[env->temp_count++] = value;
+    return value;
+}
+
+static void mark_roots(void) {
+    for (size_t i = 0; i < env->binding_count; i++) {
+        if (is_heap_value(env->bindings[i].value)) vex_gc_mark_root(value_as_pointer(env->bindings[i].value));
+    }
+    for (size_t i = 0; i < env->temp_count; i++) {
+        vex_gc_mark_root(value_as_pointer(env->temps[i]));
+    }
+}
+
+static bool lookup(const char *name, Value *out) {
+    for (size_t i = env->binding_count; i > env->frame_base; i--) {
+        if (strcmp(env->bindings[i - 1].name, name) == 0) {
+            *out = env->bindings[i - 1].value;
+            return true;
+        }
+    }
+    size_t globals_end = env->frame_base < env->global_count ? env->frame_base : env->global_count;
+    for (size_t i = globals_end; i > 0; i--) {
+        if (strcmp(env->bindings[i - 1].name, name) == 0) {
+            *out = env->bindings[i - 1].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static Value make_closure(ASTNode *function) {
+    Closure *closure = arena_alloc(global_arena, sizeof(Closure));
+    memset(closure, 0, sizeof(Closure));
+    closure->function = function;
+    return make_pointer_value(VALUE_TAG_CLOSURE, closure);
+}
+
+/* The function a top-level name is bound to, or NULL if it is bound to anything else. */
+ASTNode *eval_global_function(const char *name) {
+    for (size_t i = env->global_count; i > 0; i--) {
+        if (strcmp(env->bindings[i - 1].name, name) == 0) {
+            Value v = env->bindings[i - 1].value;
+            if (!value_has_tag(v, VALUE_TAG_CLOSURE)) return NULL;
+            return ((Closure *)value_as_pointer(v))->function;
+        }
+    }
+    return NULL;
+}
+
+static int64_t value_to_word(Value v, const char *type) {
+    if (type[0] == '<') return (int64_t)(uintptr_t)value_as_pointer(v);
+    if (strcmp(type, "float") == 0) return (int64_t)v;
+    if (strcmp(type, "bool") == 0) return value_as_bool(v);
+    if (strcmp(type, "char") == 0) return (unsigned char)value_as_char(v);
+    if (strcmp(type, "string") == 0) return (int64_t)(uintptr_t)value_as_string(v);
+    if (strcmp(type, "int") != 0 && find_variant_type(type)) return value_as_variant(v);
+    return value_as_int(v);
+}
+
+static Value word_to_value(int64_t word, const char *type) {
+    if (type[0] == '<') return make_pointer_value(VALUE_TAG_LIST, (const void *)(uintptr_t)word);
+    if (strcmp(type, "float") == 0) return make_float_value(value_as_float((Value)word));
+    if (strcmp(type, "bool") == 0) return make_bool_value(word != 0);
+    if (strcmp(type, "char") == 0) return make_char_value((char)word);
+    if (strcmp(type, "string") == 0) return make_string_value((const VexString *)(uintptr_t)word);
+    if (strcmp(type, "int") != 0 && find_variant_type(type)) return make_variant_value(word);
+    return make_int_value((int)word);
+}
+
+/* Indexed by VexElemKind. */
+static const char *elem_type_names[] = { "int", "float", "bool", "char", "string", "<list>" };
+
+static VexElemKind elem_kind_of_type(const char *type) {
+    if (type[0] == '<') return VEX_ELEM_LIST;
+    for (size_t i = 0; i < sizeof(elem_type_names) / sizeof(elem_type_names[0]); i++) {
+        if (strcmp(type, elem_type_names[i]) == 0) return (VexElemKind)i;
+    }
+    return VEX_ELEM_INT;
+}
+
+static VexElemKind elem_kind_of_value(Value v) {
+    switch (value_kind(v)) {
+        case VAL_FLOAT: return VEX_ELEM_FLOAT;
+        case VAL_BOOL: return VEX_ELEM_BOOL;
+        case VAL_CHAR: return VEX_ELEM_CHAR;
+        case VAL_STRING: return VEX_ELEM_STRING;
+        case VAL_LIST: return VEX_ELEM_LIST;
+        default: return VEX_ELEM_INT;
+    }
+}
+
+static Value call_native(Closure *closure, const Value *args, int arg_count) {
+    ASTNode *fn = closure->function;
+    int64_t inline_words[EVAL_INLINE_ARGS] = { 0 };
+    int64_t *words = arg_count > EVAL_INLINE_ARGS ? malloc(sizeof(int64_t) * (size_t)arg_count) : inline_words;
+    for (int i = 0; i < arg_count; i++) {
+        words[i] = value_to_word(args[i], fn->function.param_types[i]);
+    }
+    int64_t result = closure->native(words);
+    if (words != inline_words) free(words);
+    return keep(word_to_value(result, fn->function.return_type));
+}
+
+/*
+ * Calls and recursive re-entries (the only back-edges Vex has) are counted
+ * per function. Once their sum crosses eval_tier_threshold the function and
+ * everything it calls are compiled with the JIT and later calls go native.
+ */
+static bool tier_up(Closure *closure) {
+    closure->native = jit_compile_function(closure->function, eval_global_function);
+    if (!closure->native) closure->jit_failed = true;
+    return closure->native != NULL;
+}
+
+static Value call_closure(Closure *closure, const Value *args, int arg_count) {
+    ASTNode *fn = closure->function;
+    if (arg_count != fn->function.param_count) {
+        fprintf(stderr, "Runtime error: '%s' expects %d arguments but got %d\n", fn->function.name, fn->function.param_count, arg_count);
+        return VALUE_UNIT;
+    }
+
+    if (closure->native) return call_native(closure, args, arg_count);
+    if (!fn->function.expr) {
+        /* Imported: there is no body to interpret, only the module's object. */
+        if (!closure->jit_failed && tier_up(closure)) return call_native(closure, args, arg_count);
+        fprintf(stderr, "Runtime error: could not call imported function '%s'\n", fn->function.name);
+        return VALUE_UNIT;
+    }
+    if (eval_tier_threshold && !closure->jit_failed) {
+        closure->calls++;
+        if (closure->active) closure->backedges++;
+        if (closure->calls + closure->backedges >= eval_tier_threshold && tier_up(closure)) {
+            return call_native(closure, args, arg_count);
+        }
+    }
+
+    size_t saved_base = env->frame_base, saved_count = env->binding_count, saved_temps = env->temp_count;
+    env->frame_base = env->binding_count;
+    env->call_depth++;
+    for (int i = 0; i < arg_count; i++) {
+        bind(fn->function.param_names[i], args[i]);
+    }
+    vex_gc_poll();
+
+    if (profile_active) {
+        if (fn->function.profile_id < 0) {
+            fn->function.profile_id = profile_register_function(fn->function.name, fn->line);
+        }
+        profile_enter(fn->function.profile_id);
+        if (fn->function.expr->type != NodeBlock) profile_line(fn->function.expr->line);
+    }
+
+    closure->active++;
+    Value result = eval_ast(fn->function.expr);
+    closure->active--;
+
+    if (profile_active) profile_exit();
+    env->call_depth--;
+    env->binding_count = saved_count;
+    env->frame_base = saved_base;
+    env->temp_count = saved_temps;
+    return keep(result);
+}
+
+static Value list_op_native(ASTNode *node, Closure *closure, VexList *list, Value init) {
+    const char *elem_type = elem_type_names[vex_list_kind(list)];
+    switch (node->list_op.op) {
+        case ListMap: {
+            VexElemKind out_kind = elem_kind_of_type(closure->function->function.return_type);
+            return make_pointer_value(VALUE_TAG_LIST, vex_list_map(list, out_kind, closure->native));
+        }
+        case ListFilter:
+            return make_pointer_value(VALUE_TAG_LIST, vex_list_filter(list, closure->native));
+        case ListReduce:
+            return word_to_value(vex_list_reduce(list, value_to_word(init, elem_type), closure->native), elem_type);
+    }
+    return VALUE_UNIT;
+}
+
+static Value eval_binary(const char *op, Value left, Value right);
+
+/* One step of a fold: closure applied to acc and v, or their sum when there is no closure. */
+static Value fold_value(Closure *closure, bool is_float, Value acc, Value v) {
+    if (!closure) return eval_binary(is_float ? "+." : "+", acc, v);
+    Value args[2] = { acc, v };
+    return call_closure(closure, args, 2);
+}
+
+/*
+ * Folds take the shape vex_list_reduce gives them in compiled code: each
+ * chunk of VEX_LIST_GRAIN elements is folded on its own, the first from
+ * init and every other from its first element, and the chunk results are
+ * combined pairwise in a fixed tree, leaving out chunks a filter emptied.
+ * The tiers then agree even for a function that is not associative.
+ */
+static Value combine_chunks(Closure *closure, bool is_float, Value *partials, bool *folded, int64_t chunks) {
+    for (int64_t stride = 1; stride < chunks; stride *= 2) {
+        for (int64_t i = 0; i + stride < chunks; i += 2 * stride) {
+            if (!folded[i + stride]) continue;
+            partials[i] = keep(folded[i] ? fold_value(closure, is_float, partials[i], partials[i + stride]) : partials[i + stride]);
+            folded[i] = true;
+        }
+    }
+    return partials[0];
+}
+
+static Value list_op_interpreted(ASTNode *node, Closure *closure, VexList *list, Value init) {
+    const char *elem_type = elem_type_names[vex_list_kind(list)];
+    Value args[2];
+
+    switch (node->list_op.op) {
+        case ListMap: {
+            const char *out_type = closure->function->function.return_type;
+            VexList *out = vex_list_new(elem_kind_of_type(out_type), list->length);
+            Value result = keep(make_pointer_value(VALUE_TAG_LIST, out));
+            size_t saved_temps = env->temp_count;
+            for (int64_t i = 0; i < list->length; i++) {
+                args[0] = word_to_value(vex_list_get_word(list, i), elem_type);
+                vex_list_set_word(out, i, value_to_word(call_closure(closure, args, 1), out_type));
+                env->temp_count = saved_temps;
+            }
+            return result;
+        }
+        case ListFilter: {
+            VexList *out = vex_list_new(vex_list_kind(list), list->length);
+            keep(make_pointer_value(VALUE_TAG_LIST, out));
+            int64_t kept = 0;
+            for (int64_t i = 0; i < list->length; i++) {
+                int64_t word = vex_list_get_word(list, i);
+                args[0] = word_to_value(word, elem_type);
+                if (value_as_bool(call_closure(closure, args, 1))) vex_list_set_word(out, kept++, word);
+            }
+            out->length = kept;
+            return make_pointer_value(VALUE_TAG_LIST, out);
+        }
+        case ListReduce: {
+            int64_t chunks = (list->length + VEX_LIST_GRAIN - 1) / VEX_LIST_GRAIN;
+            if (chunks == 0) return init;
+            Value *partials = malloc(sizeof(Value) * (size_t)chunks);
+            bool *folded = malloc(sizeof(bool) * (size_t)chunks);
+            for (int64_t chunk = 0; chunk < chunks; chunk++) {
+                int64_t first = chunk * VEX_LIST_GRAIN, last = first + VEX_LIST_GRAIN;
+                if (last > list->length) last = list->length;
+                args[0] = chunk == 0 ? init : word_to_value(vex_list_get_word(list, first++), elem_type);
+                size_t saved_temps = env->temp_count;
+                for (int64_t i = first; i < last; i++) {
+                    args[1] = word_to_value(vex_list_get_word(list, i), elem_type);
+                    args[0] = call_closure(closure, args, 2);
+                    env->temp_count = saved_temps;
+                    keep(args[0]);
+                }
+                partials[chunk] = args[0];
+                folded[chunk] = true;
+            }
+            Value result = combine_chunks(closure, false, partials, folded, chunks);
+            free(partials);
+            free(folded);
+            return result;
+        }
+    }
+    return VALUE_UNIT;
+}
+
+/*
+ * map, filter and reduce hand native functions to the parallel list
+ * runtime. A function that is not native yet is tiered up straight away
+ * when the list is big enough to be split; otherwise the loop runs here.
+ */
+static Value eval_list_op(ASTNode *node) {
+    Value callee = eval_ast(node->list_op.function);
+    Value list_value = eval_ast(node->list_op.list);
+    Value init = node->list_op.init ? eval_ast(node->list_op.init) : VALUE_UNIT;
+
+    if (!value_has_tag(callee, VALUE_TAG_CLOSURE) || !value_has_tag(list_value, VALUE_TAG_LIST)) {
+        fprintf(stderr, "Runtime error: map, filter and reduce expect a function and a list\n");
+        return VALUE_UNIT;
+    }
+
+    Closure *closure = value_as_pointer(callee);
+    VexList *list = value_as_pointer(list_value);
+    if (!closure->native && eval_tier_threshold && !closure->jit_failed && list->length >= VEX_LIST_GRAIN) {
+        tier_up(closure);
+    }
+
+    if (closure->native) return list_op_native(node, closure, list, init);
+    return list_op_interpreted(node, closure, list, init);
+}
+
+static const char *type_name(const TypeTC *type) {
+    if (type->kind == TypeVariant) return type->variant->name;
+    return type->kind == TypeList ? "<list>" : type_to_string(type->kind);
+}
+
+typedef struct NativeStages {
+    ASTNode **stages;
+    Closure **closures;
+    int count;
+} NativeStages;
+
+static bool run_native_stages(int64_t *word, void *ctx) {
+    NativeStages *native = ctx;
+    for (int i = 0; i < native->count; i++) {
+        int64_t result = native->closures[i]->native(word);
+        if (native->stages[i]->list_op.op == ListMap) {
+            *word = result;
+        } else if (!(result & 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int64_t add_int_words(const int64_t *args) {
+    return args[0] + args[1];
+}
+
+static int64_t add_float_words(const int64_t *args) {
+    return (int64_t)make_float_value(value_as_float((Value)args[0]) + value_as_float((Value)args[1]));
+}
+
+/* Every element runs through all stages before the next is read; see fusion.c. */
+static Value eval_pipeline(ASTNode *node) {
+    ASTNode *sink = node->pipeline.sink;
+    bool is_reduce = sink && sink->type == NodeListOp;
+    bool is_sum = sink && !is_reduce;
+    int count = node->pipeline.stage_count;
+
+    Value list_value = eval_ast(node->pipeline.source);
+    if (!value_has_tag(list_value, VALUE_TAG_LIST)) {
+        fprintf(stderr, "Runtime error: a list pipeline expects a list\n");
+        return VALUE_UNIT;
+    }
+    VexList *list = value_as_pointer(list_value);
+
+    Closure **closures = malloc(sizeof(Closure *) * (size_t)(count + 1));
+    for (int i = 0; i <= count; i++) {
+        ASTNode *function = i < count ? node->pipeline.stages[i]->list_op.function : is_reduce ? sink->list_op.function : NULL;
+        if (!function) continue;
+        Value callee = eval_ast(function);
+        if (!value_has_tag(callee, VALUE_TAG_CLOSURE)) {
+            fprintf(stderr, "Runtime error: map, filter and reduce expect a function\n");
+            free(closures);
+            return VALUE_UNIT;
+        }
+        closures[i] = value_as_pointer(callee);
+    }
+    Value init = is_reduce ? eval_ast(sink->list_op.init) : VALUE_UNIT;
+
+    int closure_count = count + (is_reduce ? 1 : 0);
+    bool native = true;
+    for (int i = 0; i < closure_count; i++) {
+        Closure *closure = closures[i];
+        if (!closure->native && eval_tier_threshold && !closure->jit_failed && list->length >= VEX_LIST_GRAIN) {
+            tier_up(closure);
+        }
+        native = native && closure->native;
+    }
+
+    const char *in_type = elem_type_names[vex_list_kind(list)];
+    const char *out_type = type_name(is_reduce || is_sum ? node->tc_type : node->tc_type->element_type);
+    bool is_float = strcmp(out_type, "float") == 0;
+    if (is_sum) init = is_float ? make_float_value(0.0) : make_int_value(0);
+
+    if (native) {
+        NativeStages stages = { node->pipeline.stages, closures, count };
+        if (!sink) {
+            Value result = make_pointer_value(VALUE_TAG_LIST, vex_list_pipeline(list, elem_kind_of_type(out_type), run_native_stages, &stages));
+            free(closures);
+            return result;
+        }
+        VexWordFn combine = is_reduce ? closures[count]->native : is_float ? add_float_words : add_int_words;
+        int64_t word = vex_list_pipeline_reduce(list, run_native_stages, &stages, value_to_word(init, out_type), combine);
+        free(closures);
+        return word_to_value(word, out_type);
+    }
+
+    VexList *out = sink ? NULL : vex_list_new(elem_kind_of_type(out_type), list->length);
+    if (out) keep(make_pointer_value(VALUE_TAG_LIST, out));
+    Closure *reducer = is_reduce ? closures[count] : NULL;
+    int64_t chunks = sink ? (list->length + VEX_LIST_GRAIN - 1) / VEX_LIST_GRAIN : 0;
+    Value *partials = malloc(sizeof(Value) * (size_t)(chunks ? chunks : 1));
+    bool *folded = malloc(sizeof(bool) * (size_t)(chunks ? chunks : 1));
+    size_t saved_temps = env->temp_count;
+    Value acc = init;
+    bool has_acc = true;
+    int64_t kept = 0;
+    for (int64_t i = 0; i < list->length; i++) {
+        if (sink && i > 0 && i % VEX_LIST_GRAIN == 0) {
+            partials[i / VEX_LIST_GRAIN - 1] = acc;
+            folded[i / VEX_LIST_GRAIN - 1] = has_acc;
+            env->temp_count = saved_temps;
+            keep(acc);
+            saved_temps = env->temp_count;
+            has_acc = false;
+        }
+        env->temp_count = saved_temps;
+        keep(acc);
+        Value v = word_to_value(vex_list_get_word(list, i), in_type);
+        bool keep = true;
+        for (int s = 0; keep && s < count; s++) {
+            Value r = call_closure(closures[s], &v, 1);
+            if (node->pipeline.stages[s]->list_op.op == ListMap) {
+                v = r;
+            } else {
+                keep = value_as_bool(r);
+            }
+        }
+        if (!keep) continue;
+
+        if (sink) {
+            acc = has_acc ? fold_value(reducer, is_float, acc, v) : v;
+            has_acc = true;
+        } else {
+            vex_list_set_word(out, kept++, value_to_word(v, out_type));
+        }
+    }
+    free(closures);
+
+    if (sink && chunks > 0) {
+        partials[chunks - 1] = acc;
+        folded[chunks - 1] = has_acc;
+        acc = combine_chunks(reducer, is_float, partials, folded, chunks);
+    }
+    free(partials);
+    free(folded);
+    if (sink) return acc;
+    out->length = kept;
+    return make_pointer_value(VALUE_TAG_LIST, out);
+}
+
+static Value eval_list_builtin(ASTNode *node) {
+    const char *name = node->call.callee->strval;
+    Value list_value = eval_ast(node->call.args[0]);
+    if (strcmp(name, "length") == 0 && value_has_tag(list_value, VALUE_TAG_STRING)) {
+        return make_int_value((int)vex_string_length(value_as_string(list_value)));
+    }
+    if (!value_has_tag(list_value, VALUE_TAG_LIST)) {
+        fprintf(stderr, "Runtime error: %s expects a list\n", name);
+        return VALUE_UNIT;
+    }
+
+    VexList *list = value_as_pointer(list_value);
+    const char *elem_type = elem_type_names[vex_list_kind(list)];
+    if (strcmp(name, "length") == 0) return make_int_value((int)vex_list_length(list));
+    if (strcmp(name, "head") == 0) return word_to_value(vex_list_head(list), elem_type);
+    if (strcmp(name, "tail") == 0) return make_pointer_value(VALUE_TAG_LIST, vex_list_tail(list));
+
+    Value arg = eval_ast(node->call.args[1]);
+    if (strcmp(name, "push") == 0) return make_pointer_value(VALUE_TAG_LIST, vex_list_push(list, value_to_word(arg, elem_type)));
+    if (strcmp(name, "concat") == 0) return make_pointer_value(VALUE_TAG_LIST, vex_list_concat(list, value_as_pointer(arg)));
+    if (strcmp(name, "take") == 0) return make_pointer_value(VALUE_TAG_LIST, vex_list_take(list, value_as_int(arg)));
+    if (strcmp(name, "drop") == 0) return make_pointer_value(VALUE_TAG_LIST, vex_list_drop(list, value_as_int(arg)));
+    if (strcmp(name, "update") == 0) {
+        int64_t word = value_to_word(eval_ast(node->call.args[2]), elem_type);
+        return make_pointer_value(VALUE_TAG_LIST, vex_list_update(list, value_as_int(arg), word));
+    }
+    return word_to_value(vex_list_index(list, value_as_int(arg)), elem_type);
+}
+
+/* Occurrences other than the scrutinee are read out of their parent the first time they are needed. */
+static Value occurrence_value(const MatchPlan *plan, Value *values, bool *known, int occurrence) {
+    if (known[occurrence]) return values[occurrence];
+
+    const MatchOccurrence *field = &plan->occurrences[occurrence];
+    Value parent_value = occurrence_value(plan, values, known, field->parent);
+    Value value;
+    const TypeTC *parent_type = plan->occurrences[field->parent].type;
+    if (parent_type->kind == TypeVariant) {
+        int64_t word = value_as_variant(parent_value);
+        int64_t field_word = parent_type->variant->layout == VariantNullable ? word
+                           : vex_variant_is_immediate(word) ? vex_variant_payload(word)
+                           : vex_variant_fields(vex_variant_object(word))[field->field];
+        value = word_to_value(field_word, type_name(field->type));
+    } else {
+        VexList *parent = value_as_pointer(parent_value);
+        value = field->field == 0 ? word_to_value(vex_list_head(parent), elem_type_names[vex_list_kind(parent)])
+                                  : make_pointer_value(VALUE_TAG_LIST, vex_list_tail(parent));
+    }
+    known[occurrence] = true;
+    return values[occurrence] = keep(value);
+}
+
+/* What a decision switches on; see match.h. */
+static int64_t match_tag(Value value, const TypeTC *type) {
+    if (type->kind == TypeVariant && type->variant->layout == VariantNullable) return value_as_variant(value) != 0;
+    if (type->kind == TypeVariant) return vex_variant_tag(value_as_variant(value), type->variant->pointer_tagged);
+    switch (value_kind(value)) {
+        case VAL_LIST: return vex_list_length(value_as_pointer(value)) != 0;
+        case VAL_BOOL: return value_as_bool(value);
+        case VAL_CHAR: return (unsigned char)value_as_char(value);
+        default: return value_as_int(value);
+    }
+}
+
+/*
+ * Fields are evaluated before the object is allocated, and kept until they
+ * are stored in it. A nullable option is its payload's word, or 0 (which
+ * reads back as unit) for None.
+ */
+static Value eval_construct(ASTNode *node) {
+    const VariantConstructor *constructor = node->construct.constructor;
+    if (constructor->type->layout == VariantNullable) {
+        if (constructor->field_count == 0) return make_variant_value(0);
+        return make_variant_value(value_to_word(eval_ast(node->construct.args[0]), type_name(constructor->fields[0])));
+    }
+    if (constructor->repr == ConstructorImmediate) return make_variant_value(vex_variant_immediate(constructor->tag, 0));
+    if (constructor->repr == ConstructorUnboxed) {
+        int64_t payload = value_to_word(eval_ast(node->construct.args[0]), type_name(constructor->fields[0]));
+        return make_variant_value(vex_variant_immediate(constructor->tag, payload));
+    }
+
+    Value inline_args[EVAL_INLINE_ARGS];
+    Value *args = constructor->field_count > EVAL_INLINE_ARGS ? malloc(sizeof(Value) * (size_t)constructor->field_count) : inline_args;
+    for (int i = 0; i < constructor->field_count; i++) {
+        args[i] = eval_ast(node->construct.args[i]);
+    }
+    VexVariant *variant = vex_variant_new(constructor->tag, (uint32_t)constructor->field_count, constructor->references);
+    int64_t *fields = vex_variant_fields(variant);
+    for (int i = 0; i < constructor->field_count; i++) {
+        fields[i] = value_to_word(args[i], type_name(constructor->fields[i]));
+    }
+    if (args != inline_args) free(args);
+    return make_variant_value(vex_variant_word(variant, constructor->type->pointer_tagged));
+}
+
+static Value eval_match(ASTNode *node) {
+    const MatchPlan *plan = node->match.plan;
+    Value inline_values[EVAL_INLINE_ARGS];
+    bool inline_known[EVAL_INLINE_ARGS] = { false };
+    bool large = plan->occurrence_count > EVAL_INLINE_ARGS;
+    Value *values = large ? malloc(sizeof(Value) * (size_t)plan->occurrence_count) : inline_values;
+    bool *known = large ? calloc((size_t)plan->occurrence_count, sizeof(bool)) : inline_known;
+
+    values[0] = eval_ast(node->match.scrutinee);
+    known[0] = true;
+    const Decision *decision = plan->tree;
+    while (decision && decision->kind == DecisionSwitch) {
+        Value value = occurrence_value(plan, values, known, decision->occurrence);
+        decision = decision_select(decision, match_tag(value, plan->occurrences[decision->occurrence].type));
+    }
+
+    Value result = VALUE_UNIT;
+    if (!decision || decision->kind == DecisionFail) {
+        fprintf(stderr, "Runtime error: no case of the match covers the value\n");
+    } else {
+        size_t saved_count = env->binding_count;
+        for (int i = 0; i < decision->binding_count; i++) {
+            const MatchBinding *binding = &decision->bindings[i];
+            bind(binding->name, occurrence_value(plan, values, known, binding->occurrence));
+        }
+        result = eval_ast(node->match.arms[decision->arm]);
+        unwind_bindings(saved_count);
+    }
+
+    if (large) {
+        free(values);
+        free(known);
+    }
+    return result;
+}
+
+ValueKind value_kind(Value v) {
+    switch (value_tag(v)) {
+        case VALUE_TAG_INT: return VAL_INT;
+        case VALUE_TAG_BOOL: return VAL_BOOL;
+        case VALUE_TAG_CHAR: return VAL_CHAR;
+        case VALUE_TAG_STRING: return VAL_STRING;
+        case VALUE_TAG_LIST: return VAL_LIST;
+        case VALUE_TAG_CLOSURE: return VAL_CLOSURE;
+        case VALUE_TAG_UNIT: return value_is_variant(v) ? VAL_VARIANT : VAL_UNIT;
+        default: return VAL_FLOAT;
+    }
+}
+
+static bool is_comparison(const char *op) {
+    return strcmp(op, "<") == 0 || strcmp(op, ">") == 0 || strcmp(op, "<=") == 0 ||
+           strcmp(op, ">=") == 0 || strcmp(op, "==") == 0 || strcmp(op, "!=") == 0;
+}
+
+static bool compare(const char *op, double a, double b) {
+    if (strcmp(op, "<") == 0) return a < b;
+    if (strcmp(op, ">") == 0) return a > b;
+    if (strcmp(op, "<=") == 0) return a <= b;
+    if (strcmp(op, ">=") == 0) return a >= b;
+    if (strcmp(op, "==") == 0) return a == b;
+    return a != b;
+}
+
+static Value eval_binary(const char *op, Value left, Value right) {
+    if (value_has_tag(left, VALUE_TAG_INT) && value_has_tag(right, VALUE_TAG_INT)) {
+        /* Computed wide and wrapped to 32 bits, as compiled code does. */
+        int64_t a = value_as_int(left), b = value_as_int(right);
+        int64_t op_result = 0;
+
+        if (strcmp(op, "+") == 0) {
+            op_result = a + b;
+        } else if (strcmp(op, "-") == 0) {
+            op_result = a - b;
+        } else if (strcmp(op, "*") == 0) {
+            op_result = a * b;
+        } else if (strcmp(op, "/") == 0) {
+            if (b == 0) {
+                fprintf(stderr, "Runtime error: division by zero\n");
+                return make_int_value(0);
+            }
+            op_result = a / b;
+        } else if (is_comparison(op)) {
+            return make_bool_value(compare(op, (double)a, (double)b));
+        } else {
+            fprintf(stderr, "Runtime error: unknown operator '%s'\n", op);
+            return VALUE_UNIT;
+        }
+
+        return make_int_value((int)(uint32_t)op_result);
+    } else if (value_is_float(left) && value_is_float(right)) {
+        double a = value_as_float(left), b = value_as_float(right);
+        double op_result = 0.0;
+
+        if (strcmp(op, "+.") == 0) {
+            op_result = a + b;
+        } else if (strcmp(op, "-.") == 0) {
+            op_result = a - b;
+        } else if (strcmp(op, "*.") == 0) {
+            op_result = a * b;
+        } else if (strcmp(op, "/.") == 0) {
+            if (b == 0.0) {
+                fprintf(stderr, "Runtime error: division by zero\n");
+                return VALUE_UNIT;
+            }
+            op_result = a / b;
+        } else if (is_comparison(op)) {
+            return make_bool_value(compare(op, a, b));
+        } else {
+            fprintf(stderr, "Runtime error: unknown operator '%s'\n", op);
+            return VALUE_UNIT;
+        }
+
+        return make_float_value(op_result);
+    } else if (value_has_tag(left, VALUE_TAG_BOOL) && value_has_tag(right, VALUE_TAG_BOOL)) {
+        if (strcmp(op, "&&") == 0) return make_bool_value(value_as_bool(left) && value_as_bool(right));
+        if (strcmp(op, "||") == 0) return make_bool_value(value_as_bool(left) || value_as_bool(right));
+    } else if (value_has_tag(left, VALUE_TAG_STRING) && value_has_tag(right, VALUE_TAG_STRING)) {
+        if (strcmp(op, "^") == 0) return make_string_value(vex_string_concat(value_as_string(left), value_as_string(right)));
+    }
+
+    return VALUE_UNIT;
+}
+
+/* A list operand is combined element by element with the other list, or with every element against a scalar. */
+static Value eval_elementwise(const char *op, Value left, Value right) {
+    VexList *left_list = value_has_tag(left, VALUE_TAG_LIST) ? value_as_pointer(left) : NULL;
+    VexList *right_list = value_has_tag(right, VALUE_TAG_LIST) ? value_as_pointer(right) : NULL;
+    if (left_list && right_list && left_list->length != right_list->length) {
+        fprintf(stderr, "Runtime error: '%s' on lists of length %lld and %lld\n", op, (long long)left_list->length, (long long)right_list->length);
+        return VALUE_UNIT;
+    }
+
+    VexList *shape = left_list ? left_list : right_list;
+    const char *elem_type = elem_type_names[vex_list_kind(shape)];
+    VexList *out = vex_list_new(is_comparison(op) ? VEX_ELEM_BOOL : vex_list_kind(shape), shape->length);
+    for (int64_t i = 0; i < shape->length; i++) {
+        Value a = left_list ? word_to_value(vex_list_get_word(left_list, i), elem_type) : left;
+        Value b = right_list ? word_to_value(vex_list_get_word(right_list, i), elem_type) : right;
+        vex_list_set_word(out, i, value_to_word(eval_binary(op, a, b), elem_type_names[vex_list_kind(out)]));
+    }
+    return make_pointer_value(VALUE_TAG_LIST, out);
+}
 
 Value eval_ast(ASTNode *node) {
-    Value result = { .kind = VAL_UNIT };
+    Value result = VALUE_UNIT;
 
     switch (node->type) {
         case NodeIntLit: {
-            result.kind = VAL_INT;
-            result.int_val = node->intval;
+            result = make_int_value(node->intval);
             break;
         }
 
         case NodeFloatLit: {
-            result.kind = VAL_FLOAT;
-            result.float_val = node->floatval;
+            result = make_float_value(node->floatval);
             break;
         }
 
         case NodeStringLit: {
-            result.kind = VAL_STRING;
-            result.string_val = node->strval;
+            if (!node->string_lit.interned) {
+                node->string_lit.interned = vex_string_intern(node->string_lit.value, (int64_t)strlen(node->string_lit.value));
+            }
+            result = make_string_value(node->string_lit.interned);
             break;
         }
 
         case NodeCharLit: {
-            result.kind = VAL_CHAR;
-            result.char_val = node->charval;
+            result = make_char_value(node->charval);
+            break;
+        }
+
+        case NodeBoolLit: {
+            result = make_bool_value(node->boolval);
             break;
         }
 
         case NodeBinaryExpr: {
+            const char *op = node->binary_expr.op;
+            /* && and || on bools only look at their right operand when the left one does not decide. */
+            if (node->tc_type && node->tc_type->kind == TypeBool && (strcmp(op, "&&") == 0 || strcmp(op, "||") == 0)) {
+                bool left = value_as_bool(eval_ast(node->binary_expr.left));
+                result = make_bool_value(left == (op[0] == '|') ? left : value_as_bool(eval_ast(node->binary_expr.right)));
+                break;
+            }
+
             Value left = eval_ast(node->binary_expr.left);
             Value right = eval_ast(node->binary_expr.right);
-            const char *op = node->binary_expr.op;
+            if (value_has_tag(left, VALUE_TAG_LIST) || value_has_tag(right, VALUE_TAG_LIST)) {
+                result = eval_elementwise(node->binary_expr.op, left, right);
+            } else {
+                result = eval_binary(node->binary_expr.op, left, right);
+            }
+            break;
+        }
 
-            if (left.kind == VAL_INT && right.kind == VAL_INT) {
-                int op_result = 0;
-
-                if (strcmp(op, "+") == 0) {
-                    op_result = left.int_val + right.int_val;
-                } else if (strcmp(op, "-") == 0) {
-                    op_result = left.int_val - right.int_val;
-                } else if (strcmp(op, "*") == 0) {
-                    op_result = left.int_val * right.int_val;
-                } else if (strcmp(op, "/") == 0) {
-                    if (right.int_val == 0) {
-                        fprintf(stderr, "Runtime error: division by zero\n");
-                        return (Value){ .kind = VAL_UNIT };
-                    }
-                    op_result = left.int_val / right.int_val;
-                } else {
-                    fprintf(stderr, "Runtime error: unknown operator '%s'\n", op);
-                    return (Value){ .kind = VAL_UNIT };
-                }
+        case NodeIdentifier: {
+            if (!lookup(node->strval, &result)) {
+                fprintf(stderr, "Runtime error: unbound identifier '%s'\n", node->strval);
+                return VALUE_UNIT;
+            }
+            break;
+        }
 
-                result.kind = VAL_INT;
-                result.int_val = op_result;
-            } else if (left.kind == VAL_FLOAT && right.kind == VAL_FLOAT) {
-                double op_result = 0.0;
-
-                if (strcmp(op, "+.") == 0) {
-                    op_result = left.float_val + right.float_val;
-                } else if (strcmp(op, "-.") == 0) {
-                    op_result = left.float_val - right.float_val;
-                } else if (strcmp(op, "*.") == 0) {
-                    op_result = left.float_val * right.float_val;
-                } else if (strcmp(op, "/.") == 0) {
-                    if (right.float_val == 0.0f) {
-                        fprintf(stderr, "Runtime error: division by zero\n");
-                        return (Value){ .kind = VAL_UNIT };
-                    }
-                    op_result = left.float_val / right.float_val;
-                } else {
-                    fprintf(stderr, "Runtime error: unknown operator '%s'\n", op);
-                    return (Value){ .kind = VAL_UNIT };
-                }
+        case NodeVarDecl: {
+            result = eval_ast(node->var_decl.expr);
+            bind(node->var_decl.value, result);
+            break;
+        }
+
+        case NodeFunction: {
+            result = make_closure(node);
+            bind(node->function.name, result);
+            break;
+        }
+
+        case NodeCall: {
+            ASTNode *callee_node = node->call.callee;
+            if (callee_node->type == NodeIdentifier && list_builtin_arity(callee_node->strval) && !lookup(callee_node->strval, &result)) {
+                result = eval_list_builtin(node);
+                break;
+            }
 
-                result.kind = VAL_FLOAT;
-                result.float_val = op_result;
+            Value callee = eval_ast(node->call.callee);
+            if (!value_has_tag(callee, VALUE_TAG_CLOSURE)) {
+                fprintf(stderr, "Runtime error: callee is not a function\n");
+                return VALUE_UNIT;
             }
 
+            Value inline_args[EVAL_INLINE_ARGS];
+            Value *args = inline_args;
+            if (node->call.arg_count > EVAL_INLINE_ARGS) {
+                args = malloc(sizeof(Value) * (size_t)node->call.arg_count);
+            }
+            for (int i = 0; i < node->call.arg_count; i++) {
+                args[i] = eval_ast(node->call.args[i]);
+            }
+
+            result = call_closure(value_as_pointer(callee), args, node->call.arg_count);
+            if (args != inline_args) free(args);
             break;
         }
 
         case NodeBlock: {
-            result.kind = VAL_UNIT;
+            size_t saved_count = env->binding_count, saved_temps = env->temp_count;
+            result = VALUE_UNIT;
             for (int i = 0; i < node->block.count; i++) {
                 ASTNode *stmt = node->block.statements[i];
+                if (profile_active) profile_line(stmt->line);
                 result = eval_ast(stmt);
+                env->temp_count = saved_temps;
+            }
+            unwind_bindings(saved_count);
+            break;
+        }
+
+        case NodeList: {
+            Value first = eval_ast(node->list.elements[0]);
+            VexElemKind kind = elem_kind_of_value(first);
+            VexList *list = vex_list_new(kind, node->list.count);
+            keep(make_pointer_value(VALUE_TAG_LIST, list));
+            vex_list_set_word(list, 0, value_to_word(first, elem_type_names[kind]));
+            for (int i = 1; i < node->list.count; i++) {
+                vex_list_set_word(list, i, value_to_word(eval_ast(node->list.elements[i]), elem_type_names[kind]));
             }
+            result = make_pointer_value(VALUE_TAG_LIST, list);
+            break;
+        }
+
+        case NodeListOp: {
+            result = eval_list_op(node);
+            break;
+        }
+
+        case NodeListPipeline: {
+            result = eval_pipeline(node);
+            break;
+        }
+
+        case NodeMatch: {
+            result = eval_match(node);
+            break;
+        }
+
+        case NodeIf: {
+            bool condition = value_as_bool(eval_ast(node->if_expr.condition));
+            result = eval_ast(condition ? node->if_expr.then_branch : node->if_expr.else_branch);
+            break;
+        }
+
+        case NodeConstruct: {
+            result = eval_construct(node);
+            break;
+        }
+
+        case NodeTypeDecl: {
+            result = VALUE_UNIT;
             break;
         }
 
         case NodePrint: {
             Value val = eval_ast(node->print.value);
 
-            printf("- : %s = ", node->print.type);
-
-            if (strcmp(node->print.type, "int") == 0 && val.kind == VAL_INT) {
-                printf("%d\n", val.int_val);
-            } else if (strcmp(node->print.type, "float") == 0 && val.kind == VAL_FLOAT) {
-                printf("%lf\n", val.float_val);
-            } else if (strcmp(node->print.type, "bool") == 0 && val.kind == VAL_BOOL) {
-                printf("%s\n", val.bool_val ? "true" : "false");
-            } else if (strcmp(node->print.type, "char") == 0 && val.kind == VAL_CHAR) {
-                printf("%c\n", val.char_val);
-            } else if (strcmp(node->print.type, "string") == 0 && val.kind == VAL_STRING) {
-                printf("%s\n", val.string_val);
+            if (eval_echo_types) printf("- : %s = ", node->print.type);
+
+            if (strcmp(node->print.type, "int") == 0 && value_has_tag(val, VALUE_TAG_INT)) {
+                printf("%d\n", value_as_int(val));
+            } else if (strcmp(node->print.type, "float") == 0 && value_is_float(val)) {
+                printf("%lf\n", value_as_float(val));
+            } else if (strcmp(node->print.type, "bool") == 0 && value_has_tag(val, VALUE_TAG_BOOL)) {
+                printf("%s\n", value_as_bool(val) ? "true" : "false");
+            } else if (strcmp(node->print.type, "char") == 0 && value_has_tag(val, VALUE_TAG_CHAR)) {
+                printf("%c\n", value_as_char(val));
+            } else if (strcmp(node->print.type, "string") == 0 && value_has_tag(val, VALUE_TAG_STRING)) {
+                printf("%s\n", vex_string_cstr(value_as_string(val)));
             } else {
                 fprintf(stderr, "Runtime error: print type <%s> does not match evaluated value kind\n", node->print.type);
             }
 
-            result.kind = VAL_UNIT;
+            result = VALUE_UNIT;
             break;
         }
 
         default:
             fprintf(stderr, "Runtime error: unsupported node type %d\n", node->type);
-            return (Value){ .kind = VAL_UNIT };
+            return VALUE_UNIT;
+    }
+
+    return keep(result);
+}
+
+Value eval_program(ASTNode *root) {
+    static bool roots_registered = false;
+    if (!roots_registered) {
+        vex_gc_add_roots(mark_roots);
+        roots_registered = true;
     }
+    if (root->type != NodeBlock) return eval_ast(root);
 
+    for (int i = 0; i < root->block.count; i++) {
+        ASTNode *stmt = root->block.statements[i];
+        if (stmt->type == NodeFunction) {
+            bind(stmt->function.name, make_closure(stmt));
+        }
+    }
+
+    Value result = VALUE_UNIT;
+    for (int i = 0; i < root->block.count; i++) {
+        ASTNode *stmt = root->block.statements[i];
+        if (stmt->type == NodeFunction) continue;
+        if (profile_active) profile_line(stmt->line);
+        size_t saved_temps = env->temp_count;
+        result = eval_ast(stmt);
+        env->temp_count = saved_temps;
+        vex_gc_poll();
+    }
     return result;
 }
+
+/* Compiles a top-level function before its first call; false if it stays interpreted. */
+bool eval_compile_global(const char *name) {
+    Value callee;
+    if (!lookup(name, &callee) || !value_has_tag(callee, VALUE_TAG_CLOSURE)) return false;
+    Closure *closure = value_as_pointer(callee);
+    return closure->native || (!closure->jit_failed && tier_up(closure));
+}
+
+bool eval_call_global(const char *name, Value *result) {
+    Value callee;
+    if (!lookup(name, &callee) || !value_has_tag(callee, VALUE_TAG_CLOSURE)) return false;
+    *result = call_closure(value_as_pointer(callee), NULL, 0);
+    return true;
+}
+
+/*
+ * Drops the top-level bindings of name that a newer one hides, so a REPL
+ * session holds one binding per name however often it is redefined. Only
+ * called between inputs, when no call is active.
+ */
+void eval_forget_shadowed(const char *name) {
+    size_t newest = env->global_count;
+    for (size_t i = 0; i < env->global_count; i++) {
+        if (strcmp(env->bindings[i].name, name) == 0) newest = i;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < env->global_count; i++) {
+        if (i != newest && strcmp(env->bindings[i].name, name) == 0) continue;
+        env->bindings[kept++] = env->bindings[i];
+    }
+    env->binding_count = env->global_count = kept;
+}
+
+/* Later evaluation binds in env, or in the program's own environment when env is NULL. */
+void eval_use_env(EvalEnv *use) {
+    env = use ? use : &default_env;
+}
+
+void eval_free_env(EvalEnv *free_env) {
+    free(free_env->bindings);
+    free(free_env->temps);
+    memset(free_env, 0, sizeof(EvalEnv));
+}
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+
+typedef struct ProfileFunction {
+    const char *name;
+    int line, active;
+    uint64_t calls, inclusive, exclusive;
+} ProfileFunction;
+
+typedef struct ProfileLine {
+    int active;
+    uint64_t hits, inclusive, exclusive;
+} ProfileLine;
+
+/* Calling-context tree: one node per distinct call path, used for folded stacks. */
+typedef struct CallNode {
+    int function;
+    uint64_t self;
+    struct CallNode *parent, *child, *sibling;
+} CallNode;
+
+typedef struct ProfileFrame {
+    int function, line;
+    CallNode *node;
+    uint64_t entered, children, stmt_start, line_start;
+} ProfileFrame;
+
+bool profile_active = false;
+
+static ProfileFunction *functions = NULL;
+static int function_count = 0, function_capacity = 0;
+static ProfileLine *lines = NULL;
+static int line_capacity = 0;
+static ProfileFrame *frames = NULL;
+static int frame_count = 0, frame_capacity = 0;
+static CallNode call_root = { .function = -1 };
+static uint64_t start_ticks;
+static struct timespec start_time;
+
+static void *grow(void *ptr, int *capacity, int needed, size_t elem_size) {
+    if (needed <= *capacity) return ptr;
+    int new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed) new_capacity *= 2;
+    ptr = realloc(ptr, (size_t)new_capacity * elem_size);
+    if (!ptr) {
+        fputs("profile: out of memory\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    memset((char *)ptr + (size_t)*capacity * elem_size, 0, (size_t)(new_capacity - *capacity) * elem_size);
+    *capacity = new_capacity;
+    return ptr;
+}
+
+static const char *function_name(int id) {
+    return id < 0 ? "<toplevel>" : functions[id].name;
+}
+
+static void close_line(ProfileFrame *frame, uint64_t now) {
+    if (frame->line < 0) return;
+    ProfileLine *l = &lines[frame->line];
+    l->exclusive += now - frame->line_start;
+    if (--l->active == 0) l->inclusive += now - frame->stmt_start;
+    frame->line = -1;
+}
+
+void profile_start(void) {
+    frames = grow(frames, &frame_capacity, 1, sizeof(ProfileFrame));
+    frame_count = 1;
+    timespec_get(&start_time, TIME_UTC);
+    start_ticks = profile_ticks();
+    frames[0] = (ProfileFrame){ .function = -1, .line = -1, .node = &call_root, .entered = start_ticks };
+    profile_active = true;
+}
+
+int profile_register_function(const char *name, int line) {
+    functions = grow(functions, &function_capacity, function_count + 1, sizeof(ProfileFunction));
+    /* A REPL input's AST is freed once its definitions are replaced, but the report outlives it. */
+    functions[function_count].name = strcpy(malloc(strlen(name) + 1), name);
+    functions[function_count].line = line;
+    return function_count++;
+}
+
+void profile_enter(int function_id) {
+    uint64_t now = profile_ticks();
+    ProfileFrame *caller = &frames[frame_count - 1];
+    if (caller->line >= 0) lines[caller->line].exclusive += now - caller->line_start;
+
+    CallNode *node = caller->node->child;
+    while (node && node->function != function_id) node = node->sibling;
+    if (!node) {
+        node = calloc(1, sizeof(CallNode));
+        node->function = function_id;
+        node->parent = caller->node;
+        node->sibling = caller->node->child;
+        caller->node->child = node;
+    }
+
+    ProfileFunction *f = &functions[function_id];
+    f->calls++;
+    f->active++;
+
+    frames = grow(frames, &frame_capacity, frame_count + 1, sizeof(ProfileFrame));
+    frames[frame_count++] = (ProfileFrame){ .function = function_id, .line = -1, .node = node, .entered = now };
+}
+
+void profile_exit(void) {
+    uint64_t now = profile_ticks();
+    ProfileFrame *frame = &frames[--frame_count];
+    close_line(frame, now);
+
+    uint64_t inclusive = now - frame->entered;
+    uint64_t exclusive = inclusive - frame->children;
+    ProfileFunction *f = &functions[frame->function];
+    f->exclusive += exclusive;
+    if (--f->active == 0) f->inclusive += inclusive;
+    frame->node->self += exclusive;
+
+    ProfileFrame *caller = &frames[frame_count - 1];
+    caller->children += inclusive;
+    caller->line_start = now;
+}
+
+void profile_line(int line) {
+    if (line < 0) return;
+    uint64_t now = profile_ticks();
+    ProfileFrame *frame = &frames[frame_count - 1];
+    close_line(frame, now);
+
+    lines = grow(lines, &line_capacity, line + 1, sizeof(ProfileLine));
+    lines[line].hits++;
+    lines[line].active++;
+    frame->line = line;
+    frame->stmt_start = now;
+    frame->line_start = now;
+}
+
+static double ns_per_tick;
+
+static double to_ms(uint64_t ticks) {
+    return (double)ticks * ns_per_tick / 1e6;
+}
+
+static int compare_exclusive(const void *a, const void *b) {
+    const ProfileFunction *fa = &functions[*(const int *)a];
+    const ProfileFunction *fb = &functions[*(const int *)b];
+    return (fa->exclusive < fb->exclusive) - (fa->exclusive > fb->exclusive);
+}
+
+static void write_folded(FILE *out, CallNode *node, const CallNode **path, int depth) {
+    path[depth] = node;
+    if (node->self > 0) {
+        for (int i = 0; i <= depth; i++) {
+            fprintf(out, "%s%s", i ? ";" : "", function_name(path[i]->function));
+        }
+        fprintf(out, " %llu\n", (unsigned long long)((double)node->self * ns_per_tick));
+    }
+    for (CallNode *child = node->child; child; child = child->sibling) {
+        write_folded(out, child, path, depth + 1);
+    }
+}
+
+static int call_tree_depth(const CallNode *node) {
+    int depth = 0;
+    for (const CallNode *child = node->child; child; child = child->sibling) {
+        int d = call_tree_depth(child);
+        if (d > depth) depth = d;
+    }
+    return depth + 1;
+}
+
+void profile_report(FILE *out, const char *folded_path) {
+    if (!profile_active) return;
+    profile_active = false;
+
+    uint64_t now = profile_ticks();
+    while (frame_count > 1) profile_exit();
+    close_line(&frames[0], now);
+    call_root.self += now - frames[0].entered - frames[0].children;
+
+    struct timespec end_time;
+    timespec_get(&end_time, TIME_UTC);
+    double elapsed_ns = (double)(end_time.tv_sec - start_time.tv_sec) * 1e9 + (double)(end_time.tv_nsec - start_time.tv_nsec);
+    ns_per_tick = now > start_ticks ? elapsed_ns / (double)(now - start_ticks) : 0.0;
+    double total_ms = elapsed_ns / 1e6;
+
+    int *order = malloc(sizeof(int) * (size_t)(function_count ? function_count : 1));
+    for (int i = 0; i < function_count; i++) order[i] = i;
+    qsort(order, (size_t)function_count, sizeof(int), compare_exclusive);
+
+    fprintf(out, "\nFunction profile (%.3f ms total)\n", total_ms);
+    fprintf(out, "%12s %12s %12s %8s  %s\n", "calls", "incl ms", "excl ms", "excl %", "function");
+    for (int i = 0; i < function_count; i++) {
+        ProfileFunction *f = &functions[order[i]];
+        if (f->calls == 0) continue;
+        fprintf(out, "%12llu %12.3f %12.3f %7.2f%%  %s (line %d)\n", (unsigned long long)f->calls, to_ms(f->inclusive), to_ms(f->exclusive), total_ms > 0 ? to_ms(f->exclusive) * 100.0 / total_ms : 0.0, f->name, f->line);
+    }
+    free(order);
+
+    fprintf(out, "\nLine profile\n");
+    fprintf(out, "%8s %12s %12s %12s\n", "line", "hits", "incl ms", "excl ms");
+    for (int i = 0; i < line_capacity; i++) {
+        if (lines[i].hits == 0) continue;
+        fprintf(out, "%8d %12llu %12.3f %12.3f\n", i, (unsigned long long)lines[i].hits, to_ms(lines[i].inclusive), to_ms(lines[i].exclusive));
+    }
+
+    if (folded_path) {
+        FILE *folded = fopen(folded_path, "w");
+        if (!folded) {
+            fprintf(stderr, "vex: error: could not write profile to '%s'\n", folded_path);
+            return;
+        }
+        const CallNode **path = malloc(sizeof(CallNode *) * (size_t)call_tree_depth(&call_root));
+        write_folded(folded, &call_root, path, 0);
+        free(path);
+        fclose(folded);
+        fprintf(out, "\nFolded stacks written to %s\n", folded_path);
+    }
+}
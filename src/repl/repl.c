@@ -3,21 +3,243 @@
 #include <stdlib.h>
 #include "tc.h"
 #include "ast.h"
+#include "common.h"
 #include "repl.h"
 #include "eval.h"
+#include "jit.h"
+#include "llvm.h"
 #include "parser.h"
 #include "memory.h"
+#include "profile.h"
 
-extern FILE *yyin;
+typedef struct yy_buffer_state *YY_BUFFER_STATE;
+
+extern int yylineno;
 extern ASTNode *root;
 extern Arena *global_arena;
+extern YY_BUFFER_STATE yy_scan_string(const char *str);
+extern void yy_delete_buffer(YY_BUFFER_STATE buffer);
 extern void yylex_destroy(void);
 
+#define REPL_LINE_ARENA_SIZE (16 * 1024)
+
+/*
+ * An input that defined something, kept in an arena of its own with its
+ * AST, types and closures. It is freed once none of its definitions is
+ * current and no kept input refers into it. Inputs that declare types are
+ * kept for the whole session, since those types are registered globally.
+ */
+typedef struct ReplLine {
+    Arena *arena;
+    int refs; /* its current definitions, plus kept inputs that depend on it */
+    bool declares_types;
+    struct ReplLine **depends; /* every input it refers into, directly or not */
+    int depend_count, depend_capacity;
+} ReplLine;
+
+/* A current top-level definition: its type entry and the input it lives in. */
+typedef struct ReplDefinition {
+    TypeEnv entry;
+    ReplLine *line;
+} ReplDefinition;
+
+/*
+ * State that outlives a single input line. The type environment holds one
+ * ReplDefinition per defined name; an input that defines nothing is freed
+ * as soon as it has run.
+ */
+typedef struct ReplSession {
+    TypeEnv *types;
+    EvalEnv values;
+    ReplLine **kept;
+    int kept_count, kept_capacity;
+    int lines;
+} ReplSession;
+
+static bool defines_names(ASTNode *node) {
+    if (node->type == NodeFunction || node->type == NodeVarDecl || node->type == NodeTypeDecl) return true;
+    if (node->type != NodeBlock) return false;
+    for (int i = 0; i < node->block.count; i++) {
+        ASTNode *stmt = node->block.statements[i];
+        if (stmt->type == NodeFunction || stmt->type == NodeVarDecl || stmt->type == NodeTypeDecl) return true;
+    }
+    return false;
+}
+
+static void release_line(ReplSession *session, ReplLine *line) {
+    if (--line->refs > 0 || line->declares_types) return;
+
+    for (int i = 0; i < session->kept_count; i++) {
+        if (session->kept[i] == line) {
+            session->kept[i] = session->kept[--session->kept_count];
+            break;
+        }
+    }
+    for (int i = 0; i < line->depend_count; i++) {
+        release_line(session, line->depends[i]);
+    }
+    /* What codegen has learned about functions is keyed by their names and nodes, some of which are the line's. */
+    free_function_defs();
+    arena_destroy(line->arena);
+    free(line->depends);
+    free(line);
+}
+
+static void add_dependency(ReplLine *line, ReplLine *on) {
+    if (on == line) return;
+    for (int i = 0; i < line->depend_count; i++) {
+        if (line->depends[i] == on) return;
+    }
+    if (line->depend_count == line->depend_capacity) {
+        line->depend_capacity = line->depend_capacity ? line->depend_capacity * 2 : 8;
+        line->depends = realloc(line->depends, sizeof(ReplLine *) * (size_t)line->depend_capacity);
+    }
+    line->depends[line->depend_count++] = on;
+    on->refs++;
+}
+
+/* The line and, since what it points to may point further, everything it depends on. */
+static void depend_on(ReplLine *line, ReplLine *on) {
+    add_dependency(line, on);
+    for (int i = 0; i < on->depend_count; i++) {
+        add_dependency(line, on->depends[i]);
+    }
+}
+
+static ReplLine *owning_line(ReplSession *session, const void *pointer) {
+    for (int i = 0; i < session->kept_count; i++) {
+        if (arena_owns(session->kept[i]->arena, pointer)) return session->kept[i];
+    }
+    return NULL;
+}
+
+static bool redefined_later(TypeEnv *newest, const TypeEnv *entry) {
+    for (TypeEnv *newer = newest; newer != entry; newer = newer->next) {
+        if (strcmp(newer->name, entry->name) == 0) return true;
+    }
+    return false;
+}
+
+/* Drops the session's definition of name, if any, for one the current input makes. */
+static void replace_definition(ReplSession *session, TypeEnv **types, const char *name) {
+    for (TypeEnv **link = types; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) != 0) continue;
+        ReplDefinition *replaced = (ReplDefinition *)*link;
+        *link = replaced->entry.next;
+        release_line(session, replaced->line);
+        free(replaced);
+        return;
+    }
+}
+
+/*
+ * Keeps an input that defined something. Its types may point into the
+ * types of any definition it looked up, and a val may hold a function
+ * defined by another input; those inputs are kept while it is. Each name
+ * it defines replaces the session's definition of that name, whose input
+ * is freed once nothing needs it.
+ */
+static void keep_line(ReplSession *session, Arena *arena, ASTNode *input, TypeEnv *before) {
+    ReplLine *line = calloc(1, sizeof(ReplLine));
+    line->arena = arena;
+    for (int i = 0; i < input->block.count; i++) {
+        if (input->block.statements[i]->type == NodeTypeDecl) line->declares_types = true;
+    }
+
+    for (TypeEnv *entry = before; entry; entry = entry->next) {
+        if (entry->used) depend_on(line, ((ReplDefinition *)entry)->line);
+        entry->used = false;
+    }
+    for (int i = 0; i < input->block.count; i++) {
+        ASTNode *stmt = input->block.statements[i];
+        ASTNode *function = stmt->type == NodeVarDecl ? eval_global_function(stmt->var_decl.value) : NULL;
+        ReplLine *owner = function ? owning_line(session, function) : NULL;
+        if (owner) depend_on(line, owner);
+    }
+
+    /* The input's own entries come newest first, and the newest of a name is the one that stands. */
+    TypeEnv *added = NULL, **tail = &added;
+    for (TypeEnv *entry = session->types; entry != before; entry = entry->next) {
+        if (redefined_later(session->types, entry)) continue;
+        ReplDefinition *definition = malloc(sizeof(ReplDefinition));
+        definition->entry = (TypeEnv){ entry->name, entry->type, false, NULL };
+        definition->line = line;
+        line->refs++;
+        *tail = &definition->entry;
+        tail = &definition->entry.next;
+    }
+    for (TypeEnv *entry = added; entry; entry = entry->next) {
+        eval_forget_shadowed(entry->name);
+        replace_definition(session, &before, entry->name);
+    }
+    *tail = before;
+    session->types = added;
+
+    if (session->kept_count == session->kept_capacity) {
+        session->kept_capacity = session->kept_capacity ? session->kept_capacity * 2 : 32;
+        session->kept = realloc(session->kept, sizeof(ReplLine *) * (size_t)session->kept_capacity);
+    }
+    session->kept[session->kept_count++] = line;
+}
+
+static void repl_eval_line(ReplSession *session, const char *line) {
+    Arena *arena = arena_create(REPL_LINE_ARENA_SIZE);
+    global_arena = arena;
+
+    YY_BUFFER_STATE buffer = yy_scan_string(line);
+    yylineno = ++session->lines;
+    root = NULL;
+    int status = yyparse();
+    yy_delete_buffer(buffer);
+
+    bool ran = false;
+    TypeEnv *before = session->types;
+    if (status == 0 && root) {
+        typecheck_with_env(root, &session->types);
+        root = fuse_list_pipelines(root);
+        mark_local_lists(root);
+        if (vex_options.jit_repl) {
+            ran = jit_repl_line(root);
+        } else {
+            eval_program(root);
+            ran = true;
+        }
+    }
+
+    if (ran && defines_names(root)) {
+        keep_line(session, arena, root, before);
+    } else {
+        session->types = before;
+        for (TypeEnv *entry = before; entry; entry = entry->next) entry->used = false;
+        arena_destroy(arena);
+    }
+    global_arena = NULL;
+}
+
+static void end_session(ReplSession *session) {
+    while (session->types) {
+        ReplDefinition *definition = (ReplDefinition *)session->types;
+        session->types = definition->entry.next;
+        free(definition);
+    }
+    for (int i = 0; i < session->kept_count; i++) {
+        arena_destroy(session->kept[i]->arena);
+        free(session->kept[i]->depends);
+        free(session->kept[i]);
+    }
+    free(session->kept);
+    eval_free_env(&session->values);
+}
+
 void vex_repl(void) {
     char line[1024];
-    global_arena = arena_create(1024 * 1024);
+    ReplSession session = { 0 };
+    eval_use_env(&session.values);
 
     puts("Vex REPL\nType :quit to exit.\n");
+    eval_tier_threshold = vex_options.profile ? 0 : vex_options.jit_threshold;
+    llvm_auto_par = vex_options.auto_par;
+    if (vex_options.profile) profile_start();
 
     while (true) {
         printf(">>> ");
@@ -33,22 +255,12 @@ void vex_repl(void) {
 
         if (strncmp(line, ":quit", 5) == 0) break;
 
-        FILE* buffer = fmemopen(line, strlen(line), "r");
-        if (!buffer) {
-            fprintf(stderr, "Failed to open memory stream.\n");
-            continue;
-        }
-
-        yyin = buffer;
-        root = NULL;
-
-        yyparse();
-        typecheck(root);
-        eval_ast(root);
-
-        fclose(buffer);
+        repl_eval_line(&session, line);
     }
 
-    arena_destroy(global_arena);
+    if (vex_options.profile) profile_report(stderr, vex_options.profile_output);
+    jit_shutdown();
+    eval_use_env(NULL);
+    end_session(&session);
     yylex_destroy();
 }
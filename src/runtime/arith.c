@@ -0,0 +1,8 @@
+#include <stdio.h>
+#include "arith.h"
+
+void vex_division_by_zero(int64_t count) {
+    for (int64_t i = 0; i < count; i++) {
+        fputs("Runtime error: division by zero\n", stderr);
+    }
+}
@@ -0,0 +1,423 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gc.h"
+#include "vector.h"
+
+/*
+ * Generational mark-region collector. The heap is a set of 32 KiB blocks
+ * cut into 128-byte lines; each thread bump-allocates through runs of free
+ * lines, so allocation is a pointer increment. Objects never move: a minor
+ * collection marks the young objects that are still reachable, promotes
+ * them in place and frees every line that holds no old object; a major one
+ * re-marks the whole heap. Objects of LARGE_SIZE or more are allocated on
+ * their own and freed individually.
+ *
+ * Collections only start at safepoints, where every live object is reachable
+ * from a root: the shadow frames of compiled code, registered globals and
+ * the interpreter. Runtime code that calls back into Vex, or runs it on
+ * other threads, blocks collection until it is done.
+ */
+
+#define BLOCK_SIZE      (32 * 1024)
+#define LINE_SIZE       128
+#define LINE_COUNT      (BLOCK_SIZE / LINE_SIZE)
+#define LARGE_SIZE      (BLOCK_SIZE / 4)
+#define NURSERY_DEFAULT (4 * 1024 * 1024)
+#define MAJOR_MIN       (32 * 1024 * 1024)
+#define LARGE_FLAG      0x80
+
+typedef struct GcHeader {
+    uint32_t size;  /* including this header; 0 for large objects */
+    uint8_t kind;   /* VexGcKind, plus LARGE_FLAG */
+    uint8_t old;
+    uint8_t logged; /* already in the remembered set */
+    uint8_t mark;   /* epoch of the last collection that found it live */
+} GcHeader;
+
+/* Lines are marked while they hold part of a live old object; the rest are free. */
+typedef struct Block {
+    uint8_t lines[LINE_COUNT];
+} Block;
+
+#define FIRST_LINE ((sizeof(Block) + LINE_SIZE - 1) / LINE_SIZE)
+
+typedef struct LargeObject {
+    struct LargeObject *next;
+    size_t size;
+    GcHeader header;
+} LargeObject;
+
+/* A thread's current run of free lines; stale once a collection has run since it was taken. */
+typedef struct Allocator {
+    char *cursor, *limit;
+    Block *block;
+    size_t line;
+    unsigned long collections;
+} Allocator;
+
+typedef struct PointerArray {
+    void **items;
+    size_t count, capacity;
+} PointerArray;
+
+atomic_int vex_gc_pending = 0;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static PointerArray blocks, recyclable, empty;
+static PointerArray remembered, grey, globals;
+static VexGcRootFn *root_fns = NULL;
+static size_t root_fn_count = 0;
+static LargeObject *large_objects = NULL;
+static size_t large_bytes = 0;
+
+static atomic_int blocked = 0;
+static atomic_ulong collections = 0;
+static atomic_size_t allocated = 0; /* bytes handed out since the last collection */
+static size_t nursery_size = NURSERY_DEFAULT;
+static size_t old_size = 0, major_threshold = MAJOR_MIN;
+static uint8_t epoch = 1;
+static bool major = false;
+
+static unsigned long minor_count = 0, major_count = 0;
+static size_t peak_heap = 0;
+
+static _Thread_local Allocator tlab;
+static _Thread_local VexGcFrame *frames = NULL;
+
+static void out_of_memory(void) {
+    fputs("vex: out of memory\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+static void push(PointerArray *array, void *item) {
+    if (array->count == array->capacity) {
+        array->capacity = array->capacity ? array->capacity * 2 : 64;
+        array->items = realloc(array->items, sizeof(void *) * array->capacity);
+        if (!array->items) out_of_memory();
+    }
+    array->items[array->count++] = item;
+}
+
+static void report_stats(void) {
+    fprintf(stderr, "vex: gc: %lu minor and %lu major collections, heap peaked at %zu KiB\n",
+            minor_count, major_count, peak_heap / 1024);
+}
+
+static void init_heap(void) {
+    const char *env = getenv("VEX_GC_NURSERY");
+    long kib = env ? strtol(env, NULL, 10) : 0;
+    if (kib > 0) nursery_size = (size_t)kib * 1024;
+    if (getenv("VEX_GC_STATS")) atexit(report_stats);
+}
+
+static void note_peak(void) {
+    size_t heap = blocks.count * BLOCK_SIZE + large_bytes;
+    if (heap > peak_heap) peak_heap = heap;
+}
+
+static void note_allocated(size_t bytes) {
+    if (atomic_fetch_add_explicit(&allocated, bytes, memory_order_relaxed) + bytes >= nursery_size) {
+        atomic_store_explicit(&vex_gc_pending, 1, memory_order_relaxed);
+    }
+}
+
+/* Called with heap_lock held. Partly used blocks are preferred so the heap stays compact. */
+static Block *take_block(void) {
+    if (recyclable.count) return recyclable.items[--recyclable.count];
+    if (empty.count) return empty.items[--empty.count];
+
+    Block *block = aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+    if (!block) out_of_memory();
+    memset(block->lines, 0, sizeof(block->lines));
+    push(&blocks, block);
+    note_peak();
+    return block;
+}
+
+/* Moves this thread's allocator to the next run of free lines that can hold size bytes. */
+static void refill(size_t size) {
+    pthread_once(&init_once, init_heap);
+    unsigned long now = atomic_load_explicit(&collections, memory_order_acquire);
+    if (tlab.collections != now) {
+        tlab.block = NULL;
+        tlab.collections = now;
+    }
+
+    for (;;) {
+        Block *block = tlab.block;
+        size_t line = tlab.line;
+        while (block && line < LINE_COUNT) {
+            while (line < LINE_COUNT && block->lines[line]) line++;
+            size_t end = line;
+            while (end < LINE_COUNT && !block->lines[end]) end++;
+            if ((end - line) * LINE_SIZE >= size) {
+                tlab.cursor = (char *)block + line * LINE_SIZE;
+                tlab.limit = (char *)block + end * LINE_SIZE;
+                tlab.line = end;
+                note_allocated((end - line) * LINE_SIZE);
+                return;
+            }
+            line = end;
+        }
+
+        pthread_mutex_lock(&heap_lock);
+        tlab.block = take_block();
+        pthread_mutex_unlock(&heap_lock);
+        tlab.line = FIRST_LINE;
+    }
+}
+
+static void *alloc_large(size_t size, VexGcKind kind) {
+    pthread_once(&init_once, init_heap);
+    LargeObject *object = malloc(sizeof(LargeObject) + size);
+    if (!object) out_of_memory();
+    object->size = size;
+    object->header = (GcHeader){ 0, (uint8_t)(kind | LARGE_FLAG), 0, 0, 0 };
+
+    pthread_mutex_lock(&heap_lock);
+    object->next = large_objects;
+    large_objects = object;
+    large_bytes += size;
+    note_peak();
+    pthread_mutex_unlock(&heap_lock);
+
+    note_allocated(size);
+    return &object->header + 1;
+}
+
+void *vex_gc_alloc(size_t size, VexGcKind kind) {
+    size_t total = (sizeof(GcHeader) + size + 7) & ~(size_t)7;
+    if (total >= LARGE_SIZE) return alloc_large(size, kind);
+
+    if (tlab.collections != atomic_load_explicit(&collections, memory_order_relaxed) ||
+        (size_t)(tlab.limit - tlab.cursor) < total) {
+        refill(total);
+    }
+    GcHeader *header = (GcHeader *)(void *)tlab.cursor;
+    tlab.cursor += total;
+    *header = (GcHeader){ (uint32_t)total, (uint8_t)kind, 0, 0, 0 };
+    return header + 1;
+}
+
+static GcHeader *header_of(const void *object) {
+    return (GcHeader *)(uintptr_t)object - 1;
+}
+
+/* Usable bytes of object, which can exceed what was asked for once rounding is counted. */
+size_t vex_gc_size(const void *object) {
+    const GcHeader *header = header_of(object);
+    if (!(header->kind & LARGE_FLAG)) return header->size - sizeof(GcHeader);
+    const LargeObject *large = (const LargeObject *)(const void *)((const char *)header - offsetof(LargeObject, header));
+    return large->size;
+}
+
+/*
+ * Old objects are only written while they are being built, except for the
+ * elements of a list of strings or lists, which the interpreter may fill
+ * in across a collection and which an owned update may overwrite in place.
+ * Those lists are remembered so a minor collection can find the young
+ * objects they point to.
+ */
+void vex_gc_write_barrier(const void *object) {
+    GcHeader *header = header_of(object);
+    if (!header->old || header->logged) return;
+
+    pthread_mutex_lock(&heap_lock);
+    if (!header->logged) {
+        header->logged = 1;
+        push(&remembered, (void *)(uintptr_t)object);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void vex_gc_push_frame(VexGcFrame *frame) {
+    frame->prev = frames;
+    frames = frame;
+}
+
+void vex_gc_pop_frame(VexGcFrame *frame) {
+    frames = frame->prev;
+}
+
+void vex_gc_add_global(void *slot) {
+    pthread_mutex_lock(&heap_lock);
+    push(&globals, slot);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void vex_gc_add_roots(VexGcRootFn fn) {
+    pthread_mutex_lock(&heap_lock);
+    root_fns = realloc(root_fns, sizeof(VexGcRootFn) * (root_fn_count + 1));
+    if (!root_fns) out_of_memory();
+    root_fns[root_fn_count++] = fn;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* Collection waits while the caller runs Vex code on other threads or holds unrooted lists. */
+void vex_gc_block(void) {
+    atomic_fetch_add_explicit(&blocked, 1, memory_order_acquire);
+}
+
+void vex_gc_unblock(void) {
+    atomic_fetch_sub_explicit(&blocked, 1, memory_order_release);
+}
+
+static void mark_lines(const GcHeader *header) {
+    if (header->kind & LARGE_FLAG) return;
+    Block *block = (Block *)((uintptr_t)header & ~(uintptr_t)(BLOCK_SIZE - 1));
+    size_t offset = (size_t)((const char *)header - (const char *)block);
+    size_t first = offset / LINE_SIZE, last = (offset + header->size - 1) / LINE_SIZE;
+    memset(block->lines + first, 1, last - first + 1);
+}
+
+/* Returns true when object was not yet marked in this collection, so its fields need tracing. */
+bool vex_gc_mark(const void *object) {
+    GcHeader *header = header_of(object);
+    if (header->mark == epoch || (header->old && !major)) return false;
+    header->mark = epoch;
+    header->old = 1;
+    mark_lines(header);
+    return true;
+}
+
+void vex_gc_mark_list(const VexList *list) {
+    if (!list || (list->flags & (VEX_LIST_STATIC | VEX_LIST_LOCAL))) return;
+    if (vex_gc_mark(list)) push(&grey, (void *)(uintptr_t)list);
+}
+
+/* Inline and static strings are not on the heap; a flat string has nothing to trace. */
+void vex_gc_mark_string(const VexString *string) {
+    if (!string || vex_string_is_inline(string) || (string->flags & VEX_STRING_STATIC)) return;
+    if (vex_gc_mark(string) && (string->flags & VEX_STRING_ROPE)) push(&grey, (void *)(uintptr_t)string);
+}
+
+void vex_gc_mark_variant(const VexVariant *variant) {
+    if (vex_gc_mark(variant) && variant->references) push(&grey, (void *)(uintptr_t)variant);
+}
+
+void vex_gc_mark_element(VexElemKind kind, int64_t word) {
+    if (kind == VEX_ELEM_LIST) vex_gc_mark_list((const VexList *)(uintptr_t)word);
+    if (kind == VEX_ELEM_STRING) vex_gc_mark_string((const VexString *)(uintptr_t)word);
+}
+
+/*
+ * A root slot holds a list, a string or a variant. All three keep their
+ * flags at the same offset, which tells whether there is a heap header
+ * to look at. Inline strings and immediate variants both have the low
+ * bit set; a boxed variant may carry its tag in the next two bits.
+ */
+void vex_gc_mark_root(const void *object) {
+    if (!object || vex_string_is_inline(object)) return;
+    object = vex_variant_object((int64_t)(uintptr_t)object);
+    if (((const VexList *)object)->flags & (VEX_LIST_STATIC | VEX_LIST_LOCAL)) return;
+    switch (header_of(object)->kind & ~LARGE_FLAG) {
+        case VEX_GC_STRING: vex_gc_mark_string(object); break;
+        case VEX_GC_VARIANT: vex_gc_mark_variant(object); break;
+        default: vex_gc_mark_list(object); break;
+    }
+}
+
+static void trace(const void *object) {
+    switch (header_of(object)->kind & ~LARGE_FLAG) {
+        case VEX_GC_STRING: vex_string_trace(object); break;
+        case VEX_GC_VARIANT: vex_variant_trace(object); break;
+        default: vex_list_trace(object); break;
+    }
+}
+
+static void mark_roots(void) {
+    for (VexGcFrame *frame = frames; frame; frame = frame->prev) {
+        for (int64_t i = 0; i < frame->count; i++) vex_gc_mark_root(frame->roots[i]);
+    }
+    for (size_t i = 0; i < globals.count; i++) {
+        vex_gc_mark_root(*(void **)globals.items[i]);
+    }
+    for (size_t i = 0; i < root_fn_count; i++) root_fns[i]();
+
+    for (size_t i = 0; i < remembered.count; i++) {
+        if (!major) vex_list_trace(remembered.items[i]);
+        header_of(remembered.items[i])->logged = 0;
+    }
+    remembered.count = 0;
+}
+
+/* Unmarked objects carry an older epoch (or 0 while young), so this holds after either kind of collection. */
+static void sweep_large(void) {
+    LargeObject **link = &large_objects;
+    while (*link) {
+        LargeObject *object = *link;
+        if (object->header.mark == epoch) {
+            link = &object->next;
+            continue;
+        }
+        *link = object->next;
+        large_bytes -= object->size;
+        free(object);
+    }
+}
+
+/* Sorts blocks by how many free lines they have; empty blocks beyond one nursery's worth go back to the system. */
+static void sweep_blocks(void) {
+    size_t keep_empty = nursery_size / BLOCK_SIZE, kept = 0, live_lines = 0;
+    recyclable.count = 0;
+    empty.count = 0;
+
+    for (size_t i = 0; i < blocks.count; i++) {
+        Block *block = blocks.items[i];
+        size_t used = 0;
+        for (size_t line = FIRST_LINE; line < LINE_COUNT; line++) used += block->lines[line];
+        live_lines += used;
+
+        if (used == 0 && empty.count >= keep_empty) {
+            free(block);
+            continue;
+        }
+        blocks.items[kept++] = block;
+        if (used == 0) {
+            push(&empty, block);
+        } else if (used < LINE_COUNT - FIRST_LINE) {
+            push(&recyclable, block);
+        }
+    }
+    blocks.count = kept;
+    old_size = live_lines * LINE_SIZE + large_bytes;
+}
+
+void vex_gc_collect(bool full) {
+    pthread_mutex_lock(&heap_lock);
+    major = full;
+    if (major) {
+        epoch = (uint8_t)(epoch % 255 + 1);
+        for (size_t i = 0; i < blocks.count; i++) {
+            memset(((Block *)blocks.items[i])->lines, 0, sizeof(((Block *)blocks.items[i])->lines));
+        }
+    }
+
+    mark_roots();
+    while (grey.count) trace(grey.items[--grey.count]);
+
+    sweep_large();
+    sweep_blocks();
+    if (major) {
+        major_count++;
+        major_threshold = old_size * 2 > MAJOR_MIN ? old_size * 2 : MAJOR_MIN;
+    } else {
+        minor_count++;
+    }
+
+    atomic_store_explicit(&allocated, 0, memory_order_relaxed);
+    atomic_store_explicit(&vex_gc_pending, 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&collections, 1, memory_order_release);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void vex_gc_safepoint(void) {
+    if (!atomic_load_explicit(&vex_gc_pending, memory_order_relaxed)) return;
+    if (atomic_load_explicit(&blocked, memory_order_acquire) > 0) return;
+
+    vex_gc_collect(false);
+    if (old_size >= major_threshold) vex_gc_collect(true);
+}
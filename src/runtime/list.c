@@ -0,0 +1,619 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gc.h"
+#include "list.h"
+#include "par.h"
+#include "vector.h"
+
+/* The bulk operations call fn per element, or hand whole chunks to kernel when there is one. */
+typedef struct MapJob {
+    const VexList *in;
+    VexList *out;
+    VexWordFn fn;
+    VexMapKernel kernel;
+} MapJob;
+
+typedef struct FilterJob {
+    const VexList *in;
+    VexList *out;
+    VexWordFn fn;
+    VexFilterKernel kernel;
+    uint8_t *keep;
+    int64_t *offsets;
+} FilterJob;
+
+typedef struct ReduceJob {
+    const VexList *in;
+    VexWordFn fn; /* also combines the chunk results */
+    VexReduceKernel kernel;
+    int64_t init;
+    int64_t *partials;
+} ReduceJob;
+
+typedef struct PipelineJob {
+    const VexList *in;
+    VexList *out;
+    VexStageFn stage;
+    void *ctx;
+    int64_t *per_chunk; /* survivors of each chunk, or its fold when reducing */
+    uint8_t *folded;    /* whether a chunk's fold saw any element, when reducing */
+    VexWordFn combine;
+    int64_t init;
+} PipelineJob;
+
+static void *checked_malloc(size_t size) {
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        fputs("vex: out of memory\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static int64_t chunk_count(int64_t length) {
+    return (length + VEX_LIST_GRAIN - 1) / VEX_LIST_GRAIN;
+}
+
+static int64_t chunk_end(int64_t chunk, int64_t length) {
+    int64_t end = (chunk + 1) * VEX_LIST_GRAIN;
+    return end < length ? end : length;
+}
+
+/* The header and its elements share one allocation. */
+VexList *vex_list_new(VexElemKind kind, int64_t length) {
+    int32_t elem_size = vex_elem_size(kind);
+    VexList *list = vex_gc_alloc(sizeof(VexList) + (size_t)length * (size_t)elem_size, VEX_GC_LIST);
+    list->length = length;
+    list->elem_size = elem_size;
+    list->flags = (uint32_t)kind;
+    list->data = list + 1;
+    /* The interpreter fills a list one element at a time, and a collection may trace it half done. */
+    if (vex_elem_is_reference(kind)) memset(list->data, 0, (size_t)length * (size_t)elem_size);
+    return list;
+}
+
+int64_t vex_list_length(const VexList *list) {
+    return list->length;
+}
+
+static bool is_tree(const VexList *list) {
+    return (list->flags & VEX_LIST_TREE) != 0;
+}
+
+/* Small results are stored contiguously again; larger ones keep the tree. */
+static VexList *from_vector(VexElemKind kind, const VexVector *vector) {
+    int64_t length = vex_vector_length(vector);
+    if (length <= VEX_LIST_FLAT_MAX) {
+        VexList *flat = vex_list_new(kind, length);
+        vex_vector_to_list(vector, flat);
+        return flat;
+    }
+
+    VexList *list = vex_gc_alloc(sizeof(VexList) + sizeof(VexVector), VEX_GC_LIST);
+    list->length = length;
+    list->elem_size = vex_elem_size(kind);
+    list->flags = (uint32_t)kind | VEX_LIST_TREE;
+    list->data = list + 1;
+    memcpy(list->data, vector, sizeof(VexVector));
+    return list;
+}
+
+static void to_vector(const VexList *list, VexVector *out) {
+    if (is_tree(list)) {
+        memcpy(out, list->data, sizeof(VexVector));
+    } else {
+        vex_vector_from_list(out, list);
+    }
+}
+
+/* Bulk operations walk a contiguous buffer; a tree is flattened once up front. */
+const VexList *vex_list_contiguous(const VexList *list) {
+    if (!is_tree(list)) return list;
+    VexList *flat = vex_list_new(vex_list_kind(list), list->length);
+    vex_vector_to_list(list->data, flat);
+    return flat;
+}
+
+/* The list that owns a view's elements is stored after the view's header, which keeps it alive. */
+static const VexList *view_owner(const VexList *view) {
+    const VexList *owner;
+    memcpy(&owner, view + 1, sizeof(owner));
+    return owner;
+}
+
+static VexList *new_view(const VexList *list, int64_t begin, int64_t end) {
+    const VexList *owner = (list->flags & VEX_LIST_VIEW) ? view_owner(list) : list;
+    VexList *view = vex_gc_alloc(sizeof(VexList) + sizeof(owner), VEX_GC_LIST);
+    view->length = end - begin;
+    view->elem_size = list->elem_size;
+    view->flags = (uint32_t)vex_list_kind(list) | VEX_LIST_VIEW;
+    view->data = (char *)list->data + begin * list->elem_size;
+    memcpy(view + 1, &owner, sizeof(owner));
+    return view;
+}
+
+static VexList *copy_flat(const VexList *list, int64_t length) {
+    VexList *copy = vex_list_new(vex_list_kind(list), length);
+    memcpy(copy->data, list->data, (size_t)list->length * (size_t)list->elem_size);
+    return copy;
+}
+
+/* Length shared by the two operands of an elementwise operation. */
+int64_t vex_list_zip_length(const VexList *left, const VexList *right) {
+    if (left->length != right->length) {
+        fprintf(stderr, "vex: elementwise operation on lists of length %lld and %lld\n", (long long)left->length, (long long)right->length);
+        exit(EXIT_FAILURE);
+    }
+    return left->length;
+}
+
+static void check_index(const VexList *list, int64_t index, const char *what) {
+    if (index < 0 || index >= list->length) {
+        fprintf(stderr, "vex: %s: index %lld out of bounds for list of length %lld\n", what, (long long)index, (long long)list->length);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int64_t vex_list_index(const VexList *list, int64_t index) {
+    check_index(list, index, "nth");
+    return vex_list_get_word(list, index);
+}
+
+int64_t vex_list_head(const VexList *list) {
+    check_index(list, 0, "head");
+    return vex_list_get_word(list, 0);
+}
+
+static void check_count(const VexList *list, int64_t count, const char *what) {
+    if (count < 0 || count > list->length) {
+        fprintf(stderr, "vex: %s: count %lld out of range for list of length %lld\n", what, (long long)count, (long long)list->length);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* O(1) for contiguous lists: the tail is a new header over the same elements, which are never mutated. */
+VexList *vex_list_tail(const VexList *list) {
+    check_index(list, 0, "tail");
+    if (is_tree(list)) return vex_list_drop(list, 1);
+    return new_view(list, 1, list->length);
+}
+
+VexList *vex_list_push(const VexList *list, int64_t word) {
+    if (!is_tree(list) && list->length < VEX_LIST_FLAT_MAX) {
+        VexList *out = copy_flat(list, list->length + 1);
+        vex_list_set_word(out, list->length, word);
+        return out;
+    }
+
+    VexVector vector, result;
+    to_vector(list, &vector);
+    vex_vector_push(&result, &vector, word);
+    return from_vector(vex_list_kind(list), &result);
+}
+
+VexList *vex_list_update(const VexList *list, int64_t index, int64_t word) {
+    check_index(list, index, "update");
+    if (!is_tree(list) && list->length <= VEX_LIST_FLAT_MAX) {
+        VexList *out = copy_flat(list, list->length);
+        vex_list_set_word(out, index, word);
+        return out;
+    }
+
+    VexVector vector, result;
+    to_vector(list, &vector);
+    vex_vector_update(&result, &vector, index, word);
+    return from_vector(vex_list_kind(list), &result);
+}
+
+VexList *vex_list_concat(const VexList *left, const VexList *right) {
+    if (!is_tree(left) && !is_tree(right) && left->length + right->length <= VEX_LIST_FLAT_MAX) {
+        VexList *out = copy_flat(left, left->length + right->length);
+        memcpy((char *)out->data + left->length * left->elem_size, right->data, (size_t)right->length * (size_t)right->elem_size);
+        return out;
+    }
+
+    VexVector left_vector, right_vector, result;
+    to_vector(left, &left_vector);
+    to_vector(right, &right_vector);
+    vex_vector_concat(&result, &left_vector, &right_vector);
+    return from_vector(vex_list_kind(left), &result);
+}
+
+VexList *vex_list_take(const VexList *list, int64_t count) {
+    check_count(list, count, "take");
+    if (!is_tree(list)) return new_view(list, 0, count);
+
+    VexVector result;
+    vex_vector_slice(&result, list->data, 0, count);
+    return from_vector(vex_list_kind(list), &result);
+}
+
+VexList *vex_list_drop(const VexList *list, int64_t count) {
+    check_count(list, count, "drop");
+    if (!is_tree(list)) return new_view(list, count, list->length);
+
+    VexVector result;
+    vex_vector_slice(&result, list->data, count, list->length);
+    return from_vector(vex_list_kind(list), &result);
+}
+
+/*
+ * The _owned functions take a list that only their caller refers to, so
+ * when its elements follow its header in memory nobody else can see they
+ * are overwritten in place. Spare room at the end of the allocation lets
+ * repeated pushes grow the list by doubling, as a mutable array would.
+ * Any other list goes through the persistent version instead.
+ */
+static bool is_reusable(const VexList *list) {
+    return !(list->flags & (VEX_LIST_STATIC | VEX_LIST_VIEW | VEX_LIST_TREE | VEX_LIST_LOCAL)) && list->data == list + 1;
+}
+
+static int64_t capacity(const VexList *list) {
+    return (int64_t)((vex_gc_size(list) - sizeof(VexList)) / (size_t)list->elem_size);
+}
+
+/* Makes room for length elements, moving to a bigger allocation when needed. */
+static VexList *reserve(VexList *list, int64_t length) {
+    if (length <= capacity(list)) return list;
+    int64_t size = list->length * 2 > length ? list->length * 2 : length;
+    VexList *grown = copy_flat(list, size < 8 ? 8 : size);
+    grown->length = list->length;
+    return grown;
+}
+
+VexList *vex_list_push_owned(VexList *list, int64_t word) {
+    if (!is_reusable(list)) return vex_list_push(list, word);
+    list = reserve(list, list->length + 1);
+    vex_list_set_word(list, list->length++, word);
+    return list;
+}
+
+VexList *vex_list_update_owned(VexList *list, int64_t index, int64_t word) {
+    if (!is_reusable(list)) return vex_list_update(list, index, word);
+    check_index(list, index, "update");
+    vex_list_set_word(list, index, word);
+    return list;
+}
+
+VexList *vex_list_concat_owned(VexList *left, const VexList *right) {
+    if (!is_reusable(left) || is_tree(right)) return vex_list_concat(left, right);
+    left = reserve(left, left->length + right->length);
+    if (vex_elem_is_reference(vex_list_kind(left))) vex_gc_write_barrier(left);
+    memcpy((char *)left->data + left->length * left->elem_size, right->data, (size_t)right->length * (size_t)right->elem_size);
+    left->length += right->length;
+    return left;
+}
+
+VexList *vex_list_take_owned(VexList *list, int64_t count) {
+    if (!is_reusable(list)) return vex_list_take(list, count);
+    check_count(list, count, "take");
+    list->length = count;
+    return list;
+}
+
+/* The output buffer for an elementwise result over owned list: list itself when the element size matches. */
+VexList *vex_list_reuse(VexList *list, VexElemKind kind) {
+    if (!is_reusable(list) || list->elem_size != vex_elem_size(kind)) return vex_list_new(kind, list->length);
+    list->flags = (list->flags & ~VEX_LIST_KIND_MASK) | (uint32_t)kind;
+    return list;
+}
+
+int64_t vex_list_get_word(const VexList *list, int64_t index) {
+    if (is_tree(list)) return vex_vector_get(list->data, index);
+    if (list->elem_size == 1) return ((const uint8_t *)list->data)[index];
+    if (list->elem_size == 4) return ((const int32_t *)list->data)[index];
+    int64_t word;
+    memcpy(&word, (const char *)list->data + index * 8, sizeof(word));
+    return word;
+}
+
+/* list must be contiguous; only freshly allocated lists are written. */
+void vex_list_set_word(VexList *list, int64_t index, int64_t word) {
+    if (vex_elem_is_reference(vex_list_kind(list))) vex_gc_write_barrier(list);
+    if (list->elem_size == 1) {
+        ((uint8_t *)list->data)[index] = (uint8_t)word;
+    } else if (list->elem_size == 4) {
+        ((int32_t *)list->data)[index] = (int32_t)word;
+    } else {
+        memcpy((char *)list->data + index * 8, &word, sizeof(word));
+    }
+}
+
+/* Marks what list refers to: the owner of a view, the nodes of a tree, or the strings or lists it holds. */
+void vex_list_trace(const VexList *list) {
+    if (list->flags & VEX_LIST_VIEW) {
+        vex_gc_mark_list(view_owner(list));
+        return;
+    }
+
+    VexElemKind kind = vex_list_kind(list);
+    if (is_tree(list)) {
+        vex_vector_trace(list->data, kind);
+    } else if (vex_elem_is_reference(kind)) {
+        for (int64_t i = 0; i < list->length; i++) vex_gc_mark_element(kind, vex_list_get_word(list, i));
+    }
+}
+
+static void map_range(int64_t begin, int64_t end, void *ctx) {
+    MapJob *job = ctx;
+    for (int64_t chunk = begin; chunk < end; chunk++) {
+        int64_t last = chunk_end(chunk, job->in->length);
+        if (job->kernel) {
+            job->kernel(job->in, job->out, chunk * VEX_LIST_GRAIN, last);
+            continue;
+        }
+        for (int64_t i = chunk * VEX_LIST_GRAIN; i < last; i++) {
+            int64_t arg = vex_list_get_word(job->in, i);
+            vex_list_set_word(job->out, i, job->fn(&arg));
+        }
+    }
+}
+
+/*
+ * Bulk operations call back into Vex code, possibly on other threads, while
+ * their inputs and outputs are only referenced from here, so they block
+ * collection until they return.
+ */
+static VexList *run_map(MapJob *job) {
+    /* A kernel stores without the barrier, and a reused list may already be old. */
+    if (job->kernel && vex_elem_is_reference(vex_list_kind(job->out))) vex_gc_write_barrier(job->out);
+    vex_par_for(chunk_count(job->in->length), 1, map_range, job);
+    vex_gc_unblock();
+    return job->out;
+}
+
+VexList *vex_list_map(const VexList *list, VexElemKind out_kind, VexWordFn fn) {
+    vex_gc_block();
+    MapJob job = { vex_list_contiguous(list), vex_list_new(out_kind, list->length), fn, NULL };
+    return run_map(&job);
+}
+
+/* Each element is read before its slot is written, so an owned list can be mapped onto itself. */
+VexList *vex_list_map_owned(VexList *list, VexElemKind out_kind, VexWordFn fn) {
+    vex_gc_block();
+    MapJob job = { vex_list_contiguous(list), vex_list_reuse(list, out_kind), fn, NULL };
+    return run_map(&job);
+}
+
+VexList *vex_list_map_kernel(const VexList *list, VexElemKind out_kind, VexMapKernel kernel) {
+    vex_gc_block();
+    MapJob job = { vex_list_contiguous(list), vex_list_new(out_kind, list->length), NULL, kernel };
+    return run_map(&job);
+}
+
+VexList *vex_list_map_kernel_owned(VexList *list, VexElemKind out_kind, VexMapKernel kernel) {
+    vex_gc_block();
+    MapJob job = { vex_list_contiguous(list), vex_list_reuse(list, out_kind), NULL, kernel };
+    return run_map(&job);
+}
+
+static void filter_mark(int64_t begin, int64_t end, void *ctx) {
+    FilterJob *job = ctx;
+    for (int64_t chunk = begin; chunk < end; chunk++) {
+        int64_t last = chunk_end(chunk, job->in->length), kept = 0;
+        if (job->kernel) {
+            job->offsets[chunk] = job->kernel(job->in, job->keep, chunk * VEX_LIST_GRAIN, last);
+            continue;
+        }
+        for (int64_t i = chunk * VEX_LIST_GRAIN; i < last; i++) {
+            int64_t arg = vex_list_get_word(job->in, i);
+            job->keep[i] = (uint8_t)(job->fn(&arg) & 1);
+            kept += job->keep[i];
+        }
+        job->offsets[chunk] = kept;
+    }
+}
+
+static void filter_copy(int64_t begin, int64_t end, void *ctx) {
+    FilterJob *job = ctx;
+    size_t size = (size_t)job->in->elem_size;
+    for (int64_t chunk = begin; chunk < end; chunk++) {
+        int64_t last = chunk_end(chunk, job->in->length), at = job->offsets[chunk];
+        for (int64_t i = chunk * VEX_LIST_GRAIN; i < last; i++) {
+            if (!job->keep[i]) continue;
+            memcpy((char *)job->out->data + (size_t)at * size, (const char *)job->in->data + (size_t)i * size, size);
+            at++;
+        }
+    }
+}
+
+/* Two passes over the same chunks: mark and count, then copy each chunk to its prefix-sum offset. */
+static VexList *run_filter(const VexList *list, VexWordFn fn, VexFilterKernel kernel) {
+    int64_t chunks = chunk_count(list->length);
+    vex_gc_block();
+    FilterJob job = {
+        .in = vex_list_contiguous(list),
+        .fn = fn,
+        .kernel = kernel,
+        .keep = checked_malloc((size_t)list->length),
+        .offsets = checked_malloc(sizeof(int64_t) * (size_t)chunks),
+    };
+    vex_par_for(chunks, 1, filter_mark, &job);
+
+    int64_t total = 0;
+    for (int64_t chunk = 0; chunk < chunks; chunk++) {
+        int64_t kept = job.offsets[chunk];
+        job.offsets[chunk] = total;
+        total += kept;
+    }
+
+    job.out = vex_list_new(vex_list_kind(list), total);
+    vex_par_for(chunks, 1, filter_copy, &job);
+    free(job.keep);
+    free(job.offsets);
+    vex_gc_unblock();
+    return job.out;
+}
+
+VexList *vex_list_filter(const VexList *list, VexWordFn fn) {
+    return run_filter(list, fn, NULL);
+}
+
+VexList *vex_list_filter_kernel(const VexList *list, VexFilterKernel kernel) {
+    return run_filter(list, NULL, kernel);
+}
+
+/* The first chunk folds from init and every other one from its own first element. */
+static void reduce_range(int64_t begin, int64_t end, void *ctx) {
+    ReduceJob *job = ctx;
+    int64_t args[2];
+    for (int64_t chunk = begin; chunk < end; chunk++) {
+        int64_t first = chunk * VEX_LIST_GRAIN, last = chunk_end(chunk, job->in->length);
+        int64_t acc = job->init;
+        if (chunk > 0) acc = vex_list_get_word(job->in, first++);
+        if (job->kernel) {
+            job->partials[chunk] = job->kernel(job->in, first, last, acc);
+            continue;
+        }
+        args[0] = acc;
+        for (int64_t i = first; i < last; i++) {
+            args[1] = vex_list_get_word(job->in, i);
+            args[0] = job->fn(args);
+        }
+        job->partials[chunk] = args[0];
+    }
+}
+
+/*
+ * Each chunk is folded on its own, then the partial results are combined
+ * pairwise in a fixed tree. init is folded in exactly once, so the result
+ * equals a left fold whenever fn is associative. Chunk boundaries depend
+ * only on the length, so the result is the same for any number of threads,
+ * and the interpreter folds in the same shape (see eval.c).
+ */
+static int64_t run_reduce(const VexList *list, int64_t init, VexWordFn fn, VexReduceKernel kernel) {
+    int64_t chunks = chunk_count(list->length);
+    if (chunks == 0) return init;
+
+    vex_gc_block();
+    ReduceJob job = { vex_list_contiguous(list), fn, kernel, init, checked_malloc(sizeof(int64_t) * (size_t)chunks) };
+    vex_par_for(chunks, 1, reduce_range, &job);
+
+    int64_t args[2];
+    for (int64_t stride = 1; stride < chunks; stride *= 2) {
+        for (int64_t i = 0; i + stride < chunks; i += 2 * stride) {
+            args[0] = job.partials[i];
+            args[1] = job.partials[i + stride];
+            job.partials[i] = fn(args);
+        }
+    }
+
+    int64_t result = job.partials[0];
+    free(job.partials);
+    vex_gc_unblock();
+    return result;
+}
+
+int64_t vex_list_reduce(const VexList *list, int64_t init, VexWordFn fn) {
+    return run_reduce(list, init, fn, NULL);
+}
+
+/* kernel folds each chunk and combine, the function's word thunk, joins the chunk results. */
+int64_t vex_list_reduce_kernel(const VexList *list, int64_t init, VexReduceKernel kernel, VexWordFn combine) {
+    return run_reduce(list, init, combine, kernel);
+}
+
+/* Survivors of each chunk are packed at the start of that chunk's own slice of the output. */
+static void pipeline_range(int64_t begin, int64_t end, void *ctx) {
+    PipelineJob *job = ctx;
+    for (int64_t chunk = begin; chunk < end; chunk++) {
+        int64_t last = chunk_end(chunk, job->in->length), at = chunk * VEX_LIST_GRAIN;
+        for (int64_t i = chunk * VEX_LIST_GRAIN; i < last; i++) {
+            int64_t word = vex_list_get_word(job->in, i);
+            if (job->stage(&word, job->ctx)) vex_list_set_word(job->out, at++, word);
+        }
+        job->per_chunk[chunk] = at - chunk * VEX_LIST_GRAIN;
+    }
+}
+
+/*
+ * Runs a fused chain of maps and filters in one pass per chunk. The output
+ * is sized for the input; afterwards the chunks are slid down over the gaps
+ * that filtering left, so no intermediate list is ever built.
+ */
+VexList *vex_list_pipeline(const VexList *list, VexElemKind out_kind, VexStageFn stage, void *ctx) {
+    int64_t chunks = chunk_count(list->length);
+    vex_gc_block();
+    PipelineJob job = {
+        .in = vex_list_contiguous(list),
+        .out = vex_list_new(out_kind, list->length),
+        .stage = stage,
+        .ctx = ctx,
+        .per_chunk = checked_malloc(sizeof(int64_t) * (size_t)chunks),
+    };
+    vex_par_for(chunks, 1, pipeline_range, &job);
+
+    size_t size = (size_t)job.out->elem_size;
+    int64_t total = 0;
+    for (int64_t chunk = 0; chunk < chunks; chunk++) {
+        if (total != chunk * VEX_LIST_GRAIN) {
+            char *data = job.out->data;
+            memmove(data + (size_t)total * size, data + (size_t)(chunk * VEX_LIST_GRAIN) * size, (size_t)job.per_chunk[chunk] * size);
+        }
+        total += job.per_chunk[chunk];
+    }
+    job.out->length = total;
+
+    free(job.per_chunk);
+    vex_gc_unblock();
+    return job.out;
+}
+
+/* Like reduce_range, with the first survivor of a chunk standing in for its first element. */
+static void pipeline_reduce_range(int64_t begin, int64_t end, void *ctx) {
+    PipelineJob *job = ctx;
+    int64_t args[2];
+    for (int64_t chunk = begin; chunk < end; chunk++) {
+        int64_t last = chunk_end(chunk, job->in->length);
+        bool folded = chunk == 0;
+        args[0] = job->init;
+        for (int64_t i = chunk * VEX_LIST_GRAIN; i < last; i++) {
+            args[1] = vex_list_get_word(job->in, i);
+            if (!job->stage(&args[1], job->ctx)) continue;
+            args[0] = folded ? job->combine(args) : args[1];
+            folded = true;
+        }
+        job->per_chunk[chunk] = args[0];
+        job->folded[chunk] = folded;
+    }
+}
+
+/*
+ * A fused chain ending in a fold; chunk results combine in the same fixed
+ * tree as vex_list_reduce, leaving out chunks where nothing survived.
+ */
+int64_t vex_list_pipeline_reduce(const VexList *list, VexStageFn stage, void *ctx, int64_t init, VexWordFn combine) {
+    int64_t chunks = chunk_count(list->length);
+    if (chunks == 0) return init;
+
+    vex_gc_block();
+    PipelineJob job = {
+        .in = vex_list_contiguous(list),
+        .stage = stage,
+        .ctx = ctx,
+        .per_chunk = checked_malloc(sizeof(int64_t) * (size_t)chunks),
+        .folded = checked_malloc((size_t)chunks),
+        .combine = combine,
+        .init = init,
+    };
+    vex_par_for(chunks, 1, pipeline_reduce_range, &job);
+
+    int64_t args[2];
+    for (int64_t stride = 1; stride < chunks; stride *= 2) {
+        for (int64_t i = 0; i + stride < chunks; i += 2 * stride) {
+            if (!job.folded[i + stride]) continue;
+            args[0] = job.per_chunk[i];
+            args[1] = job.per_chunk[i + stride];
+            job.per_chunk[i] = job.folded[i] ? combine(args) : args[1];
+            job.folded[i] = true;
+        }
+    }
+
+    int64_t result = job.per_chunk[0];
+    free(job.per_chunk);
+    free(job.folded);
+    vex_gc_unblock();
+    return result;
+}
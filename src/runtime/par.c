@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "gc.h"
+#include "par.h"
+
+#define DEQUE_CAPACITY 4096
+#define MAX_WORKERS 256
+
+/*
+ * Runtime granularity control: once this many tasks are already waiting in
+ * the spawning worker's deque there is enough exposed parallelism, and new
+ * spawns run inline like a plain call.
+ */
+#define MAX_PENDING 32
+
+/*
+ * Forks nest at most this many levels deeper than it takes to give every
+ * worker a task of its own; below that, compiled code stops spawning.
+ */
+#define SPAWN_DEPTH_SLACK 4
+
+/* Chase-Lev work-stealing deque; the owner pushes and pops at the bottom, thieves take from the top. */
+typedef struct Deque {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    _Atomic(VexTask *) tasks[DEQUE_CAPACITY];
+} Deque;
+
+typedef struct RangeJob {
+    VexRangeFn body;
+    void *ctx;
+    int64_t begin, end, grain;
+} RangeJob;
+
+typedef struct Worker {
+    Deque deque;
+    pthread_t thread;
+    unsigned int seed;
+} Worker;
+
+static Worker *workers = NULL;
+static unsigned int worker_count = 1;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int sleeping = 0;
+static int max_depth = 0;
+static _Thread_local Worker *self = NULL;
+/* How many forks enclose the code this thread is running. */
+static _Thread_local int depth = 0;
+
+static bool deque_push(Deque *deque, VexTask *task) {
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t >= DEQUE_CAPACITY) return false;
+
+    atomic_store_explicit(&deque->tasks[b & (DEQUE_CAPACITY - 1)], task, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+static VexTask *deque_pop(Deque *deque) {
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    VexTask *task = atomic_load_explicit(&deque->tasks[b & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+    if (t == b) {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static VexTask *deque_steal(Deque *deque) {
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b) return NULL;
+
+    VexTask *task = atomic_load_explicit(&deque->tasks[t & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static long deque_size(Deque *deque) {
+    return atomic_load_explicit(&deque->bottom, memory_order_relaxed) - atomic_load_explicit(&deque->top, memory_order_relaxed);
+}
+
+static void run_task(VexTask *task) {
+    int saved = depth;
+    depth = task->depth;
+    task->fn(task->env);
+    depth = saved;
+    atomic_store_explicit(&task->done, 1, memory_order_release);
+}
+
+static VexTask *steal_any(Worker *thief) {
+    unsigned int seed = thief ? thief->seed : 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    if (thief) thief->seed = seed;
+
+    unsigned int start = seed % worker_count;
+    for (unsigned int i = 0; i < worker_count; i++) {
+        Worker *victim = &workers[(start + i) % worker_count];
+        if (victim == thief) continue;
+        VexTask *task = deque_steal(&victim->deque);
+        if (task) return task;
+    }
+    return NULL;
+}
+
+/* Idle workers park on a condition variable; the timeout bounds the cost of a missed wakeup. */
+static void park(void) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&idle_lock);
+    atomic_fetch_add(&sleeping, 1);
+    pthread_cond_timedwait(&idle_cond, &idle_lock, &until);
+    atomic_fetch_sub(&sleeping, 1);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+static void *worker_main(void *arg) {
+    self = arg;
+    unsigned int idle = 0;
+    for (;;) {
+        VexTask *task = steal_any(self);
+        if (task) {
+            run_task(task);
+            idle = 0;
+        } else if (++idle < 64) {
+            sched_yield();
+        } else {
+            park();
+        }
+    }
+    return NULL;
+}
+
+static unsigned int configured_workers(void) {
+    const char *env = getenv("VEX_NUM_THREADS");
+    long count = env ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) count = 1;
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+    return (unsigned int)count;
+}
+
+/* The thread that spawns first becomes worker 0; the others are started here. */
+static void start_workers(void) {
+    worker_count = configured_workers();
+    workers = calloc(worker_count, sizeof(Worker));
+    if (!workers) {
+        worker_count = 1;
+        return;
+    }
+
+    for (unsigned int i = 0; i < worker_count; i++) {
+        workers[i].seed = 2654435761u * (i + 1);
+    }
+    self = &workers[0];
+
+    for (unsigned int i = 1; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            fputs("vex: warning: could not start parallel worker\n", stderr);
+            worker_count = i;
+            break;
+        }
+        pthread_detach(workers[i].thread);
+    }
+
+    for (unsigned int n = 1; n < worker_count; n *= 2) max_depth++;
+    max_depth += SPAWN_DEPTH_SLACK;
+}
+
+bool vex_par_should_spawn(void) {
+    pthread_once(&start_once, start_workers);
+    return worker_count > 1 && depth < max_depth;
+}
+
+/* Collection is blocked from a spawn until its join, while the task may be running elsewhere. */
+void vex_par_spawn(void *task, VexTaskFn fn, void *env) {
+    VexTask *t = task;
+    vex_gc_block();
+    t->fn = fn;
+    t->env = env;
+    t->depth = ++depth;
+    atomic_store_explicit(&t->done, 0, memory_order_relaxed);
+
+    pthread_once(&start_once, start_workers);
+    if (!self || worker_count < 2 || deque_size(&self->deque) >= MAX_PENDING || !deque_push(&self->deque, t)) {
+        run_task(t);
+        return;
+    }
+
+    if (atomic_load_explicit(&sleeping, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+/* Runs other work while waiting, so a joining worker never sits idle. */
+void vex_par_join(void *task) {
+    VexTask *t = task;
+    while (!atomic_load_explicit(&t->done, memory_order_acquire)) {
+        VexTask *next = self ? deque_pop(&self->deque) : NULL;
+        if (!next && workers) next = steal_any(self);
+        if (next) {
+            run_task(next);
+        } else {
+            sched_yield();
+        }
+    }
+    depth--;
+    vex_gc_unblock();
+}
+
+static void range_task(void *env) {
+    RangeJob *job = env;
+    if (job->end - job->begin <= job->grain) {
+        job->body(job->begin, job->end, job->ctx);
+        return;
+    }
+
+    int64_t mid = job->begin + (job->end - job->begin) / 2;
+    RangeJob left = { job->body, job->ctx, job->begin, mid, job->grain };
+    RangeJob right = { job->body, job->ctx, mid, job->end, job->grain };
+    int64_t storage[VEX_TASK_WORDS];
+    vex_par_spawn(storage, range_task, &right);
+    range_task(&left);
+    vex_par_join(storage);
+}
+
+/* Splits [0, count) in halves down to grain-sized pieces and runs body on each, in parallel. */
+void vex_par_for(int64_t count, int64_t grain, VexRangeFn body, void *ctx) {
+    if (count <= 0) return;
+    RangeJob job = { body, ctx, 0, count, grain < 1 ? 1 : grain };
+    range_task(&job);
+}
+
+unsigned int vex_par_worker_count(void) {
+    pthread_once(&start_once, start_workers);
+    return worker_count;
+}
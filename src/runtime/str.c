@@ -0,0 +1,238 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "gc.h"
+#include "str.h"
+#include "uthash.h"
+
+/* One interned literal, keyed by its bytes. */
+typedef struct InternEntry {
+    const VexString *string;
+    UT_hash_handle hh;
+} InternEntry;
+
+static InternEntry *interned = NULL;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *flat_bytes(const VexString *string) {
+    return (const char *)(string + 1);
+}
+
+static const VexString *const *halves(const VexString *string) {
+    return (const VexString *const *)(const void *)(string + 1);
+}
+
+static bool is_rope(const VexString *string) {
+    return !vex_string_is_inline(string) && (string->flags & VEX_STRING_ROPE);
+}
+
+static uint32_t depth_of(const VexString *string) {
+    return vex_string_is_inline(string) ? 0 : string->depth;
+}
+
+static const VexString *make_inline(const char *bytes, int64_t length) {
+    uintptr_t word = (uintptr_t)length << 1 | 1;
+    for (int64_t i = 0; i < length; i++) {
+        word |= (uintptr_t)(unsigned char)bytes[i] << (8 * (i + 1));
+    }
+    return (const VexString *)word;
+}
+
+int64_t vex_string_length(const VexString *string) {
+    if (vex_string_is_inline(string)) return (int64_t)(((uintptr_t)string & 0xff) >> 1);
+    return string->length;
+}
+
+static VexString *new_flat(int64_t length) {
+    VexString *string = vex_gc_alloc(sizeof(VexString) + (size_t)length + 1, VEX_GC_STRING);
+    string->length = length;
+    string->depth = 0;
+    string->flags = 0;
+    return string;
+}
+
+static const VexString *make_rope(const VexString *left, const VexString *right) {
+    VexString *rope = vex_gc_alloc(sizeof(VexString) + 2 * sizeof(VexString *), VEX_GC_STRING);
+    uint32_t left_depth = depth_of(left), right_depth = depth_of(right);
+    rope->length = vex_string_length(left) + vex_string_length(right);
+    rope->depth = (left_depth > right_depth ? left_depth : right_depth) + 1;
+    rope->flags = VEX_STRING_ROPE;
+    const VexString *parts[] = { left, right };
+    memcpy(rope + 1, parts, sizeof(parts));
+    return rope;
+}
+
+/* Writes the bytes of string to out, walking a rope's leaves left to right without recursion. */
+static void copy_into(const VexString *string, char *out) {
+    const VexString *stack[VEX_STRING_MAX_DEPTH + 2];
+    int top = 0;
+    stack[top++] = string;
+    while (top) {
+        const VexString *part = stack[--top];
+        if (vex_string_is_inline(part)) {
+            for (int64_t i = 0; i < vex_string_length(part); i++) {
+                *out++ = (char)(((uintptr_t)part >> (8 * (i + 1))) & 0xff);
+            }
+        } else if (part->flags & VEX_STRING_ROPE) {
+            stack[top++] = halves(part)[1];
+            stack[top++] = halves(part)[0];
+        } else {
+            memcpy(out, flat_bytes(part), (size_t)part->length);
+            out += part->length;
+        }
+    }
+}
+
+static const VexString *flatten(const VexString *left, const VexString *right) {
+    int64_t left_length = vex_string_length(left);
+    VexString *flat = new_flat(left_length + vex_string_length(right));
+    char *bytes = (char *)(flat + 1);
+    copy_into(left, bytes);
+    copy_into(right, bytes + left_length);
+    bytes[flat->length] = '\0';
+    return flat;
+}
+
+static size_t count_leaves(const VexString *string) {
+    return is_rope(string) ? count_leaves(halves(string)[0]) + count_leaves(halves(string)[1]) : 1;
+}
+
+static void collect_leaves(const VexString *string, const VexString **leaves, size_t *count) {
+    if (!is_rope(string)) {
+        leaves[(*count)++] = string;
+        return;
+    }
+    collect_leaves(halves(string)[0], leaves, count);
+    collect_leaves(halves(string)[1], leaves, count);
+}
+
+static const VexString *build_balanced(const VexString **leaves, size_t count) {
+    if (count == 1) return leaves[0];
+    size_t half = count / 2;
+    return make_rope(build_balanced(leaves, half), build_balanced(leaves + half, count - half));
+}
+
+/*
+ * Short results are copied into a flat string. Longer ones become a rope
+ * node, except that a short piece appended to a rope whose right half is a
+ * short leaf is merged into that leaf, so building a string a little at a
+ * time does not produce one node per piece. A rope that gets too deep,
+ * as repeated appends make it, is rebalanced over its leaves.
+ */
+const VexString *vex_string_concat(const VexString *left, const VexString *right) {
+    int64_t left_length = vex_string_length(left), right_length = vex_string_length(right);
+    int64_t length = left_length + right_length;
+    if (!left_length) return right;
+    if (!right_length) return left;
+
+    if (length <= VEX_STRING_INLINE_MAX) {
+        char bytes[VEX_STRING_INLINE_MAX];
+        copy_into(left, bytes);
+        copy_into(right, bytes + left_length);
+        return make_inline(bytes, length);
+    }
+    if (length <= VEX_STRING_LEAF_MAX) return flatten(left, right);
+
+    if (is_rope(left) && !is_rope(halves(left)[1]) &&
+        vex_string_length(halves(left)[1]) + right_length <= VEX_STRING_LEAF_MAX) {
+        return make_rope(halves(left)[0], flatten(halves(left)[1], right));
+    }
+
+    const VexString *rope = make_rope(left, right);
+    if (rope->depth <= VEX_STRING_MAX_DEPTH) return rope;
+
+    size_t count = 0;
+    const VexString **leaves = malloc(sizeof(VexString *) * count_leaves(rope));
+    if (!leaves) {
+        fputs("vex: out of memory\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    collect_leaves(rope, leaves, &count);
+    rope = build_balanced(leaves, count);
+    free(leaves);
+    return rope;
+}
+
+/* A NUL-terminated copy for C code such as printf; flat strings are returned as they are. */
+const char *vex_string_cstr(const VexString *string) {
+    if (!vex_string_is_inline(string) && !(string->flags & VEX_STRING_ROPE)) return flat_bytes(string);
+
+    int64_t length = vex_string_length(string);
+    char *bytes = vex_gc_alloc((size_t)length + 1, VEX_GC_DATA);
+    copy_into(string, bytes);
+    bytes[length] = '\0';
+    return bytes;
+}
+
+void vex_string_trace(const VexString *string) {
+    if (!(string->flags & VEX_STRING_ROPE)) return;
+    vex_gc_mark_string(halves(string)[0]);
+    vex_gc_mark_string(halves(string)[1]);
+}
+
+/* Literals are kept once per distinct text for the life of the process, outside the collected heap. */
+const VexString *vex_string_intern(const char *bytes, int64_t length) {
+    if (length <= VEX_STRING_INLINE_MAX) return make_inline(bytes, length);
+
+    pthread_mutex_lock(&intern_lock);
+    InternEntry *entry = NULL;
+    HASH_FIND(hh, interned, bytes, (size_t)length, entry);
+    if (!entry) {
+        VexString *string = malloc(sizeof(VexString) + (size_t)length + 1);
+        entry = malloc(sizeof(InternEntry));
+        if (!string || !entry) {
+            fputs("vex: out of memory\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        string->length = length;
+        string->depth = 0;
+        string->flags = VEX_STRING_STATIC;
+        memcpy(string + 1, bytes, (size_t)length);
+        ((char *)(string + 1))[length] = '\0';
+        entry->string = string;
+        HASH_ADD_KEYPTR(hh, interned, flat_bytes(string), (size_t)length, entry);
+    }
+    pthread_mutex_unlock(&intern_lock);
+    return entry->string;
+}
+
+/* Skips ahead over bytes below 0x80, sixteen at a time where SSE2 is available and eight otherwise. */
+static const unsigned char *skip_ascii(const unsigned char *p, const unsigned char *end) {
+#if defined(__SSE2__)
+    while (end - p >= 16 && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(const void *)p))) p += 16;
+#else
+    uint64_t word;
+    while (end - p >= 8 && (memcpy(&word, p, sizeof(word)), !(word & UINT64_C(0x8080808080808080)))) p += 8;
+#endif
+    while (p < end && *p < 0x80) p++;
+    return p;
+}
+
+/* Rejects overlong forms, surrogates and code points past U+10FFFF as well as malformed sequences. */
+bool vex_utf8_valid(const char *bytes, int64_t length) {
+    const unsigned char *p = (const unsigned char *)bytes, *end = p + length;
+    for (p = skip_ascii(p, end); p < end; p = skip_ascii(p, end)) {
+        int extra;
+        uint32_t code, min;
+        if ((*p & 0xe0) == 0xc0) {
+            extra = 1, code = *p & 0x1fu, min = 0x80;
+        } else if ((*p & 0xf0) == 0xe0) {
+            extra = 2, code = *p & 0x0fu, min = 0x800;
+        } else if ((*p & 0xf8) == 0xf0) {
+            extra = 3, code = *p & 0x07u, min = 0x10000;
+        } else {
+            return false;
+        }
+        if (end - p <= extra) return false;
+        for (int i = 1; i <= extra; i++) {
+            if ((p[i] & 0xc0) != 0x80) return false;
+            code = code << 6 | (p[i] & 0x3fu);
+        }
+        if (code < min || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff)) return false;
+        p += extra + 1;
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#include "gc.h"
+#include "variant.h"
+
+/* The caller fills in every field before its next safepoint. */
+VexVariant *vex_variant_new(uint32_t tag, uint32_t field_count, uint32_t references) {
+    VexVariant *variant = vex_gc_alloc(sizeof(VexVariant) + sizeof(int64_t) * field_count, VEX_GC_VARIANT);
+    variant->tag = tag;
+    variant->field_count = field_count;
+    variant->references = references;
+    variant->flags = 0;
+    return variant;
+}
+
+void vex_variant_trace(const VexVariant *variant) {
+    const int64_t *fields = vex_variant_fields(variant);
+    for (uint32_t i = 0; i < variant->field_count; i++) {
+        if (variant->references & (UINT32_C(1) << i)) vex_gc_mark_root((const void *)(uintptr_t)fields[i]);
+    }
+}
+
+int64_t vex_variant_box(uint32_t tag, int64_t payload, uint32_t boxed_tags, uint32_t reference_tags) {
+    if (!(boxed_tags >> tag & 1)) return vex_variant_immediate(tag, payload);
+    VexVariant *variant = vex_variant_new(tag, 1, reference_tags >> tag & 1);
+    vex_variant_fields(variant)[0] = payload;
+    return vex_variant_word(variant, true);
+}
+
+uint32_t vex_variant_unbox_tag(int64_t word) {
+    return vex_variant_tag(word, true);
+}
+
+int64_t vex_variant_unbox_payload(int64_t word) {
+    if (vex_variant_is_immediate(word)) return vex_variant_payload(word);
+    return vex_variant_fields(vex_variant_object(word))[0];
+}
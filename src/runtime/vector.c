@@ -0,0 +1,385 @@
+#include <stdbool.h>
+#include <string.h>
+#include "gc.h"
+#include "vector.h"
+
+#define BITS   VEX_VECTOR_BITS
+#define BRANCH VEX_VECTOR_BRANCH
+
+/*
+ * Concatenation may leave this many more slots on a level than a dense
+ * packing would need before it repacks them (the RRB search-step bound).
+ */
+#define EXTRA_SLOTS 2
+
+/*
+ * A node at shift 0 is a leaf holding words; a node at shift s holds
+ * children of at most 1 << s elements each. sizes is NULL while every child
+ * but the last is full, so the child for an index is found by radix; other
+ * nodes keep cumulative child sizes and search them.
+ */
+struct VexNode {
+    uint32_t count;
+    int64_t *sizes;
+    union {
+        VexNode *children[BRANCH];
+        int64_t words[BRANCH];
+    };
+};
+
+static VexNode *new_node(uint32_t count) {
+    VexNode *node = vex_gc_alloc(sizeof(VexNode), VEX_GC_NODE);
+    node->count = count;
+    node->sizes = NULL;
+    return node;
+}
+
+/* Size tables are immutable, so a copy shares its original's until finish_node replaces it. */
+static VexNode *copy_node(const VexNode *node) {
+    VexNode *copy = vex_gc_alloc(sizeof(VexNode), VEX_GC_NODE);
+    memcpy(copy, node, sizeof(VexNode));
+    return copy;
+}
+
+static int64_t node_size(const VexNode *node, uint32_t shift) {
+    if (shift == 0) return node->count;
+    if (node->sizes) return node->sizes[node->count - 1];
+    return ((int64_t)(node->count - 1) << shift) + node_size(node->children[node->count - 1], shift - BITS);
+}
+
+/* Recomputes the size table of an internal node whose children changed. */
+static VexNode *finish_node(VexNode *node, uint32_t shift) {
+    int64_t sizes[BRANCH], total = 0;
+    bool balanced = true;
+    for (uint32_t i = 0; i < node->count; i++) {
+        int64_t size = node_size(node->children[i], shift - BITS);
+        if (i + 1 < node->count && size != (INT64_C(1) << shift)) balanced = false;
+        total += size;
+        sizes[i] = total;
+    }
+
+    node->sizes = NULL;
+    if (!balanced) {
+        node->sizes = vex_gc_alloc(sizeof(int64_t) * node->count, VEX_GC_DATA);
+        memcpy(node->sizes, sizes, sizeof(int64_t) * node->count);
+    }
+    return node;
+}
+
+/* Picks the slot holding index and makes index relative to that slot. */
+static uint32_t locate(const VexNode *node, uint32_t shift, int64_t *index) {
+    uint32_t slot = (uint32_t)(*index >> shift);
+    if (node->sizes) {
+        while (node->sizes[slot] <= *index) slot++;
+        if (slot > 0) *index -= node->sizes[slot - 1];
+    } else {
+        *index -= (int64_t)slot << shift;
+    }
+    return slot;
+}
+
+static VexNode *new_path(uint32_t shift, VexNode *leaf) {
+    VexNode *node = leaf;
+    for (uint32_t level = BITS; level <= shift; level += BITS) {
+        VexNode *parent = new_node(1);
+        parent->children[0] = node;
+        node = parent;
+    }
+    return node;
+}
+
+/* Appends a leaf along the right edge below node; NULL when that subtree is full. */
+static VexNode *push_leaf(const VexNode *node, uint32_t shift, VexNode *leaf) {
+    VexNode *child = shift > BITS ? push_leaf(node->children[node->count - 1], shift - BITS, leaf) : NULL;
+    if (child) {
+        VexNode *copy = copy_node(node);
+        copy->children[copy->count - 1] = child;
+        return finish_node(copy, shift);
+    }
+    if (node->count == BRANCH) return NULL;
+
+    VexNode *copy = copy_node(node);
+    copy->children[copy->count++] = new_path(shift - BITS, leaf);
+    return finish_node(copy, shift);
+}
+
+static void push_tail(VexVector *vector, VexNode *leaf) {
+    VexNode *root = NULL;
+    if (!vector->root) {
+        root = leaf;
+    } else if (vector->shift > 0) {
+        root = push_leaf(vector->root, vector->shift, leaf);
+    }
+
+    if (!root) {
+        root = new_node(2);
+        root->children[0] = vector->root;
+        root->children[1] = new_path(vector->shift, leaf);
+        vector->shift += BITS;
+        finish_node(root, vector->shift);
+    }
+    vector->root = root;
+    vector->root_size += leaf->count;
+}
+
+static void collapse(VexVector *vector) {
+    while (vector->shift > 0 && vector->root->count == 1) {
+        vector->root = vector->root->children[0];
+        vector->shift -= BITS;
+    }
+}
+
+int64_t vex_vector_length(const VexVector *vector) {
+    return vector->root_size + (vector->tail ? vector->tail->count : 0);
+}
+
+int64_t vex_vector_get(const VexVector *vector, int64_t index) {
+    if (index >= vector->root_size) return vector->tail->words[index - vector->root_size];
+
+    const VexNode *node = vector->root;
+    for (uint32_t shift = vector->shift; shift > 0; shift -= BITS) {
+        node = node->children[locate(node, shift, &index)];
+    }
+    return node->words[index];
+}
+
+void vex_vector_from_list(VexVector *out, const VexList *flat) {
+    *out = (VexVector){ 0 };
+    for (int64_t i = 0; i < flat->length;) {
+        VexNode *leaf = new_node(0);
+        while (leaf->count < BRANCH && i < flat->length) {
+            leaf->words[leaf->count++] = vex_list_get_word(flat, i++);
+        }
+        if (out->tail) push_tail(out, out->tail);
+        out->tail = leaf;
+    }
+}
+
+static int64_t copy_words(const VexNode *node, uint32_t shift, VexList *flat, int64_t at) {
+    for (uint32_t i = 0; i < node->count; i++) {
+        if (shift == 0) {
+            vex_list_set_word(flat, at++, node->words[i]);
+        } else {
+            at = copy_words(node->children[i], shift - BITS, flat, at);
+        }
+    }
+    return at;
+}
+
+/* flat must be a contiguous list with room for every element. */
+void vex_vector_to_list(const VexVector *vector, VexList *flat) {
+    int64_t at = vector->root ? copy_words(vector->root, vector->shift, flat, 0) : 0;
+    if (vector->tail) copy_words(vector->tail, 0, flat, at);
+}
+
+void vex_vector_push(VexVector *out, const VexVector *vector, int64_t word) {
+    *out = *vector;
+    if (out->tail && out->tail->count == BRANCH) {
+        push_tail(out, out->tail);
+        out->tail = NULL;
+    }
+
+    VexNode *tail = out->tail ? copy_node(out->tail) : new_node(0);
+    tail->words[tail->count++] = word;
+    out->tail = tail;
+}
+
+static VexNode *update_node(const VexNode *node, uint32_t shift, int64_t index, int64_t word) {
+    VexNode *copy = copy_node(node);
+    uint32_t slot = locate(node, shift, &index);
+    if (shift == 0) {
+        copy->words[slot] = word;
+    } else {
+        copy->children[slot] = update_node(node->children[slot], shift - BITS, index, word);
+    }
+    return copy;
+}
+
+void vex_vector_update(VexVector *out, const VexVector *vector, int64_t index, int64_t word) {
+    *out = *vector;
+    if (index >= vector->root_size) {
+        out->tail = copy_node(vector->tail);
+        out->tail->words[index - vector->root_size] = word;
+    } else {
+        out->root = update_node(vector->root, vector->shift, index, word);
+    }
+}
+
+/* Keeps the first count elements of node, 0 < count <= its size. */
+static VexNode *take_node(const VexNode *node, uint32_t shift, int64_t count) {
+    int64_t last = count - 1;
+    uint32_t slot = locate(node, shift, &last);
+    VexNode *copy = copy_node(node);
+    copy->count = slot + 1;
+    if (shift == 0) return copy;
+
+    copy->children[slot] = take_node(node->children[slot], shift - BITS, last + 1);
+    return finish_node(copy, shift);
+}
+
+/* Drops the first start elements of node, 0 <= start < its size. */
+static VexNode *drop_node(const VexNode *node, uint32_t shift, int64_t start) {
+    uint32_t slot = locate(node, shift, &start);
+    VexNode *copy = new_node(node->count - slot);
+    if (shift == 0) {
+        memcpy(copy->words, node->words + slot, sizeof(int64_t) * copy->count);
+        return copy;
+    }
+
+    memcpy(copy->children, node->children + slot, sizeof(VexNode *) * copy->count);
+    copy->children[0] = drop_node(node->children[slot], shift - BITS, start);
+    return finish_node(copy, shift);
+}
+
+void vex_vector_slice(VexVector *out, const VexVector *vector, int64_t begin, int64_t end) {
+    *out = (VexVector){ 0 };
+    if (begin >= end) return;
+
+    int64_t root_end = end < vector->root_size ? end : vector->root_size;
+    if (begin < root_end) {
+        VexNode *root = vector->root;
+        if (root_end < vector->root_size) root = take_node(root, vector->shift, root_end);
+        if (begin > 0) root = drop_node(root, vector->shift, begin);
+        out->root = root;
+        out->shift = vector->shift;
+        out->root_size = root_end - begin;
+        collapse(out);
+    }
+
+    if (end > vector->root_size) {
+        int64_t from = begin > vector->root_size ? begin - vector->root_size : 0;
+        out->tail = new_node((uint32_t)(end - vector->root_size - from));
+        memcpy(out->tail->words, vector->tail->words + from, sizeof(int64_t) * out->tail->count);
+    }
+}
+
+/*
+ * Repacks nodes of one level so that, together, they use at most
+ * EXTRA_SLOTS more nodes than a dense packing. Returns the new node count.
+ */
+static int rebalance(VexNode **nodes, int count, uint32_t shift) {
+    int64_t slots = 0;
+    for (int i = 0; i < count; i++) slots += nodes[i]->count;
+    if (count <= (slots + BRANCH - 1) / BRANCH + EXTRA_SLOTS) return count;
+
+    VexNode *packed[2 * BRANCH];
+    int packed_count = 0;
+    VexNode *current = NULL;
+    for (int i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < nodes[i]->count; j++) {
+            if (!current || current->count == BRANCH) {
+                if (current && shift > 0) finish_node(current, shift);
+                current = packed[packed_count++] = new_node(0);
+            }
+            if (shift == 0) {
+                current->words[current->count++] = nodes[i]->words[j];
+            } else {
+                current->children[current->count++] = nodes[i]->children[j];
+            }
+        }
+    }
+    if (shift > 0) finish_node(current, shift);
+
+    memcpy(nodes, packed, sizeof(VexNode *) * (size_t)packed_count);
+    return packed_count;
+}
+
+/*
+ * Joins two subtrees into a node one level above the taller of them, with
+ * one or two children. Only the nodes along the seam between them are
+ * rebuilt, and rebalancing keeps each level within EXTRA_SLOTS of dense.
+ */
+static VexNode *concat_nodes(VexNode *left, uint32_t left_shift, VexNode *right, uint32_t right_shift) {
+    VexNode *nodes[2 * BRANCH];
+    int count = 0;
+    uint32_t shift;
+
+    if (left_shift == 0 && right_shift == 0) {
+        nodes[count++] = left;
+        nodes[count++] = right;
+        shift = 0;
+    } else {
+        VexNode *mid;
+        if (left_shift > right_shift) {
+            mid = concat_nodes(left->children[left->count - 1], left_shift - BITS, right, right_shift);
+            shift = left_shift - BITS;
+        } else if (left_shift < right_shift) {
+            mid = concat_nodes(left, left_shift, right->children[0], right_shift - BITS);
+            shift = right_shift - BITS;
+        } else {
+            mid = concat_nodes(left->children[left->count - 1], left_shift - BITS, right->children[0], right_shift - BITS);
+            shift = left_shift - BITS;
+        }
+
+        if (left_shift > shift) {
+            for (uint32_t i = 0; i + 1 < left->count; i++) nodes[count++] = left->children[i];
+        }
+        for (uint32_t i = 0; i < mid->count; i++) nodes[count++] = mid->children[i];
+        if (right_shift > shift) {
+            for (uint32_t i = 1; i < right->count; i++) nodes[count++] = right->children[i];
+        }
+    }
+
+    count = rebalance(nodes, count, shift);
+
+    VexNode *parents[2];
+    int parent_count = 0;
+    for (int i = 0; i < count; i += BRANCH) {
+        VexNode *parent = new_node((uint32_t)(count - i < BRANCH ? count - i : BRANCH));
+        memcpy(parent->children, nodes + i, sizeof(VexNode *) * parent->count);
+        parents[parent_count++] = finish_node(parent, shift + BITS);
+    }
+    if (left_shift == 0 && right_shift == 0) return parents[0];
+
+    VexNode *top = new_node((uint32_t)parent_count);
+    memcpy(top->children, parents, sizeof(VexNode *) * (size_t)parent_count);
+    return finish_node(top, shift + 2 * BITS);
+}
+
+void vex_vector_concat(VexVector *out, const VexVector *left, const VexVector *right) {
+    if (vex_vector_length(right) == 0) {
+        *out = *left;
+        return;
+    }
+    if (vex_vector_length(left) == 0) {
+        *out = *right;
+        return;
+    }
+
+    *out = *left;
+    if (out->tail) {
+        push_tail(out, out->tail);
+        out->tail = NULL;
+    }
+
+    if (right->root) {
+        uint32_t shift = (out->shift > right->shift ? out->shift : right->shift) + BITS;
+        out->root = concat_nodes(out->root, out->shift, right->root, right->shift);
+        out->shift = shift;
+        out->root_size += right->root_size;
+        collapse(out);
+    }
+    out->tail = right->tail;
+}
+
+/*
+ * Nodes do not record their height, so the collector reaches them through
+ * the vector that owns them. A node is built after its children and never
+ * changed, so once a node is old so is everything below it.
+ */
+static void trace_node(const VexNode *node, uint32_t shift, VexElemKind kind) {
+    if (!vex_gc_mark(node)) return;
+    if (node->sizes) vex_gc_mark(node->sizes);
+    for (uint32_t i = 0; i < node->count; i++) {
+        if (shift > 0) {
+            trace_node(node->children[i], shift - BITS, kind);
+        } else {
+            vex_gc_mark_element(kind, node->words[i]);
+        }
+    }
+}
+
+void vex_vector_trace(const VexVector *vector, VexElemKind kind) {
+    if (vector->root) trace_node(vector->root, vector->shift, kind);
+    if (vector->tail) trace_node(vector->tail, 0, kind);
+}
@@ -2,11 +2,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include "ast.h"
+#include "match.h"
 #include "memory.h"
+#include "str.h"
 #include "tc.h"
+#include "variant.h"
 
 extern Arena *global_arena;
 
+/* Declared types, the most recent first so a redeclaration in the REPL shadows the old one. */
+static VariantType *variant_types = NULL;
+
+/*
+ * Instances of option and result, one per type argument, so that equal
+ * types share one VariantType. They are made by whichever line first
+ * mentions them, so they live outside the arena the REPL rolls back.
+ */
+static VariantType *outcome_types = NULL;
+
+static TypeTC *parse_outcome_annotation(const char *type_str);
+
 static void type_error(const char *msg) {
     fprintf(stderr, "Type error: %s\n", msg);
     exit(1);
@@ -26,9 +41,54 @@ TypeTC *make_type(TypeKind kind) {
     TypeTC *t = arena_alloc(global_arena, sizeof(TypeTC));
     t->kind = kind;
     t->element_type = NULL;
+    t->variant = NULL;
     return t;
 }
 
+static TypeTC *make_variant_type(VariantType *variant) {
+    TypeTC *t = make_type(TypeVariant);
+    t->variant = variant;
+    return t;
+}
+
+static bool is_outcome_annotation(const char *name) {
+    size_t length = strlen(name);
+    return (strncmp(name, "option<", 7) == 0 || strncmp(name, "result<", 7) == 0) && name[length - 1] == '>';
+}
+
+VariantType *find_variant_type(const char *name) {
+    for (VariantType *type = variant_types; type; type = type->next) {
+        if (strcmp(type->name, name) == 0) return type;
+    }
+    for (VariantType *type = outcome_types; type; type = type->next) {
+        if (strcmp(type->name, name) == 0) return type;
+    }
+    return is_outcome_annotation(name) ? parse_outcome_annotation(name)->variant : NULL;
+}
+
+static VariantConstructor *find_constructor(const VariantType *type, const char *name) {
+    for (int i = 0; i < type->constructor_count; i++) {
+        if (strcmp(type->constructors[i].name, name) == 0) return &type->constructors[i];
+    }
+    return NULL;
+}
+
+static VariantConstructor *find_any_constructor(const char *name) {
+    for (VariantType *type = variant_types; type; type = type->next) {
+        VariantConstructor *constructor = find_constructor(type, name);
+        if (constructor) return constructor;
+    }
+    return NULL;
+}
+
+/* Kinds are enough for everything but lists and declared types. */
+static bool same_type(const TypeTC *a, const TypeTC *b) {
+    if (a->kind != b->kind) return false;
+    if (a->kind == TypeList) return same_type(a->element_type, b->element_type);
+    if (a->kind == TypeVariant) return a->variant == b->variant;
+    return true;
+}
+
 TypeTC *make_list_type(TypeTC *elem_type) {
     TypeTC *t = make_type(TypeList);
     t->element_type = elem_type;
@@ -43,6 +103,7 @@ const char *type_to_string(TypeKind kind) {
         case TypeChar: return "char";
         case TypeString: return "string";
         case TypeList: return "list";
+        case TypeVariant: return "variant";
         case TypeError: return "<error>";
         default: return "<invalid>";
     }
@@ -61,15 +122,26 @@ TypeTC *parse_type_annotation(const char *type_str) {
     TypeTC *base_type = lookup_type_from_string(type_str);
     if (base_type) return base_type;
 
-    if (strncmp(type_str, "list<", 5) == 0 || type_str[0] == '<') {
-        char inner[16];
-        if (type_str[0] == '<') sscanf(type_str, "<%15[^>]>", inner);
-        else sscanf(type_str, "list<%15[^>]>", inner);
+    if (is_outcome_annotation(type_str)) return parse_outcome_annotation(type_str);
+
+    VariantType *variant = find_variant_type(type_str);
+    if (variant) return make_variant_type(variant);
 
-        TypeTC *inner_type = lookup_type_from_string(inner);
-        if (inner_type) {
-            return make_list_type(inner_type);
+    if (strncmp(type_str, "list<", 5) == 0 || type_str[0] == '<') {
+        const char *start = type_str[0] == '<' ? type_str + 1 : type_str + 5;
+        size_t length = strlen(start) - 1;
+        char *inner = malloc(length + 1);
+        memcpy(inner, start, length);
+        inner[length] = '\0';
+
+        TypeTC *inner_type = NULL;
+        if (lookup_type_from_string(inner) || strncmp(inner, "list<", 5) == 0 || inner[0] == '<') {
+            inner_type = parse_type_annotation(inner);
         }
+        bool declared = !inner_type && (find_variant_type(inner) || is_outcome_annotation(inner));
+        free(inner);
+        if (inner_type) return make_list_type(inner_type);
+        if (declared) type_error("Lists of options, results and declared types are not supported yet");
         type_error("Unknown inner list type");
     }
 
@@ -77,7 +149,137 @@ TypeTC *parse_type_annotation(const char *type_str) {
     exit(1);
 }
 
+/* How a type is written in an annotation, with lists as <elem>; an instance of option or result is named by it. */
+static char *annotation_of(const TypeTC *type) {
+    const char *name = type->kind == TypeVariant ? type->variant->name : type_to_string(type->kind);
+    if (type->kind != TypeList) return strcpy(malloc(strlen(name) + 1), name);
+
+    char *element = annotation_of(type->element_type);
+    size_t size = strlen(element) + 3;
+    char *list = malloc(size);
+    snprintf(list, size, "<%s>", element);
+    free(element);
+    return list;
+}
+
+static TypeTC *persistent_type(const TypeTC *type) {
+    TypeTC *copy = malloc(sizeof(TypeTC));
+    *copy = *type;
+    if (type->element_type) copy->element_type = persistent_type(type->element_type);
+    return copy;
+}
+
+/* A string, list or declared value is never a null word, which leaves null free for None. */
+static bool has_null_niche(const TypeTC *type) {
+    return type->kind == TypeString || type->kind == TypeList ||
+           (type->kind == TypeVariant && type->variant->layout == VariantTagged);
+}
+
+static bool is_unboxable(const TypeTC *type);
+static bool is_reference(const TypeTC *type);
+
+/* A Some of a nullable option is its payload; a flagged payload is laid out as a declared type's would be when it has to be one word. */
+static void init_outcome_constructor(VariantType *type, uint32_t tag, const char *name, const TypeTC *field) {
+    VariantConstructor *constructor = &type->constructors[tag];
+    constructor->name = name;
+    constructor->tag = tag;
+    constructor->type = type;
+    constructor->field_count = field ? 1 : 0;
+    constructor->fields = NULL;
+    constructor->references = 0;
+    constructor->repr = ConstructorImmediate;
+    if (!field) return;
+
+    constructor->fields = malloc(sizeof(TypeTC *));
+    constructor->fields[0] = persistent_type(field);
+    constructor->references = is_reference(field) ? 1 : 0;
+    constructor->repr = type->layout == VariantNullable || is_unboxable(field) ? ConstructorUnboxed : ConstructorBoxed;
+    if (constructor->repr == ConstructorBoxed) type->boxed_count++;
+    else type->has_payloads = true;
+}
+
+/* The one instance of option<value> (error NULL) or result<value,error>. */
+static TypeTC *outcome_type(const TypeTC *value, const TypeTC *error) {
+    char *value_name = annotation_of(value), *error_name = error ? annotation_of(error) : NULL;
+    size_t size = strlen(value_name) + (error_name ? strlen(error_name) : 0) + 10;
+    char *name = malloc(size);
+    if (error_name) snprintf(name, size, "result<%s,%s>", value_name, error_name);
+    else snprintf(name, size, "option<%s>", value_name);
+    free(value_name);
+    free(error_name);
+
+    VariantType *type = outcome_types;
+    while (type && strcmp(type->name, name) != 0) type = type->next;
+    if (type) {
+        free(name);
+        return make_variant_type(type);
+    }
+
+    type = calloc(1, sizeof(VariantType));
+    type->name = name;
+    type->layout = !error && has_null_niche(value) ? VariantNullable : VariantFlagged;
+    type->constructor_count = 2;
+    type->pointer_tagged = true;
+    type->constructors = calloc(2, sizeof(VariantConstructor));
+    if (error) {
+        init_outcome_constructor(type, 0, "Ok", value);
+        init_outcome_constructor(type, 1, "Error", error);
+    } else {
+        init_outcome_constructor(type, 0, "None", NULL);
+        init_outcome_constructor(type, 1, "Some", value);
+    }
+    type->next = outcome_types;
+    outcome_types = type;
+    return make_variant_type(type);
+}
+
+/* option<T> or result<T,E>, where the arguments may themselves contain commas inside angle brackets. */
+static TypeTC *parse_outcome_annotation(const char *type_str) {
+    bool is_result = type_str[0] == 'r';
+    size_t length = strlen(type_str) - 8;
+    char *args = malloc(length + 1);
+    memcpy(args, type_str + 7, length);
+    args[length] = '\0';
+
+    char *error = NULL;
+    int depth = 0;
+    for (char *c = args; *c; c++) {
+        if (*c == '<') depth++;
+        else if (*c == '>') depth--;
+        else if (*c == ',' && depth == 0 && !error) {
+            *c = '\0';
+            error = c + 1;
+        }
+    }
+    if (is_result != (error != NULL)) {
+        fprintf(stderr, "Type error: '%s' should be option<T> or result<T,E>\n", type_str);
+        exit(1);
+    }
+
+    TypeTC *value_type = parse_type_annotation(args);
+    TypeTC *error_type = error ? parse_type_annotation(error) : NULL;
+    free(args);
+    return outcome_type(value_type, error_type);
+}
+
+/* With a list operand the operator applies to each element; a scalar operand is broadcast. */
+static TypeTC *typecheck_elementwise(const char *op, TypeTC *left, TypeTC *right) {
+    TypeTC *left_elem = left->kind == TypeList ? left->element_type : left;
+    TypeTC *right_elem = right->kind == TypeList ? right->element_type : right;
+    if (left_elem->kind == TypeList || right_elem->kind == TypeList) {
+        type_error("Elementwise operators do not apply to nested lists");
+    }
+    if (strcmp(op, "^") == 0) {
+        type_error("'^' does not apply to lists");
+    }
+    return make_list_type(typecheck_binary(op, left_elem, right_elem));
+}
+
 TypeTC *typecheck_binary(const char *op, TypeTC *left, TypeTC *right) {
+    if (left->kind == TypeList || right->kind == TypeList) {
+        return typecheck_elementwise(op, left, right);
+    }
+
     if (strcmp(op, "+") == 0 || strcmp(op, "-") == 0 ||
         strcmp(op, "*") == 0 || strcmp(op, "/") == 0) {
         if (left->kind == TypeInt && right->kind == TypeInt)
@@ -100,6 +302,10 @@ TypeTC *typecheck_binary(const char *op, TypeTC *left, TypeTC *right) {
         if (left->kind == TypeBool && right->kind == TypeBool)
             return make_type(TypeBool);
         type_error("Logical operators require bool operands");
+    } else if (strcmp(op, "^") == 0) {
+        if (left->kind == TypeString && right->kind == TypeString)
+            return make_type(TypeString);
+        type_error("Operands to '^' must both be string");
     }
 
     type_error("Unsupported binary operator");
@@ -110,6 +316,7 @@ TypeEnv *add_binding(TypeEnv *env, const char *name, TypeTC *type) {
     TypeEnv *new_env = arena_alloc(global_arena, sizeof(TypeEnv));
     new_env->name = name;
     new_env->type = type;
+    new_env->used = false;
     new_env->next = env;
     return new_env;
 }
@@ -117,6 +324,7 @@ TypeEnv *add_binding(TypeEnv *env, const char *name, TypeTC *type) {
 TypeTC *lookup_type(TypeEnv *env, const char *name) {
     while (env) {
         if (strcmp(env->name, name) == 0) {
+            env->used = true;
             return env->type;
         }
         env = env->next;
@@ -132,16 +340,352 @@ TypeTC *make_function_type(TypeTC *return_type, TypeTC **param_types, int param_
     return t;
 }
 
+static TypeTC *typecheck_list_builtin(ASTNode *node, TypeEnv *env) {
+    const char *name = node->call.callee->strval;
+    if (node->call.arg_count != list_builtin_arity(name)) {
+        type_error("Argument count mismatch in function call");
+    }
+
+    TypeTC *list_type = typecheck_expr_with_env(node->call.args[0], env);
+    if (strcmp(name, "length") == 0 && list_type->kind == TypeString) return make_type(TypeInt);
+    if (list_type->kind != TypeList) {
+        fprintf(stderr, "Type error: %s expects a list but got <%s>\n", name, type_to_string(list_type->kind));
+        exit(1);
+    }
+
+    if (strcmp(name, "length") == 0) return make_type(TypeInt);
+    if (strcmp(name, "sum") == 0) {
+        if (list_type->element_type->kind != TypeInt && list_type->element_type->kind != TypeFloat) {
+            type_error("sum expects a list of int or float");
+        }
+        return list_type->element_type;
+    }
+    if (strcmp(name, "head") == 0) return list_type->element_type;
+    if (strcmp(name, "tail") == 0) return list_type;
+
+    if (strcmp(name, "push") == 0) {
+        if (!same_type(typecheck_expr_with_env(node->call.args[1], env), list_type->element_type)) {
+            type_error("push expects a value of the list element type");
+        }
+        return list_type;
+    }
+    if (strcmp(name, "concat") == 0) {
+        TypeTC *other = typecheck_expr_with_env(node->call.args[1], env);
+        if (!same_type(other, list_type)) {
+            type_error("concat expects two lists of the same element type");
+        }
+        return list_type;
+    }
+
+    if (typecheck_expr_with_env(node->call.args[1], env)->kind != TypeInt) {
+        fprintf(stderr, "Type error: %s expects an int as its second argument\n", name);
+        exit(1);
+    }
+    if (strcmp(name, "update") == 0) {
+        if (!same_type(typecheck_expr_with_env(node->call.args[2], env), list_type->element_type)) {
+            type_error("update expects a value of the list element type");
+        }
+        return list_type;
+    }
+    if (strcmp(name, "take") == 0 || strcmp(name, "drop") == 0) return list_type;
+    return list_type->element_type;
+}
+
+/* Registers a declared type by name, so its fields and other declarations can refer to it. */
+static void declare_variant_type(ASTNode *node) {
+    VariantType *type = arena_alloc(global_arena, sizeof(VariantType));
+    memset(type, 0, sizeof(VariantType));
+    type->name = node->type_decl.name;
+    type->next = variant_types;
+    variant_types = type;
+    node->type_decl.declared = type;
+}
+
+static bool is_unboxable(const TypeTC *type) {
+    return type->kind == TypeInt || type->kind == TypeChar || type->kind == TypeBool;
+}
+
+/* Whether a value's word may point into the collected heap. */
+static bool is_reference(const TypeTC *type) {
+    return type->kind == TypeString || type->kind == TypeList || type->kind == TypeVariant;
+}
+
+/* Resolves the constructors of a declared type and picks their layout; see variant.h. */
+static void define_variant_type(ASTNode *node) {
+    VariantType *type = node->type_decl.declared;
+    int count = node->type_decl.variant_count;
+    if (count > VEX_VARIANT_MAX_TAGS) {
+        fprintf(stderr, "Type error: type '%s' has more than %d constructors\n", type->name, VEX_VARIANT_MAX_TAGS);
+        exit(1);
+    }
+
+    VariantConstructor *constructors = arena_alloc(global_arena, sizeof(VariantConstructor) * (size_t)count);
+    for (int i = 0; i < count; i++) {
+        const struct Variant *variant = &node->type_decl.variants[i];
+        VariantConstructor *constructor = &constructors[i];
+        for (int j = 0; j < i; j++) {
+            if (strcmp(constructors[j].name, variant->name) == 0) {
+                fprintf(stderr, "Type error: constructor '%s' is declared twice in type '%s'\n", variant->name, type->name);
+                exit(1);
+            }
+        }
+        if (variant->field_count > VEX_VARIANT_MAX_FIELDS) {
+            fprintf(stderr, "Type error: constructor '%s' has more than %d fields\n", variant->name, VEX_VARIANT_MAX_FIELDS);
+            exit(1);
+        }
+
+        constructor->name = variant->name;
+        constructor->type = type;
+        constructor->field_count = variant->field_count;
+        constructor->fields = arena_alloc(global_arena, sizeof(TypeTC *) * (size_t)(variant->field_count ? variant->field_count : 1));
+        constructor->references = 0;
+        for (int j = 0; j < variant->field_count; j++) {
+            constructor->fields[j] = parse_type_annotation(variant->field_types[j]);
+            if (is_reference(constructor->fields[j])) constructor->references |= UINT32_C(1) << j;
+        }
+
+        if (variant->field_count == 0) {
+            constructor->repr = ConstructorImmediate;
+        } else if (variant->field_count == 1 && is_unboxable(constructor->fields[0])) {
+            constructor->repr = ConstructorUnboxed;
+            type->has_payloads = true;
+        } else {
+            constructor->repr = ConstructorBoxed;
+            type->boxed_count++;
+        }
+    }
+
+    type->constructors = arena_alloc(global_arena, sizeof(VariantConstructor) * (size_t)count);
+    type->constructor_count = count;
+    type->pointer_tagged = type->boxed_count <= VEX_VARIANT_POINTER_TAGS;
+    uint32_t boxed = 0, unboxed = (uint32_t)type->boxed_count;
+    for (int i = 0; i < count; i++) {
+        uint32_t tag = constructors[i].repr == ConstructorBoxed ? boxed++ : unboxed++;
+        constructors[i].tag = tag;
+        type->constructors[tag] = constructors[i];
+    }
+}
+
+static TypeTC *typecheck_expected(ASTNode *node, TypeEnv *env, TypeTC *expected);
+
+/* A constructor applied to its fields, which may have been parsed as a call or a bare name. */
+static TypeTC *typecheck_construct(ASTNode *node, VariantConstructor *constructor, ASTNode **args, int arg_count, TypeEnv *env) {
+    if (arg_count != constructor->field_count) {
+        fprintf(stderr, "Type error: constructor '%s' takes %d arguments but got %d\n", constructor->name, constructor->field_count, arg_count);
+        exit(1);
+    }
+    for (int i = 0; i < arg_count; i++) {
+        if (!same_type(typecheck_expected(args[i], env, constructor->fields[i]), constructor->fields[i])) {
+            fprintf(stderr, "Type error: argument %d of constructor '%s' should be <%s>\n", i + 1, constructor->name, type_to_string(constructor->fields[i]->kind));
+            exit(1);
+        }
+    }
+
+    node->type = NodeConstruct;
+    node->construct.name = constructor->name;
+    node->construct.args = args;
+    node->construct.arg_count = arg_count;
+    node->construct.constructor = constructor;
+    return make_variant_type(constructor->type);
+}
+
+static void pattern_type_error(const Pattern *pattern, const TypeTC *type) {
+    fprintf(stderr, "Type error: pattern on line %d does not match a value of type <%s>\n", pattern->line, type_to_string(type->kind));
+    exit(1);
+}
+
+/* Checks pattern against the type of the value it matches and adds the names it binds to env; outer is env before the pattern. */
+static TypeEnv *typecheck_pattern(Pattern *pattern, TypeTC *type, TypeEnv *env, const TypeEnv *outer) {
+    switch (pattern->kind) {
+        case PatternWildcard:
+            return env;
+
+        case PatternBind:
+            if (type->kind == TypeVariant && find_constructor(type->variant, pattern->name)) {
+                const char *name = pattern->name;
+                pattern->kind = PatternConstructor;
+                pattern->constructor.name = name;
+                pattern->constructor.args = NULL;
+                pattern->constructor.arg_count = 0;
+                return typecheck_pattern(pattern, type, env, outer);
+            }
+            for (const TypeEnv *bound = env; bound != outer; bound = bound->next) {
+                if (strcmp(bound->name, pattern->name) == 0) {
+                    fprintf(stderr, "Type error: '%s' is bound twice in one pattern\n", pattern->name);
+                    exit(1);
+                }
+            }
+            return add_binding(env, pattern->name, type);
+
+        case PatternInt:
+            if (type->kind != TypeInt) pattern_type_error(pattern, type);
+            return env;
+
+        case PatternChar:
+            if (type->kind != TypeChar) pattern_type_error(pattern, type);
+            return env;
+
+        case PatternBool:
+            if (type->kind != TypeBool) pattern_type_error(pattern, type);
+            return env;
+
+        case PatternNil:
+            if (type->kind != TypeList) pattern_type_error(pattern, type);
+            return env;
+
+        case PatternCons:
+            if (type->kind != TypeList) pattern_type_error(pattern, type);
+            env = typecheck_pattern(pattern->cons.head, type->element_type, env, outer);
+            return typecheck_pattern(pattern->cons.tail, type, env, outer);
+
+        case PatternConstructor: {
+            if (type->kind != TypeVariant) pattern_type_error(pattern, type);
+            const VariantConstructor *constructor = find_constructor(type->variant, pattern->constructor.name);
+            if (!constructor) {
+                fprintf(stderr, "Type error: '%s' on line %d is not a constructor of type '%s'\n", pattern->constructor.name, pattern->line, type->variant->name);
+                exit(1);
+            }
+            if (pattern->constructor.arg_count != constructor->field_count) {
+                fprintf(stderr, "Type error: constructor '%s' on line %d takes %d fields but the pattern has %d\n",
+                        constructor->name, pattern->line, constructor->field_count, pattern->constructor.arg_count);
+                exit(1);
+            }
+            pattern->constructor.tag = (int)constructor->tag;
+            for (int i = 0; i < constructor->field_count; i++) {
+                env = typecheck_pattern(pattern->constructor.args[i], constructor->fields[i], env, outer);
+            }
+            return env;
+        }
+    }
+    return env;
+}
+
+static TypeTC *typecheck_node(ASTNode *node, TypeEnv *env);
+
+/* Statements in order, each seeing the vals before it; the last one gives the value, and the expected type if there is one. */
+static TypeTC *typecheck_block(ASTNode *node, TypeEnv *env, TypeTC *expected) {
+    TypeEnv *block_env = env;
+    TypeTC *last_type = make_type(TypeError);
+
+    for (int i = 0; i < node->block.count; i++) {
+        ASTNode *stmt = node->block.statements[i];
+        bool is_last = i == node->block.count - 1;
+        TypeTC *stmt_type = expected && is_last ? typecheck_expected(stmt, block_env, expected) : typecheck_expr_with_env(stmt, block_env);
+
+        if (stmt->type == NodeVarDecl) {
+            TypeTC *binding_type = stmt_type;
+
+            if (stmt->var_decl.type) {
+                binding_type = parse_type_annotation(stmt->var_decl.type);
+            }
+
+            block_env = add_binding(block_env, stmt->var_decl.value, binding_type);
+        }
+
+        last_type = stmt_type;
+    }
+
+    return last_type;
+}
+
+/* Every arm is checked against the expected type, or failing that against the first arm's. */
+static TypeTC *typecheck_match(ASTNode *node, TypeEnv *env, TypeTC *expected) {
+    TypeTC *scrutinee_type = typecheck_expr_with_env(node->match.scrutinee, env);
+    TypeTC *result_type = expected;
+    for (int i = 0; i < node->match.arm_count; i++) {
+        TypeEnv *arm_env = typecheck_pattern(node->match.patterns[i], scrutinee_type, env, env);
+        TypeTC *arm_type = result_type ? typecheck_expected(node->match.arms[i], arm_env, result_type)
+                                       : typecheck_expr_with_env(node->match.arms[i], arm_env);
+        if (result_type && !same_type(arm_type, result_type)) {
+            type_error("All match arms must have the same type");
+        }
+        if (!result_type) result_type = arm_type;
+    }
+
+    node->match.plan = compile_match(node);
+    if (!node->match.plan->exhaustive) {
+        fprintf(stderr, "Type error: match on line %d does not cover every value; add a case such as _\n", node->line);
+        exit(1);
+    }
+    return result_type;
+}
+
+/* The condition is a bool, and the branches are checked like the arms of a match. */
+static TypeTC *typecheck_if(ASTNode *node, TypeEnv *env, TypeTC *expected) {
+    if (typecheck_expr_with_env(node->if_expr.condition, env)->kind != TypeBool) {
+        type_error("The condition of an if must be a bool");
+    }
+    ASTNode *branches[] = { node->if_expr.then_branch, node->if_expr.else_branch };
+    TypeTC *result_type = expected;
+    for (int i = 0; i < 2; i++) {
+        TypeTC *branch_type = result_type ? typecheck_expected(branches[i], env, result_type)
+                                          : typecheck_expr_with_env(branches[i], env);
+        if (result_type && !same_type(branch_type, result_type)) {
+            type_error("Both branches of an if must have the same type");
+        }
+        if (!result_type) result_type = branch_type;
+    }
+    return result_type;
+}
+
+/*
+ * Checks node where its context already fixes its type, as a val
+ * annotation, a parameter, a return type or a constructor's field does.
+ * Blocks, matches and ifs pass it on to whatever gives their value; that is
+ * how None, Ok and Error, which say nothing of the rest of their type,
+ * get one. The caller still compares the result with expected.
+ */
+static TypeTC *typecheck_expected(ASTNode *node, TypeEnv *env, TypeTC *expected) {
+    TypeTC *type;
+    switch (node->type) {
+        case NodeBlock:
+            type = typecheck_block(node, env, expected);
+            break;
+        case NodeMatch:
+            type = typecheck_match(node, env, expected);
+            break;
+        case NodeIf:
+            type = typecheck_if(node, env, expected);
+            break;
+        case NodeConstruct:
+            if (!node->construct.constructor && expected->kind == TypeVariant) {
+                node->construct.constructor = find_constructor(expected->variant, node->construct.name);
+                if (!node->construct.constructor) {
+                    fprintf(stderr, "Type error: '%s' on line %d is not a constructor of type '%s'\n", node->construct.name, node->line, expected->variant->name);
+                    exit(1);
+                }
+            }
+            return typecheck_expr_with_env(node, env);
+        default:
+            return typecheck_expr_with_env(node, env);
+    }
+    node->tc_type = type;
+    return type;
+}
+
+/* Every checked expression keeps its type so code generation can use it. */
 TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
+    TypeTC *type = typecheck_node(node, env);
+    node->tc_type = type;
+    return type;
+}
+
+static TypeTC *typecheck_node(ASTNode *node, TypeEnv *env) {
     switch (node->type) {
         case NodeIntLit: return make_type(TypeInt);
         case NodeFloatLit: return make_type(TypeFloat);
         case NodeBoolLit: return make_type(TypeBool);
         case NodeCharLit: return make_type(TypeChar);
-        case NodeStringLit: return make_type(TypeString);
+        case NodeStringLit:
+            if (!vex_utf8_valid(node->string_lit.value, (int64_t)strlen(node->string_lit.value))) {
+                type_error("String literal is not valid UTF-8");
+            }
+            return make_type(TypeString);
 
         case NodeIdentifier: {
             TypeTC *t = lookup_type(env, node->strval);
+            VariantConstructor *constructor = t ? NULL : find_any_constructor(node->strval);
+            if (constructor) return typecheck_construct(node, constructor, NULL, 0, env);
             if (!t) {
                 fprintf(stderr, "Undefined identifier: %s\n", node->strval);
                 exit(1);
@@ -156,13 +700,12 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
         }
 
         case NodeVarDecl: {
-            TypeTC *value_type = typecheck_expr_with_env(node->var_decl.expr, env);
-
-            TypeTC *annot_type = NULL;
-            if (node->var_decl.type) {
-                annot_type = parse_type_annotation(node->var_decl.type);
+            TypeTC *annot_type = node->var_decl.type ? parse_type_annotation(node->var_decl.type) : NULL;
+            TypeTC *value_type = annot_type ? typecheck_expected(node->var_decl.expr, env, annot_type)
+                                            : typecheck_expr_with_env(node->var_decl.expr, env);
 
-                if (annot_type->kind != value_type->kind) {
+            if (annot_type) {
+                if (!same_type(annot_type, value_type)) {
                     type_error("Type mismatch in val binding");
                 }
 
@@ -174,29 +717,8 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
             }
         }
 
-        case NodeBlock: {
-            TypeEnv *block_env = env;
-            TypeTC *last_type = make_type(TypeError);
-
-            for (int i = 0; i < node->block.count; i++) {
-                ASTNode *stmt = node->block.statements[i];
-                TypeTC *stmt_type = typecheck_expr_with_env(stmt, block_env);
-            
-                if (stmt->type == NodeVarDecl) {
-                    TypeTC *binding_type = stmt_type;
-            
-                    if (stmt->var_decl.type) {
-                        binding_type = parse_type_annotation(stmt->var_decl.type);
-                    }
-            
-                    block_env = add_binding(block_env, stmt->var_decl.value, binding_type);
-                }
-            
-                last_type = stmt_type;
-            }                      
-
-            return last_type;
-        }
+        case NodeBlock:
+            return typecheck_block(node, env, NULL);
 
         case NodeList: {
             if (node->list.count == 0) {
@@ -204,9 +726,12 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
             }
 
             TypeTC *first_elem_type = typecheck_expr_with_env(node->list.elements[0], env);
+            if (first_elem_type->kind == TypeVariant) {
+                type_error("Lists of options, results and declared types are not supported yet");
+            }
             for (int i = 1; i < node->list.count; i++) {
                 TypeTC *elem_type = typecheck_expr_with_env(node->list.elements[i], env);
-                if (elem_type->kind != first_elem_type->kind) {
+                if (!same_type(elem_type, first_elem_type)) {
                     type_error("All list elements must have the same type");
                 }
             }
@@ -217,8 +742,11 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
         case NodePrint: {
             TypeTC *annot_type = parse_type_annotation(node->print.type);
             TypeTC *value = typecheck_expr_with_env(node->print.value, env);
+            if (annot_type->kind == TypeVariant) {
+                type_error("print does not support options, results or declared types; match on the value instead");
+            }
 
-            if (annot_type->kind != value->kind) {
+            if (!same_type(annot_type, value)) {
                 fprintf(stderr, "Type error: print expected type <%s> but got <%s>\n", type_to_string(annot_type->kind), type_to_string(value->kind));
                 exit(1);
             }
@@ -235,14 +763,15 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
 
             TypeTC *function_type = make_function_type(return_type, param_types, node->function.param_count);
             env = add_binding(env, node->function.name, function_type);
+            if (!node->function.expr) return return_type;
 
             TypeEnv *function_env = env;
             for (int i = 0; i < node->function.param_count; i++) {
                 function_env = add_binding(function_env, node->function.param_names[i], param_types[i]);
             }
-            TypeTC *body_type = typecheck_expr_with_env(node->function.expr, function_env);
+            TypeTC *body_type = typecheck_expected(node->function.expr, function_env, return_type);
 
-            if (return_type->kind != body_type->kind) {
+            if (!same_type(return_type, body_type)) {
                 fprintf(stderr, "Function '%s' returns type <%s> but body evaluates to <%s>\n",
                         node->function.name, type_to_string(return_type->kind), type_to_string(body_type->kind));
                 exit(1);
@@ -252,6 +781,15 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
         }
 
         case NodeCall: {
+            ASTNode *callee = node->call.callee;
+            if (callee->type == NodeIdentifier && !lookup_type(env, callee->strval)) {
+                VariantConstructor *constructor = find_any_constructor(callee->strval);
+                if (constructor) return typecheck_construct(node, constructor, node->call.args, node->call.arg_count, env);
+            }
+            if (callee->type == NodeIdentifier && list_builtin_arity(callee->strval) && !lookup_type(env, callee->strval)) {
+                return typecheck_list_builtin(node, env);
+            }
+
             TypeTC *callee_type = typecheck_expr_with_env(node->call.callee, env);
             if (callee_type->kind != TypeFunction) {
                 type_error("Callee must be a function");
@@ -265,8 +803,8 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
             }
 
             for (int i = 0; i < node->call.arg_count; i++) {
-                TypeTC *arg_type = typecheck_expr_with_env(node->call.args[i], env);
-                if (arg_type->kind != param_types[i]->kind) {
+                TypeTC *arg_type = typecheck_expected(node->call.args[i], env, param_types[i]);
+                if (!same_type(arg_type, param_types[i])) {
                     fprintf(stderr, "Type mismatch in argument %d: expected <%s> but got <%s>\n",
                             i + 1, type_to_string(param_types[i]->kind), type_to_string(arg_type->kind));
                     exit(1);
@@ -276,6 +814,80 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
             return callee_type->return_type;
         }
         
+        case NodeListOp: {
+            if (!node->list_op.list) {
+                type_error("map, filter and reduce without a list argument must be the right side of |>");
+            }
+            TypeTC *function_type = typecheck_expr_with_env(node->list_op.function, env);
+            TypeTC *list_type = typecheck_expr_with_env(node->list_op.list, env);
+            if (list_type->kind != TypeList) {
+                type_error("map, filter and reduce expect a list");
+            }
+            TypeTC *elem_type = list_type->element_type;
+
+            int arity = node->list_op.op == ListReduce ? 2 : 1;
+            if (function_type->kind != TypeFunction || function_type->param_count != arity) {
+                type_error(arity == 1 ? "map and filter expect a one-argument function" : "reduce expects a two-argument function");
+            }
+            for (int i = 0; i < arity; i++) {
+                if (!same_type(function_type->param_types[i], elem_type)) {
+                    type_error("Function parameter does not match the list element type");
+                }
+            }
+
+            switch (node->list_op.op) {
+                case ListMap:
+                    if (function_type->return_type->kind == TypeList || function_type->return_type->kind == TypeFunction ||
+                        function_type->return_type->kind == TypeVariant) {
+                        type_error("map can only produce lists of primitive values");
+                    }
+                    return make_list_type(function_type->return_type);
+
+                case ListFilter:
+                    if (function_type->return_type->kind != TypeBool) {
+                        type_error("filter expects a function returning bool");
+                    }
+                    return list_type;
+
+                case ListReduce: {
+                    TypeTC *init_type = typecheck_expr_with_env(node->list_op.init, env);
+                    if (!same_type(init_type, elem_type) || !same_type(function_type->return_type, elem_type)) {
+                        type_error("reduce expects an initial value and result of the list element type");
+                    }
+                    return elem_type;
+                }
+            }
+            break;
+        }
+
+        case NodeMatch:
+            return typecheck_match(node, env, NULL);
+
+        case NodeIf:
+            return typecheck_if(node, env, NULL);
+
+        case NodeConstruct: {
+            VariantConstructor *constructor = node->construct.constructor;
+            if (!constructor && strcmp(node->construct.name, "Some") == 0) {
+                TypeTC *value_type = typecheck_expr_with_env(node->construct.args[0], env);
+                constructor = &outcome_type(value_type, NULL)->variant->constructors[1];
+            }
+            if (!constructor) {
+                fprintf(stderr, "Type error: '%s' on line %d needs an option or result type from context; annotate the val, parameter or return type it flows into\n",
+                        node->construct.name, node->line);
+                exit(1);
+            }
+            return typecheck_construct(node, constructor, node->construct.args, node->construct.arg_count, env);
+        }
+
+        case NodeTypeDecl:
+            if (!node->type_decl.declared) type_error("Types can only be declared at the top level");
+            return make_variant_type(node->type_decl.declared);
+
+        case NodeImport:
+            type_error("Modules can only be imported at the top level of a file");
+            break;
+
         default:
             type_error("Unsupported expression type");
     }
@@ -284,11 +896,24 @@ TypeTC *typecheck_expr_with_env(ASTNode *node, TypeEnv *env) {
 }
 
 TypeTC *typecheck(ASTNode *node) {
+    TypeEnv *env = NULL;
+    return typecheck_with_env(node, &env);
+}
+
+TypeTC *typecheck_with_env(ASTNode *node, TypeEnv **env_inout) {
+    TypeEnv *env = *env_inout;
+
     if (node->type != NodeBlock) {
-        return typecheck_expr_with_env(node, NULL);
+        return typecheck_expr_with_env(node, env);
     }
 
-    TypeEnv *env = NULL;
+    /* Types first, by name and then in full, so that they and every signature can refer to any of them. */
+    for (int i = 0; i < node->block.count; i++) {
+        if (node->block.statements[i]->type == NodeTypeDecl) declare_variant_type(node->block.statements[i]);
+    }
+    for (int i = 0; i < node->block.count; i++) {
+        if (node->block.statements[i]->type == NodeTypeDecl) define_variant_type(node->block.statements[i]);
+    }
 
     for (int i = 0; i < node->block.count; i++) {
         ASTNode *stmt = node->block.statements[i];
@@ -319,5 +944,6 @@ TypeTC *typecheck(ASTNode *node) {
         last_type = typecheck_expr_with_env(node->block.statements[i], env);
     }
 
+    *env_inout = env;
     return last_type;
 }